@@ -0,0 +1,99 @@
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <glog/logging.h>
+#include "tcptun_cipher.h"
+#include "tcptun_common.h"
+#include "tcptun_frame.h"
+
+namespace {
+///frames sealed per call, like the frames queued in one round of the loop
+const size_t kFramesPerBatch = 32;
+const int64_t kRunUs = 1000000;
+
+///fill buf with frames of payload_len bytes of payload, each followed by room for the tag
+void build_frames(std::vector<char> &buf, const size_t &payload_len) {
+    auto frame_len = tcptun::kFrameHeaderLen + payload_len + tcptun::FrameCipher::kTagLen;
+    buf.assign(frame_len * kFramesPerBatch, 0);
+    for (size_t i = 0; i < kFramesPerBatch; ++i) {
+        tcptun::frame_header_t header = {0};
+        header.conn_id = static_cast<uint32_t>(i + 1);
+        header.type = tcptun::kFrameData;
+        header.length = static_cast<uint16_t>(payload_len + tcptun::FrameCipher::kTagLen);
+        auto frame = buf.data() + i * frame_len;
+        tcptun::write_frame_header(frame, header);
+        for (size_t j = 0; j < payload_len; ++j)
+            frame[tcptun::kFrameHeaderLen + j] = static_cast<char>(i * 31 + j);
+    }
+}
+
+/**
+ * seal batches of frames for kRunUs on one core and open every batch on the other side of the link
+ * @return below zero if a sealed frame does not open to what was sealed
+ */
+int32_t bench(const tcptun::cipher_type_t &type, const char *name, const size_t &payload_len) {
+    tcptun::cipher_policy_t policy;
+    policy.type = type;
+    policy.psk = "tcptun bench";
+    tcptun::FrameCipher client(policy);
+    tcptun::FrameCipher server(policy);
+    char client_nonce[tcptun::FrameCipher::kNonceLen];
+    char server_nonce[tcptun::FrameCipher::kNonceLen];
+    if (client.GenerateNonce(client_nonce) < 0 || server.GenerateNonce(server_nonce) < 0 ||
+        client.DeriveKeys(true, client_nonce, server_nonce) < 0 ||
+        server.DeriveKeys(false, client_nonce, server_nonce) < 0) {
+        fprintf(stderr, "%s: failed to set up the keys\n", name);
+        return -1;
+    }
+    std::vector<char> plain;
+    build_frames(plain, payload_len);
+    std::vector<char> buf(plain);
+    uint64_t batches = 0;
+    int64_t seal_us = 0;
+    int64_t open_us = 0;
+    while (seal_us < kRunUs) {
+        memcpy(buf.data(), plain.data(), plain.size());
+        auto start = tcptun::getnowtime_us();
+        if (client.SealFrames(buf.data(), buf.size()) != static_cast<int32_t>(kFramesPerBatch)) {
+            fprintf(stderr, "%s: failed to seal frames\n", name);
+            return -2;
+        }
+        auto sealed = tcptun::getnowtime_us();
+        if (server.OpenFrames(buf.data(), buf.size()) != static_cast<int32_t>(kFramesPerBatch)) {
+            fprintf(stderr, "%s: sealed frames failed to open\n", name);
+            return -3;
+        }
+        open_us += tcptun::getnowtime_us() - sealed;
+        seal_us += sealed - start;
+        ++batches;
+    }
+    auto frame_len = tcptun::kFrameHeaderLen + payload_len + tcptun::FrameCipher::kTagLen;
+    for (size_t i = 0; i < kFramesPerBatch; ++i) {
+        auto offset = i * frame_len + tcptun::kFrameHeaderLen;
+        if (memcmp(buf.data() + offset, plain.data() + offset, payload_len) != 0) {
+            fprintf(stderr, "%s: frame %zu opened to other bytes\n", name, i);
+            return -4;
+        }
+    }
+    double bits = 8.0 * payload_len * kFramesPerBatch * batches;
+    printf("%-18s payload:%5zu frames:%9llu seal:%7.2f Gbit/s open:%7.2f Gbit/s\n", name, payload_len,
+           static_cast<unsigned long long>(batches * kFramesPerBatch), bits / seal_us / 1000,
+           bits / open_us / 1000);
+    return 0;
+}
+}
+
+///sealing and opening rate of FrameCipher on one core, it exits with an error if a frame does not
+///open to the bytes sealed
+int main(int argc, char *argv[]) {
+    google::InitGoogleLogging("INFO");
+    FLAGS_logtostderr = true;
+    const size_t payload_lens[] = {256, 2048, 16384};
+    for (auto payload_len : payload_lens) {
+        if (bench(tcptun::kCipherAes256Gcm, "aes-256-gcm", payload_len) < 0 ||
+            bench(tcptun::kCipherChacha20Poly1305, "chacha20-poly1305", payload_len) < 0)
+            return 1;
+    }
+    return 0;
+}
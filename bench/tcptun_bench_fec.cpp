@@ -0,0 +1,82 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <glog/logging.h>
+#include "tcptun_common.h"
+#include "tcptun_fec.h"
+
+namespace {
+const int64_t kRunUs = 1000000;
+
+/**
+ * encode groups of data_shards shards of shard_len bytes for kRunUs, then drop parity_shards shards of a
+ * group and rebuild them
+ * @return below zero if the rebuilt shards differ from the data encoded
+ */
+int32_t bench(const int32_t &data_shards, const int32_t &parity_shards, const size_t &shard_len) {
+    tcptun::ReedSolomon rs(data_shards, parity_shards);
+    auto total = data_shards + parity_shards;
+    std::vector<std::vector<uint8_t>> shards(total, std::vector<uint8_t>(shard_len));
+    for (int32_t i = 0; i < data_shards; ++i) {
+        for (size_t j = 0; j < shard_len; ++j)
+            shards[i][j] = static_cast<uint8_t>(rand());
+    }
+    std::vector<const uint8_t *> data;
+    std::vector<uint8_t *> parity;
+    for (int32_t i = 0; i < total; ++i) {
+        if (i < data_shards)
+            data.push_back(shards[i].data());
+        else
+            parity.push_back(shards[i].data());
+    }
+    uint64_t groups = 0;
+    auto start = tcptun::getnowtime_us();
+    int64_t elapsed_us = 0;
+    while (elapsed_us < kRunUs) {
+        for (int32_t i = 0; i < 64; ++i) {
+            if (rs.Encode(data, parity, shard_len) < 0) {
+                fprintf(stderr, "failed to encode %d+%d\n", data_shards, parity_shards);
+                return -1;
+            }
+        }
+        groups += 64;
+        elapsed_us = tcptun::getnowtime_us() - start;
+    }
+    ///lose as many shards as there is parity, data shards first
+    auto received = shards;
+    std::vector<uint8_t *> buffers;
+    std::vector<bool> present(total, true);
+    for (int32_t i = 0; i < total; ++i)
+        buffers.push_back(received[i].data());
+    for (int32_t i = 0; i < parity_shards; ++i) {
+        auto lost = (i * 2) % total;
+        present[lost] = false;
+        memset(buffers[lost], 0, shard_len);
+    }
+    if (rs.Reconstruct(buffers, present, shard_len) < 0) {
+        fprintf(stderr, "failed to reconstruct %d+%d\n", data_shards, parity_shards);
+        return -2;
+    }
+    for (int32_t i = 0; i < data_shards; ++i) {
+        if (received[i] != shards[i]) {
+            fprintf(stderr, "data shard %d of %d+%d rebuilt wrong\n", i, data_shards, parity_shards);
+            return -3;
+        }
+    }
+    double bits = 8.0 * data_shards * shard_len * groups;
+    printf("%2d+%d shard:%5zu groups:%9llu encode:%7.2f Gbit/s of data\n", data_shards, parity_shards, shard_len,
+           static_cast<unsigned long long>(groups), bits / elapsed_us / 1000);
+    return 0;
+}
+}
+
+///encoding rate of ReedSolomon on one core with the kernel the cpu supports, it exits with an error
+///if a group with parity_shards shards lost is not rebuilt
+int main(int argc, char *argv[]) {
+    google::InitGoogleLogging("INFO");
+    FLAGS_logtostderr = true;
+    if (bench(10, 3, 1400) < 0 || bench(4, 2, 1400) < 0 || bench(20, 5, 1400) < 0 || bench(10, 3, 64) < 0)
+        return 1;
+    return 0;
+}
@@ -0,0 +1,227 @@
+#include <cstdio>
+#include <cstring>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <glog/logging.h>
+#include "tcptun_common.h"
+#include "tcptun_ring.h"
+
+namespace {
+const uint64_t kSpscMessages = 10000000;
+const int32_t kMpscProducers = 4;
+const uint64_t kMpscMessagesPerProducer = 1000000;
+const int32_t kRoundTrips = 100000;
+///a consumer woken up by nothing this long after messages were pushed has lost a wakeup
+const int32_t kWakeupTimeoutMs = 1000;
+const size_t kDrainBatch = 4096;
+
+///pin the calling thread to cpu if the machine has it, @return false if it does not
+bool pin_thread(const int32_t &cpu) {
+    if (cpu >= static_cast<int32_t>(std::thread::hardware_concurrency()))
+        return false;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+/**
+ * wait for notify_fd like the event loop does and read it
+ * @return false if nothing woke us up in kWakeupTimeoutMs
+ */
+bool wait_notify(const int32_t &notify_fd) {
+    struct pollfd pfd = {notify_fd, POLLIN, 0};
+    if (poll(&pfd, 1, kWakeupTimeoutMs) <= 0)
+        return false;
+    uint64_t count = 0;
+    if (read(notify_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        return false;
+    return true;
+}
+
+/**
+ * one producer pushes kSpscMessages numbers in order, the consumer sleeps on notify_fd between drains
+ * @return below zero if a message is lost, reordered or left without a wakeup
+ */
+int32_t bench_spsc() {
+    auto notify_fd = eventfd(0, EFD_NONBLOCK);
+    tcptun::SpscRing ring(1024, notify_fd);
+    std::atomic<bool> produced(false);
+    std::thread producer([&ring, &produced]() {
+        pin_thread(1);
+        for (uint64_t i = 1; i <= kSpscMessages; ++i) {
+            ///a full ring waits for the consumer, which may share the cpu
+            while (!ring.Push(reinterpret_cast<void *>(i)))
+                std::this_thread::yield();
+        }
+        produced = true;
+    });
+    pin_thread(0);
+    std::vector<void *> msgs;
+    uint64_t expected = 1;
+    uint64_t drained = 0;
+    uint64_t wakeups = 0;
+    int32_t ret = 0;
+    auto start = tcptun::getnowtime_us();
+    while (drained < kSpscMessages) {
+        if (!wait_notify(notify_fd)) {
+            msgs.clear();
+            drained += ring.Drain(msgs, kDrainBatch);
+            fprintf(stderr, "spsc: no wakeup with %zu messages in the ring\n", msgs.size());
+            ret = -1;
+            break;
+        }
+        ++wakeups;
+        msgs.clear();
+        drained += ring.Drain(msgs, kDrainBatch);
+        for (auto msg : msgs) {
+            if (reinterpret_cast<uint64_t>(msg) != expected) {
+                fprintf(stderr, "spsc: message %llu where %llu was expected\n",
+                        static_cast<unsigned long long>(reinterpret_cast<uint64_t>(msg)),
+                        static_cast<unsigned long long>(expected));
+                ret = -2;
+                break;
+            }
+            ++expected;
+        }
+        if (ret < 0)
+            break;
+    }
+    auto elapsed_us = tcptun::getnowtime_us() - start;
+    ///let the producer finish after a failure
+    while (!produced) {
+        msgs.clear();
+        ring.Drain(msgs, kDrainBatch);
+    }
+    producer.join();
+    close(notify_fd);
+    if (ret == 0)
+        printf("spsc  1 producer  messages:%9llu %7.2f Mmsg/s messages per wakeup:%8.1f\n",
+               static_cast<unsigned long long>(kSpscMessages), static_cast<double>(kSpscMessages) / elapsed_us,
+               static_cast<double>(kSpscMessages) / wakeups);
+    return ret;
+}
+
+///the same for kMpscProducers producers, each one's messages must stay in order
+int32_t bench_mpsc() {
+    auto notify_fd = eventfd(0, EFD_NONBLOCK);
+    tcptun::MpscQueue queue(notify_fd);
+    std::vector<std::thread> producers;
+    for (int32_t p = 0; p < kMpscProducers; ++p) {
+        producers.emplace_back([&queue, p]() {
+            pin_thread(1 + p);
+            for (uint64_t i = 1; i <= kMpscMessagesPerProducer; ++i)
+                queue.Push(reinterpret_cast<void *>((static_cast<uint64_t>(p) << 32) | i));
+        });
+    }
+    pin_thread(0);
+    std::vector<uint64_t> last(kMpscProducers, 0);
+    std::vector<void *> msgs;
+    const uint64_t total = kMpscProducers * kMpscMessagesPerProducer;
+    uint64_t received = 0;
+    uint64_t wakeups = 0;
+    int32_t ret = 0;
+    auto start = tcptun::getnowtime_us();
+    while (received < total) {
+        if (!wait_notify(notify_fd)) {
+            fprintf(stderr, "mpsc: no wakeup with %zu messages in the queue\n", queue.size());
+            ret = -1;
+            break;
+        }
+        ++wakeups;
+        msgs.clear();
+        queue.Drain(msgs, kDrainBatch);
+        for (auto msg : msgs) {
+            auto value = reinterpret_cast<uint64_t>(msg);
+            auto p = static_cast<size_t>(value >> 32);
+            if (p >= last.size() || (value & 0xffffffff) != last[p] + 1) {
+                fprintf(stderr, "mpsc: message %llu of producer %zu out of order\n",
+                        static_cast<unsigned long long>(value & 0xffffffff), p);
+                ret = -2;
+                break;
+            }
+            last[p] = value & 0xffffffff;
+            ++received;
+        }
+        if (ret < 0)
+            break;
+    }
+    auto elapsed_us = tcptun::getnowtime_us() - start;
+    for (auto &producer : producers)
+        producer.join();
+    close(notify_fd);
+    if (ret == 0)
+        printf("mpsc %2d producers messages:%9llu %7.2f Mmsg/s messages per wakeup:%8.1f\n", kMpscProducers,
+               static_cast<unsigned long long>(total), static_cast<double>(total) / elapsed_us,
+               static_cast<double>(total) / wakeups);
+    return ret;
+}
+
+///ping pong over two rings, every message wakes the other side up, @return below zero on a lost wakeup
+int32_t bench_round_trip() {
+    auto ping_fd = eventfd(0, EFD_NONBLOCK);
+    auto pong_fd = eventfd(0, EFD_NONBLOCK);
+    tcptun::SpscRing ping(64, ping_fd);
+    tcptun::SpscRing pong(64, pong_fd);
+    std::thread echo([&]() {
+        pin_thread(1);
+        std::vector<void *> msgs;
+        for (int32_t i = 0; i < kRoundTrips;) {
+            if (!wait_notify(ping_fd))
+                return;
+            msgs.clear();
+            ping.Drain(msgs, kDrainBatch);
+            for (auto msg : msgs) {
+                pong.Push(msg);
+                ++i;
+            }
+        }
+    });
+    pin_thread(0);
+    std::vector<void *> msgs;
+    int32_t ret = 0;
+    auto start = tcptun::getnowtime_us();
+    for (int32_t i = 0; i < kRoundTrips && ret == 0; ++i) {
+        ping.Push(reinterpret_cast<void *>(static_cast<uintptr_t>(i + 1)));
+        msgs.clear();
+        while (msgs.empty()) {
+            if (!wait_notify(pong_fd)) {
+                fprintf(stderr, "round trip %d: no wakeup\n", i);
+                ret = -1;
+                break;
+            }
+            pong.Drain(msgs, kDrainBatch);
+        }
+        if (ret == 0 && (msgs.size() != 1 || msgs.front() != reinterpret_cast<void *>(static_cast<uintptr_t>(i + 1)))) {
+            fprintf(stderr, "round trip %d: wrong message back\n", i);
+            ret = -2;
+        }
+    }
+    auto elapsed_us = tcptun::getnowtime_us() - start;
+    echo.join();
+    close(ping_fd);
+    close(pong_fd);
+    if (ret == 0)
+        printf("spsc round trip with eventfd wakeups:%7.2f us\n", static_cast<double>(elapsed_us) / kRoundTrips);
+    return ret;
+}
+}
+
+///throughput of SpscRing and MpscQueue between threads pinned to cpus from 0 and the round trip
+///through two rings, it exits with an error if a message is lost, reordered or not woken up for
+int main(int argc, char *argv[]) {
+    google::InitGoogleLogging("INFO");
+    FLAGS_logtostderr = true;
+    if (std::thread::hardware_concurrency() < 2)
+        printf("one cpu only, the threads are not pinned apart\n");
+    if (bench_spsc() < 0 || bench_mpsc() < 0 || bench_round_trip() < 0)
+        return 1;
+    return 0;
+}
@@ -8,15 +8,141 @@
 #include <noncopyable.h>
 #include <cstdint>
 #include <string>
+#include <vector>
+
+struct backend_config_t {
+  std::string ip;
+  int32_t port;
+  int32_t weight;
+};
+
+struct listener_config_t {
+  std::string listen_ip;
+  int32_t listen_port;
+  std::string frontend;
+  std::string target;
+  ///max rate the streams of the listener are read at together, zero for no limit
+  int32_t rate_kbps;
+  ///priority class of the streams of the listener, from 0 which is served first to 3,
+  ///below zero for priority_class, and their weight within the class, from 1 to 32
+  int32_t priority;
+  int32_t weight;
+  ///streams of the listener idle that long are closed, idle_timeout_ms of the config if not set
+  int32_t idle_timeout_ms;
+};
 
 struct system_config_t {
   explicit system_config_t(const std::string& config_file_path);
   int32_t parse_config_json(const std::string& config_file_path);
   int32_t BUF_SIZE;
+  ///an ip is an ipv4 or ipv6 literal, or "unix:/path" of a unix domain socket whose port is not needed,
+  ///remote_ip of tcptun server may also be a hostname
   std::string listen_ip;
   int32_t listen_port;
   std::string remote_ip;
   int32_t remote_port;
+  ///optional, listeners on an ipv6 address such as "::" also accept ipv4 clients
+  bool dual_stack;
+  ///optional, tcp fast open on the peer link of tcp transport and on the connections of tcptun server
+  ///to outside servers, the kernel falls back to a plain handshake when either side can't do it
+  bool tcp_fastopen;
+  ///optional, adaptive batching of frames sent on the peer link
+  bool batch_enable;
+  double batch_rtt_fraction;
+  int32_t batch_max_hold_ms;
+  ///optional, offer LZ4 compression of frames to peer
+  bool compress_enable;
+  int32_t compress_acceleration;
+  ///optional, "none", "aes-256-gcm" or "chacha20-poly1305", psk is required unless cipher is "none"
+  std::string cipher;
+  std::string psk;
+  ///optional, "tcp" or "udp", how frames are carried between tcptun client and tcptun server
+  std::string transport;
+  ///optional, arq parameters of udp transport
+  int32_t arq_window;
+  int32_t arq_rto_ms;
+  int32_t arq_min_rto_ms;
+  int32_t arq_fast_resend;
+  int32_t arq_pacing_kbps;
+  int32_t udp_mtu;
+  ///optional, reed-solomon fec of udp transport, zero data shards to disable it
+  int32_t fec_data_shards;
+  int32_t fec_parity_shards;
+  ///optional, drop and delay udp datagrams sent, for testing only
+  double udp_loss_rate;
+  int32_t udp_delay_ms;
+  ///optional, tcptun server only, connections to remote server kept ready for new streams
+  int32_t upstream_pool_size;
+  int32_t upstream_pool_max_idle_ms;
+  ///optional, tcptun server only, hostnames of backends and destinations are looked up by dns_threads
+  ///threads and their answers are kept dns_cache_ttl_ms, failures dns_negative_ttl_ms
+  int32_t dns_threads;
+  int32_t dns_cache_ttl_ms;
+  int32_t dns_negative_ttl_ms;
+  ///optional, tcptun server only, the addresses of an outside server are tried one more every
+  ///connect_attempt_delay_ms until one connects, the stream is closed after connect_timeout_ms
+  int32_t connect_attempt_delay_ms;
+  int32_t connect_timeout_ms;
+  ///optional, tcptun server only, after SIGTERM or a handoff the process exits once its streams are
+  ///finished, streams still open after drain_timeout_ms are closed. a tcp peer link without cipher is
+  ///handed over to the new process then and serves new streams meanwhile, any other link refuses them,
+  ///so tcptun client can't open streams for up to drain_timeout_ms until it reconnects
+  int32_t drain_timeout_ms;
+  ///optional, tcptun server only, unix socket path for hot upgrade, a new process with the same path takes
+  ///over the listen fd and then the peer link of the running one, empty to disable
+  std::string handoff_path;
+  ///optional, bytes buffered for one stream, for the peer link and its streams, and for the whole process,
+  ///over them reading is paused and new streams are refused, zero for no limit
+  int32_t stream_buffer_limit_kb;
+  int32_t session_buffer_limit_kb;
+  int32_t buffer_limit_kb;
+  ///optional, max rates outside connections are read at, every stream on its own and all of them together,
+  ///zero for no limit, bytes over them are left in the kernel
+  int32_t stream_rate_kbps;
+  int32_t session_rate_kbps;
+  ///optional, bytes of rate_burst_ms at the rate may be read at once after an idle time
+  int32_t rate_burst_ms;
+  ///optional, interval of the stats in the log, zero to disable
+  int32_t stats_interval_ms;
+  ///optional, microseconds the event loop polls epoll without blocking before it sleeps, it keeps
+  ///a core busy for the latency of waking up, zero to sleep at once
+  int32_t busy_poll_us;
+  ///optional, cpus like "0-3,8" the event loop thread is pinned to, its buffers are then allocated on
+  ///their numa node, empty to leave the thread to the scheduler
+  std::vector<int32_t> cpu_affinity;
+  ///optional, tcp listeners share their ports by SO_REUSEPORT with the other processes listening
+  ///there and take the connections handled by the first cpu of cpu_affinity, which must be set
+  bool incoming_cpu_steering;
+  ///optional, class of the streams with no priority of their own, from 0 which is served first to 3,
+  ///a waiting class is still served priority_share_percent of the bytes of the higher ones
+  int32_t priority_class;
+  int32_t priority_share_percent;
+  ///optional, frames handed to the peer link before the scheduler picks the next ones, zero to send frames
+  ///in the order they come, and frames waiting for a stream before its outside connection is no longer read
+  int32_t peer_queue_kb;
+  int32_t stream_queue_kb;
+  ///optional, streams neither read nor written that long are closed, zero to keep them
+  int32_t idle_timeout_ms;
+  ///optional, tcptun server only, outside servers of new streams, remote_ip:remote_port if not set
+  std::vector<backend_config_t> backends;
+  ///optional, "round_robin", "least_conn" or "hash"
+  std::string balance;
+  int32_t health_check_interval_ms;
+  int32_t health_check_timeout_ms;
+  int32_t max_fails;
+  int32_t fail_timeout_ms;
+  ///optional, tcptun client only, "none", "socks5" or "http_connect", how outside clients ask for destinations
+  std::string frontend;
+  ///optional, tcptun client only, "host:port" of the streams when frontend is "none",
+  ///empty to use the backends of tcptun server
+  std::string target;
+  ///optional, tcptun server only, destinations streams may ask for, nothing is allowed if empty
+  std::vector<std::string> allow_destinations;
+  ///optional, tcptun server only, service tag to "host:port" or "unix:/path" for the streams opened with a tag
+  std::vector<std::pair<std::string, std::string>> services;
+  ///optional, tcptun client only, every listener is served by the same peer link, listen_ip and
+  ///listen_port are not needed when it is set, otherwise it holds the one listener made of them
+  std::vector<listener_config_t> listeners;
   bool parse_flag;
 };
 
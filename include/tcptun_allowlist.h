@@ -0,0 +1,43 @@
+#ifndef TCPTUN_TCPTUN_ALLOWLIST_H
+#define TCPTUN_TCPTUN_ALLOWLIST_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace tcptun {
+
+///destinations the streams of tcptun client may ask tcptun server for, nothing is allowed
+///when there is no rule
+///
+///a rule is "host:port", host is "*", an ip, a cidr like 10.0.0.0/8 or [fd00::/8],
+///a hostname or "*.example.com" for its subdomains, port is "*", a number or a range like 8000-8999
+class DestinationAllowlist {
+ public:
+  ///@return below zero if the rule can't be parsed
+  int32_t Add(const std::string &rule);
+  bool Allowed(const std::string &host, const int32_t &port) const;
+  bool Empty() const { return rules_.empty(); }
+ private:
+  enum host_match_t : uint8_t {
+    kMatchAny = 0,
+    kMatchName = 1,
+    kMatchSuffix = 2,
+    kMatchCidr = 3,
+  };
+  typedef struct {
+    host_match_t match;
+    ///lowercase name, or ".example.com" for kMatchSuffix
+    std::string name;
+    int32_t family;
+    uint8_t addr[16];
+    int32_t prefix_len;
+    int32_t port_min;
+    int32_t port_max;
+  } rule_t;
+  std::vector<rule_t> rules_;
+};
+
+}
+
+#endif //TCPTUN_TCPTUN_ALLOWLIST_H
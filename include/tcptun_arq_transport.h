@@ -0,0 +1,196 @@
+#ifndef TCPTUN_TCPTUN_ARQ_TRANSPORT_H
+#define TCPTUN_TCPTUN_ARQ_TRANSPORT_H
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <random>
+#include <vector>
+#include <sys/socket.h>
+#include "tcptun_transport.h"
+#include "tcptun_fec.h"
+
+namespace tcptun {
+
+///sequence numbers wrap around after 2^32 segments, a is before b if the signed distance from b to a
+///is negative, which holds while the segments compared are less than 2^31 apart, like _itimediff of KCP
+inline int32_t seq_diff(const uint32_t &a, const uint32_t &b) {
+    return static_cast<int32_t>(a - b);
+}
+
+///orders the segments of a window by seq_diff, so the first one stays first when sn wraps around
+struct seq_less_t {
+  bool operator()(const uint32_t &a, const uint32_t &b) const { return seq_diff(a, b) < 0; }
+};
+
+///drop and delay datagrams before they are sent, like netem but in process
+class LossInjector : public noncopyable {
+ public:
+  LossInjector(const double &loss_rate, const int32_t &delay_ms);
+  bool Enabled() const { return loss_rate_ > 0 || delay_ms_ > 0; }
+  /**
+   * @return true if the datagram should be sent now, false if it is dropped or held for later
+   */
+  bool Admit(const char *data, const size_t &len, const int64_t &now_ms);
+  ///move the datagrams whose delay elapsed to datagrams
+  void PopDue(const int64_t &now_ms, std::vector<std::vector<char>> &datagrams);
+  int32_t NextTimeoutMs(const int64_t &now_ms) const;
+  void Clear() { delayed_.clear(); }
+ private:
+  double loss_rate_;
+  int32_t delay_ms_;
+  std::minstd_rand rand_;
+  std::uniform_real_distribution<double> dist_;
+  std::deque<std::pair<int64_t, std::vector<char>>> delayed_;
+};
+
+///checks the first bytes of the stream of a new arq session before it replaces the current one
+///@param data first bytes of the stream of the new session
+///@return one to take the new session, zero if more bytes are needed, below zero to refuse it
+typedef std::function<int32_t(const char *data, const size_t &len)> session_check_t;
+
+///selective repeat arq over udp in the spirit of KCP
+///
+///datagram: | conv(4) | flags(1) | body |, body is a batch of segments, or a fec packet
+///carrying a batch of segments when flags has kDatagramFec
+///segment: | cmd(1) | wnd(2) | ts(4) | sn(4) | una(4) | len(2) | data |
+///every PUSH is acked on its own so only the lost segments are resent, a segment is
+///resent when its rto expires or when fast_resend later segments have been acked,
+///data segments are paced by a token bucket of pacing_kbps
+///
+///tcptun client picks a random conv for its session, tcptun server takes a new conv as a
+///new session if the client has not received anything yet (una is zero), otherwise it
+///answers RST so that a client talking to a restarted server learns about it
+///
+///with a session check tcptun server keeps a new conv aside, its current session untouched,
+///until the first bytes of its stream pass the check. it follows its client to another
+///address only once a datagram from there acks a segment in flight or carries a new one
+class ArqTransport : public PeerTransport {
+ public:
+  /**
+   * @param fd udp socket, connected to tcptun server for tcptun client and bound to the listen
+   * address for tcptun server, set NON_BLOCKING and owned by the transport
+   */
+  ArqTransport(const int32_t &fd, bool is_client, const transport_policy_t &policy);
+  ~ArqTransport() override;
+  ///tcptun server only, see session_check_t
+  void SetSessionCheck(const session_check_t &check) { session_check_ = check; }
+  int32_t fd() const override { return fd_; }
+  bool Connected() const override { return connected_; }
+  int32_t HandleEvents(const uint32_t &events) override;
+  ssize_t Recv(char *buf, const size_t &len) override;
+  ssize_t Send(const char *buf, const size_t &len) override;
+  int32_t SetWantWrite(bool want) override { return 0; }
+  ///bytes not read by Recv close the receive window, which holds peer back
+  int32_t SetWantRead(bool want) override { return 0; }
+  ///bytes waiting to be cut into segments, which is one window at most without it
+  int32_t SetUnsentLimit(const int32_t &bytes) override;
+  int32_t Update(const int64_t &now_ms) override;
+  int32_t NextTimeoutMs(const int64_t &now_ms) override;
+  ///segments of a round are always merged into datagrams, nothing to hold
+  bool Busy(uint32_t &rtt_us) override;
+  int32_t SetCork(bool cork) override { return 0; }
+  void Close() override;
+ private:
+  typedef struct {
+    uint8_t cmd;
+    uint16_t wnd;
+    uint32_t ts;
+    uint32_t sn;
+    uint32_t una;
+    uint16_t len;
+  } segment_header_t;
+  typedef struct {
+    uint32_t ts;
+    int64_t resend_ms;
+    int32_t rto;
+    uint32_t xmit;
+    uint32_t fastack;
+    std::vector<char> data;
+  } segment_t;
+  typedef struct {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    ///ts and data of the first segments of its stream, by sn
+    std::map<uint32_t, std::pair<uint32_t, std::vector<char>>> segments;
+    int64_t deadline_ms;
+  } candidate_t;
+  int32_t Input(const char *datagram, const size_t &len, const struct sockaddr_storage &addr,
+                const socklen_t &addr_len, const int64_t &now_ms);
+  /**
+   * @param from_peer the datagram comes from the address of the session, only ACK and PUSH are read otherwise
+   * @return one if the segments ack a segment in flight or carry one not received yet, zero otherwise
+   */
+  int32_t InputSegments(const char *body, const size_t &len, bool from_peer, const int64_t &now_ms);
+  ///@return false if the segments of the datagram can't be read without a session, like fec parity
+  bool ReadSessionBody(const char *datagram, const size_t &len, const char *&body, size_t &body_len) const;
+  ///@return 1 to start a new session, 0 to ignore, -1 to answer RST
+  int32_t CheckNewSession(const char *datagram, const size_t &len);
+  ///keep the segments of a new conv until its stream passes session_check_
+  ///@return 1 if the new session is taken, 0 otherwise
+  int32_t AdmitSession(const uint32_t &conv, const char *datagram, const size_t &len,
+                       const struct sockaddr_storage &addr, const socklen_t &addr_len, const int64_t &now_ms);
+  bool FromPeer(const struct sockaddr_storage &addr, const socklen_t &addr_len) const;
+  void StartSession(const uint32_t &conv, const int64_t &now_ms);
+  void ResetSession();
+  void UpdateRtt(const int32_t &rtt);
+  void Flush(const int64_t &now_ms);
+  void AppendSegment(const segment_header_t &header, const char *data);
+  void FlushDatagram();
+  void SendDatagram(const char *data, const size_t &len);
+  void SendRst(const uint32_t &conv, const struct sockaddr_storage &addr, const socklen_t &addr_len);
+  uint16_t WindowUnused() const;
+  int32_t fd_;
+  bool is_client_;
+  transport_policy_t policy_;
+  bool connected_;
+  ///peer reset or timed out, Recv reports it as closed
+  bool closed_by_peer_;
+  uint32_t conv_;
+  struct sockaddr_storage peer_addr_;
+  socklen_t peer_addr_len_;
+  size_t mss_;
+  ///bytes accepted by Send and not cut into segments yet
+  std::vector<char> snd_stream_;
+  size_t snd_stream_offset_;
+  ///max bytes of snd_stream_ not cut yet, zero for one window
+  size_t snd_stream_limit_;
+  std::map<uint32_t, segment_t, seq_less_t> snd_buf_;
+  uint32_t snd_una_;
+  uint32_t snd_nxt_;
+  uint32_t rmt_wnd_;
+  int32_t srtt_;
+  int32_t rttvar_;
+  int32_t rto_;
+  double pacing_tokens_;
+  int64_t pacing_ms_;
+  bool pacing_limited_;
+  ///segments received out of order
+  std::map<uint32_t, std::vector<char>, seq_less_t> rcv_buf_;
+  ///bytes received in order and not read by Recv yet
+  std::vector<char> rcv_stream_;
+  size_t rcv_stream_offset_;
+  uint32_t rcv_nxt_;
+  bool rcv_wnd_closed_;
+  ///sn and ts of the PUSH segments to ack
+  std::vector<std::pair<uint32_t, uint32_t>> acklist_;
+  bool send_wins_;
+  int64_t probe_ms_;
+  int64_t last_recv_ms_;
+  int64_t last_send_ms_;
+  int64_t now_ms_;
+  ///segments of the datagram being built
+  std::vector<char> dgram_;
+  std::unique_ptr<FecEncoder> fec_encoder_;
+  std::unique_ptr<FecDecoder> fec_decoder_;
+  LossInjector injector_;
+  session_check_t session_check_;
+  ///new sessions waiting for their stream to pass session_check_, by conv
+  std::map<uint32_t, candidate_t> candidates_;
+};
+
+}
+
+#endif //TCPTUN_TCPTUN_ARQ_TRANSPORT_H
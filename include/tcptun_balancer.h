@@ -0,0 +1,132 @@
+#ifndef TCPTUN_TCPTUN_BALANCER_H
+#define TCPTUN_TCPTUN_BALANCER_H
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "noncopyable.h"
+#include "tcptun_common.h"
+#include "tcptun_upstream_pool.h"
+#include "tcptun_resolver.h"
+#include "tcptun_happy_eyeballs.h"
+
+namespace tcptun {
+
+enum balance_type_t : uint8_t {
+  ///smooth weighted round robin
+  kBalanceRoundRobin = 0,
+  ///fewest open streams relative to weight
+  kBalanceLeastConn = 1,
+  ///consistent hash of conn_id on a ring of weight * kHashPointsPerWeight points per backend
+  kBalanceHash = 2,
+};
+
+typedef struct {
+  ip_port_t addr;
+  int32_t weight;
+} backend_t;
+
+enum pick_result_t : int32_t {
+  kPickPooled = 0,
+  kPickConnect = 1,
+};
+
+typedef struct {
+  balance_type_t type;
+  std::vector<backend_t> backends;
+  ///active check, every backend is probed by a connect this often, zero to disable
+  int32_t health_check_interval_ms;
+  ///a probe not connected in this time fails
+  int32_t health_check_timeout_ms;
+  ///passive check, a backend failing max_fails connects in a row is ejected for fail_timeout_ms
+  int32_t max_fails;
+  int32_t fail_timeout_ms;
+} balance_policy_t;
+
+///picks the outside server of every new stream of tcptun server, the address of a backend
+///may be a hostname which is looked up by the resolver
+///
+///health probes and pool refills race the addresses of a backend with HappyEyeballs, their
+///fds are registered to epoll for EPOLLOUT and
+///must be passed to HandleEvent, a stream picking a backend without a pooled connection is
+///connected by the caller and told by ConnectDone, streams must be released when their fd is closed
+class UpstreamBalancer : public noncopyable {
+ public:
+  ///@param resolver it must outlive the balancer
+  UpstreamBalancer(const int32_t &epoll_fd, const balance_policy_t &policy, const upstream_pool_policy_t &pool_policy,
+                   const connect_policy_t &connect_policy, Resolver *resolver);
+  static int32_t ParseBalanceType(const std::string &name, balance_type_t &type);
+  bool Owns(const int32_t &fd) const;
+  int32_t HandleEvent(const int32_t &fd);
+  /**
+   * pick a backend for a new stream, backends tried by the stream before are skipped
+   * @param fd connection from the pool of the backend if kPickPooled is returned
+   * @param addrs addresses of the backend if kPickConnect is returned, the caller connects to them
+   * and tells the result by ConnectDone
+   * @return below zero if no backend is left
+   */
+  int32_t Pick(const uint32_t &conn_id, int32_t &fd, std::vector<socket_address_t> &addrs);
+  /**
+   * @param fd connection of conn_id to the backend of kPickConnect, below zero if it failed,
+   * then the backend is blamed and Pick may be called again for another one
+   */
+  void ConnectDone(const uint32_t &conn_id, const int32_t &fd);
+  ///the stream of conn_id is closed before ConnectDone
+  void Abandon(const uint32_t &conn_id);
+  ///the stream of fd is closed
+  void Release(const int32_t &fd);
+  void ReleaseAll();
+  void Update(const int64_t &now_ms);
+  ///@return milliseconds until Update must be called again, -1 if no timer is pending
+  int32_t NextTimeoutMs(const int64_t &now_ms) const;
+  ///@return true if a probe or a pool refill found no fd free since the last call
+  bool TakeOutOfFds();
+  static const int32_t kHashPointsPerWeight = 64;
+ private:
+  typedef struct {
+    ip_port_t addr;
+    int32_t weight;
+    int32_t current_weight;
+    int32_t active_streams;
+    int32_t fails;
+    int64_t ejected_until_ms;
+    ///result of the last active check
+    bool healthy;
+    ///the active check in progress, null if there is none
+    std::unique_ptr<HappyEyeballs> probe;
+    std::unique_ptr<UpstreamPool> pool;
+  } backend_state_t;
+  bool Available(const backend_state_t &backend, const int64_t &now_ms) const;
+  int32_t Select(const uint32_t &conn_id, const std::vector<bool> &tried, const int64_t &now_ms);
+  void OnConnectResult(const size_t &index, bool ok, const int64_t &now_ms);
+  void StartProbe(const size_t &index, const int64_t &now_ms);
+  ///@param ret what the race of the probe returned
+  void FinishProbe(const size_t &index, const int32_t &ret, const int64_t &now_ms);
+  int32_t epoll_fd_;
+  balance_policy_t policy_;
+  connect_policy_t connect_policy_;
+  Resolver *resolver_;
+  std::vector<backend_state_t> backends_;
+  ///hash ring point to backend index
+  std::map<uint32_t, size_t> ring_;
+  size_t rr_start_;
+  int64_t next_probe_ms_;
+  ///stream fd to backend index
+  std::unordered_map<int32_t, size_t> stream_backend_;
+  typedef struct {
+    ///backend connected to by the caller, -1 if none
+    int32_t index;
+    std::vector<bool> tried;
+  } picking_t;
+  ///streams between Pick and ConnectDone
+  std::unordered_map<uint32_t, picking_t> picking_;
+  ///a probe finished after it found no fd free
+  bool out_of_fds_;
+};
+
+}
+
+#endif //TCPTUN_TCPTUN_BALANCER_H
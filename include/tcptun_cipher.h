@@ -0,0 +1,93 @@
+#ifndef TCPTUN_TCPTUN_CIPHER_H
+#define TCPTUN_TCPTUN_CIPHER_H
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include "noncopyable.h"
+
+typedef struct evp_cipher_ctx_st EVP_CIPHER_CTX;
+
+namespace tcptun {
+
+enum cipher_type_t : uint8_t {
+  kCipherNone = 0,
+  ///uses AES-NI and PCLMULQDQ when the cpu has them
+  kCipherAes256Gcm = 1,
+  ///faster than AES-GCM on cpus without AES-NI, uses AVX2 when available
+  kCipherChacha20Poly1305 = 2,
+};
+
+typedef struct {
+  cipher_type_t type;
+  ///pre-shared key of tcptun client and tcptun server
+  std::string psk;
+} cipher_policy_t;
+
+///authenticated encryption of the frames on the peer link
+///
+///handshake: client sends nonce_c and HMAC(psk, "tcptun client" | features | nonce_c), server
+///verifies it and answers nonce_s and HMAC(psk, "tcptun server" | features | nonce_c | nonce_s),
+///both sides then derive one key per direction from psk and the two nonces.
+///the payload of every frame after the handshake is sealed with the key of its direction,
+///the frame header is authenticated as AAD and the nonce is an implicit per direction counter,
+///so dropped, reordered or replayed frames fail to open
+class FrameCipher : public noncopyable {
+ public:
+  static const size_t kNonceLen = 32;
+  static const size_t kProofLen = 32;
+  static const size_t kTagLen = 16;
+  explicit FrameCipher(const cipher_policy_t &policy);
+  ~FrameCipher();
+  /**
+   * @param name "none", "aes-256-gcm" or "chacha20-poly1305"
+   * @return zero if the name is known
+   */
+  static int32_t ParseCipherType(const std::string &name, cipher_type_t &type);
+  bool Enabled() const { return policy_.type != kCipherNone; }
+  ///keys are derived and frames can be sealed and opened
+  bool Ready() const { return ready_; }
+  cipher_type_t Type() const { return policy_.type; }
+  int32_t GenerateNonce(char *nonce);
+  /**
+   * compute the handshake proof of this side
+   * @param is_client which side the proof is for
+   * @param features features carried by the hello frame
+   * @param server_nonce ignored for the client proof
+   */
+  int32_t ComputeProof(bool is_client, const uint32_t &features, const char *client_nonce,
+                       const char *server_nonce, char *proof);
+  ///@return true if proof matches the one computed locally
+  bool VerifyProof(bool is_client, const uint32_t &features, const char *client_nonce,
+                   const char *server_nonce, const char *proof);
+  /**
+   * derive the session keys, after this call frames are sealed and opened
+   */
+  int32_t DeriveKeys(bool is_client, const char *client_nonce, const char *server_nonce);
+  /**
+   * seal all the frames in buf in place, the length in the header of every frame must include
+   * kTagLen bytes reserved at the end of its payload for the tag
+   * @return number of frames sealed, below zero for error
+   */
+  int32_t SealFrames(char *buf, const size_t &len);
+  /**
+   * open all the frames in buf in place, after this call the last kTagLen bytes of
+   * every payload are meaningless
+   * @return number of frames opened, below zero if any frame fails authentication
+   */
+  int32_t OpenFrames(char *buf, const size_t &len);
+  void Reset();
+ private:
+  int32_t InitContext(EVP_CIPHER_CTX *ctx, const unsigned char *key, bool encrypt);
+  void MakeIv(uint64_t counter, unsigned char *iv);
+  cipher_policy_t policy_;
+  bool ready_;
+  EVP_CIPHER_CTX *seal_ctx_;
+  EVP_CIPHER_CTX *open_ctx_;
+  uint64_t seal_counter_;
+  uint64_t open_counter_;
+};
+
+}
+
+#endif //TCPTUN_TCPTUN_CIPHER_H
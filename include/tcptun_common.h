@@ -5,6 +5,8 @@
 #ifndef TCPTUN_TCPTUN_COMMON_H
 #define TCPTUN_TCPTUN_COMMON_H
 #include <string>
+#include <vector>
+#include <sys/socket.h>
 
 namespace tcptun {
 
@@ -13,20 +15,104 @@ typedef struct {
   int32_t port;
 } ip_port_t;
 
+///a resolved address of any family, unix addresses included
+typedef struct {
+  struct sockaddr_storage addr;
+  socklen_t len;
+} socket_address_t;
+
 int32_t AddEvent2Epoll(const int32_t &epoll_fd, const int32_t &fd, const uint32_t &events);
 
+int32_t ModEvent2Epoll(const int32_t &epoll_fd, const int32_t &fd, const uint32_t &events);
+
+///register fd with data of its own, which epoll reports instead of the fd
+int32_t AddEvent2Epoll(const int32_t &epoll_fd, const int32_t &fd, const uint32_t &events, const uint64_t &data);
+
+int32_t ModEvent2Epoll(const int32_t &epoll_fd, const int32_t &fd, const uint32_t &events, const uint64_t &data);
+
+int32_t DelEvent2Epoll(const int32_t &epoll_fd, const int32_t &fd);
+
 int set_non_blocking(const int32_t &fd);
 
-int new_listen_socket(const std::string &ip, const size_t &port, int &fd);
+///the next close of fd sends RST instead of FIN, the bytes not sent yet are dropped
+int set_reset_on_close(const int32_t &fd);
+
+///"unix:/path" is a unix domain socket, the port that comes with it is ignored
+bool is_unix_address(const std::string &addr);
+
+///address of an ipv4 or ipv6 literal or of a unix address, hostnames are refused since resolving them would block
+int resolve_literal_address(const std::string &ip, const size_t &port, socket_address_t &address);
+
+///"ip:port", "[ipv6]:port" or "unix:/path", for logs
+std::string address_to_string(const socket_address_t &address);
+
+///ip and remote_ip of the functions below are ipv4 or ipv6 literals, ip of listen socket and
+///remote_ip of tcp sockets may also be unix addresses
+
+/**
+ * @param dual_stack a listener on an ipv6 address also accepts ipv4 clients, not used by other addresses
+ * @param incoming_cpu tcp listeners only, below zero to ignore, otherwise the listener shares the port by
+ * SO_REUSEPORT with the other processes listening there, and the kernel hands it the connections whose
+ * packets are handled by incoming_cpu, so they stay on the cpu of the process
+ * @return zero if fd is listening, below zero for error
+ */
+int new_listen_socket(const std::string &ip, const size_t &port, const bool &dual_stack, int &fd,
+                      const int32_t &incoming_cpu = -1);
+
+/**
+ * accept tcp fast open on a tcp listener, data in the SYN of a client is taken without waiting for the handshake
+ * @return below zero if the kernel does not support it, the listener works without it then
+ */
+int set_listen_fastopen(const int &fd);
 
-int new_connected_socket(const std::string &remote_ip, const size_t &remote_port, int &fd);
+/**
+ * @param fastopen tcp only, connect returns at once if the kernel has a fast open cookie of the remote, the
+ * first send then carries the SYN and may fail with EINPROGRESS like EAGAIN, plain connect is used if the
+ * kernel does not support it
+ */
+int new_connected_socket(const std::string &remote_ip, const size_t &remote_port, const bool &fastopen, int &fd);
+
+int new_connected_socket(const socket_address_t &address, const bool &fastopen, int &fd);
+
+/**
+ * start a non-blocking connect, wait for EPOLLOUT and check SO_ERROR to learn the result
+ * @param fastopen the same as new_connected_socket
+ * @return zero if the connection is established or in progress, below zero for error
+ */
+int new_connecting_socket(const std::string &remote_ip, const size_t &remote_port, const bool &fastopen, int &fd);
+
+int new_connecting_socket(const socket_address_t &address, const bool &fastopen, int &fd);
+
+///udp socket bound to ip:port, for tcptun server of udp transport
+int new_bound_udp_socket(const std::string &ip, const size_t &port, const bool &dual_stack, int &fd);
+
+///udp socket connected to remote_ip:remote_port, for tcptun client of udp transport
+int new_connected_udp_socket(const std::string &remote_ip, const size_t &remote_port, int &fd);
+
+/**
+ * block signals and read them from a signalfd instead, so the event loop handles them with epoll
+ * @return below zero for error
+ */
+int new_signal_fd(const std::vector<int> &signals, int &fd);
+
+///split "host:port", ipv6 hosts are in brackets like "[::1]:443"
+int parse_host_port(const std::string &addr, std::string &host, int32_t &port);
 
 void write_u32(char *p, uint32_t l);
 
 uint32_t read_u32(const char *p);
 
+void write_u16(char *p, uint16_t l);
+
+uint16_t read_u16(const char *p);
+
 int64_t getnowtime_ms();
 
+int64_t getnowtime_us();
+
+///@param list cpus like "0-3,8", @return below zero if it is malformed
+int parse_cpu_list(const std::string &list, std::vector<int32_t> &cpus);
+
 }
 
 #endif //TCPTUN_TCPTUN_COMMON_H
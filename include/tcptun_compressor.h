@@ -0,0 +1,54 @@
+#ifndef TCPTUN_TCPTUN_COMPRESSOR_H
+#define TCPTUN_TCPTUN_COMPRESSOR_H
+
+#include <cstdint>
+#include <cstddef>
+#include <unordered_map>
+#include <vector>
+#include "noncopyable.h"
+
+namespace tcptun {
+
+typedef struct {
+  bool enable;
+  ///acceleration of LZ4 fast mode, bigger is faster but compresses less
+  int32_t acceleration;
+} compress_policy_t;
+
+///per frame LZ4 compression, the compressibility of every stream is sampled so that
+///streams carrying already compressed or encrypted data are sent as they are
+class FrameCompressor : public noncopyable {
+ public:
+  explicit FrameCompressor(const compress_policy_t &policy);
+  /**
+   * try to compress the payload of a frame of conn_id
+   * @param dst should be at least CompressBound(len) bytes
+   * @return length of the compressed data, zero if the payload should be sent uncompressed,
+   * below zero for error
+   */
+  int32_t Compress(const uint32_t &conn_id, const char *src, const size_t &len, char *dst, const size_t &dst_len);
+  /**
+   * @return length of the decompressed data, below zero for error
+   */
+  int32_t Decompress(const char *src, const size_t &len, char *dst, const size_t &dst_len);
+  ///forget the sampling state of a closed stream
+  void RemoveStream(const uint32_t &conn_id);
+  void Clear();
+  static size_t CompressBound(const size_t &len);
+ private:
+  typedef struct {
+    ///consecutive frames which did not shrink enough
+    uint32_t misses;
+    ///frames to send uncompressed before sampling the stream again
+    uint32_t bypass_frames;
+    ///bypass_frames used by the next backoff, doubled every time the stream fails again
+    uint32_t backoff;
+  } stream_sample_t;
+  compress_policy_t policy_;
+  std::vector<char> lz4_state_;
+  std::unordered_map<uint32_t, stream_sample_t> connid2sample_;
+};
+
+}
+
+#endif //TCPTUN_TCPTUN_COMPRESSOR_H
@@ -7,43 +7,401 @@
 
 #include <vector>
 #include <cstdint>
+#include <deque>
+#include <string>
 #include <unordered_map>
+#include <unordered_set>
 #include <memory>
 #include "tcptun_common.h"
+#include "tcptun_frame.h"
+#include "tcptun_compressor.h"
+#include "tcptun_cipher.h"
+#include "tcptun_transport.h"
+#include "tcptun_balancer.h"
+#include "tcptun_proxy.h"
+#include "tcptun_allowlist.h"
+#include "tcptun_resolver.h"
+#include "tcptun_happy_eyeballs.h"
+#include "tcptun_memory_budget.h"
+#include "tcptun_token_bucket.h"
+#include "tcptun_frame_scheduler.h"
+#include "tcptun_timer_wheel.h"
+#include "tcptun_stream.h"
+#include "tcptun_event_loop.h"
 
 namespace tcptun {
 
-class ConnectionManager {
+///adaptive coalescing of the frames sent to peer, when the peer link still has
+///unacknowledged data in flight we cork it for a while so that small frames
+///are merged into full segments, when the link is idle frames are sent at once
+typedef struct {
+  bool enable;
+  ///the hold time is at most rtt_fraction * measured rtt of the peer link
+  double rtt_fraction;
+  ///and never longer than max_hold_ms
+  int32_t max_hold_ms;
+} batch_policy_t;
+
+///where the streams go
+typedef struct {
+  ///tcptun client only, how the outside client of local_listen_fd tells the destination of its stream
+  frontend_type_t frontend;
+  ///tcptun client only, destination of the streams of local_listen_fd when frontend is kFrontendNone,
+  ///"host:port", a service tag of tcptun server, or empty for the backends of tcptun server
+  std::string target;
+  ///tcptun client only, max rate the streams of local_listen_fd are read at together, zero for no limit
+  int32_t rate_kbps;
+  ///tcptun client only, priority class and weight of the streams of local_listen_fd, see FrameScheduler,
+  ///a class below zero for the default one
+  int32_t priority;
+  int32_t weight;
+  ///streams neither read nor written for this long are closed, for the streams of local_listen_fd
+  ///on tcptun client and for every stream on tcptun server, zero for never
+  int32_t idle_timeout_ms;
+  ///tcptun server only, rules of DestinationAllowlist for the destinations asked for by streams
+  std::vector<std::string> allow_destinations;
+  ///tcptun server only, service tag to "host:port", services are not checked by the allowlist
+  std::unordered_map<std::string, std::string> services;
+} stream_policy_t;
+
+///the default handler of the event loop, it handles the events of every fd it registers to epoll_fd
+class ConnectionManager : public EventHandler {
  public:
   /**
    * Constructor
+   * @param epoll_fd epoll fd of the event loop, connection manager registers the fds created by itself and
+   * the peer links accepted to it
    * @param local_listen_fd local listen fd, set it NON_BLOCKING before pass it as a param
    * @param peer_connected_fd connected fd to remote for tcptun client, it's the connected fd to tcptun server,
-   * for tcptun server it's the connected fd to outside server, set it NON_BLOCKING before pass it as a param
+   * for tcptun server it's zero, set it NON_BLOCKING before pass it as a param
    * @param ip_port the ip and port information of remote server
+   * @param transport_policy how frames are carried to peer, for udp transport tcptun client passes its
+   * connected udp socket as peer_connected_fd and tcptun server passes its bound udp socket as
+   * local_listen_fd, the sockets are owned by the connection manager afterwards
+   * @param batch_policy how to coalesce frames sent on the peer link
+   * @param compress_policy whether to offer compression of frames to peer
+   * @param cipher_policy cipher and pre-shared key of the peer link, if a cipher is set the
+   * peer must authenticate itself with the same key before any stream is opened
+   * @param balance_policy outside servers of new streams and how to pick them, tcptun server only
+   * @param upstream_pool_policy connections to every outside server kept ready, tcptun server only
+   * @param resolver_policy how hostnames of backends and destinations are looked up, tcptun server only
+   * @param connect_policy how the addresses of a backend or destination are raced, tcptun server only
+   * @param stream_policy destinations of the streams
+   * @param rate_policy max rates outside connections are read at, bytes over them are left in the kernel
+   * @param priority_policy how frames of the streams wait for the peer link, tcptun server gives a stream
+   * the priority asked for by its open frame
+   * @param memory_policy limits of the bytes buffered for a stream and for the session, over them
+   * reading is paused and new streams are refused until the buffers drain
+   * @param memory_budget bytes buffered by the whole process, owned by the caller and shared with the
+   * other connection managers, it must outlive them
+   */
+  ConnectionManager(const int32_t &epoll_fd,
+                    const int32_t &local_listen_fd,
+                    const int32_t &peer_connected_fd,
+                    ip_port_t ip_port,
+                    const transport_policy_t &transport_policy,
+                    const batch_policy_t &batch_policy,
+                    const compress_policy_t &compress_policy,
+                    const cipher_policy_t &cipher_policy,
+                    const balance_policy_t &balance_policy,
+                    const upstream_pool_policy_t &upstream_pool_policy,
+                    const resolver_policy_t &resolver_policy,
+                    const connect_policy_t &connect_policy,
+                    const stream_policy_t &stream_policy,
+                    const rate_policy_t &rate_policy,
+                    const priority_policy_t &priority_policy,
+                    const memory_policy_t &memory_policy,
+                    MemoryBudget *memory_budget);
+  ~ConnectionManager();
+  /**
+   * tcptun client only, accept streams on one more listen fd, like local_listen_fd the
+   * fd must be registered to epoll with its fd as data by the caller, it is set NON_BLOCKING here
+   * @param frontend, target, rate_kbps, priority, weight and idle_timeout_ms the same as those of
+   * stream_policy_t for local_listen_fd
    */
-  ConnectionManager(const int32_t &local_listen_fd,const int32_t& peer_connected_fd, ip_port_t ip_port);
+  int32_t AddListener(const int32_t &listen_fd, const frontend_type_t &frontend, const std::string &target,
+                      const int32_t &rate_kbps, const int32_t &priority, const int32_t &weight,
+                      const int32_t &idle_timeout_ms);
+  ///stop accepting on listen_fd, the caller closes it
+  void RemoveListener(const int32_t &listen_fd);
+  bool IsListener(const int32_t &fd) const { return listeners_.count(fd) != 0; }
+  ///hand the events of an fd registered by the connection manager, a listener or the peer link to
+  ///HandleStreamEvents, HandleNewConnection, HandlePeerEvents or HandleOutsideEvents
+  void HandleEvents(const epoll_data_t &data, const uint32_t &events) override;
   /**
-   * handle the issue when new connection comes
+   * handle the issue when new connection comes, when the process is out of fds the least
+   * recently active streams are reset to make room
    * @param is_client if tcptun client call this function, set is_client as true, for tcptun server set it as false
-   * @return below zero for error, zero for everythis is fine
+   * @param listen_fd the listen fd which is readable
+   * @return below zero for error, zero for everythis is fine, otherwise the new fd, which is registered
+   * to epoll by the connection manager, for tcptun server it is a new peer link, which replaces the
+   * current one only once its hello is authenticated
    */
-  int32_t HandleNewConnection(bool is_client);
-  int32_t RecvDataFromPeer();
-  int32_t RecvDataFromOutside(const int32_t& readable_fd);
+  int32_t HandleNewConnection(bool is_client, const int32_t &listen_fd);
+  /**
+   * tcptun client calls it once the peer link is connected to negotiate link features,
+   * frames are sent uncompressed until the answer of tcptun server arrives,
+   * and if a cipher is set they are not sent at all until then
+   */
+  int32_t SendHelloToPeer();
+  /**
+   * call it when PeerFd reports events
+   * @return below zero for error, zero for everything is fine
+   */
+  int32_t HandlePeerEvents(const uint32_t &events);
+  ///fd of the peer link registered to epoll, -1 if there is none
+  int32_t PeerFd() const;
+  /**
+   * call it when event_stream finds a stream in the data epoll reported, data read from the outside
+   * connection is queued as a frame for peer and not sent until FlushToPeer is called
+   */
+  int32_t HandleStreamEvents(stream_t *stream, const uint32_t &events);
+  /**
+   * call it when any other fd reports events, connections in progress of the upstream pool, answers
+   * of the resolver and connection attempts to outside servers are handled here
+   */
+  int32_t HandleOutsideEvents(const int32_t &fd, const uint32_t &events);
+  /**
+   * send the queued frames to peer according to the batch policy and run
+   * the timers of the connection manager, call it once after handling a batch of events
+   * @return below zero for error, zero for everything is fine
+   */
+  int32_t FlushToPeer();
+  /**
+   * @return timeout in milliseconds for epoll_wait, -1 when nothing is held
+   */
+  int32_t NextTimeoutMs();
+  /**
+   * tcptun server only, stop taking tcptun clients and wait for the streams to finish
+   * @param handover true if a new process takes the peer link over once drained, a link which can be
+   * released keeps serving new streams until then, any other link refuses them from now on
+   */
+  void StartDrain(const bool &handover);
+  ///@return true if no stream is open or being connected
+  bool Drained() const;
+  ///close every stream and tell peer about it, for streams outliving a drain, new streams are refused from now on
+  void AbortStreams();
+  /**
+   * tcptun server only, give up the peer link so another process can take it over with AdoptPeer,
+   * it is possible at frame boundaries of a tcp link without encryption, whose keys can't move
+   * @param fd the peer link, removed from epoll and not closed
+   * @param features link features agreed with tcptun client
+   * @return zero if fd is released, one if streams are open or frames are still being sent or
+   * received, below zero if the link can't be released
+   */
+  int32_t ReleasePeer(int32_t &fd, uint32_t &features);
+  /**
+   * tcptun server only, take over a peer link released by another process, as if it were accepted
+   * @return the fd which should be registered to epoll by the caller, below zero if it is refused
+   */
+  int32_t AdoptPeer(const int32_t &fd, const uint32_t &features);
+  memory_stats_t MemoryStats() const;
  private:
+  int32_t RecvDataFromPeer();
+  ///@return one if more bytes may be read, zero if the transport is drained, below zero for error
+  int32_t RecvFramesFromPeer();
+  int32_t HandleFrameFromPeer(const frame_header_t &header, const char *payload);
+  int32_t HandleHelloFromPeer(const frame_header_t &header, const char *payload);
+  int32_t HandleOpenFromPeer(const frame_header_t &header, const char *payload);
+  ///pick a backend or look up the destination of the stream of conn_id and race its addresses,
+  ///called again when the lookup finishes or the race to a backend is lost
+  int32_t ConnectStream(const uint32_t &conn_id);
+  int32_t HandleResolverEvent();
+  ///@param ret what the race of the stream of conn_id returned
+  int32_t HandleRaceResult(const uint32_t &conn_id, const int32_t &ret);
+  void UpdateRaces(const int64_t &now);
+  ///connects of streams, probes or pool refills found no fd free, free some like accept does
+  void UpdateConnectsOutOfFds();
+  ///set up a stream for fd from stream_pool_ and register fd to epoll
+  stream_t *NewStream(const uint32_t &conn_id, const int32_t &fd);
+  stream_t *AttachOutsideConnection(const uint32_t &conn_id, const int32_t &fd);
+  ///@param broken the connection reported EPOLLERR or EPOLLHUP, it is read whatever its rate to be closed
+  int32_t RecvDataFromOutside(stream_t *stream, bool broken);
+  ///what the kernel does not take now is kept and sent when the stream reports EPOLLOUT
+  int32_t SendToOutside(stream_t *stream, const char *data, const size_t &len);
+  int32_t FlushToOutside(stream_t *stream);
+  int32_t HandleProxyHandshake(stream_t *stream);
+  ///queue len bytes of stream data placed at recv_buf + kFrameHeaderLen
+  int32_t QueueDataToPeer(const uint32_t &conn_id, const size_t &len);
+  int32_t QueueOpenToPeer(const uint32_t &conn_id, const std::string &destination);
+  ///@param reset peer drops what it keeps for the stream and resets its outside connection
+  int32_t QueueCloseToPeer(const uint32_t &conn_id, bool reset = false);
+  ///frames other than hello wait in scheduler_ while the link buffer is full
+  int32_t QueueFrameToPeer(const char *frame, const size_t &len);
+  void AppendFrameToPeer(const char *frame, const size_t &len);
+  ///move frames from scheduler_ to the link buffer as far as priority_policy_.link_queue allows
+  void ScheduleFramesToPeer();
+  ///seal the queued frames and hand them to the transport according to the batch policy
+  int32_t SendFramesToPeer(const int64_t &now);
+  int32_t SendPendingToPeer();
+  ///@return true if peer link still has unacknowledged data in flight
+  bool PeerLinkBusy();
+  int32_t SetPeerCork(bool cork);
+  void ResetPeerState();
+  void CloseOutsideConnection(stream_t *stream);
+  ///the outside connection of the stream is gone, close the stream on both sides
+  ///@param reset abort the stream, its fd is closed with RST and peer is told to do the same
+  void CloseOutsideStream(stream_t *stream, bool reset = false);
+  void CloseOutsideConnections();
+  void ClosePeerConnection();
+  ///epoll events of the outside connection of the stream
+  uint32_t OutsideEvents(const stream_t *stream) const;
+  ///ask epoll for the events the stream wants now
+  void WatchOutside(stream_t *stream);
+  ///charge the buffers to the budget and pause or resume reading, @return true if reading peer is resumed
+  bool UpdateMemory();
+  bool SetPeerReadPaused(bool paused);
+  void SetOutsideReadPaused(bool paused);
+  ///@return bytes the outside connection of the stream may be read now according to its rates
+  size_t ReadAllowance(stream_t *stream, const int64_t &now);
+  void ConsumeReadAllowance(stream_t *stream, const size_t &bytes);
+  ///stop reading the stream until its frames are sent
+  void BacklogOutside(stream_t *stream);
+  void UpdateBacklogged(const uint32_t &conn_id);
+  ///stop reading the stream until its rates allow a full read again
+  void ThrottleOutside(stream_t *stream, const int64_t &now);
+  void UpdateThrottled(const int64_t &now);
+  ///start the idle timer of a new stream
+  void TrackOutside(stream_t *stream, const int32_t &idle_timeout_ms);
+  void TouchOutside(stream_t *stream);
+  ///close the streams idle for longer than their timeouts
+  void UpdateIdle(const int64_t &now);
+  ///reset the least recently active streams, @return the number of streams reset
+  size_t EvictStreams();
+  ///accept failed for lack of fds, free some or drop the connection with the reserve fd and stop
+  ///accepting on listen_fd for a while, so level triggered epoll does not report it again at once
+  void HandleAcceptExhausted(const int32_t &listen_fd);
+  ///watch the listeners again once their pause is over
+  void UpdatePausedListeners(const int64_t &now);
+  ///tcptun server only, read the hello of a new peer link, it takes over once the hello is authenticated
+  void HandlePendingLinkEvents(const int32_t &fd, const uint32_t &events);
+  /**
+   * check the first bytes a new peer link or arq session of tcptun client carries
+   * @return one if they start with an authenticated hello, zero if more bytes are needed, below zero otherwise
+   */
+  int32_t CheckPeerHello(const char *data, const size_t &len);
+  ///@return true if the client hello proves the psk and was never seen before
+  bool AuthenticateHello(const char *payload);
+  ///replace the peer link with fd, its hello is handled as if the new link had carried it
+  void PromotePendingLink(const int32_t &fd, const std::string &hello);
+  void ClosePendingLink(const int32_t &fd);
+  ///close the new peer links which have not sent their hello in time
+  void UpdatePendingLinks(const int64_t &now);
+  bool PeerConnected() const { return peer_ != nullptr && peer_->Connected(); }
+  int32_t epoll_fd_;
   int32_t local_listen_fd_;
-  ///connected fd to peer, for tcptun_client peer is tcptun_server
+  bool is_client_;
+  ///link to peer, for tcptun_client peer is tcptun_server
   ///for tcptun_server peer is tcptun_client
-  int32_t peer_connected_fd_;
+  std::unique_ptr<PeerTransport> peer_;
+  transport_type_t transport_type_;
   char recv_buf[2048];
   int32_t recv_len;
-  ///outside connections, for tcptun_client outside connections are connections from its clients
-  ///for tcptun_server outside connections are connections from its server
-  ///for both client and server value is conn_id that identify the connection
-  std::unordered_map<int32_t, uint32_t> outside_connectionfd_2connid_;
-  ///key is conn_id and value is the connection fd
-  std::unordered_map<uint32_t, int32_t> connid2outside_connectionfd_;
+  ///bytes received from peer which have not formed a whole frame yet
+  std::vector<char> peer_recv_buf_;
+  size_t peer_recv_len_;
+  ///frames waiting to be sent to peer, peer_send_offset_ is the sent part,
+  ///frames behind peer_sealed_offset_ are not sealed yet
+  std::vector<char> peer_send_buf_;
+  size_t peer_send_offset_;
+  size_t peer_sealed_offset_;
+  ///whether the transport was asked to report writable
+  bool peer_want_write_;
+  batch_policy_t batch_policy_;
+  bool peer_corked_;
+  int64_t peer_cork_deadline_ms_;
+  ///smoothed rtt of peer link reported by the transport, in microseconds
+  uint32_t peer_rtt_us_;
+  ///features we offer and features agreed by both sides, bits of link_feature_t
+  uint32_t local_features_;
+  uint32_t peer_features_;
+  bool hello_sent_;
+  FrameCompressor compressor_;
+  std::vector<char> compress_buf_;
+  FrameCipher cipher_;
+  char client_nonce_[FrameCipher::kNonceLen];
+  ///declared before balancer_, which looks up backends with it
+  Resolver resolver_;
+  UpstreamBalancer balancer_;
+  stream_policy_t stream_policy_;
+  DestinationAllowlist allowlist_;
+  typedef struct {
+    frontend_type_t frontend;
+    std::string target;
+    TokenBucket rate;
+    int32_t priority;
+    int32_t weight;
+    int32_t idle_timeout_ms;
+  } listener_t;
+  ///listen fd to the way its streams find their destination
+  std::unordered_map<int32_t, listener_t> listeners_;
+  StreamPool stream_pool_;
+  ///streams with an outside connection, for tcptun_client outside connections are connections from
+  ///its clients, for tcptun_server outside connections are connections to its servers, the key is
+  ///conn_id that identify the stream
+  std::unordered_map<uint32_t, stream_t *> streams_;
+  ///the same streams by the fd of their outside connection
+  std::unordered_map<int32_t, stream_t *> fd_streams_;
+  connect_policy_t connect_policy_;
+  bool draining_;
+  ///draining with the peer link going to a new process, streams opened by peer are still served
+  bool drain_serves_streams_;
+  typedef struct {
+    ///the stream goes to a backend of balancer_ if true, to host:port otherwise
+    bool backend;
+    std::string destination;
+    std::string host;
+    int32_t port;
+    ///data of the stream received from peer before it is connected
+    std::string pending;
+    ///null while the host is being looked up
+    std::unique_ptr<HappyEyeballs> race;
+  } connecting_stream_t;
+  ///tcptun server only, streams being looked up or connected
+  std::unordered_map<uint32_t, connecting_stream_t> connecting_streams_;
+  ///streams with bytes in their send_buf
+  std::unordered_set<stream_t *> sending_streams_;
+  memory_policy_t memory_policy_;
+  MemoryBudget *memory_budget_;
+  ///bytes charged to memory_budget_ by this session
+  int64_t session_memory_;
+  ///the session has no flow control of its own streams, so a stream over its limit pauses
+  ///reading peer for every stream until its outside connection takes the bytes
+  bool peer_read_paused_;
+  ///outside connections are not read and new streams are refused
+  bool outside_read_paused_;
+  memory_stats_t memory_stats_;
+  rate_policy_t rate_policy_;
+  TokenBucket session_rate_;
+  ///streams not read until their unthrottle_ms
+  std::unordered_set<stream_t *> throttled_streams_;
+  ///earliest unthrottle_ms of throttled_streams_, -1 if there is none
+  int64_t next_unthrottle_ms_;
+  priority_policy_t priority_policy_;
+  FrameScheduler scheduler_;
+  ///streams not read until they have less than half of priority_policy_.stream_queue waiting in scheduler_
+  size_t backlogged_streams_;
+  ///timers of the streams with an idle timeout, by the fd of their outside connection
+  TimerWheel idle_wheel_;
+  ///spare fd given up to accept and close a connection when the process is out of fds, -1 if lost
+  int32_t reserve_fd_;
+  ///listeners removed from epoll until the time of the value
+  std::unordered_map<int32_t, int64_t> paused_listeners_;
+  ///pause of the next listener out of fds, doubled every time until an accept succeeds
+  int32_t accept_backoff_ms_;
+  ///a race of a stream found no fd free, its connect is retried once UpdateConnectsOutOfFds freed some
+  bool connects_out_of_fds_;
+  typedef struct {
+    ///hello frame read so far, nothing behind it is read so the frames following it are left to the transport
+    std::string hello;
+    int64_t deadline_ms;
+  } pending_link_t;
+  ///tcptun server only, peer links accepted and waiting for their hello, by fd, the current
+  ///peer link and its streams are left alone until one of them authenticates
+  std::unordered_map<int32_t, pending_link_t> pending_links_;
+  ///nonces of the client hellos accepted, so a hello replayed on a new link does not take over
+  std::unordered_set<std::string> seen_client_nonces_;
+  std::deque<std::string> seen_client_nonce_order_;
   ///remote server info
   ///for tcptun_client remote server info is the info of tcptun server
   ///for tcptun_server remote server info is the info of another outside server
@@ -0,0 +1,164 @@
+#ifndef TCPTUN_TCPTUN_EVENT_LOOP_H
+#define TCPTUN_TCPTUN_EVENT_LOOP_H
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/epoll.h>
+#include "noncopyable.h"
+#include "tcptun_ring.h"
+
+namespace tcptun {
+
+///what the event loop calls for the events of an fd
+class EventHandler {
+ public:
+  virtual ~EventHandler() = default;
+  /**
+   * @param data epoll data the fd was registered with, the fd itself for fds registered by AddHandler
+   * @param events events epoll reported, errors are logged by the handler
+   */
+  virtual void HandleEvents(const epoll_data_t &data, const uint32_t &events) = 0;
+};
+
+typedef struct {
+  ///returns of epoll_wait with events, and the events they reported
+  uint64_t wakeups;
+  uint64_t events;
+  ///most events of one wakeup
+  int32_t peak_events;
+  ///wakeups which filled the event array, the rest of the events waited for the next call
+  uint64_t full_wakeups;
+  ///wakeups found by the busy poll before the loop would have blocked
+  uint64_t busy_poll_wakeups;
+  ///events epoll_wait may return at once now
+  size_t event_array_size;
+} loop_stats_t;
+
+///one line for the log
+std::string loop_stats_to_string(const loop_stats_t &stats);
+
+typedef std::function<void()> task_t;
+typedef std::function<void(const uint32_t &events)> event_callback_t;
+
+///handler calling a function, for the few fds the samples watch themselves
+class CallbackHandler : public EventHandler {
+ public:
+  explicit CallbackHandler(event_callback_t callback);
+  void HandleEvents(const epoll_data_t &data, const uint32_t &events) override;
+ private:
+  event_callback_t callback_;
+};
+
+///epoll reactor, a round of the loop waits for events and hands them to the handlers of their fds,
+///then runs the timers due, the tasks queued and the round hook, in this order
+///
+///the event array grows while epoll_wait fills it and shrinks back while it stays mostly empty, so
+///a busy loop takes its events in few calls and an idle one does not keep a large array
+///
+///fds registered by AddHandler find their handler by their number, the rest of the fds registered
+///to epoll_fd, which other objects register themselves, go to the default handler, an fd must be
+///removed by DelHandler before it is closed, so its number is not taken for the old handler's
+///
+///everything but QueueInLoop, RunInLoop, Wakeup and Quit must be called on the thread of the loop
+class EventLoop : public noncopyable {
+ public:
+  EventLoop();
+  ~EventLoop();
+  ///@return below zero if the loop could not be set up
+  int32_t epoll_fd() const { return epoll_fd_; }
+  /**
+   * @param handler called for the events of fd until DelHandler, it must outlive the registration
+   * @return below zero for error
+   */
+  int32_t AddHandler(const int32_t &fd, const uint32_t &events, EventHandler *handler);
+  int32_t ModHandler(const int32_t &fd, const uint32_t &events);
+  int32_t DelHandler(const int32_t &fd);
+  ///@param handler called for the events of the fds registered to epoll_fd by others
+  void SetDefaultHandler(EventHandler *handler);
+  ///@param hook called before every wait, the loop blocks for at most what it returns, -1 for no limit
+  void SetTimeoutHook(const std::function<int32_t()> &hook);
+  ///@param hook called at the end of every round, for the work batched over the events of a round
+  void SetRoundHook(const task_t &hook);
+  /**
+   * pin the calling thread, which is to run the loop, to cpus and have the pages it allocates from
+   * now on taken from the numa node it runs on, so the buffers of the loop stay near the cpus and
+   * the interrupts of the connections, call it before the buffers of the loop are allocated
+   * @return below zero if the thread can't be pinned, a failure to set the memory policy is only logged
+   */
+  int32_t PinThread(const std::vector<int32_t> &cpus);
+  ///@param busy_poll_us poll epoll without blocking this long before every wait that would block,
+  ///which trades a core for the latency of waking up, zero to block at once
+  void SetBusyPoll(const int32_t &busy_poll_us);
+  /**
+   * timers fire at the end of the round they are due in, with the milliseconds of epoll_wait
+   * @return id of the timer for CancelTimer, never zero
+   */
+  uint64_t RunAt(const int64_t &when_ms, const task_t &task);
+  uint64_t RunAfter(const int32_t &delay_ms, const task_t &task);
+  ///the task runs every interval_ms until the timer is cancelled
+  uint64_t RunEvery(const int32_t &interval_ms, const task_t &task);
+  ///a timer fired already or cancelled is ignored, a timer may cancel itself
+  void CancelTimer(const uint64_t &id);
+  ///run the task now on the thread of the loop, or queue it from any other thread
+  void RunInLoop(const task_t &task);
+  ///run the task in the current round, or in the next one if it is called by another thread
+  void QueueInLoop(const task_t &task);
+  ///end the wait of the loop
+  void Wakeup();
+  ///handle events until Quit, the thread calling it is the thread of the loop
+  ///@return zero after Quit, below zero if epoll_wait failed
+  int32_t Loop();
+  ///the loop returns at the end of the current round
+  void Quit();
+  bool InLoopThread() const { return thread_id_ == std::this_thread::get_id(); }
+  loop_stats_t Stats() const;
+  static const size_t kMinEvents = 64;
+  static const size_t kMaxEvents = 4096;
+  ///the event array is halved after this many wakeups in a row using at most a quarter of it
+  static const int32_t kShrinkWakeups = 256;
+ private:
+  typedef struct {
+    uint64_t id;
+    ///zero for a timer firing once
+    int32_t interval_ms;
+    task_t task;
+  } timer_t;
+  ///@return milliseconds epoll_wait may block for
+  int32_t NextTimeoutMs(const int64_t &now);
+  ///epoll_wait after the busy poll, @return what epoll_wait returned
+  int32_t Wait(int32_t timeout_ms);
+  void ResizeEvents(const int32_t &nfds);
+  void HandleWakeup();
+  void RunTimers(const int64_t &now);
+  void RunTasks();
+  int32_t epoll_fd_;
+  int32_t wakeup_fd_;
+  std::vector<struct epoll_event> events_;
+  ///wakeups in a row using at most a quarter of events_
+  int32_t sparse_wakeups_;
+  int32_t busy_poll_us_;
+  loop_stats_t stats_;
+  ///indexed by fd
+  std::vector<EventHandler *> handlers_;
+  EventHandler *default_handler_;
+  std::function<int32_t()> timeout_hook_;
+  task_t round_hook_;
+  ///by expire time
+  std::multimap<int64_t, timer_t> timers_;
+  uint64_t next_timer_id_;
+  ///timers being fired now, cancelled ones are not run or scheduled again
+  std::vector<uint64_t> firing_timers_;
+  std::thread::id thread_id_;
+  std::atomic<bool> quit_;
+  ///tasks queued by any thread, each one a task_t allocated by QueueInLoop
+  MpscQueue tasks_;
+};
+
+}
+
+#endif //TCPTUN_TCPTUN_EVENT_LOOP_H
@@ -0,0 +1,94 @@
+#ifndef TCPTUN_TCPTUN_FEC_H
+#define TCPTUN_TCPTUN_FEC_H
+
+#include <cstdint>
+#include <cstddef>
+#include <map>
+#include <vector>
+#include "noncopyable.h"
+
+namespace tcptun {
+
+///systematic Reed-Solomon erasure code over GF(256), parity rows form a Cauchy
+///matrix so any data_shards of the data_shards + parity_shards shards rebuild the data
+class ReedSolomon : public noncopyable {
+ public:
+  ///data_shards must be positive and data_shards + parity_shards at most 256, or the codec is invalid
+  ReedSolomon(const int32_t &data_shards, const int32_t &parity_shards);
+  ///@return false if the shards given to the constructor were out of range, Encode and Reconstruct fail then
+  bool Valid() const { return data_shards_ > 0; }
+  /**
+   * compute parity shards from data shards, all the shards are shard_len bytes
+   * @return below zero if the codec is invalid or the shards do not match it
+   */
+  int32_t Encode(const std::vector<const uint8_t *> &data, const std::vector<uint8_t *> &parity,
+                 const size_t &shard_len);
+  /**
+   * rebuild the missing data shards in place
+   * @param shards data_shards + parity_shards buffers of shard_len bytes
+   * @param present which of shards hold received data
+   * @return below zero if the codec is invalid or less than data_shards shards are present
+   */
+  int32_t Reconstruct(const std::vector<uint8_t *> &shards, const std::vector<bool> &present,
+                      const size_t &shard_len);
+  int32_t data_shards() const { return data_shards_; }
+  int32_t parity_shards() const { return parity_shards_; }
+ private:
+  int32_t data_shards_;
+  int32_t parity_shards_;
+  ///(data_shards + parity_shards) x data_shards encoding matrix, top rows are identity
+  std::vector<uint8_t> matrix_;
+};
+
+///dst ^= c * src in GF(256), uses AVX2 or SSSE3 shuffle tables when the cpu has them
+void gf256_mul_add_region(const uint8_t &c, const uint8_t *src, uint8_t *dst, const size_t &len);
+
+///every datagram protected by fec starts with
+///| group_id(4) | index(1) | data_shards(1) | parity_shards(1) | reserved(1) |
+///data shards carry | length(2) | data | and parity shards carry the parity of them
+const size_t kFecHeaderLen = 8;
+
+///cut datagrams into groups of data_shards and append parity_shards parity datagrams to each group
+class FecEncoder : public noncopyable {
+ public:
+  FecEncoder(const int32_t &data_shards, const int32_t &parity_shards);
+  /**
+   * @param packets datagrams to send, the data datagram first and then
+   * the parity datagrams if this one completes a group
+   * @return below zero if the shards are invalid or the data is too long
+   */
+  int32_t Encode(const char *data, const size_t &len, std::vector<std::vector<char>> &packets);
+ private:
+  ReedSolomon rs_;
+  uint32_t group_id_;
+  ///|length(2)|data| of the data shards of current group
+  std::vector<std::vector<uint8_t>> shards_;
+};
+
+///deliver data datagrams as soon as they arrive and rebuild the lost ones of a group
+///once data_shards datagrams of it are received
+class FecDecoder : public noncopyable {
+ public:
+  FecDecoder(const int32_t &data_shards, const int32_t &parity_shards);
+  /**
+   * @param datas data carried by this datagram and recovered by it
+   * @return below zero for an invalid datagram or invalid shards
+   */
+  int32_t Decode(const char *packet, const size_t &len, std::vector<std::vector<char>> &datas);
+  ///number of data datagrams rebuilt from parity so far
+  uint64_t recovered() const { return recovered_; }
+ private:
+  typedef struct {
+    std::vector<std::vector<uint8_t>> shards;
+    std::vector<bool> present;
+    int32_t received;
+    bool done;
+  } group_t;
+  ReedSolomon rs_;
+  std::map<uint32_t, group_t> groups_;
+  uint64_t recovered_;
+};
+
+}
+
+#endif //TCPTUN_TCPTUN_FEC_H
@@ -0,0 +1,67 @@
+#ifndef TCPTUN_TCPTUN_FRAME_H
+#define TCPTUN_TCPTUN_FRAME_H
+
+#include <cstdint>
+#include <cstddef>
+
+namespace tcptun {
+
+///every message on the peer link is a frame:
+///| conn_id(4) | type(1) | flags(1) | length(2) | payload(length) |
+///all the integers are in network byte order
+const size_t kFrameHeaderLen = 8;
+const size_t kMaxFramePayloadLen = 65535;
+
+enum frame_type_t : uint8_t {
+  ///payload is stream data for conn_id
+  kFrameData = 0,
+  ///link setup, conn_id is zero and payload is features(4), client sends the
+  ///features it wants and server answers with the ones it agrees to,
+  ///with kFeatureEncrypt the payload is followed by the handshake of FrameCipher
+  kFrameHello = 1,
+  ///tcptun client opens the stream conn_id before any data of it, payload is the
+  ///destination "host:port", empty for the backends of tcptun server,
+  ///flags may carry the priority of the stream, see write_priority_flags
+  kFrameOpen = 2,
+  ///the stream conn_id is closed by the sender, e.g. its destination is not allowed
+  kFrameClose = 3,
+};
+
+enum frame_flag_t : uint8_t {
+  ///payload of the data frame is LZ4 compressed
+  kFrameFlagCompressed = 0x01,
+  ///the open frame carries the priority of the stream in the other bits:
+  ///| kFrameFlagPriority(1 bit) | weight - 1 (5 bits) | class (2 bits) |
+  kFrameFlagPriority = 0x80,
+  ///the stream of the close frame is aborted, the bytes kept for it are dropped
+  ///and its outside connection is reset
+  kFrameFlagReset = 0x02,
+};
+
+enum link_feature_t : uint32_t {
+  kFeatureCompress = 0x01,
+  ///payload of every frame after hello is sealed, the hello carries nonce and proof of the psk
+  kFeatureEncrypt = 0x02,
+};
+
+typedef struct {
+  uint32_t conn_id;
+  uint8_t type;
+  ///bits of frame_flag_t
+  uint8_t flags;
+  uint16_t length;
+} frame_header_t;
+
+void write_frame_header(char *p, const frame_header_t &header);
+
+void read_frame_header(const char *p, frame_header_t &header);
+
+///@return flags of an open frame for a stream of the priority class and weight
+uint8_t write_priority_flags(const int32_t &priority, const int32_t &weight);
+
+///@return false if the open frame has no priority, an older tcptun client sends none
+bool read_priority_flags(const uint8_t &flags, int32_t &priority, int32_t &weight);
+
+}
+
+#endif //TCPTUN_TCPTUN_FRAME_H
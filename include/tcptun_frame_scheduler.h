@@ -0,0 +1,90 @@
+#ifndef TCPTUN_TCPTUN_FRAME_SCHEDULER_H
+#define TCPTUN_TCPTUN_FRAME_SCHEDULER_H
+
+#include <cstdint>
+#include <cstddef>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include "noncopyable.h"
+
+namespace tcptun {
+
+///class 0 is served first
+const int32_t kPriorityClasses = 4;
+const int32_t kMaxPriorityWeight = 32;
+
+///which frames go to peer first when the peer link is slower than the outside connections
+typedef struct {
+  ///class of the streams which have none of their own
+  int32_t default_class;
+  ///a class waiting behind higher ones is still served this percent of the bytes they are served
+  int32_t share_percent;
+  ///bytes of frames handed to the peer link ahead of the scheduler, and for tcp the bytes left
+  ///unsent in the kernel, the rest wait in the scheduler, zero to send frames in the order they come
+  int32_t link_queue;
+  ///bytes of frames waiting for a stream before its outside connection is no longer read
+  int32_t stream_queue;
+} priority_policy_t;
+
+///frames to peer wait here while the peer link is busy, classes are served by strict priority
+///and the streams of a class by deficit round robin according to their weights, frames of a
+///stream keep their order
+class FrameScheduler : public noncopyable {
+ public:
+  explicit FrameScheduler(const priority_policy_t &policy);
+  /**
+   * @param priority class of the frames of conn_id queued from now on, below zero for the default one
+   * @param weight share of the stream among the streams of its class, from one to kMaxPriorityWeight
+   */
+  void SetStream(const uint32_t &conn_id, const int32_t &priority, const int32_t &weight);
+  ///frames of conn_id queued already are still sent
+  void RemoveStream(const uint32_t &conn_id);
+  void RemoveStreams();
+  ///@return false if conn_id has no class of its own
+  bool Stream(const uint32_t &conn_id, int32_t &priority, int32_t &weight) const;
+  void Push(const uint32_t &conn_id, const char *frame, const size_t &len);
+  /**
+   * @param frame points to the next frame, it is valid until the scheduler is changed
+   * @return length of the frame, zero if nothing is queued
+   */
+  size_t Pop(uint32_t &conn_id, const char *&frame);
+  ///@return bytes queued for conn_id
+  size_t Queued(const uint32_t &conn_id) const;
+  size_t bytes() const { return bytes_; }
+  bool empty() const { return bytes_ == 0; }
+  ///drop every frame, the classes of the streams are kept
+  void Clear();
+ private:
+  typedef struct {
+    int32_t priority;
+    int32_t weight;
+  } stream_t;
+  typedef struct {
+    int32_t priority;
+    int32_t weight;
+    ///frames one after another, frames before offset are sent
+    std::string frames;
+    size_t offset;
+    ///bytes the stream may still send in its turn
+    int64_t deficit;
+  } queue_t;
+  int32_t ClassToServe() const;
+  ///classes waiting behind the one served earn credits, which are spent when they go ahead
+  void UpdateCredits(const int32_t &served, const size_t &len);
+  priority_policy_t policy_;
+  ///streams with a class of their own
+  std::unordered_map<uint32_t, stream_t> streams_;
+  ///streams with frames queued, the front of active_ of a class is the one whose turn it is
+  std::unordered_map<uint32_t, queue_t> queues_;
+  std::deque<uint32_t> active_[kPriorityClasses];
+  ///bytes times 100 a waiting class may be served ahead of the higher ones
+  int64_t credits_[kPriorityClasses];
+  ///frames of the last queue emptied by Pop
+  std::string popped_;
+  size_t bytes_;
+};
+
+}
+
+#endif //TCPTUN_TCPTUN_FRAME_SCHEDULER_H
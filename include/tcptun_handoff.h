@@ -0,0 +1,53 @@
+#ifndef TCPTUN_TCPTUN_HANDOFF_H
+#define TCPTUN_TCPTUN_HANDOFF_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace tcptun {
+
+///hot upgrade of tcptun server, the running process listens on a unix socket at handoff_path,
+///a new process connects to it at startup and the running one hands its listen fd over with
+///SCM_RIGHTS and drains, once its streams are finished the peer link follows on the same
+///connection, so tcptun client keeps its link across the restart
+
+enum handoff_type_t : uint32_t {
+  ///fds is the listen fd
+  kHandoffListener = 1,
+  ///fds is the peer link, features are the link features agreed with tcptun client
+  kHandoffPeer = 2,
+};
+
+typedef struct {
+  uint32_t type;
+  uint32_t features;
+  std::vector<int32_t> fds;
+} handoff_msg_t;
+
+///max fds carried by one message
+const size_t kMaxHandoffFds = 4;
+
+/**
+ * @param fd connected unix stream socket, the fds of msg stay open in the sender
+ * @return below zero for error
+ */
+int32_t send_handoff_msg(const int32_t &fd, const handoff_msg_t &msg);
+
+/**
+ * @param fd connected unix stream socket
+ * @param msg the fds received are owned by the caller
+ * @return zero if a message is received, one if the sender closed the socket, below zero for error,
+ * errno is EAGAIN if a non-blocking fd has nothing to read
+ */
+int32_t recv_handoff_msg(const int32_t &fd, handoff_msg_t &msg);
+
+/**
+ * connect to the handoff socket of a running process, the blocking fd gives up receiving after a few seconds
+ * @return zero if connected, below zero if nobody listens on path
+ */
+int32_t connect_handoff(const std::string &path, int32_t &fd);
+
+}
+
+#endif //TCPTUN_TCPTUN_HANDOFF_H
@@ -0,0 +1,74 @@
+#ifndef TCPTUN_TCPTUN_HAPPY_EYEBALLS_H
+#define TCPTUN_TCPTUN_HAPPY_EYEBALLS_H
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+#include "noncopyable.h"
+#include "tcptun_common.h"
+
+namespace tcptun {
+
+typedef struct {
+  ///the next address is tried when the attempts before it are still pending after this delay,
+  ///RFC 8305 recommends 250ms
+  int32_t attempt_delay_ms;
+  ///the race is lost if no attempt has succeeded by then
+  int32_t timeout_ms;
+  ///connect with tcp fast open, an address whose cookie is known wins at once since its
+  ///handshake is left to the first send
+  bool fastopen;
+} connect_policy_t;
+
+enum race_result_t : int32_t {
+  kRaceRunning = 0,
+  kRaceWon = 1,
+};
+
+///RFC 8305 connection attempts to the addresses of one outside server, a dead address costs
+///attempt_delay_ms instead of a whole connect timeout
+///
+///the addresses are tried in the order given with the families interleaved, every attempt is a
+///non-blocking connect registered to epoll for EPOLLOUT whose fd must be passed to HandleEvent,
+///the first attempt connected wins and the others are closed. an attempt without a free fd is
+///no fault of its address, the address is tried again a little later until timeout_ms
+class HappyEyeballs : public noncopyable {
+ public:
+  HappyEyeballs(const int32_t &epoll_fd, const std::vector<socket_address_t> &addrs, const connect_policy_t &policy);
+  ///attempts still running are closed
+  ~HappyEyeballs();
+  bool Owns(const int32_t &fd) const;
+  /**
+   * start the first attempt
+   * @return kRaceRunning, kRaceWon or below zero if every address failed
+   */
+  int32_t Start(const int64_t &now_ms);
+  ///@return the same as Start
+  int32_t HandleEvent(const int32_t &fd, const int64_t &now_ms);
+  ///start the attempts due and give up after timeout_ms, @return the same as Start
+  int32_t Update(const int64_t &now_ms);
+  ///@return milliseconds until Update must be called again, -1 if the race is over
+  int32_t NextTimeoutMs(const int64_t &now_ms) const;
+  ///the connected fd after kRaceWon, it is removed from epoll and owned by the caller
+  int32_t winner() const { return winner_; }
+  ///@return true if an attempt found no fd free since the last call, the owner should free some
+  bool TakeOutOfFds();
+ private:
+  void StartAttempt(const int64_t &now_ms);
+  void CloseAttempts();
+  int32_t epoll_fd_;
+  std::vector<socket_address_t> addrs_;
+  connect_policy_t policy_;
+  ///index of the next address to try
+  size_t next_;
+  ///fd and address index of the attempts in progress
+  std::vector<std::pair<int32_t, size_t>> attempts_;
+  int64_t next_attempt_ms_;
+  int64_t deadline_ms_;
+  int32_t winner_;
+  bool out_of_fds_;
+};
+
+}
+
+#endif //TCPTUN_TCPTUN_HAPPY_EYEBALLS_H
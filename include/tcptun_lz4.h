@@ -0,0 +1,39 @@
+#ifndef TCPTUN_TCPTUN_LZ4_H
+#define TCPTUN_TCPTUN_LZ4_H
+
+#include <cstdint>
+#include <cstddef>
+
+namespace tcptun {
+
+///codec of the LZ4 block format, https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md, written
+///for tcptun and not taken from liblz4. its blocks are exchanged with liblz4, tests/tcptun_test_lz4.cpp
+///checks that both ways
+
+///bytes of the largest block lz4_compress is given
+const int32_t kLz4MaxInputLen = 0x7E000000;
+
+///@return largest length a block of len bytes compresses to, 0 if len is out of range
+int32_t lz4_compress_bound(const int32_t &len);
+
+///@return bytes of the state lz4_compress needs, it must be aligned like malloc
+size_t lz4_state_len();
+
+/**
+ * compress a whole block with the greedy single hash table matcher of LZ4 fast mode
+ * @param state lz4_state_len() bytes, reused between calls
+ * @param acceleration 1 or more, bigger is faster but compresses less
+ * @return bytes written to dst, 0 if they do not fit in dst_len or src_len is out of range
+ */
+int32_t lz4_compress(void *state, const char *src, const int32_t &src_len, char *dst, const int32_t &dst_len,
+                     int32_t acceleration);
+
+/**
+ * decompress a whole block, a malformed block is never read or written out of bounds
+ * @return bytes written to dst, below zero if the block is malformed or does not fit in dst_len
+ */
+int32_t lz4_decompress(const char *src, const int32_t &src_len, char *dst, const int32_t &dst_len);
+
+}
+
+#endif //TCPTUN_TCPTUN_LZ4_H
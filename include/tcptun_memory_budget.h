@@ -0,0 +1,60 @@
+#ifndef TCPTUN_TCPTUN_MEMORY_BUDGET_H
+#define TCPTUN_TCPTUN_MEMORY_BUDGET_H
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include "noncopyable.h"
+
+namespace tcptun {
+
+///limits of the bytes a connection manager buffers, zero for no limit
+typedef struct {
+  ///bytes from peer kept for one outside connection, including those held while it is connected
+  int64_t stream_limit;
+  ///bytes of every stream plus the frames waiting to be sent to peer
+  int64_t session_limit;
+} memory_policy_t;
+
+typedef struct {
+  int64_t session_bytes;
+  int64_t session_peak;
+  int64_t global_bytes;
+  int64_t global_peak;
+  size_t streams;
+  ///times reading was paused since the start
+  uint64_t peer_read_pauses;
+  uint64_t outside_read_pauses;
+  uint64_t refused_streams;
+} memory_stats_t;
+
+///bytes buffered by every connection manager of the process, each of them charges the growth
+///of its buffers here, buffers of a fixed size and those bounded by the arq window are not charged
+class MemoryBudget : public noncopyable {
+ public:
+  ///@param limit zero for no limit
+  explicit MemoryBudget(const int64_t &limit);
+  ///@param bytes below zero to give bytes back
+  void Charge(const int64_t &bytes);
+  /**
+   * @param paused whether the caller is paused by the budget already, it stays paused until
+   * half of the limit is left so that it does not flap around the limit
+   */
+  bool Exceeded(bool paused) const;
+  int64_t used() const { return used_; }
+  int64_t peak() const { return peak_; }
+ private:
+  int64_t limit_;
+  int64_t used_;
+  int64_t peak_;
+};
+
+///@return true if used is over limit, see MemoryBudget::Exceeded for paused
+bool over_limit(const int64_t &used, const int64_t &limit, bool paused);
+
+///one line for the log
+std::string memory_stats_to_string(const memory_stats_t &stats);
+
+}
+
+#endif //TCPTUN_TCPTUN_MEMORY_BUDGET_H
@@ -0,0 +1,59 @@
+#ifndef TCPTUN_TCPTUN_PROXY_H
+#define TCPTUN_TCPTUN_PROXY_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "noncopyable.h"
+
+namespace tcptun {
+
+enum frontend_type_t : uint8_t {
+  ///destination of the stream is fixed by config
+  kFrontendNone = 0,
+  ///the outside client asks for its destination with a SOCKS5 CONNECT
+  kFrontendSocks5 = 1,
+  ///the outside client asks for its destination with an HTTP CONNECT
+  kFrontendHttpConnect = 2,
+};
+
+enum handshake_result_t : int32_t {
+  kHandshakeMore = 0,
+  kHandshakeDone = 1,
+};
+
+///server side of the SOCKS5 (no authentication, CONNECT only) and HTTP CONNECT handshakes
+///
+///success is answered as soon as the destination is known instead of after tcptun server
+///has connected to it, so the outside client can send its first bytes one rtt earlier,
+///a destination tcptun server can't reach shows up as the stream being closed
+class ProxyHandshake : public noncopyable {
+ public:
+  explicit ProxyHandshake(const frontend_type_t &type);
+  static int32_t ParseFrontendType(const std::string &name, frontend_type_t &type);
+  /**
+   * feed the bytes read from the outside connection
+   * @param reply bytes to write back to the outside connection, also set on error
+   * @return kHandshakeMore, kHandshakeDone or below zero for a bad request
+   */
+  int32_t Feed(const char *data, const size_t &len, std::string &reply);
+  ///"host:port", ipv6 hosts are in brackets
+  const std::string &destination() const { return destination_; }
+  ///bytes received after the request, they belong to the stream
+  const std::vector<char> &remaining() const { return buf_; }
+  ///requests are small, a client sending more without finishing one is broken
+  static const size_t kMaxRequestLen = 8192;
+ private:
+  int32_t FeedSocks5(std::string &reply);
+  int32_t FeedHttpConnect(std::string &reply);
+  void Consume(const size_t &len);
+  frontend_type_t type_;
+  ///socks5 only, whether the method negotiation is done
+  bool greeted_;
+  std::vector<char> buf_;
+  std::string destination_;
+};
+
+}
+
+#endif //TCPTUN_TCPTUN_PROXY_H
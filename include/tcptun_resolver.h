@@ -0,0 +1,87 @@
+#ifndef TCPTUN_TCPTUN_RESOLVER_H
+#define TCPTUN_TCPTUN_RESOLVER_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "noncopyable.h"
+#include "tcptun_common.h"
+
+namespace tcptun {
+
+typedef struct {
+  ///threads calling getaddrinfo, they are started by the first hostname looked up
+  int32_t threads;
+  ///getaddrinfo tells no ttl, answers are trusted this long, an expired answer is still used
+  ///while it is looked up again
+  int32_t cache_ttl_ms;
+  ///a failed lookup is remembered this long, so a bad name is not looked up for every stream
+  int32_t negative_ttl_ms;
+} resolver_policy_t;
+
+enum lookup_result_t : int32_t {
+  kLookupDone = 0,
+  kLookupPending = 1,
+};
+
+///resolves hostnames of outside servers without blocking the event loop
+///
+///lookups run on worker threads, the eventfd of the resolver is registered to epoll for
+///EPOLLIN and must be passed to HandleEvent, which tells the hosts whose lookups finished,
+///Lookup of those hosts is answered from the cache afterwards
+class Resolver : public noncopyable {
+ public:
+  Resolver(const int32_t &epoll_fd, const resolver_policy_t &policy);
+  ~Resolver();
+  bool Owns(const int32_t &fd) const { return fd == event_fd_; }
+  /**
+   * @param host ip literal, unix address or hostname
+   * @param addrs addresses of host with port set, in the order getaddrinfo prefers them
+   * @return kLookupDone if addrs is filled, kLookupPending until HandleEvent reports host,
+   * below zero if host can't be resolved
+   */
+  int32_t Lookup(const std::string &host, const int32_t &port, std::vector<socket_address_t> &addrs);
+  /**
+   * @param hosts hosts whose lookups finished since the last call
+   * @return below zero for error
+   */
+  int32_t HandleEvent(std::vector<std::string> &hosts);
+  static const size_t kMaxCacheEntries = 4096;
+ private:
+  typedef struct {
+    std::vector<socket_address_t> addrs;
+    ///answers are trusted until expire_ms, a failure is remembered until then
+    int64_t expire_ms;
+    bool resolving;
+  } entry_t;
+  typedef struct {
+    std::string host;
+    std::vector<socket_address_t> addrs;
+    ///return value of getaddrinfo, zero if addrs is good
+    int32_t error;
+  } answer_t;
+  void Start(const std::string &host, entry_t &entry);
+  void Evict(const int64_t &now_ms);
+  void Work();
+  int32_t epoll_fd_;
+  int32_t event_fd_;
+  resolver_policy_t policy_;
+  ///touched by the event loop only
+  std::unordered_map<std::string, entry_t> cache_;
+  ///shared with the workers
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::deque<std::string> queries_;
+  std::vector<answer_t> answers_;
+  bool stopping_;
+  std::vector<std::thread> workers_;
+};
+
+}
+
+#endif //TCPTUN_TCPTUN_RESOLVER_H
@@ -0,0 +1,78 @@
+#ifndef TCPTUN_TCPTUN_RING_H
+#define TCPTUN_TCPTUN_RING_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <vector>
+#include "noncopyable.h"
+
+namespace tcptun {
+
+///size of the cache lines the indexes of the producers and the consumer are kept apart by
+const size_t kCacheLineSize = 64;
+
+///write one to notify_fd, an eventfd of the consumer
+void notify_event_fd(const int32_t &notify_fd);
+
+///bounded queue of pointers from one producer thread to one consumer thread, without locks
+///
+///the consumer sleeps on notify_fd, which the producer writes only when the ring turns from empty to
+///not empty, so a burst of messages costs one wakeup, the consumer reads notify_fd before Drain,
+///messages are owned by whoever holds them
+class SpscRing : public noncopyable {
+ public:
+  /**
+   * @param capacity rounded up to a power of two
+   * @param notify_fd eventfd the consumer waits on, not owned, it may be shared by several queues
+   */
+  SpscRing(const size_t &capacity, const int32_t &notify_fd);
+  ///producer only, @return false if the ring is full
+  bool Push(void *msg);
+  ///consumer only, @return number of messages appended to msgs, at most max, if more are left
+  ///notify_fd is written so the consumer comes back for them
+  size_t Drain(std::vector<void *> &msgs, const size_t &max);
+  size_t capacity() const { return mask_ + 1; }
+ private:
+  ///written by the producer, with its last look at head_ on the same line
+  alignas(kCacheLineSize) std::atomic<size_t> tail_;
+  size_t head_cache_;
+  ///written by the consumer, with its last look at tail_
+  alignas(kCacheLineSize) std::atomic<size_t> head_;
+  size_t tail_cache_;
+  alignas(kCacheLineSize) size_t mask_;
+  int32_t notify_fd_;
+  std::unique_ptr<void *[]> slots_;
+};
+
+///unbounded queue of pointers from any number of producer threads to one consumer thread, for control
+///messages, producers do not wait for each other and notify_fd is written as for SpscRing
+class MpscQueue : public noncopyable {
+ public:
+  ///@param notify_fd eventfd the consumer waits on, not owned
+  explicit MpscQueue(const int32_t &notify_fd);
+  ///messages left are not freed
+  ~MpscQueue();
+  ///any thread
+  void Push(void *msg);
+  ///consumer only, the same as SpscRing::Drain
+  size_t Drain(std::vector<void *> &msgs, const size_t &max);
+  ///messages pushed and not drained yet
+  size_t size() const;
+ private:
+  typedef struct node_t {
+    std::atomic<node_t *> next;
+    void *msg;
+  } node_t;
+  ///producers swap themselves in here
+  alignas(kCacheLineSize) std::atomic<node_t *> head_;
+  std::atomic<int64_t> pending_;
+  ///the last node drained, whose next is the first message, touched by the consumer only
+  alignas(kCacheLineSize) node_t *tail_;
+  int32_t notify_fd_;
+};
+
+}
+
+#endif //TCPTUN_TCPTUN_RING_H
@@ -0,0 +1,84 @@
+#ifndef TCPTUN_TCPTUN_STREAM_H
+#define TCPTUN_TCPTUN_STREAM_H
+
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+#include <sys/epoll.h>
+#include "noncopyable.h"
+#include "tcptun_proxy.h"
+#include "tcptun_token_bucket.h"
+
+namespace tcptun {
+
+typedef enum {
+  ///tcptun client only, the frontend of the listener has not told the destination yet,
+  ///peer knows nothing of the stream
+  kStreamHandshake = 0,
+  ///open on both sides
+  kStreamOpen = 1,
+  ///closed by peer, the bytes peer sent before are still being delivered to the outside connection
+  kStreamHalfClosed = 2,
+} stream_state_t;
+
+///a stream and its outside connection, streams of tcptun server being connected have none yet
+typedef struct {
+  ///-1 while the stream is in the pool
+  int32_t fd;
+  uint32_t conn_id;
+  stream_state_t state;
+  std::unique_ptr<ProxyHandshake> handshake;
+  ///bytes from peer not taken by the kernel yet, EPOLLOUT is asked for while it is not empty
+  std::string send_buf;
+  ///the stream has a rate of its own or of its listener
+  bool rate_limited;
+  TokenBucket rate;
+  ///listener the stream was accepted on, -1 for tcptun server
+  int32_t listen_fd;
+  ///not read until this time because of its rates, -1 if it is read
+  int64_t unthrottle_ms;
+  ///not read until its frames waiting in the scheduler drain
+  bool backlogged;
+  ///when the stream was last read or written
+  int64_t active_ms;
+  ///zero for no idle timeout
+  int32_t idle_timeout_ms;
+  ///expire time of the timer of the stream in the idle wheel, other timers of its fd are stale
+  int64_t timer_ms;
+  ///bytes read from and written to the outside connection
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+} stream_t;
+
+///epoll data of the outside connection of a stream points to the stream, the top bit tells it from
+///the fds registered by everything else, which never set it, nor do user space addresses
+const uint64_t kStreamEventTag = 1ULL << 63;
+
+uint64_t stream_event_data(stream_t *stream);
+
+///@return the stream epoll reports events of, nullptr if data is an fd
+stream_t *event_stream(const epoll_data_t &data);
+
+///streams are allocated in chunks and never freed until the pool is, so events epoll reported for a
+///stream closed earlier in the same round still point to a stream, whose fd is -1 or a new one
+class StreamPool : public noncopyable {
+ public:
+  explicit StreamPool(const size_t &chunk_size);
+  ///@return a stream set up for fd and conn_id, open and with no rate or timer
+  stream_t *Acquire(const int32_t &fd, const uint32_t &conn_id);
+  ///buffers of the stream are freed and its fd set to -1
+  void Release(stream_t *stream);
+  ///streams in use
+  size_t size() const { return size_; }
+ private:
+  size_t chunk_size_;
+  std::vector<std::unique_ptr<stream_t[]>> chunks_;
+  std::vector<stream_t *> free_;
+  size_t size_;
+};
+
+}
+
+#endif //TCPTUN_TCPTUN_STREAM_H
@@ -0,0 +1,42 @@
+#ifndef TCPTUN_TCPTUN_TIMER_WHEEL_H
+#define TCPTUN_TCPTUN_TIMER_WHEEL_H
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include "noncopyable.h"
+
+namespace tcptun {
+
+///hashed timing wheel for many coarse timers, such as the idle timeouts of streams, adding
+///a timer and finding the ones due take constant time whatever the number of timers,
+///a timer is not cancelled, the owner ignores the ones it does not expect any more
+class TimerWheel : public noncopyable {
+ public:
+  /**
+   * @param tick_ms timers fire at most tick_ms late
+   * @param slots a timer further than slots ticks away is looked at once every turn of the wheel
+   */
+  TimerWheel(const int32_t &tick_ms, const size_t &slots);
+  void Add(const int32_t &id, const int64_t &expire_ms);
+  ///@param expired ids and expire times of the timers due by now
+  void Advance(const int64_t &now, std::vector<std::pair<int32_t, int64_t>> &expired);
+  ///@return milliseconds until a slot with timers is due, -1 if there is none
+  int32_t NextTimeoutMs(const int64_t &now) const;
+  size_t size() const { return size_; }
+  void Clear();
+ private:
+  typedef struct {
+    int32_t id;
+    int64_t expire_ms;
+  } timer_t;
+  int32_t tick_ms_;
+  std::vector<std::vector<timer_t>> slots_;
+  ///every tick before it has been handled, -1 until the first timer
+  int64_t tick_;
+  size_t size_;
+};
+
+}
+
+#endif //TCPTUN_TCPTUN_TIMER_WHEEL_H
@@ -0,0 +1,40 @@
+#ifndef TCPTUN_TCPTUN_TOKEN_BUCKET_H
+#define TCPTUN_TCPTUN_TOKEN_BUCKET_H
+
+#include <cstdint>
+#include <cstddef>
+
+namespace tcptun {
+
+///limits of the rate outside connections are read at, zero for no limit
+typedef struct {
+  ///every stream on its own
+  int32_t stream_kbps;
+  ///every stream of the session together
+  int32_t session_kbps;
+  ///bytes of burst_ms at the rate may be read at once after a pause
+  int32_t burst_ms;
+} rate_policy_t;
+
+///token bucket refilled from the clock of the event loop when it is used, it has no timer of its own
+class TokenBucket {
+ public:
+  ///@param rate_kbps zero for no limit
+  explicit TokenBucket(const int32_t &rate_kbps = 0, const int32_t &burst_ms = 0);
+  bool Limited() const { return rate_ > 0; }
+  ///@return bytes which may be taken now
+  size_t Available(const int64_t &now_ms);
+  void Consume(const size_t &bytes);
+  ///@return milliseconds until bytes, or a full bucket if it is smaller, may be taken
+  int64_t WaitMs(const size_t &bytes) const;
+ private:
+  ///bytes per millisecond
+  double rate_;
+  double capacity_;
+  double tokens_;
+  int64_t last_ms_;
+};
+
+}
+
+#endif //TCPTUN_TCPTUN_TOKEN_BUCKET_H
@@ -0,0 +1,126 @@
+#ifndef TCPTUN_TCPTUN_TRANSPORT_H
+#define TCPTUN_TCPTUN_TRANSPORT_H
+
+#include <cstdint>
+#include <cstddef>
+#include <sys/types.h>
+#include "noncopyable.h"
+
+namespace tcptun {
+
+enum transport_type_t : uint8_t {
+  kTransportTcp = 0,
+  ///selective repeat arq over udp, see ArqTransport
+  kTransportUdp = 1,
+};
+
+typedef struct {
+  transport_type_t type;
+  ///udp only, max segments in flight and max segments buffered by receiver
+  int32_t window;
+  ///udp only, initial and lower bound of retransmission timeout
+  int32_t rto_ms;
+  int32_t min_rto_ms;
+  ///udp only, resend a segment once this many later segments are acked, zero to disable
+  int32_t fast_resend;
+  ///udp only, max sending rate of data segments, zero for no pacing
+  int32_t pacing_kbps;
+  ///udp only, max size of a datagram
+  int32_t mtu;
+  ///udp only, reed-solomon data and parity datagrams of a fec group, zero data shards to disable fec
+  int32_t fec_data_shards;
+  int32_t fec_parity_shards;
+  ///udp only, drop and delay sent datagrams in process to test on loopback
+  double loss_rate;
+  int32_t delay_ms;
+} transport_policy_t;
+
+enum transport_event_t : uint32_t {
+  ///bytes of peer stream can be read by Recv
+  kTransportReadable = 0x01,
+  ///a new session replaced the old one, everything bound to the old session must be dropped
+  kTransportReset = 0x02,
+};
+
+///reliable byte stream between tcptun client and tcptun server, frames are
+///carried on top of it the same way whatever the transport is
+class PeerTransport : public noncopyable {
+ public:
+  virtual ~PeerTransport() = default;
+  ///fd registered to epoll for this transport
+  virtual int32_t fd() const = 0;
+  ///whether there is a session with peer
+  virtual bool Connected() const = 0;
+  /**
+   * handle the epoll events of fd()
+   * @return bits of transport_event_t, below zero for error
+   */
+  virtual int32_t HandleEvents(const uint32_t &events) = 0;
+  /**
+   * like recv(2), read the byte stream from peer
+   * @return bytes read, zero if peer closed the session, -1 with errno EAGAIN if nothing to read
+   */
+  virtual ssize_t Recv(char *buf, const size_t &len) = 0;
+  /**
+   * like send(2), the bytes accepted are delivered reliably and in order
+   * @return bytes accepted, -1 with errno EAGAIN if no space
+   */
+  virtual ssize_t Send(const char *buf, const size_t &len) = 0;
+  ///ask to be woken up when Send can accept bytes again
+  virtual int32_t SetWantWrite(bool want) = 0;
+  ///stop or go on reporting bytes of peer, Recv still works while it is stopped
+  virtual int32_t SetWantRead(bool want) = 0;
+  ///bytes Send accepts beyond those being transmitted, zero for the default of the transport
+  virtual int32_t SetUnsentLimit(const int32_t &bytes) = 0;
+  ///drive timers and transmission, called after every round of the event loop
+  virtual int32_t Update(const int64_t &now_ms) = 0;
+  ///@return milliseconds until Update must be called again, -1 if no timer is pending
+  virtual int32_t NextTimeoutMs(const int64_t &now_ms) = 0;
+  /**
+   * @param rtt_us smoothed rtt of the link in microseconds
+   * @return true if the transport would merge more bytes into the data still in flight
+   */
+  virtual bool Busy(uint32_t &rtt_us) = 0;
+  ///hold partial segments until uncorked
+  virtual int32_t SetCork(bool cork) = 0;
+  ///end the session with peer
+  virtual void Close() = 0;
+};
+
+class TcpTransport : public PeerTransport {
+ public:
+  /**
+   * @param epoll_fd EPOLLOUT of fd is toggled on it
+   * @param fd connected tcp or unix stream socket, it is set NON_BLOCKING and owned by the transport
+   */
+  TcpTransport(const int32_t &epoll_fd, const int32_t &fd);
+  ~TcpTransport() override;
+  int32_t fd() const override { return fd_; }
+  bool Connected() const override { return fd_ != 0; }
+  int32_t HandleEvents(const uint32_t &events) override;
+  ssize_t Recv(char *buf, const size_t &len) override;
+  ssize_t Send(const char *buf, const size_t &len) override;
+  int32_t SetWantWrite(bool want) override;
+  int32_t SetWantRead(bool want) override;
+  ///TCP_NOTSENT_LOWAT, frames left unsent in the kernel can't be reordered any more
+  int32_t SetUnsentLimit(const int32_t &bytes) override;
+  int32_t Update(const int64_t &now_ms) override { return 0; }
+  int32_t NextTimeoutMs(const int64_t &now_ms) override { return -1; }
+  bool Busy(uint32_t &rtt_us) override;
+  int32_t SetCork(bool cork) override;
+  void Close() override;
+  ///give up fd without closing it, it is removed from epoll, @return fd
+  int32_t Detach();
+ private:
+  int32_t UpdateEvents();
+  int32_t epoll_fd_;
+  int32_t fd_;
+  bool want_read_;
+  bool want_write_;
+  ///false for a unix stream socket, which has no TCP_INFO nor TCP_CORK
+  bool is_tcp_;
+};
+
+}
+
+#endif //TCPTUN_TCPTUN_TRANSPORT_H
@@ -0,0 +1,78 @@
+#ifndef TCPTUN_TCPTUN_UPSTREAM_POOL_H
+#define TCPTUN_TCPTUN_UPSTREAM_POOL_H
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <vector>
+#include "noncopyable.h"
+#include "tcptun_common.h"
+#include "tcptun_resolver.h"
+#include "tcptun_happy_eyeballs.h"
+
+namespace tcptun {
+
+typedef struct {
+  ///idle connections kept ready, zero to disable the pool
+  int32_t size;
+  ///idle connections older than this are replaced by fresh ones, zero to keep them forever
+  int32_t max_idle_ms;
+} upstream_pool_policy_t;
+
+///connections to the outside server made before any stream needs them, so a new
+///stream of tcptun server skips the handshake with the outside server
+///
+///connections are made by races of HappyEyeballs, the connecting fds are registered
+///to epoll for EPOLLOUT and must be passed to HandleConnectEvent, ready connections
+///are removed from epoll until they are taken by Acquire
+class UpstreamPool : public noncopyable {
+ public:
+  ///@param resolver looks up remote.ip when it is a hostname, it must outlive the pool
+  UpstreamPool(const int32_t &epoll_fd, ip_port_t remote, const upstream_pool_policy_t &policy,
+               const connect_policy_t &connect_policy, Resolver *resolver);
+  ~UpstreamPool();
+  bool Enabled() const { return policy_.size > 0; }
+  ///whether fd is a connection in progress of the pool
+  bool Owns(const int32_t &fd) const;
+  /**
+   * call it when a connecting fd reports events
+   * @return kRaceRunning, kRaceWon if a connection is ready, below zero if the connection failed
+   */
+  int32_t HandleConnectEvent(const int32_t &fd);
+  /**
+   * take a ready connection, connections closed by outside server meanwhile are skipped
+   * @param fd the connection, NON_BLOCKING and not registered to epoll
+   * @return below zero if no connection is ready
+   */
+  int32_t Acquire(int32_t &fd);
+  /**
+   * expire old idle connections and start connects until the pool is full again
+   * @return connects failed by timeout
+   */
+  int32_t Update(const int64_t &now_ms);
+  ///@return milliseconds until Update must be called again, -1 if no timer is pending
+  int32_t NextTimeoutMs(const int64_t &now_ms) const;
+  ///@return true if a connect found no fd free since the last call, see HappyEyeballs::TakeOutOfFds
+  bool TakeOutOfFds();
+ private:
+  void Refill(const int64_t &now_ms);
+  ///@param index the race in connecting_, @param ret what it returned
+  int32_t FinishConnect(const size_t &index, const int32_t &ret, const int64_t &now_ms);
+  int32_t epoll_fd_;
+  ip_port_t remote_;
+  upstream_pool_policy_t policy_;
+  connect_policy_t connect_policy_;
+  Resolver *resolver_;
+  std::vector<std::unique_ptr<HappyEyeballs>> connecting_;
+  ///ready connections and the time they became ready, oldest first
+  std::deque<std::pair<int32_t, int64_t>> idle_;
+  ///connects are retried with backoff while the outside server is unreachable
+  int32_t retry_backoff_ms_;
+  int64_t retry_ms_;
+  ///a race finished after it found no fd free
+  bool out_of_fds_;
+};
+
+}
+
+#endif //TCPTUN_TCPTUN_UPSTREAM_POOL_H
@@ -5,6 +5,7 @@
 #include <glog/logging.h>
 #include "tcptun_common.h"
 #include "tcptun_connection_manager.h"
+#include "tcptun_event_loop.h"
 #include "parse_config.h"
 #include <sys/epoll.h>
 
@@ -17,42 +18,51 @@ int32_t run(const std::string &config_path) {
         LOG(ERROR) << "failed to parse config file";
         return -1;
     }
-    const std::string local_ip = system_config->listen_ip;
-    const size_t local_port = system_config->listen_port;
     const std::string remote_ip = system_config->remote_ip;
     const size_t remote_port = system_config->remote_port;
-    int epoll_fd = -1;
-    epoll_fd = epoll_create1(0);
-    if (epoll_fd < 0) {
-        LOG(ERROR) << "failed to call epoll_create1 error:" << strerror(errno);
+    tcptun::EventLoop loop;
+    const int32_t epoll_fd = loop.epoll_fd();
+    if (epoll_fd < 0)
         return -2;
+    ///pinned before the buffers of the connection manager are allocated, so they are local to the cpus
+    if (!system_config->cpu_affinity.empty() && loop.PinThread(system_config->cpu_affinity) < 0)
+        return -10;
+    const int32_t incoming_cpu = system_config->incoming_cpu_steering ? system_config->cpu_affinity.front() : -1;
+    ///every listener shares the peer link, the first one is local_listen_fd of connection manager
+    std::vector<int32_t> listen_fds;
+    int32_t ret = 0;
+    for (auto &listener : system_config->listeners) {
+        int listen_fd = -1;
+        ret = tcptun::new_listen_socket(listener.listen_ip, listener.listen_port, system_config->dual_stack,
+                                        listen_fd, incoming_cpu);
+        if (ret < 0) {
+            LOG(ERROR) << "failed to call new_listen_socket local_ip:" << listener.listen_ip << " local_port:"
+                       << listener.listen_port;
+            return -3;
+        }
+        ///listeners and the peer link are handled by the connection manager, the default handler
+        ret = tcptun::AddEvent2Epoll(epoll_fd, listen_fd, EPOLLIN);
+        if (ret < 0) {
+            close(listen_fd);
+            LOG(ERROR) << "failed to call AddEvent2Epoll epoll_fd:" << epoll_fd << " local_listen_fd:" << listen_fd;
+            return -4;
+        }
+        listen_fds.push_back(listen_fd);
     }
-    int local_listen_fd = -1;
-    auto ret = tcptun::new_listen_socket(local_ip, local_port, local_listen_fd);
-    if (ret < 0) {
-        LOG(ERROR) << "failed to call new_listen_socket local_ip:" << local_ip << " local_port:" << local_port;
-        return -3;
-    }
-    const int32_t maxevent = 64;
-    struct epoll_event events[maxevent];
-    ret = tcptun::AddEvent2Epoll(epoll_fd, local_listen_fd, EPOLLIN);
-    if (ret < 0) {
-        close(epoll_fd);
-        close(local_listen_fd);
-        LOG(ERROR) << "failed to call AddEvent2Epoll epoll_fd:" << epoll_fd << " local_listen_fd:" << local_listen_fd;
-        return -4;
-    }
+    int local_listen_fd = listen_fds.front();
+    bool udp_transport = system_config->transport == "udp";
     int32_t remote_connected_fd = -1;
-    ret = tcptun::new_connected_socket(remote_ip, remote_port, remote_connected_fd);
+    if (udp_transport)
+        ret = tcptun::new_connected_udp_socket(remote_ip, remote_port, remote_connected_fd);
+    else
+        ret = tcptun::new_connected_socket(remote_ip, remote_port, system_config->tcp_fastopen, remote_connected_fd);
     if (ret < 0) {
-        close(epoll_fd);
         close(local_listen_fd);
         LOG(ERROR) << "failed to call new_connected_socket remote_ip" << remote_ip << " remote_port:" << remote_port;
         return -5;
     }
     ret = tcptun::AddEvent2Epoll(epoll_fd, remote_connected_fd, EPOLLIN);
     if (ret < 0) {
-        close(epoll_fd);
         close(local_listen_fd);
         close(remote_connected_fd);
         LOG(ERROR) << "failed to call AddEvent2Epoll epoll_fd:" << epoll_fd << " local_listen_fd:" << local_listen_fd;
@@ -61,36 +71,98 @@ int32_t run(const std::string &config_path) {
     ip_port_t server_info;
     server_info.ip = remote_ip;
     server_info.port = remote_port;
-    std::shared_ptr<tcptun::ConnectionManager>
-        sp_tcptun_cm(new tcptun::ConnectionManager(local_listen_fd, remote_connected_fd, server_info));
-    while (true) {
-        int nfds = epoll_wait(epoll_fd, events, maxevent, -1);
-        if (nfds < 0) {
-            if (errno != EINTR) {
-                LOG(ERROR) << "epoll_wait return error:" << strerror(errno);
-                break;
-            }
+    tcptun::transport_policy_t transport_policy = {};
+    transport_policy.type = udp_transport ? tcptun::kTransportUdp : tcptun::kTransportTcp;
+    transport_policy.window = system_config->arq_window;
+    transport_policy.rto_ms = system_config->arq_rto_ms;
+    transport_policy.min_rto_ms = system_config->arq_min_rto_ms;
+    transport_policy.fast_resend = system_config->arq_fast_resend;
+    transport_policy.pacing_kbps = system_config->arq_pacing_kbps;
+    transport_policy.mtu = system_config->udp_mtu;
+    transport_policy.fec_data_shards = system_config->fec_data_shards;
+    transport_policy.fec_parity_shards = system_config->fec_parity_shards;
+    transport_policy.loss_rate = system_config->udp_loss_rate;
+    transport_policy.delay_ms = system_config->udp_delay_ms;
+    tcptun::batch_policy_t batch_policy = {0};
+    batch_policy.enable = system_config->batch_enable;
+    batch_policy.rtt_fraction = system_config->batch_rtt_fraction;
+    batch_policy.max_hold_ms = system_config->batch_max_hold_ms;
+    tcptun::compress_policy_t compress_policy = {0};
+    compress_policy.enable = system_config->compress_enable;
+    compress_policy.acceleration = system_config->compress_acceleration;
+    tcptun::cipher_policy_t cipher_policy;
+    cipher_policy.psk = system_config->psk;
+    if (tcptun::FrameCipher::ParseCipherType(system_config->cipher, cipher_policy.type) < 0) {
+        LOG(ERROR) << "unknown cipher:" << system_config->cipher;
+        return -7;
+    }
+    std::vector<tcptun::frontend_type_t> frontends;
+    for (auto &listener : system_config->listeners) {
+        tcptun::frontend_type_t frontend = tcptun::kFrontendNone;
+        if (tcptun::ProxyHandshake::ParseFrontendType(listener.frontend, frontend) < 0) {
+            LOG(ERROR) << "unknown frontend:" << listener.frontend;
+            return -8;
         }
-        for (int i = 0; i < nfds; ++i) {
-            if (events[i].data.fd == local_listen_fd) {
-                auto new_client_fd = sp_tcptun_cm->HandleNewConnection(true);
-                if (new_client_fd < 0) {
-                    LOG(ERROR) << "failed to call tcptun::ConnectionManager HandleNewConnection";
-                    continue;
-                }
-                auto temp = tcptun::AddEvent2Epoll(epoll_fd, new_client_fd, EPOLLIN);
-                ///todo how to handle this issue is a problem but fortunately it will barely happen
-                if (temp < 0) {
-                    LOG(ERROR) << "failed to call AddEvent2Epoll epoll_fd:" << epoll_fd << " client_fd:"
-                               << new_client_fd;
-                }
-            } else if (events[i].data.fd == remote_connected_fd) {
-                sp_tcptun_cm->RecvDataFromPeer();
-            } else {
-                sp_tcptun_cm->RecvDataFromOutside(events[i].data.fd);
-            }
+        frontends.push_back(frontend);
+    }
+    tcptun::stream_policy_t stream_policy;
+    stream_policy.frontend = frontends.front();
+    stream_policy.target = system_config->listeners.front().target;
+    stream_policy.rate_kbps = system_config->listeners.front().rate_kbps;
+    stream_policy.priority = system_config->listeners.front().priority;
+    stream_policy.weight = system_config->listeners.front().weight;
+    stream_policy.idle_timeout_ms = system_config->listeners.front().idle_timeout_ms;
+    ///the remote of tcptun client is tcptun server, streams to it share the peer link
+    tcptun::balance_policy_t balance_policy = {};
+    tcptun::upstream_pool_policy_t upstream_pool_policy = {0};
+    tcptun::resolver_policy_t resolver_policy = {0};
+    tcptun::connect_policy_t connect_policy = {0};
+    tcptun::rate_policy_t rate_policy;
+    rate_policy.stream_kbps = system_config->stream_rate_kbps;
+    rate_policy.session_kbps = system_config->session_rate_kbps;
+    rate_policy.burst_ms = system_config->rate_burst_ms;
+    tcptun::priority_policy_t priority_policy;
+    priority_policy.default_class = system_config->priority_class;
+    priority_policy.share_percent = system_config->priority_share_percent;
+    priority_policy.link_queue = system_config->peer_queue_kb * 1024;
+    priority_policy.stream_queue = system_config->stream_queue_kb * 1024;
+    tcptun::memory_policy_t memory_policy;
+    memory_policy.stream_limit = static_cast<int64_t>(system_config->stream_buffer_limit_kb) * 1024;
+    memory_policy.session_limit = static_cast<int64_t>(system_config->session_buffer_limit_kb) * 1024;
+    tcptun::MemoryBudget memory_budget(static_cast<int64_t>(system_config->buffer_limit_kb) * 1024);
+    std::shared_ptr<tcptun::ConnectionManager>
+        sp_tcptun_cm(new tcptun::ConnectionManager(epoll_fd, local_listen_fd, remote_connected_fd, server_info,
+                                                   transport_policy, batch_policy, compress_policy,
+                                                   cipher_policy, balance_policy, upstream_pool_policy,
+                                                   resolver_policy, connect_policy, stream_policy, rate_policy,
+                                                   priority_policy, memory_policy, &memory_budget));
+    for (size_t i = 1; i < listen_fds.size(); ++i) {
+        ret = sp_tcptun_cm->AddListener(listen_fds[i], frontends[i], system_config->listeners[i].target,
+                                        system_config->listeners[i].rate_kbps, system_config->listeners[i].priority,
+                                        system_config->listeners[i].weight,
+                                        system_config->listeners[i].idle_timeout_ms);
+        if (ret < 0) {
+            LOG(ERROR) << "failed to add listen_fd:" << listen_fds[i];
+            return -9;
         }
     }
+    ret = sp_tcptun_cm->SendHelloToPeer();
+    if (ret < 0) {
+        LOG(ERROR) << "failed to call tcptun::ConnectionManager SendHelloToPeer ret:" << ret;
+        return -6;
+    }
+    loop.SetDefaultHandler(sp_tcptun_cm.get());
+    loop.SetBusyPoll(system_config->busy_poll_us);
+    loop.SetTimeoutHook([&]() { return sp_tcptun_cm->NextTimeoutMs(); });
+    ///frames read in this round are coalesced and sent here
+    loop.SetRoundHook([&]() { sp_tcptun_cm->FlushToPeer(); });
+    if (system_config->stats_interval_ms > 0) {
+        loop.RunEvery(system_config->stats_interval_ms, [&]() {
+            LOG(INFO) << "stats " << tcptun::memory_stats_to_string(sp_tcptun_cm->MemoryStats()) << " "
+                      << tcptun::loop_stats_to_string(loop.Stats());
+        });
+    }
+    return loop.Loop();
 }
 
 int main(int argc, char *argv[]) {
@@ -4,13 +4,22 @@
 
 #include "tcptun_common.h"
 #include "tcptun_connection_manager.h"
+#include "tcptun_event_loop.h"
+#include "tcptun_handoff.h"
 #include "parse_config.h"
 #include <glog/logging.h>
+#include <signal.h>
 #include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
+#include <algorithm>
 #include <memory>
 
 using tcptun::ip_port_t;
 
+///time for the close frames of aborted streams to reach tcptun client
+const int64_t kDrainGraceMs = 1000;
+
 int32_t run(const std::string &config_file_path) {
     SystemConfig *instance = SystemConfig::GetInstance(config_file_path);
     auto system_config = instance->system_config();
@@ -22,23 +31,47 @@ int32_t run(const std::string &config_file_path) {
     const size_t local_port = system_config->listen_port;
     const std::string remote_ip = system_config->remote_ip;
     const size_t remote_port = system_config->remote_port;
-    int epoll_fd = -1;
-    epoll_fd = epoll_create1(0);
-    if (epoll_fd < 0) {
-        LOG(ERROR) << "failed to call epoll_create1 error:" << strerror(errno);
+    tcptun::EventLoop loop;
+    const int32_t epoll_fd = loop.epoll_fd();
+    if (epoll_fd < 0)
         return -2;
-    }
+    ///pinned before the buffers of the connection manager are allocated, so they are local to the cpus
+    if (!system_config->cpu_affinity.empty() && loop.PinThread(system_config->cpu_affinity) < 0)
+        return -10;
+    const int32_t incoming_cpu = system_config->incoming_cpu_steering ? system_config->cpu_affinity.front() : -1;
+    bool udp_transport = system_config->transport == "udp";
     int local_listen_fd = -1;
-    auto ret = tcptun::new_listen_socket(local_ip, local_port, local_listen_fd);
-    if (ret < 0) {
-        LOG(ERROR) << "failed to call new_listen_socket local_ip:" << local_ip << " local_port:" << local_port;
-        return -3;
+    ///the udp socket of udp transport carries the arq state of every session, it can't be handed over
+    const std::string handoff_path = udp_transport ? "" : system_config->handoff_path;
+    ///connection to the process we took over from, it hands the peer link over once it is drained
+    int32_t handoff_fd = -1;
+    int32_t ret = 0;
+    if (!handoff_path.empty() && tcptun::connect_handoff(handoff_path, handoff_fd) == 0) {
+        tcptun::handoff_msg_t msg;
+        ret = tcptun::recv_handoff_msg(handoff_fd, msg);
+        if (ret != 0 || msg.type != tcptun::kHandoffListener) {
+            LOG(ERROR) << "failed to take over the listen fd from handoff_path:" << handoff_path << " ret:" << ret;
+            return -9;
+        }
+        local_listen_fd = msg.fds.front();
+        LOG(INFO) << "took over listen_fd:" << local_listen_fd << " from handoff_path:" << handoff_path;
+    } else {
+        ///with udp transport tcptun clients reach us on a udp socket, there is nothing to listen on
+        const bool dual_stack = system_config->dual_stack;
+        ret = udp_transport ? tcptun::new_bound_udp_socket(local_ip, local_port, dual_stack, local_listen_fd)
+                            : tcptun::new_listen_socket(local_ip, local_port, dual_stack, local_listen_fd,
+                                                        incoming_cpu);
+        if (ret < 0) {
+            LOG(ERROR) << "failed to call new_listen_socket local_ip:" << local_ip << " local_port:" << local_port;
+            return -3;
+        }
+        if (!udp_transport && system_config->tcp_fastopen && !tcptun::is_unix_address(local_ip) &&
+            tcptun::set_listen_fastopen(local_listen_fd) < 0)
+            LOG(WARNING) << "tcp fast open is not available, tcptun clients connect with a plain handshake";
     }
-    const int32_t maxevent = 64;
-    struct epoll_event events[maxevent];
+    ///the listener and the peer links are handled by the connection manager, the default handler
     ret = tcptun::AddEvent2Epoll(epoll_fd, local_listen_fd, EPOLLIN);
     if (ret < 0) {
-        close(epoll_fd);
         close(local_listen_fd);
         LOG(ERROR) << "failed to call AddEvent2Epoll epoll_fd:" << epoll_fd << " local_listen_fd:" << local_listen_fd;
         return -4;
@@ -46,53 +79,236 @@ int32_t run(const std::string &config_file_path) {
     ip_port_t server_info;
     server_info.port = remote_port;
     server_info.ip = remote_ip;
+    tcptun::transport_policy_t transport_policy = {};
+    transport_policy.type = udp_transport ? tcptun::kTransportUdp : tcptun::kTransportTcp;
+    transport_policy.window = system_config->arq_window;
+    transport_policy.rto_ms = system_config->arq_rto_ms;
+    transport_policy.min_rto_ms = system_config->arq_min_rto_ms;
+    transport_policy.fast_resend = system_config->arq_fast_resend;
+    transport_policy.pacing_kbps = system_config->arq_pacing_kbps;
+    transport_policy.mtu = system_config->udp_mtu;
+    transport_policy.fec_data_shards = system_config->fec_data_shards;
+    transport_policy.fec_parity_shards = system_config->fec_parity_shards;
+    transport_policy.loss_rate = system_config->udp_loss_rate;
+    transport_policy.delay_ms = system_config->udp_delay_ms;
+    tcptun::batch_policy_t batch_policy = {0};
+    batch_policy.enable = system_config->batch_enable;
+    batch_policy.rtt_fraction = system_config->batch_rtt_fraction;
+    batch_policy.max_hold_ms = system_config->batch_max_hold_ms;
+    tcptun::compress_policy_t compress_policy = {0};
+    compress_policy.enable = system_config->compress_enable;
+    compress_policy.acceleration = system_config->compress_acceleration;
+    tcptun::cipher_policy_t cipher_policy;
+    cipher_policy.psk = system_config->psk;
+    if (tcptun::FrameCipher::ParseCipherType(system_config->cipher, cipher_policy.type) < 0) {
+        LOG(ERROR) << "unknown cipher:" << system_config->cipher;
+        return -7;
+    }
+    tcptun::upstream_pool_policy_t upstream_pool_policy = {0};
+    upstream_pool_policy.size = system_config->upstream_pool_size;
+    upstream_pool_policy.max_idle_ms = system_config->upstream_pool_max_idle_ms;
+    tcptun::resolver_policy_t resolver_policy;
+    resolver_policy.threads = system_config->dns_threads;
+    resolver_policy.cache_ttl_ms = system_config->dns_cache_ttl_ms;
+    resolver_policy.negative_ttl_ms = system_config->dns_negative_ttl_ms;
+    tcptun::connect_policy_t connect_policy;
+    connect_policy.attempt_delay_ms = system_config->connect_attempt_delay_ms;
+    connect_policy.timeout_ms = system_config->connect_timeout_ms;
+    connect_policy.fastopen = system_config->tcp_fastopen;
+    tcptun::rate_policy_t rate_policy;
+    rate_policy.stream_kbps = system_config->stream_rate_kbps;
+    rate_policy.session_kbps = system_config->session_rate_kbps;
+    rate_policy.burst_ms = system_config->rate_burst_ms;
+    ///streams are given the priority of their open frames, priority_class is for older tcptun clients
+    tcptun::priority_policy_t priority_policy;
+    priority_policy.default_class = system_config->priority_class;
+    priority_policy.share_percent = system_config->priority_share_percent;
+    priority_policy.link_queue = system_config->peer_queue_kb * 1024;
+    priority_policy.stream_queue = system_config->stream_queue_kb * 1024;
+    tcptun::memory_policy_t memory_policy;
+    memory_policy.stream_limit = static_cast<int64_t>(system_config->stream_buffer_limit_kb) * 1024;
+    memory_policy.session_limit = static_cast<int64_t>(system_config->session_buffer_limit_kb) * 1024;
+    tcptun::MemoryBudget memory_budget(static_cast<int64_t>(system_config->buffer_limit_kb) * 1024);
+    tcptun::balance_policy_t balance_policy;
+    if (tcptun::UpstreamBalancer::ParseBalanceType(system_config->balance, balance_policy.type) < 0) {
+        LOG(ERROR) << "unknown balance:" << system_config->balance;
+        return -8;
+    }
+    for (auto &backend_config : system_config->backends) {
+        tcptun::backend_t backend;
+        backend.addr.ip = backend_config.ip;
+        backend.addr.port = backend_config.port;
+        backend.weight = backend_config.weight;
+        balance_policy.backends.push_back(backend);
+    }
+    balance_policy.health_check_interval_ms = system_config->health_check_interval_ms;
+    balance_policy.health_check_timeout_ms = system_config->health_check_timeout_ms;
+    balance_policy.max_fails = system_config->max_fails;
+    balance_policy.fail_timeout_ms = system_config->fail_timeout_ms;
+    tcptun::stream_policy_t stream_policy;
+    stream_policy.frontend = tcptun::kFrontendNone;
+    stream_policy.rate_kbps = 0;
+    stream_policy.priority = -1;
+    stream_policy.weight = 1;
+    stream_policy.idle_timeout_ms = system_config->idle_timeout_ms;
+    stream_policy.allow_destinations = system_config->allow_destinations;
+    for (auto &service : system_config->services)
+        stream_policy.services[service.first] = service.second;
     std::shared_ptr<tcptun::ConnectionManager>
-        sp_tcptun_cm(new tcptun::ConnectionManager(local_listen_fd, 0, server_info));
-    int peer_connected_fd = -1;
-    while (true) {
-        int nfds = epoll_wait(epoll_fd, events, maxevent, -1);
-        ret = nfds;
-        if (nfds < 0) {
-            if (errno != EINTR) {
-                LOG(ERROR) << "epoll_wait return error:" << strerror(errno);
-                break;
-            }
+        sp_tcptun_cm(new tcptun::ConnectionManager(epoll_fd, local_listen_fd, 0, server_info, transport_policy,
+                                                   batch_policy, compress_policy, cipher_policy,
+                                                   balance_policy, upstream_pool_policy, resolver_policy,
+                                                   connect_policy, stream_policy, rate_policy, priority_policy,
+                                                   memory_policy, &memory_budget));
+    ///the new process we handed the listen fd over to, it gets the peer link once we are drained
+    int32_t successor_fd = -1;
+    int32_t handoff_listen_fd = -1;
+    int32_t signal_fd = -1;
+    int64_t drain_deadline_ms = -1;
+    bool streams_aborted = false;
+    auto start_drain = [&]() {
+        if (drain_deadline_ms >= 0)
+            return;
+        drain_deadline_ms = tcptun::getnowtime_ms() + system_config->drain_timeout_ms;
+        LOG(INFO) << "stop accepting, exit once the streams are finished or in " << system_config->drain_timeout_ms
+                  << "ms";
+        sp_tcptun_cm->StartDrain(successor_fd >= 0);
+        ///stop accepting tcptun clients, the udp socket is the peer link itself and stays
+        if (!udp_transport && local_listen_fd >= 0) {
+            sp_tcptun_cm->RemoveListener(local_listen_fd);
+            close(local_listen_fd);
+            local_listen_fd = -1;
+        }
+        if (handoff_listen_fd >= 0) {
+            loop.DelHandler(handoff_listen_fd);
+            close(handoff_listen_fd);
+            handoff_listen_fd = -1;
         }
-        for (int i = 0; i < nfds; ++i) {
-            if (events[i].data.fd == local_listen_fd) {
-                auto new_peer_connected_fd = sp_tcptun_cm->HandleNewConnection(false);
-                if (new_peer_connected_fd < 0) {
-                    LOG(ERROR) << "failed to call tcptun::ConnectionManager HandleNewConnection";
-                    continue;
-                }
-                peer_connected_fd = new_peer_connected_fd;
-                auto temp = tcptun::AddEvent2Epoll(epoll_fd, new_peer_connected_fd, EPOLLIN);
-                ///todo how to handle this issue is a problem but fortunately it will barely happen
-                if (temp < 0) {
-                    LOG(ERROR) << "failed to call AddEvent2Epoll epoll_fd:" << epoll_fd << " new_peer_connected_fd:"
-                               << new_peer_connected_fd;
-                }
-            } else if (events[i].data.fd == peer_connected_fd) {
-                auto correspond_fd = sp_tcptun_cm->RecvDataFromPeer();
-                if (correspond_fd < 0) {
-                    LOG(ERROR) << "failed to call tcptun::ConnectionManager RecvDataFromPeer ret:"<<correspond_fd;
-                    continue;
-                }
-                struct epoll_event temp_event = {0};
-                temp_event.data.fd = correspond_fd;
-                temp_event.events = EPOLLIN;
-                auto temp = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, correspond_fd, &temp_event);
-                if (temp < 0 && errno != EEXIST) {
-                    LOG(ERROR) << "failed to call epoll_ctl ADD epoll_fd:" << epoll_fd << " correspond_fd:"
-                               << correspond_fd;
-                }
+    };
+    tcptun::CallbackHandler handoff_handler([&](const uint32_t &events) {
+        tcptun::handoff_msg_t msg;
+        auto temp = tcptun::recv_handoff_msg(handoff_fd, msg);
+        if (temp < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (temp == 0 && msg.type == tcptun::kHandoffPeer) {
+            auto peer_fd = sp_tcptun_cm->AdoptPeer(msg.fds.front(), msg.features);
+            if (peer_fd < 0 || tcptun::AddEvent2Epoll(epoll_fd, peer_fd, EPOLLIN) < 0) {
+                LOG(ERROR) << "failed to take over peer link fd:" << msg.fds.front();
+                close(msg.fds.front());
+            } else {
+                LOG(INFO) << "took over peer link fd:" << peer_fd;
             }
-            else{
-                sp_tcptun_cm->RecvDataFromOutside(events[i].data.fd);
+        }
+        ///the process we took over from has nothing more to hand over
+        loop.DelHandler(handoff_fd);
+        close(handoff_fd);
+        handoff_fd = -1;
+    });
+    if (handoff_fd >= 0 && (tcptun::set_non_blocking(handoff_fd) < 0 ||
+                            loop.AddHandler(handoff_fd, EPOLLIN, &handoff_handler) < 0)) {
+        LOG(ERROR) << "failed to watch handoff_fd:" << handoff_fd << ", the peer link will not be taken over";
+        close(handoff_fd);
+        handoff_fd = -1;
+    }
+    tcptun::CallbackHandler handoff_listen_handler([&](const uint32_t &events) {
+        auto new_fd = accept(handoff_listen_fd, nullptr, nullptr);
+        if (new_fd < 0)
+            return;
+        ///only one process takes over, and it listens on handoff_path itself once it has our listen fd
+        loop.DelHandler(handoff_listen_fd);
+        close(handoff_listen_fd);
+        handoff_listen_fd = -1;
+        tcptun::handoff_msg_t msg;
+        msg.type = tcptun::kHandoffListener;
+        msg.features = 0;
+        msg.fds.push_back(local_listen_fd);
+        if (tcptun::send_handoff_msg(new_fd, msg) < 0) {
+            close(new_fd);
+            return;
+        }
+        LOG(INFO) << "handed listen_fd:" << local_listen_fd << " over to a new process, drain";
+        successor_fd = new_fd;
+        start_drain();
+    });
+    ///the process we took over from has stopped listening, so its socket file is stale now
+    if (!handoff_path.empty() &&
+        (tcptun::new_listen_socket("unix:" + handoff_path, 0, false, handoff_listen_fd) < 0 ||
+         loop.AddHandler(handoff_listen_fd, EPOLLIN, &handoff_listen_handler) < 0)) {
+        LOG(ERROR) << "failed to listen on handoff_path:" << handoff_path << ", hot upgrade is disabled";
+        if (handoff_listen_fd >= 0)
+            close(handoff_listen_fd);
+        handoff_listen_fd = -1;
+    }
+    tcptun::CallbackHandler signal_handler([&](const uint32_t &events) {
+        struct signalfd_siginfo info;
+        while (read(signal_fd, &info, sizeof(info)) == sizeof(info))
+            LOG(INFO) << "got signal:" << info.ssi_signo;
+        ///a second signal cuts the drain short
+        if (drain_deadline_ms >= 0)
+            drain_deadline_ms = tcptun::getnowtime_ms();
+        start_drain();
+    });
+    if (tcptun::new_signal_fd({SIGTERM, SIGINT}, signal_fd) < 0 ||
+        loop.AddHandler(signal_fd, EPOLLIN, &signal_handler) < 0)
+        LOG(ERROR) << "failed to watch signals, SIGTERM will not drain";
+    ///exit once drained, the peer link goes to the successor if there is one
+    auto check_drain = [&]() {
+        if (drain_deadline_ms < 0)
+            return;
+        auto now = tcptun::getnowtime_ms();
+        if (!sp_tcptun_cm->Drained() && now < drain_deadline_ms)
+            return;
+        if (!sp_tcptun_cm->Drained() && !streams_aborted) {
+            ///tell tcptun client about the streams we give up, the frames go out in a short grace
+            LOG(WARNING) << "drain timeout, close the streams left";
+            sp_tcptun_cm->AbortStreams();
+            sp_tcptun_cm->FlushToPeer();
+            streams_aborted = true;
+            drain_deadline_ms = now + kDrainGraceMs;
+            return;
+        }
+        if (successor_fd >= 0) {
+            int32_t peer_fd = -1;
+            tcptun::handoff_msg_t msg;
+            auto temp = sp_tcptun_cm->ReleasePeer(peer_fd, msg.features);
+            ///frames on their way to or from peer are finished first
+            if (temp == 1 && now < drain_deadline_ms)
+                return;
+            if (temp == 0) {
+                msg.type = tcptun::kHandoffPeer;
+                msg.fds.push_back(peer_fd);
+                if (tcptun::send_handoff_msg(successor_fd, msg) == 0)
+                    LOG(INFO) << "handed peer link fd:" << peer_fd << " over to the new process";
+                close(peer_fd);
             }
+            close(successor_fd);
+        }
+        LOG(INFO) << "drained, exit";
+        loop.Quit();
+    };
+    loop.SetDefaultHandler(sp_tcptun_cm.get());
+    loop.SetBusyPoll(system_config->busy_poll_us);
+    loop.SetTimeoutHook([&]() {
+        int32_t timeout_ms = sp_tcptun_cm->NextTimeoutMs();
+        if (drain_deadline_ms >= 0) {
+            auto drain_ms = static_cast<int32_t>(std::max<int64_t>(0, drain_deadline_ms - tcptun::getnowtime_ms()));
+            if (timeout_ms < 0 || drain_ms < timeout_ms)
+                timeout_ms = drain_ms;
         }
+        return timeout_ms;
+    });
+    loop.SetRoundHook([&]() {
+        ///frames read in this round are coalesced and sent here
+        sp_tcptun_cm->FlushToPeer();
+        check_drain();
+    });
+    if (system_config->stats_interval_ms > 0) {
+        loop.RunEvery(system_config->stats_interval_ms, [&]() {
+            LOG(INFO) << "stats " << tcptun::memory_stats_to_string(sp_tcptun_cm->MemoryStats()) << " "
+                      << tcptun::loop_stats_to_string(loop.Stats());
+        });
     }
-    return ret;
+    return loop.Loop();
 }
 
 int main(int argc, char *argv[]) {
@@ -6,8 +6,21 @@
 #include <glog/logging.h>
 #include <fstream>
 #include <rapidjson/document.h>
-
-system_config_t::system_config_t(const std::string &config_file_path) {
+#include "tcptun_common.h"
+
+system_config_t::system_config_t(const std::string &config_file_path)
+    : dual_stack(true), tcp_fastopen(false), batch_enable(true), batch_rtt_fraction(0.25), batch_max_hold_ms(10),
+      compress_enable(false), compress_acceleration(1), cipher("none"), transport("tcp"),
+      arq_window(256), arq_rto_ms(200), arq_min_rto_ms(30), arq_fast_resend(2), arq_pacing_kbps(0),
+      udp_mtu(1350), fec_data_shards(0), fec_parity_shards(0), udp_loss_rate(0), udp_delay_ms(0),
+      upstream_pool_size(0), upstream_pool_max_idle_ms(30000), dns_threads(2), dns_cache_ttl_ms(30000),
+      dns_negative_ttl_ms(5000), connect_attempt_delay_ms(250), connect_timeout_ms(10000), drain_timeout_ms(30000),
+      stream_buffer_limit_kb(1024), session_buffer_limit_kb(16384), buffer_limit_kb(65536), stream_rate_kbps(0),
+      session_rate_kbps(0), rate_burst_ms(100), stats_interval_ms(60000), busy_poll_us(0),
+      incoming_cpu_steering(false), priority_class(2), priority_share_percent(5), peer_queue_kb(64), stream_queue_kb(256), idle_timeout_ms(0),
+      balance("round_robin"),
+      health_check_interval_ms(2000), health_check_timeout_ms(1000), max_fails(3), fail_timeout_ms(10000),
+      frontend("none") {
     auto ret = parse_config_json(config_file_path);
     if (ret < 0) {
         LOG(ERROR) << "failed to parse config json";
@@ -46,16 +59,24 @@ int32_t system_config_t::parse_config_json(const std::string &config_file_path)
             LOG(WARNING) << "BUF_SIZE:" << BUF_SIZE << " maybe too big";
         }
     }
+    bool has_listeners = document.HasMember("listeners");
     if (!document.HasMember("listen_ip")) {
-        LOG(ERROR) << "invalid format, listen_ip must be contained";
-        return -1;
+        if (!has_listeners) {
+            LOG(ERROR) << "invalid format, listen_ip must be contained";
+            return -1;
+        }
     } else {
         rapidjson::Value &listen_ip_json = document["listen_ip"];
         listen_ip = std::string(listen_ip_json.GetString());
     }
+    ///the port of a unix address is not needed
+    listen_port = 0;
+    remote_port = 0;
     if (!document.HasMember("listen_port")) {
-        LOG(ERROR) << "invalid format, listen_port be contained";
-        return -1;
+        if (!has_listeners && !tcptun::is_unix_address(listen_ip)) {
+            LOG(ERROR) << "invalid format, listen_port be contained";
+            return -1;
+        }
     } else {
         rapidjson::Value &listen_port_json = document["listen_port"];
         listen_port = listen_port_json.GetInt();
@@ -68,12 +89,448 @@ int32_t system_config_t::parse_config_json(const std::string &config_file_path)
         remote_ip = std::string(remote_ip_json.GetString());
     }
     if (!document.HasMember("remote_port")) {
-        LOG(ERROR) << "invalid format, listen_port be contained";
-        return -1;
+        if (!tcptun::is_unix_address(remote_ip)) {
+            LOG(ERROR) << "invalid format, listen_port be contained";
+            return -1;
+        }
     } else {
         rapidjson::Value &remote_port_json = document["remote_port"];
         remote_port = remote_port_json.GetInt();
     }
+    if (document.HasMember("dual_stack")) {
+        rapidjson::Value &dual_stack_json = document["dual_stack"];
+        dual_stack = dual_stack_json.GetBool();
+    }
+    if (document.HasMember("tcp_fastopen")) {
+        rapidjson::Value &tcp_fastopen_json = document["tcp_fastopen"];
+        tcp_fastopen = tcp_fastopen_json.GetBool();
+    }
+    if (document.HasMember("batch_enable")) {
+        rapidjson::Value &batch_enable_json = document["batch_enable"];
+        batch_enable = batch_enable_json.GetBool();
+    }
+    if (document.HasMember("batch_rtt_fraction")) {
+        rapidjson::Value &batch_rtt_fraction_json = document["batch_rtt_fraction"];
+        batch_rtt_fraction = batch_rtt_fraction_json.GetDouble();
+        if (batch_rtt_fraction < 0 || batch_rtt_fraction > 1) {
+            LOG(ERROR) << "invalid batch_rtt_fraction:" << batch_rtt_fraction << ", it should be in [0, 1]";
+            return -1;
+        }
+    }
+    if (document.HasMember("batch_max_hold_ms")) {
+        rapidjson::Value &batch_max_hold_ms_json = document["batch_max_hold_ms"];
+        batch_max_hold_ms = batch_max_hold_ms_json.GetInt();
+        if (batch_max_hold_ms < 0) {
+            LOG(ERROR) << "invalid batch_max_hold_ms:" << batch_max_hold_ms;
+            return -1;
+        }
+    }
+    if (document.HasMember("compress_enable")) {
+        rapidjson::Value &compress_enable_json = document["compress_enable"];
+        compress_enable = compress_enable_json.GetBool();
+    }
+    if (document.HasMember("compress_acceleration")) {
+        rapidjson::Value &compress_acceleration_json = document["compress_acceleration"];
+        compress_acceleration = compress_acceleration_json.GetInt();
+        if (compress_acceleration < 1) {
+            LOG(ERROR) << "invalid compress_acceleration:" << compress_acceleration << ", it should be at least 1";
+            return -1;
+        }
+    }
+    if (document.HasMember("cipher")) {
+        rapidjson::Value &cipher_json = document["cipher"];
+        cipher = std::string(cipher_json.GetString());
+    }
+    if (document.HasMember("psk")) {
+        rapidjson::Value &psk_json = document["psk"];
+        psk = std::string(psk_json.GetString());
+    }
+    if (cipher != "none" && psk.empty()) {
+        LOG(ERROR) << "invalid format, psk must be contained when cipher is:" << cipher;
+        return -1;
+    }
+    if (document.HasMember("transport")) {
+        rapidjson::Value &transport_json = document["transport"];
+        transport = std::string(transport_json.GetString());
+        if (transport != "tcp" && transport != "udp") {
+            LOG(ERROR) << "invalid transport:" << transport << ", it should be tcp or udp";
+            return -1;
+        }
+    }
+    if (document.HasMember("arq_window")) {
+        rapidjson::Value &arq_window_json = document["arq_window"];
+        arq_window = arq_window_json.GetInt();
+        if (arq_window < 1 || arq_window > 32768) {
+            LOG(ERROR) << "invalid arq_window:" << arq_window << ", it should be in [1, 32768]";
+            return -1;
+        }
+    }
+    if (document.HasMember("arq_rto_ms")) {
+        rapidjson::Value &arq_rto_ms_json = document["arq_rto_ms"];
+        arq_rto_ms = arq_rto_ms_json.GetInt();
+    }
+    if (document.HasMember("arq_min_rto_ms")) {
+        rapidjson::Value &arq_min_rto_ms_json = document["arq_min_rto_ms"];
+        arq_min_rto_ms = arq_min_rto_ms_json.GetInt();
+    }
+    if (arq_min_rto_ms < 1 || arq_rto_ms < arq_min_rto_ms) {
+        LOG(ERROR) << "invalid arq_rto_ms:" << arq_rto_ms << " arq_min_rto_ms:" << arq_min_rto_ms;
+        return -1;
+    }
+    if (document.HasMember("arq_fast_resend")) {
+        rapidjson::Value &arq_fast_resend_json = document["arq_fast_resend"];
+        arq_fast_resend = arq_fast_resend_json.GetInt();
+    }
+    if (document.HasMember("arq_pacing_kbps")) {
+        rapidjson::Value &arq_pacing_kbps_json = document["arq_pacing_kbps"];
+        arq_pacing_kbps = arq_pacing_kbps_json.GetInt();
+    }
+    if (arq_fast_resend < 0 || arq_pacing_kbps < 0) {
+        LOG(ERROR) << "invalid arq_fast_resend:" << arq_fast_resend << " arq_pacing_kbps:" << arq_pacing_kbps;
+        return -1;
+    }
+    if (document.HasMember("udp_mtu")) {
+        rapidjson::Value &udp_mtu_json = document["udp_mtu"];
+        udp_mtu = udp_mtu_json.GetInt();
+        if (udp_mtu < 576 || udp_mtu > 65000) {
+            LOG(ERROR) << "invalid udp_mtu:" << udp_mtu << ", it should be in [576, 65000]";
+            return -1;
+        }
+    }
+    if (document.HasMember("fec_data_shards")) {
+        rapidjson::Value &fec_data_shards_json = document["fec_data_shards"];
+        fec_data_shards = fec_data_shards_json.GetInt();
+    }
+    if (document.HasMember("fec_parity_shards")) {
+        rapidjson::Value &fec_parity_shards_json = document["fec_parity_shards"];
+        fec_parity_shards = fec_parity_shards_json.GetInt();
+    }
+    if (fec_data_shards < 0 || (fec_data_shards > 0 && fec_parity_shards < 1) ||
+        fec_data_shards + fec_parity_shards > 255) {
+        LOG(ERROR) << "invalid fec_data_shards:" << fec_data_shards << " fec_parity_shards:" << fec_parity_shards;
+        return -1;
+    }
+    if (document.HasMember("udp_loss_rate")) {
+        rapidjson::Value &udp_loss_rate_json = document["udp_loss_rate"];
+        udp_loss_rate = udp_loss_rate_json.GetDouble();
+        if (udp_loss_rate < 0 || udp_loss_rate >= 1) {
+            LOG(ERROR) << "invalid udp_loss_rate:" << udp_loss_rate << ", it should be in [0, 1)";
+            return -1;
+        }
+    }
+    if (document.HasMember("udp_delay_ms")) {
+        rapidjson::Value &udp_delay_ms_json = document["udp_delay_ms"];
+        udp_delay_ms = udp_delay_ms_json.GetInt();
+        if (udp_delay_ms < 0) {
+            LOG(ERROR) << "invalid udp_delay_ms:" << udp_delay_ms;
+            return -1;
+        }
+    }
+    if (document.HasMember("upstream_pool_size")) {
+        rapidjson::Value &upstream_pool_size_json = document["upstream_pool_size"];
+        upstream_pool_size = upstream_pool_size_json.GetInt();
+        if (upstream_pool_size < 0) {
+            LOG(ERROR) << "invalid upstream_pool_size:" << upstream_pool_size;
+            return -1;
+        }
+    }
+    if (document.HasMember("upstream_pool_max_idle_ms")) {
+        rapidjson::Value &upstream_pool_max_idle_ms_json = document["upstream_pool_max_idle_ms"];
+        upstream_pool_max_idle_ms = upstream_pool_max_idle_ms_json.GetInt();
+        if (upstream_pool_max_idle_ms < 0) {
+            LOG(ERROR) << "invalid upstream_pool_max_idle_ms:" << upstream_pool_max_idle_ms;
+            return -1;
+        }
+    }
+    if (document.HasMember("dns_threads")) {
+        rapidjson::Value &dns_threads_json = document["dns_threads"];
+        dns_threads = dns_threads_json.GetInt();
+    }
+    if (document.HasMember("dns_cache_ttl_ms")) {
+        rapidjson::Value &dns_cache_ttl_ms_json = document["dns_cache_ttl_ms"];
+        dns_cache_ttl_ms = dns_cache_ttl_ms_json.GetInt();
+    }
+    if (document.HasMember("dns_negative_ttl_ms")) {
+        rapidjson::Value &dns_negative_ttl_ms_json = document["dns_negative_ttl_ms"];
+        dns_negative_ttl_ms = dns_negative_ttl_ms_json.GetInt();
+    }
+    if (dns_threads < 1 || dns_cache_ttl_ms < 0 || dns_negative_ttl_ms < 0) {
+        LOG(ERROR) << "invalid dns_threads:" << dns_threads << " dns_cache_ttl_ms:" << dns_cache_ttl_ms
+                   << " dns_negative_ttl_ms:" << dns_negative_ttl_ms;
+        return -1;
+    }
+    if (document.HasMember("connect_attempt_delay_ms")) {
+        rapidjson::Value &connect_attempt_delay_ms_json = document["connect_attempt_delay_ms"];
+        connect_attempt_delay_ms = connect_attempt_delay_ms_json.GetInt();
+    }
+    if (document.HasMember("connect_timeout_ms")) {
+        rapidjson::Value &connect_timeout_ms_json = document["connect_timeout_ms"];
+        connect_timeout_ms = connect_timeout_ms_json.GetInt();
+    }
+    if (connect_attempt_delay_ms < 0 || connect_timeout_ms <= 0) {
+        LOG(ERROR) << "invalid connect_attempt_delay_ms:" << connect_attempt_delay_ms
+                   << " connect_timeout_ms:" << connect_timeout_ms;
+        return -1;
+    }
+    if (document.HasMember("drain_timeout_ms")) {
+        rapidjson::Value &drain_timeout_ms_json = document["drain_timeout_ms"];
+        drain_timeout_ms = drain_timeout_ms_json.GetInt();
+        if (drain_timeout_ms < 0) {
+            LOG(ERROR) << "invalid drain_timeout_ms:" << drain_timeout_ms;
+            return -1;
+        }
+    }
+    if (document.HasMember("handoff_path")) {
+        rapidjson::Value &handoff_path_json = document["handoff_path"];
+        handoff_path = handoff_path_json.GetString();
+    }
+    if (document.HasMember("stream_buffer_limit_kb")) {
+        rapidjson::Value &stream_buffer_limit_kb_json = document["stream_buffer_limit_kb"];
+        stream_buffer_limit_kb = stream_buffer_limit_kb_json.GetInt();
+    }
+    if (document.HasMember("session_buffer_limit_kb")) {
+        rapidjson::Value &session_buffer_limit_kb_json = document["session_buffer_limit_kb"];
+        session_buffer_limit_kb = session_buffer_limit_kb_json.GetInt();
+    }
+    if (document.HasMember("buffer_limit_kb")) {
+        rapidjson::Value &buffer_limit_kb_json = document["buffer_limit_kb"];
+        buffer_limit_kb = buffer_limit_kb_json.GetInt();
+    }
+    if (stream_buffer_limit_kb < 0 || session_buffer_limit_kb < 0 || buffer_limit_kb < 0) {
+        LOG(ERROR) << "invalid stream_buffer_limit_kb:" << stream_buffer_limit_kb << " session_buffer_limit_kb:"
+                   << session_buffer_limit_kb << " buffer_limit_kb:" << buffer_limit_kb;
+        return -1;
+    }
+    if (document.HasMember("stream_rate_kbps")) {
+        rapidjson::Value &stream_rate_kbps_json = document["stream_rate_kbps"];
+        stream_rate_kbps = stream_rate_kbps_json.GetInt();
+    }
+    if (document.HasMember("session_rate_kbps")) {
+        rapidjson::Value &session_rate_kbps_json = document["session_rate_kbps"];
+        session_rate_kbps = session_rate_kbps_json.GetInt();
+    }
+    if (document.HasMember("rate_burst_ms")) {
+        rapidjson::Value &rate_burst_ms_json = document["rate_burst_ms"];
+        rate_burst_ms = rate_burst_ms_json.GetInt();
+    }
+    if (stream_rate_kbps < 0 || session_rate_kbps < 0 || rate_burst_ms <= 0) {
+        LOG(ERROR) << "invalid stream_rate_kbps:" << stream_rate_kbps << " session_rate_kbps:" << session_rate_kbps
+                   << " rate_burst_ms:" << rate_burst_ms;
+        return -1;
+    }
+    if (document.HasMember("stats_interval_ms")) {
+        rapidjson::Value &stats_interval_ms_json = document["stats_interval_ms"];
+        stats_interval_ms = stats_interval_ms_json.GetInt();
+        if (stats_interval_ms < 0) {
+            LOG(ERROR) << "invalid stats_interval_ms:" << stats_interval_ms;
+            return -1;
+        }
+    }
+    if (document.HasMember("busy_poll_us")) {
+        rapidjson::Value &busy_poll_us_json = document["busy_poll_us"];
+        busy_poll_us = busy_poll_us_json.GetInt();
+        if (busy_poll_us < 0) {
+            LOG(ERROR) << "invalid busy_poll_us:" << busy_poll_us;
+            return -1;
+        }
+    }
+    if (document.HasMember("cpu_affinity")) {
+        rapidjson::Value &cpu_affinity_json = document["cpu_affinity"];
+        std::string cpu_list = std::string(cpu_affinity_json.GetString());
+        if (!cpu_list.empty() && tcptun::parse_cpu_list(cpu_list, cpu_affinity) < 0) {
+            LOG(ERROR) << "invalid cpu_affinity:" << cpu_list;
+            return -1;
+        }
+    }
+    if (document.HasMember("incoming_cpu_steering")) {
+        rapidjson::Value &incoming_cpu_steering_json = document["incoming_cpu_steering"];
+        incoming_cpu_steering = incoming_cpu_steering_json.GetBool();
+        if (incoming_cpu_steering && cpu_affinity.empty()) {
+            LOG(ERROR) << "incoming_cpu_steering needs cpu_affinity";
+            return -1;
+        }
+    }
+    if (document.HasMember("priority_class")) {
+        rapidjson::Value &priority_class_json = document["priority_class"];
+        priority_class = priority_class_json.GetInt();
+    }
+    if (document.HasMember("priority_share_percent")) {
+        rapidjson::Value &priority_share_percent_json = document["priority_share_percent"];
+        priority_share_percent = priority_share_percent_json.GetInt();
+    }
+    if (document.HasMember("peer_queue_kb")) {
+        rapidjson::Value &peer_queue_kb_json = document["peer_queue_kb"];
+        peer_queue_kb = peer_queue_kb_json.GetInt();
+    }
+    if (document.HasMember("stream_queue_kb")) {
+        rapidjson::Value &stream_queue_kb_json = document["stream_queue_kb"];
+        stream_queue_kb = stream_queue_kb_json.GetInt();
+    }
+    if (priority_class < 0 || priority_class > 3 || priority_share_percent < 0 || priority_share_percent > 100 ||
+        peer_queue_kb < 0 || stream_queue_kb < 0) {
+        LOG(ERROR) << "invalid priority_class:" << priority_class << " priority_share_percent:"
+                   << priority_share_percent << " peer_queue_kb:" << peer_queue_kb << " stream_queue_kb:"
+                   << stream_queue_kb;
+        return -1;
+    }
+    if (document.HasMember("idle_timeout_ms")) {
+        rapidjson::Value &idle_timeout_ms_json = document["idle_timeout_ms"];
+        idle_timeout_ms = idle_timeout_ms_json.GetInt();
+        if (idle_timeout_ms < 0) {
+            LOG(ERROR) << "invalid idle_timeout_ms:" << idle_timeout_ms;
+            return -1;
+        }
+    }
+    if (document.HasMember("backends")) {
+        rapidjson::Value &backends_json = document["backends"];
+        if (!backends_json.IsArray()) {
+            LOG(ERROR) << "invalid format, backends should be an array";
+            return -1;
+        }
+        for (auto &backend_json : backends_json.GetArray()) {
+            if (!backend_json.IsObject() || !backend_json.HasMember("ip")) {
+                LOG(ERROR) << "invalid format, every backend must contain ip and port";
+                return -1;
+            }
+            backend_config_t backend;
+            backend.ip = std::string(backend_json["ip"].GetString());
+            if (!backend_json.HasMember("port") && !tcptun::is_unix_address(backend.ip)) {
+                LOG(ERROR) << "invalid format, every backend must contain ip and port";
+                return -1;
+            }
+            backend.port = backend_json.HasMember("port") ? backend_json["port"].GetInt() : 0;
+            backend.weight = backend_json.HasMember("weight") ? backend_json["weight"].GetInt() : 1;
+            if (backend.weight < 1) {
+                LOG(ERROR) << "invalid weight:" << backend.weight << " of backend " << backend.ip;
+                return -1;
+            }
+            backends.push_back(backend);
+        }
+    }
+    if (backends.empty()) {
+        backend_config_t backend;
+        backend.ip = remote_ip;
+        backend.port = remote_port;
+        backend.weight = 1;
+        backends.push_back(backend);
+    }
+    if (document.HasMember("balance")) {
+        rapidjson::Value &balance_json = document["balance"];
+        balance = std::string(balance_json.GetString());
+    }
+    if (document.HasMember("health_check_interval_ms")) {
+        rapidjson::Value &health_check_interval_ms_json = document["health_check_interval_ms"];
+        health_check_interval_ms = health_check_interval_ms_json.GetInt();
+    }
+    if (document.HasMember("health_check_timeout_ms")) {
+        rapidjson::Value &health_check_timeout_ms_json = document["health_check_timeout_ms"];
+        health_check_timeout_ms = health_check_timeout_ms_json.GetInt();
+    }
+    if (health_check_interval_ms < 0 || health_check_timeout_ms < 1) {
+        LOG(ERROR) << "invalid health_check_interval_ms:" << health_check_interval_ms
+                   << " health_check_timeout_ms:" << health_check_timeout_ms;
+        return -1;
+    }
+    if (document.HasMember("max_fails")) {
+        rapidjson::Value &max_fails_json = document["max_fails"];
+        max_fails = max_fails_json.GetInt();
+    }
+    if (document.HasMember("fail_timeout_ms")) {
+        rapidjson::Value &fail_timeout_ms_json = document["fail_timeout_ms"];
+        fail_timeout_ms = fail_timeout_ms_json.GetInt();
+    }
+    if (max_fails < 0 || fail_timeout_ms < 0) {
+        LOG(ERROR) << "invalid max_fails:" << max_fails << " fail_timeout_ms:" << fail_timeout_ms;
+        return -1;
+    }
+    if (document.HasMember("frontend")) {
+        rapidjson::Value &frontend_json = document["frontend"];
+        frontend = std::string(frontend_json.GetString());
+    }
+    if (document.HasMember("target")) {
+        rapidjson::Value &target_json = document["target"];
+        target = std::string(target_json.GetString());
+    }
+    if (document.HasMember("allow_destinations")) {
+        rapidjson::Value &allow_destinations_json = document["allow_destinations"];
+        if (!allow_destinations_json.IsArray()) {
+            LOG(ERROR) << "invalid format, allow_destinations should be an array";
+            return -1;
+        }
+        for (auto &rule_json : allow_destinations_json.GetArray())
+            allow_destinations.push_back(std::string(rule_json.GetString()));
+    }
+    if (document.HasMember("services")) {
+        rapidjson::Value &services_json = document["services"];
+        if (!services_json.IsObject()) {
+            LOG(ERROR) << "invalid format, services should be an object of tag and host:port or unix:/path";
+            return -1;
+        }
+        for (auto &service_json : services_json.GetObject()) {
+            std::string tag(service_json.name.GetString());
+            if (tag.find(':') != std::string::npos) {
+                LOG(ERROR) << "invalid service tag:" << tag << ", it can't contain ':'";
+                return -1;
+            }
+            services.emplace_back(tag, std::string(service_json.value.GetString()));
+        }
+    }
+    if (has_listeners) {
+        rapidjson::Value &listeners_json = document["listeners"];
+        if (!listeners_json.IsArray() || listeners_json.Empty()) {
+            LOG(ERROR) << "invalid format, listeners should be a non empty array";
+            return -1;
+        }
+        for (auto &listener_json : listeners_json.GetArray()) {
+            if (!listener_json.IsObject() || !listener_json.HasMember("listen_ip")) {
+                LOG(ERROR) << "invalid format, every listener must contain listen_ip and listen_port";
+                return -1;
+            }
+            listener_config_t listener;
+            listener.listen_ip = std::string(listener_json["listen_ip"].GetString());
+            if (!listener_json.HasMember("listen_port") && !tcptun::is_unix_address(listener.listen_ip)) {
+                LOG(ERROR) << "invalid format, every listener must contain listen_ip and listen_port";
+                return -1;
+            }
+            listener.listen_port = listener_json.HasMember("listen_port") ? listener_json["listen_port"].GetInt() : 0;
+            listener.frontend = listener_json.HasMember("frontend") ?
+                                std::string(listener_json["frontend"].GetString()) : "none";
+            listener.target = listener_json.HasMember("target") ?
+                              std::string(listener_json["target"].GetString()) : "";
+            listener.rate_kbps = listener_json.HasMember("rate_kbps") ? listener_json["rate_kbps"].GetInt() : 0;
+            if (listener.rate_kbps < 0) {
+                LOG(ERROR) << "invalid rate_kbps:" << listener.rate_kbps << " of listener:" << listener.listen_ip;
+                return -1;
+            }
+            listener.priority = listener_json.HasMember("priority") ? listener_json["priority"].GetInt() : -1;
+            listener.weight = listener_json.HasMember("weight") ? listener_json["weight"].GetInt() : 1;
+            if (listener.priority > 3 || listener.weight < 1 || listener.weight > 32) {
+                LOG(ERROR) << "invalid priority:" << listener.priority << " weight:" << listener.weight
+                           << " of listener:" << listener.listen_ip;
+                return -1;
+            }
+            listener.idle_timeout_ms = listener_json.HasMember("idle_timeout_ms") ?
+                                       listener_json["idle_timeout_ms"].GetInt() : idle_timeout_ms;
+            if (listener.idle_timeout_ms < 0) {
+                LOG(ERROR) << "invalid idle_timeout_ms:" << listener.idle_timeout_ms << " of listener:"
+                           << listener.listen_ip;
+                return -1;
+            }
+            listeners.push_back(listener);
+        }
+    } else {
+        listener_config_t listener;
+        listener.listen_ip = listen_ip;
+        listener.listen_port = listen_port;
+        listener.frontend = frontend;
+        listener.target = target;
+        listener.rate_kbps = 0;
+        listener.priority = -1;
+        listener.weight = 1;
+        listener.idle_timeout_ms = idle_timeout_ms;
+        listeners.push_back(listener);
+    }
+    return 0;
 }
 
 SystemConfig::SystemConfig(const std::string &config_file_path) : system_config_(config_file_path) {}
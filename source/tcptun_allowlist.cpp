@@ -0,0 +1,131 @@
+#include "tcptun_allowlist.h"
+#include <cstring>
+#include <algorithm>
+#include <arpa/inet.h>
+#include <glog/logging.h>
+
+namespace tcptun {
+
+namespace {
+std::string to_lower(std::string s) {
+    std::transform(s.begin(), s.end(), s.begin(), ::tolower);
+    return s;
+}
+
+int32_t parse_port(const std::string &s, int32_t &port) {
+    if (s.empty() || s.size() > 5 || s.find_first_not_of("0123456789") != std::string::npos)
+        return -1;
+    port = std::stoi(s);
+    return port >= 1 && port <= 65535 ? 0 : -1;
+}
+
+///@return the address family, zero if host is not an ip
+int32_t parse_ip(const std::string &host, uint8_t *addr) {
+    if (inet_pton(AF_INET, host.c_str(), addr) == 1)
+        return AF_INET;
+    if (inet_pton(AF_INET6, host.c_str(), addr) == 1)
+        return AF_INET6;
+    return 0;
+}
+
+bool prefix_equal(const uint8_t *a, const uint8_t *b, const int32_t &prefix_len) {
+    auto full = prefix_len / 8;
+    if (memcmp(a, b, full) != 0)
+        return false;
+    auto rest = prefix_len % 8;
+    if (rest == 0)
+        return true;
+    uint8_t mask = static_cast<uint8_t>(0xff << (8 - rest));
+    return (a[full] & mask) == (b[full] & mask);
+}
+}
+
+int32_t DestinationAllowlist::Add(const std::string &rule) {
+    auto colon = rule.rfind(':');
+    if (colon == std::string::npos || colon == 0) {
+        LOG(ERROR) << "invalid destination rule:" << rule << ", it should be host:port";
+        return -1;
+    }
+    rule_t r;
+    memset(r.addr, 0, sizeof(r.addr));
+    r.family = 0;
+    r.prefix_len = 0;
+    auto port = rule.substr(colon + 1);
+    if (port == "*") {
+        r.port_min = 1;
+        r.port_max = 65535;
+    } else {
+        auto dash = port.find('-');
+        if (parse_port(port.substr(0, dash), r.port_min) < 0 ||
+            parse_port(dash == std::string::npos ? port : port.substr(dash + 1), r.port_max) < 0 ||
+            r.port_min > r.port_max) {
+            LOG(ERROR) << "invalid port of destination rule:" << rule;
+            return -2;
+        }
+    }
+    auto host = rule.substr(0, colon);
+    if (host.size() > 2 && host.front() == '[' && host.back() == ']')
+        host = host.substr(1, host.size() - 2);
+    if (host == "*") {
+        r.match = kMatchAny;
+    } else if (host.compare(0, 2, "*.") == 0) {
+        r.match = kMatchSuffix;
+        r.name = to_lower(host.substr(1));
+    } else {
+        auto slash = host.find('/');
+        r.family = parse_ip(host.substr(0, slash), r.addr);
+        if (r.family != 0) {
+            r.match = kMatchCidr;
+            int32_t max_len = r.family == AF_INET ? 32 : 128;
+            r.prefix_len = max_len;
+            if (slash != std::string::npos) {
+                auto len = host.substr(slash + 1);
+                if (len.empty() || len.size() > 3 || len.find_first_not_of("0123456789") != std::string::npos ||
+                    std::stoi(len) > max_len) {
+                    LOG(ERROR) << "invalid prefix length of destination rule:" << rule;
+                    return -3;
+                }
+                r.prefix_len = std::stoi(len);
+            }
+        } else if (slash != std::string::npos) {
+            LOG(ERROR) << "invalid cidr of destination rule:" << rule;
+            return -4;
+        } else {
+            r.match = kMatchName;
+            r.name = to_lower(host);
+        }
+    }
+    rules_.push_back(r);
+    return 0;
+}
+
+bool DestinationAllowlist::Allowed(const std::string &host, const int32_t &port) const {
+    uint8_t addr[16] = {0};
+    auto family = parse_ip(host, addr);
+    auto name = to_lower(host);
+    for (auto &r : rules_) {
+        if (port < r.port_min || port > r.port_max)
+            continue;
+        switch (r.match) {
+            case kMatchAny:
+                return true;
+            case kMatchName:
+                if (name == r.name)
+                    return true;
+                break;
+            case kMatchSuffix:
+                if (family == 0 && name.size() > r.name.size() &&
+                    name.compare(name.size() - r.name.size(), r.name.size(), r.name) == 0)
+                    return true;
+                break;
+            case kMatchCidr:
+                ///a hostname never matches an ip rule, it could resolve to anything
+                if (family == r.family && prefix_equal(addr, r.addr, r.prefix_len))
+                    return true;
+                break;
+        }
+    }
+    return false;
+}
+
+}
@@ -0,0 +1,755 @@
+#include "tcptun_arq_transport.h"
+#include <cstring>
+#include <algorithm>
+#include <errno.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <glog/logging.h>
+#include "random_generator.h"
+#include "tcptun_common.h"
+
+namespace tcptun {
+
+namespace {
+const size_t kDatagramHeaderLen = 5;
+const uint8_t kDatagramFec = 0x01;
+const size_t kSegmentHeaderLen = 17;
+const size_t kMaxDatagramLen = 65536;
+
+enum segment_cmd_t : uint8_t {
+  kCmdPush = 1,
+  kCmdAck = 2,
+  ///ask peer for its window when it advertised zero
+  kCmdWask = 3,
+  ///tell peer our window, also used as keepalive
+  kCmdWins = 4,
+  kCmdRst = 5,
+};
+
+const int32_t kMaxRtoMs = 60000;
+const int64_t kProbeIntervalMs = 1000;
+const int64_t kKeepaliveMs = 5000;
+const int64_t kPeerTimeoutMs = 30000;
+///at most this many datagrams are read for one EPOLLIN
+const int32_t kMaxRecvBatch = 256;
+///new sessions kept aside at most, and for how long, while their stream is checked
+const size_t kMaxCandidates = 16;
+const int64_t kCandidateTimeoutMs = 10000;
+///segments of a new session kept for the check, its hello fits in the first one
+const uint32_t kCandidateSegments = 4;
+
+void write_segment_header(char *p, const uint8_t &cmd, const uint16_t &wnd, const uint32_t &ts,
+                          const uint32_t &sn, const uint32_t &una, const uint16_t &len) {
+    *(unsigned char *) p = cmd;
+    write_u16(p + 1, wnd);
+    write_u32(p + 3, ts);
+    write_u32(p + 7, sn);
+    write_u32(p + 11, una);
+    write_u16(p + 15, len);
+}
+}
+
+LossInjector::LossInjector(const double &loss_rate, const int32_t &delay_ms)
+    : loss_rate_(loss_rate),
+      delay_ms_(delay_ms),
+      rand_(static_cast<uint32_t>(getnowtime_ms())),
+      dist_(0.0, 1.0) {}
+
+bool LossInjector::Admit(const char *data, const size_t &len, const int64_t &now_ms) {
+    if (loss_rate_ > 0 && dist_(rand_) < loss_rate_)
+        return false;
+    if (delay_ms_ <= 0)
+        return true;
+    delayed_.emplace_back(now_ms + delay_ms_, std::vector<char>(data, data + len));
+    return false;
+}
+
+void LossInjector::PopDue(const int64_t &now_ms, std::vector<std::vector<char>> &datagrams) {
+    while (!delayed_.empty() && delayed_.front().first <= now_ms) {
+        datagrams.push_back(std::move(delayed_.front().second));
+        delayed_.pop_front();
+    }
+}
+
+int32_t LossInjector::NextTimeoutMs(const int64_t &now_ms) const {
+    if (delayed_.empty())
+        return -1;
+    return static_cast<int32_t>(std::max<int64_t>(0, delayed_.front().first - now_ms));
+}
+
+ArqTransport::ArqTransport(const int32_t &fd, bool is_client, const transport_policy_t &policy)
+    : fd_(fd),
+      is_client_(is_client),
+      policy_(policy),
+      connected_(false),
+      closed_by_peer_(false),
+      conv_(0),
+      peer_addr_(),
+      peer_addr_len_(0),
+      mss_(0),
+      snd_stream_offset_(0),
+      snd_stream_limit_(0),
+      snd_una_(0),
+      snd_nxt_(0),
+      rmt_wnd_(0),
+      srtt_(0),
+      rttvar_(0),
+      rto_(policy.rto_ms),
+      pacing_tokens_(0),
+      pacing_ms_(0),
+      pacing_limited_(false),
+      rcv_stream_offset_(0),
+      rcv_nxt_(0),
+      rcv_wnd_closed_(false),
+      send_wins_(false),
+      probe_ms_(0),
+      last_recv_ms_(0),
+      last_send_ms_(0),
+      now_ms_(getnowtime_ms()),
+      injector_(policy.loss_rate, policy.delay_ms) {
+    auto ret = set_non_blocking(fd_);
+    if (ret < 0)
+        LOG(ERROR) << "failed to call set_non_blocking to udp fd:" << fd_;
+    size_t overhead = kDatagramHeaderLen + kSegmentHeaderLen;
+    if (policy_.fec_data_shards > 0) {
+        fec_encoder_.reset(new FecEncoder(policy_.fec_data_shards, policy_.fec_parity_shards));
+        fec_decoder_.reset(new FecDecoder(policy_.fec_data_shards, policy_.fec_parity_shards));
+        overhead += kFecHeaderLen + 2;
+    }
+    mss_ = policy_.mtu > static_cast<int32_t>(overhead) ? policy_.mtu - overhead : 0;
+    if (mss_ == 0)
+        LOG(ERROR) << "mtu:" << policy_.mtu << " is too small";
+    if (is_client_) {
+        uint32_t conv = 0;
+        if (RandomNumberGenerator::GetInstance()->GetRandomNumberNonZero(conv) < 0)
+            LOG(ERROR) << "failed to call GetRandomNumberNonZero for conv";
+        StartSession(conv, now_ms_);
+    }
+}
+
+ArqTransport::~ArqTransport() {
+    Close();
+    if (fd_ != 0)
+        close(fd_);
+}
+
+void ArqTransport::StartSession(const uint32_t &conv, const int64_t &now_ms) {
+    ResetSession();
+    conv_ = conv;
+    connected_ = true;
+    rmt_wnd_ = policy_.window;
+    last_recv_ms_ = now_ms;
+    last_send_ms_ = now_ms;
+    pacing_ms_ = now_ms;
+    LOG(INFO) << "arq session conv:" << conv_ << " started";
+}
+
+void ArqTransport::ResetSession() {
+    connected_ = false;
+    closed_by_peer_ = false;
+    snd_stream_.clear();
+    snd_stream_offset_ = 0;
+    snd_buf_.clear();
+    snd_una_ = 0;
+    snd_nxt_ = 0;
+    srtt_ = 0;
+    rttvar_ = 0;
+    rto_ = policy_.rto_ms;
+    pacing_tokens_ = 0;
+    pacing_limited_ = false;
+    rcv_buf_.clear();
+    rcv_stream_.clear();
+    rcv_stream_offset_ = 0;
+    rcv_nxt_ = 0;
+    rcv_wnd_closed_ = false;
+    acklist_.clear();
+    send_wins_ = false;
+    probe_ms_ = 0;
+    dgram_.clear();
+    injector_.Clear();
+    if (policy_.fec_data_shards > 0) {
+        fec_encoder_.reset(new FecEncoder(policy_.fec_data_shards, policy_.fec_parity_shards));
+        fec_decoder_.reset(new FecDecoder(policy_.fec_data_shards, policy_.fec_parity_shards));
+    }
+}
+
+int32_t ArqTransport::HandleEvents(const uint32_t &events) {
+    if (!(events & EPOLLIN))
+        return 0;
+    now_ms_ = getnowtime_ms();
+    int32_t result = 0;
+    char datagram[kMaxDatagramLen];
+    for (int32_t i = 0; i < kMaxRecvBatch; ++i) {
+        struct sockaddr_storage addr = {0};
+        socklen_t addr_len = sizeof(addr);
+        auto len = recvfrom(fd_, datagram, sizeof(datagram), 0, (struct sockaddr *) &addr, &addr_len);
+        if (len < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            if (errno == EINTR)
+                continue;
+            ///ECONNREFUSED of a connected udp socket, the next datagrams may still get through
+            LOG(WARNING) << "failed to call recvfrom error:" << strerror(errno);
+            break;
+        }
+        auto ret = Input(datagram, len, addr, addr_len, now_ms_);
+        if (ret > 0)
+            result |= ret;
+    }
+    if (rcv_stream_offset_ < rcv_stream_.size() || closed_by_peer_)
+        result |= kTransportReadable;
+    return result;
+}
+
+bool ArqTransport::ReadSessionBody(const char *datagram, const size_t &len, const char *&body,
+                                   size_t &body_len) const {
+    body = datagram + kDatagramHeaderLen;
+    body_len = len - kDatagramHeaderLen;
+    if (!(datagram[4] & kDatagramFec))
+        return true;
+    if (fec_decoder_ == nullptr || body_len < kFecHeaderLen + 2)
+        return false;
+    ///parity shards can't be read without the rest of the group
+    if (static_cast<uint8_t>(body[4]) >= policy_.fec_data_shards)
+        return false;
+    body_len = std::min<size_t>(read_u16(body + kFecHeaderLen), body_len - kFecHeaderLen - 2);
+    body += kFecHeaderLen + 2;
+    return true;
+}
+
+int32_t ArqTransport::CheckNewSession(const char *datagram, const size_t &len) {
+    const char *body = nullptr;
+    size_t body_len = 0;
+    if (!ReadSessionBody(datagram, len, body, body_len) || body_len < kSegmentHeaderLen)
+        return 0;
+    auto cmd = static_cast<uint8_t>(body[0]);
+    if (cmd == kCmdRst)
+        return 0;
+    ///una is what the client has received, a new client has received nothing
+    return read_u32(body + 11) == 0 ? 1 : -1;
+}
+
+int32_t ArqTransport::AdmitSession(const uint32_t &conv, const char *datagram, const size_t &len,
+                                   const struct sockaddr_storage &addr, const socklen_t &addr_len,
+                                   const int64_t &now_ms) {
+    const char *body = nullptr;
+    size_t body_len = 0;
+    if (!ReadSessionBody(datagram, len, body, body_len))
+        return 0;
+    auto it = candidates_.find(conv);
+    if (it == candidates_.end()) {
+        if (candidates_.size() >= kMaxCandidates) {
+            auto oldest = std::min_element(candidates_.begin(), candidates_.end(),
+                                           [](const std::pair<const uint32_t, candidate_t> &a,
+                                              const std::pair<const uint32_t, candidate_t> &b) {
+                                               return a.second.deadline_ms < b.second.deadline_ms;
+                                           });
+            candidates_.erase(oldest);
+        }
+        it = candidates_.emplace(conv, candidate_t()).first;
+        it->second.deadline_ms = now_ms + kCandidateTimeoutMs;
+    }
+    auto &candidate = it->second;
+    candidate.addr = addr;
+    candidate.addr_len = addr_len;
+    ///nothing is acked yet, the client resends the segments until the session is taken
+    size_t offset = 0;
+    while (offset + kSegmentHeaderLen <= body_len) {
+        const char *p = body + offset;
+        auto sn = read_u32(p + 7);
+        auto seg_len = read_u16(p + 15);
+        if (offset + kSegmentHeaderLen + seg_len > body_len)
+            break;
+        if (static_cast<uint8_t>(p[0]) == kCmdPush && sn < kCandidateSegments && !candidate.segments.count(sn)) {
+            candidate.segments[sn] = std::make_pair(read_u32(p + 3), std::vector<char>(p + kSegmentHeaderLen,
+                                                                                       p + kSegmentHeaderLen + seg_len));
+        }
+        offset += kSegmentHeaderLen + seg_len;
+    }
+    std::vector<char> stream;
+    for (uint32_t sn = 0; candidate.segments.count(sn); ++sn) {
+        auto &data = candidate.segments[sn].second;
+        stream.insert(stream.end(), data.begin(), data.end());
+    }
+    auto ret = session_check_(stream.data(), stream.size());
+    if (ret == 0)
+        return 0;
+    if (ret < 0) {
+        LOG(WARNING) << "new arq session conv:" << conv << " failed the session check";
+        candidates_.erase(it);
+        SendRst(conv, addr, addr_len);
+        return 0;
+    }
+    auto segments = std::move(candidate.segments);
+    candidates_.erase(it);
+    ///like accept of tcp, a new client replaces the old one
+    StartSession(conv, now_ms);
+    peer_addr_ = addr;
+    peer_addr_len_ = addr_len;
+    for (auto &ele : segments) {
+        acklist_.emplace_back(ele.first, ele.second.first);
+        rcv_buf_[ele.first] = std::move(ele.second.second);
+    }
+    return 1;
+}
+
+bool ArqTransport::FromPeer(const struct sockaddr_storage &addr, const socklen_t &addr_len) const {
+    if (addr_len != peer_addr_len_ || addr.ss_family != peer_addr_.ss_family)
+        return false;
+    if (addr.ss_family == AF_INET) {
+        auto a = reinterpret_cast<const struct sockaddr_in *>(&addr);
+        auto b = reinterpret_cast<const struct sockaddr_in *>(&peer_addr_);
+        return a->sin_port == b->sin_port && a->sin_addr.s_addr == b->sin_addr.s_addr;
+    }
+    if (addr.ss_family == AF_INET6) {
+        auto a = reinterpret_cast<const struct sockaddr_in6 *>(&addr);
+        auto b = reinterpret_cast<const struct sockaddr_in6 *>(&peer_addr_);
+        return a->sin6_port == b->sin6_port && memcmp(&a->sin6_addr, &b->sin6_addr, sizeof(a->sin6_addr)) == 0;
+    }
+    return memcmp(&addr, &peer_addr_, addr_len) == 0;
+}
+
+int32_t ArqTransport::Input(const char *datagram, const size_t &len, const struct sockaddr_storage &addr,
+                            const socklen_t &addr_len, const int64_t &now_ms) {
+    if (len < kDatagramHeaderLen)
+        return 0;
+    auto conv = read_u32(datagram);
+    int32_t result = 0;
+    ///a client socket is connected, only the server hears from anyone
+    bool from_peer = is_client_ || FromPeer(addr, addr_len);
+    if (!connected_ || conv != conv_) {
+        if (is_client_ || conv == 0)
+            return 0;
+        auto check = CheckNewSession(datagram, len);
+        if (check < 0)
+            SendRst(conv, addr, addr_len);
+        if (check <= 0)
+            return 0;
+        if (session_check_) {
+            ///the current session goes on until the new one passes the check
+            if (AdmitSession(conv, datagram, len, addr, addr_len, now_ms) == 0)
+                return 0;
+        } else {
+            ///like accept of tcp, a new client replaces the old one
+            StartSession(conv, now_ms);
+            peer_addr_ = addr;
+            peer_addr_len_ = addr_len;
+        }
+        from_peer = true;
+        result |= kTransportReset;
+    }
+    const char *body = datagram + kDatagramHeaderLen;
+    size_t body_len = len - kDatagramHeaderLen;
+    int32_t fresh = 0;
+    if (!(datagram[4] & kDatagramFec)) {
+        fresh = InputSegments(body, body_len, from_peer, now_ms);
+    } else if (fec_decoder_ == nullptr) {
+        LOG(WARNING) << "fec datagram received but fec is disabled";
+        return result;
+    } else {
+        std::vector<std::vector<char>> bodies;
+        if (fec_decoder_->Decode(body, body_len, bodies) < 0)
+            return result;
+        for (auto &b : bodies)
+            fresh |= InputSegments(b.data(), b.size(), from_peer, now_ms);
+    }
+    if (!from_peer && fresh > 0) {
+        ///follow the client when its address changes, e.g. NAT rebinding, once it acked or sent something
+        ///new from there, anyone may send a datagram which merely carries the conv
+        LOG(INFO) << "arq session conv:" << conv_ << " follows its client to a new address";
+        peer_addr_ = addr;
+        peer_addr_len_ = addr_len;
+        from_peer = true;
+    }
+    if (from_peer)
+        last_recv_ms_ = now_ms;
+    return result;
+}
+
+int32_t ArqTransport::InputSegments(const char *body, const size_t &len, bool from_peer, const int64_t &now_ms) {
+    int32_t fresh = 0;
+    size_t offset = 0;
+    bool has_ack = false;
+    uint32_t max_ack = 0;
+    while (offset + kSegmentHeaderLen <= len) {
+        const char *p = body + offset;
+        segment_header_t header = {0};
+        header.cmd = static_cast<uint8_t>(p[0]);
+        header.wnd = read_u16(p + 1);
+        header.ts = read_u32(p + 3);
+        header.sn = read_u32(p + 7);
+        header.una = read_u32(p + 11);
+        header.len = read_u16(p + 15);
+        if (offset + kSegmentHeaderLen + header.len > len)
+            break;
+        const char *data = p + kSegmentHeaderLen;
+        offset += kSegmentHeaderLen + header.len;
+        ///a datagram from another address is only believed for the segments it acks or carries
+        if (!from_peer && header.cmd != kCmdAck && header.cmd != kCmdPush)
+            continue;
+        if (from_peer)
+            rmt_wnd_ = header.wnd;
+        ///everything before una is received by peer, an una beyond what we sent is not believed
+        if (from_peer && seq_diff(header.una, snd_nxt_) <= 0) {
+            while (!snd_buf_.empty() && seq_diff(snd_buf_.begin()->first, header.una) < 0)
+                snd_buf_.erase(snd_buf_.begin());
+        }
+        switch (header.cmd) {
+            case kCmdAck: {
+                auto it = snd_buf_.find(header.sn);
+                if (it != snd_buf_.end()) {
+                    ///karn's algorithm, rtt of a resent segment is ambiguous
+                    if (it->second.xmit == 1)
+                        UpdateRtt(static_cast<int32_t>(static_cast<uint32_t>(now_ms) - header.ts));
+                    snd_buf_.erase(it);
+                    fresh = 1;
+                }
+                if (!has_ack || seq_diff(header.sn, max_ack) > 0)
+                    max_ack = header.sn;
+                has_ack = true;
+                break;
+            }
+            case kCmdPush: {
+                if (seq_diff(header.sn, rcv_nxt_ + policy_.window) >= 0)
+                    break;
+                acklist_.emplace_back(header.sn, header.ts);
+                if (seq_diff(header.sn, rcv_nxt_) >= 0 && !rcv_buf_.count(header.sn)) {
+                    rcv_buf_[header.sn].assign(data, data + header.len);
+                    fresh = 1;
+                }
+                break;
+            }
+            case kCmdWask:
+                send_wins_ = true;
+                break;
+            case kCmdWins:
+                break;
+            case kCmdRst:
+                LOG(INFO) << "arq session conv:" << conv_ << " reset by peer";
+                closed_by_peer_ = true;
+                break;
+            default:
+                LOG(WARNING) << "unknown arq segment cmd:" << static_cast<int32_t>(header.cmd);
+                break;
+        }
+    }
+    if (has_ack && policy_.fast_resend > 0) {
+        ///segments before the highest ack are skipped by it, count that for fast resend
+        for (auto &ele : snd_buf_) {
+            if (seq_diff(ele.first, max_ack) >= 0)
+                break;
+            ++ele.second.fastack;
+        }
+    }
+    snd_una_ = snd_buf_.empty() ? snd_nxt_ : snd_buf_.begin()->first;
+    while (!rcv_buf_.empty() && rcv_buf_.begin()->first == rcv_nxt_) {
+        auto &data = rcv_buf_.begin()->second;
+        rcv_stream_.insert(rcv_stream_.end(), data.begin(), data.end());
+        rcv_buf_.erase(rcv_buf_.begin());
+        ++rcv_nxt_;
+    }
+    return fresh;
+}
+
+void ArqTransport::UpdateRtt(const int32_t &rtt) {
+    if (rtt < 0)
+        return;
+    ///rfc 6298
+    if (srtt_ == 0) {
+        srtt_ = rtt;
+        rttvar_ = rtt / 2;
+    } else {
+        auto delta = std::abs(rtt - srtt_);
+        rttvar_ = (3 * rttvar_ + delta) / 4;
+        srtt_ = (7 * srtt_ + rtt) / 8;
+        if (srtt_ < 1)
+            srtt_ = 1;
+    }
+    rto_ = std::min(std::max(srtt_ + std::max(1, 4 * rttvar_), policy_.min_rto_ms), kMaxRtoMs);
+}
+
+ssize_t ArqTransport::Recv(char *buf, const size_t &len) {
+    if (rcv_stream_offset_ < rcv_stream_.size()) {
+        auto n = std::min(len, rcv_stream_.size() - rcv_stream_offset_);
+        memcpy(buf, rcv_stream_.data() + rcv_stream_offset_, n);
+        rcv_stream_offset_ += n;
+        if (rcv_stream_offset_ == rcv_stream_.size()) {
+            rcv_stream_.clear();
+            rcv_stream_offset_ = 0;
+        }
+        ///tell peer at once that the window opened again
+        if (rcv_wnd_closed_ && WindowUnused() > 0) {
+            rcv_wnd_closed_ = false;
+            send_wins_ = true;
+        }
+        return n;
+    }
+    if (closed_by_peer_) {
+        connected_ = false;
+        closed_by_peer_ = false;
+        return 0;
+    }
+    errno = EAGAIN;
+    return -1;
+}
+
+ssize_t ArqTransport::Send(const char *buf, const size_t &len) {
+    if (!connected_) {
+        errno = ENOTCONN;
+        return -1;
+    }
+    ///bytes waiting for a free slot of the window are bounded by one window
+    size_t limit = static_cast<size_t>(policy_.window) * mss_;
+    if (snd_stream_limit_ > 0)
+        limit = std::min(limit, snd_stream_limit_);
+    size_t pending = snd_stream_.size() - snd_stream_offset_;
+    if (pending >= limit) {
+        errno = EAGAIN;
+        return -1;
+    }
+    auto n = std::min(len, limit - pending);
+    snd_stream_.insert(snd_stream_.end(), buf, buf + n);
+    return n;
+}
+
+int32_t ArqTransport::SetUnsentLimit(const int32_t &bytes) {
+    snd_stream_limit_ = bytes > 0 ? static_cast<size_t>(bytes) : 0;
+    return 0;
+}
+
+uint16_t ArqTransport::WindowUnused() const {
+    size_t queued = rcv_buf_.size() + (rcv_stream_.size() - rcv_stream_offset_ + mss_ - 1) / mss_;
+    if (queued >= static_cast<size_t>(policy_.window))
+        return 0;
+    return static_cast<uint16_t>(std::min<size_t>(policy_.window - queued, 0xffff));
+}
+
+int32_t ArqTransport::Update(const int64_t &now_ms) {
+    now_ms_ = now_ms;
+    std::vector<std::vector<char>> due;
+    injector_.PopDue(now_ms, due);
+    for (auto &d : due) {
+        ssize_t ret = is_client_ ? send(fd_, d.data(), d.size(), 0)
+                                 : sendto(fd_, d.data(), d.size(), 0, (struct sockaddr *) &peer_addr_, peer_addr_len_);
+        if (ret < 0)
+            LOG(WARNING) << "failed to send delayed datagram error:" << strerror(errno);
+    }
+    for (auto it = candidates_.begin(); it != candidates_.end();) {
+        if (now_ms < it->second.deadline_ms)
+            ++it;
+        else
+            it = candidates_.erase(it);
+    }
+    if (!connected_)
+        return 0;
+    if (now_ms - last_recv_ms_ > kPeerTimeoutMs && !closed_by_peer_) {
+        LOG(WARNING) << "arq session conv:" << conv_ << " timed out";
+        closed_by_peer_ = true;
+    }
+    Flush(now_ms);
+    return closed_by_peer_ ? kTransportReadable : 0;
+}
+
+void ArqTransport::Flush(const int64_t &now_ms) {
+    auto wnd = WindowUnused();
+    if (wnd == 0)
+        rcv_wnd_closed_ = true;
+    segment_header_t header = {0};
+    header.wnd = wnd;
+    header.una = rcv_nxt_;
+    header.cmd = kCmdAck;
+    for (auto &ack : acklist_) {
+        header.sn = ack.first;
+        header.ts = ack.second;
+        AppendSegment(header, nullptr);
+    }
+    acklist_.clear();
+    header.sn = 0;
+    header.ts = static_cast<uint32_t>(now_ms);
+    if (rmt_wnd_ == 0) {
+        if (probe_ms_ == 0) {
+            probe_ms_ = now_ms + kProbeIntervalMs;
+        } else if (now_ms >= probe_ms_) {
+            header.cmd = kCmdWask;
+            AppendSegment(header, nullptr);
+            probe_ms_ = now_ms + kProbeIntervalMs;
+        }
+    } else {
+        probe_ms_ = 0;
+    }
+    if (send_wins_ || now_ms - last_send_ms_ >= kKeepaliveMs) {
+        header.cmd = kCmdWins;
+        AppendSegment(header, nullptr);
+        send_wins_ = false;
+    }
+    ///cut the stream into segments as far as the window allows
+    auto cwnd = std::min<uint32_t>(policy_.window, rmt_wnd_);
+    while (seq_diff(snd_nxt_, snd_una_ + cwnd) < 0 && snd_stream_offset_ < snd_stream_.size()) {
+        auto n = std::min(mss_, snd_stream_.size() - snd_stream_offset_);
+        segment_t seg = {0};
+        seg.data.assign(snd_stream_.begin() + snd_stream_offset_, snd_stream_.begin() + snd_stream_offset_ + n);
+        snd_stream_offset_ += n;
+        snd_buf_[snd_nxt_++] = std::move(seg);
+    }
+    if (snd_stream_offset_ == snd_stream_.size()) {
+        snd_stream_.clear();
+        snd_stream_offset_ = 0;
+    }
+    if (policy_.pacing_kbps > 0) {
+        ///kbps / 8 is bytes per millisecond
+        pacing_tokens_ += (now_ms - pacing_ms_) * (policy_.pacing_kbps / 8.0);
+        pacing_tokens_ = std::min(pacing_tokens_, 16.0 * policy_.mtu);
+        pacing_ms_ = now_ms;
+    }
+    pacing_limited_ = false;
+    header.cmd = kCmdPush;
+    for (auto &ele : snd_buf_) {
+        auto &seg = ele.second;
+        bool resend = false;
+        if (seg.xmit == 0) {
+            seg.rto = rto_;
+        } else if (now_ms >= seg.resend_ms) {
+            ///back off less than tcp does, loss on these links is not congestion
+            seg.rto = std::min(seg.rto + seg.rto / 2, kMaxRtoMs);
+            resend = true;
+        } else if (policy_.fast_resend > 0 && seg.fastack >= static_cast<uint32_t>(policy_.fast_resend)) {
+            resend = true;
+        } else {
+            continue;
+        }
+        if (policy_.pacing_kbps > 0) {
+            if (pacing_tokens_ < static_cast<double>(seg.data.size() + kSegmentHeaderLen)) {
+                pacing_limited_ = true;
+                break;
+            }
+            pacing_tokens_ -= seg.data.size() + kSegmentHeaderLen;
+        }
+        if (resend)
+            VLOG(1) << "arq resend sn:" << ele.first << " xmit:" << seg.xmit;
+        seg.fastack = 0;
+        seg.resend_ms = now_ms + seg.rto;
+        seg.ts = static_cast<uint32_t>(now_ms);
+        ++seg.xmit;
+        header.sn = ele.first;
+        header.ts = seg.ts;
+        header.len = static_cast<uint16_t>(seg.data.size());
+        AppendSegment(header, seg.data.data());
+    }
+    FlushDatagram();
+}
+
+void ArqTransport::AppendSegment(const segment_header_t &header, const char *data) {
+    size_t need = kSegmentHeaderLen + (data != nullptr ? header.len : 0);
+    if (!dgram_.empty() && dgram_.size() + need > mss_ + kSegmentHeaderLen)
+        FlushDatagram();
+    if (dgram_.empty())
+        dgram_.resize(kDatagramHeaderLen);
+    auto offset = dgram_.size();
+    dgram_.resize(offset + need);
+    write_segment_header(dgram_.data() + offset, header.cmd, header.wnd, header.ts, header.sn, header.una,
+                         data != nullptr ? header.len : 0);
+    if (data != nullptr)
+        memcpy(dgram_.data() + offset + kSegmentHeaderLen, data, header.len);
+}
+
+void ArqTransport::FlushDatagram() {
+    if (dgram_.empty())
+        return;
+    write_u32(dgram_.data(), conv_);
+    if (fec_encoder_ == nullptr) {
+        dgram_[4] = 0;
+        SendDatagram(dgram_.data(), dgram_.size());
+        dgram_.clear();
+        return;
+    }
+    std::vector<std::vector<char>> packets;
+    auto ret = fec_encoder_->Encode(dgram_.data() + kDatagramHeaderLen, dgram_.size() - kDatagramHeaderLen,
+                                    packets);
+    dgram_.clear();
+    if (ret < 0) {
+        LOG(ERROR) << "failed to call FecEncoder Encode ret:" << ret;
+        return;
+    }
+    std::vector<char> datagram;
+    for (auto &packet : packets) {
+        datagram.resize(kDatagramHeaderLen);
+        write_u32(datagram.data(), conv_);
+        datagram[4] = kDatagramFec;
+        datagram.insert(datagram.end(), packet.begin(), packet.end());
+        SendDatagram(datagram.data(), datagram.size());
+    }
+}
+
+void ArqTransport::SendDatagram(const char *data, const size_t &len) {
+    last_send_ms_ = now_ms_;
+    if (injector_.Enabled() && !injector_.Admit(data, len, now_ms_))
+        return;
+    ssize_t ret = is_client_ ? send(fd_, data, len, 0)
+                             : sendto(fd_, data, len, 0, (struct sockaddr *) &peer_addr_, peer_addr_len_);
+    ///a full socket buffer is the same as a lost datagram for arq
+    if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+        LOG(WARNING) << "failed to send datagram error:" << strerror(errno);
+}
+
+void ArqTransport::SendRst(const uint32_t &conv, const struct sockaddr_storage &addr, const socklen_t &addr_len) {
+    char datagram[kDatagramHeaderLen + kSegmentHeaderLen];
+    write_u32(datagram, conv);
+    datagram[4] = 0;
+    write_segment_header(datagram + kDatagramHeaderLen, kCmdRst, 0, 0, 0, 0, 0);
+    if (sendto(fd_, datagram, sizeof(datagram), 0, (const struct sockaddr *) &addr, addr_len) < 0)
+        LOG(WARNING) << "failed to send rst for conv:" << conv << " error:" << strerror(errno);
+}
+
+int32_t ArqTransport::NextTimeoutMs(const int64_t &now_ms) {
+    int64_t timeout = injector_.NextTimeoutMs(now_ms);
+    auto take = [&timeout](int64_t t) {
+        if (t < 0)
+            t = 0;
+        if (timeout < 0 || t < timeout)
+            timeout = t;
+    };
+    if (!connected_)
+        return static_cast<int32_t>(timeout);
+    if (!acklist_.empty() || send_wins_ || closed_by_peer_)
+        return 0;
+    if (pacing_limited_)
+        take(1);
+    if (snd_stream_offset_ < snd_stream_.size() &&
+        seq_diff(snd_nxt_, snd_una_ + std::min<uint32_t>(policy_.window, rmt_wnd_)) < 0)
+        take(0);
+    for (auto &ele : snd_buf_)
+        take(ele.second.xmit == 0 ? 0 : ele.second.resend_ms - now_ms);
+    if (probe_ms_ != 0)
+        take(probe_ms_ - now_ms);
+    take(last_send_ms_ + kKeepaliveMs - now_ms);
+    take(last_recv_ms_ + kPeerTimeoutMs - now_ms);
+    return static_cast<int32_t>(timeout);
+}
+
+bool ArqTransport::Busy(uint32_t &rtt_us) {
+    rtt_us = static_cast<uint32_t>(srtt_) * 1000;
+    return false;
+}
+
+void ArqTransport::Close() {
+    if (!connected_)
+        return;
+    struct sockaddr_storage addr = peer_addr_;
+    if (is_client_ || peer_addr_len_ != 0) {
+        ///a client socket is connected, its address is ignored
+        char datagram[kDatagramHeaderLen + kSegmentHeaderLen];
+        write_u32(datagram, conv_);
+        datagram[4] = 0;
+        write_segment_header(datagram + kDatagramHeaderLen, kCmdRst, 0, 0, 0, 0, 0);
+        ssize_t ret = is_client_ ? send(fd_, datagram, sizeof(datagram), 0)
+                                 : sendto(fd_, datagram, sizeof(datagram), 0, (struct sockaddr *) &addr,
+                                          peer_addr_len_);
+        if (ret < 0)
+            LOG(WARNING) << "failed to send rst for conv:" << conv_ << " error:" << strerror(errno);
+    }
+    LOG(INFO) << "arq session conv:" << conv_ << " closed";
+    ResetSession();
+}
+
+}
@@ -0,0 +1,351 @@
+#include "tcptun_balancer.h"
+#include <cstring>
+#include <algorithm>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <glog/logging.h>
+
+namespace tcptun {
+
+const int32_t UpstreamBalancer::kHashPointsPerWeight;
+
+namespace {
+uint32_t fnv1a(const std::string &s) {
+    uint32_t h = 2166136261u;
+    for (auto c : s) {
+        h ^= static_cast<unsigned char>(c);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+///murmur3 finalizer, conn_id is random already but this keeps the ring even for any id
+uint32_t mix32(uint32_t h) {
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+}
+
+UpstreamBalancer::UpstreamBalancer(const int32_t &epoll_fd, const balance_policy_t &policy,
+                                   const upstream_pool_policy_t &pool_policy, const connect_policy_t &connect_policy,
+                                   Resolver *resolver)
+    : epoll_fd_(epoll_fd),
+      policy_(policy),
+      connect_policy_(connect_policy),
+      resolver_(resolver),
+      rr_start_(0),
+      next_probe_ms_(0),
+      out_of_fds_(false) {
+    backends_.resize(policy_.backends.size());
+    for (size_t i = 0; i < backends_.size(); ++i) {
+        auto &backend = backends_[i];
+        backend.addr = policy_.backends[i].addr;
+        backend.weight = std::max(1, policy_.backends[i].weight);
+        backend.current_weight = 0;
+        backend.active_streams = 0;
+        backend.fails = 0;
+        backend.ejected_until_ms = 0;
+        backend.healthy = true;
+        backend.pool.reset(new UpstreamPool(epoll_fd_, backend.addr, pool_policy, connect_policy_, resolver_));
+        ///look up hostnames now, so the first stream does not wait for them
+        std::vector<socket_address_t> addrs;
+        resolver_->Lookup(backend.addr.ip, backend.addr.port, addrs);
+        if (policy_.type == kBalanceHash) {
+            auto name = backend.addr.ip + ":" + std::to_string(backend.addr.port);
+            for (int32_t p = 0; p < backend.weight * kHashPointsPerWeight; ++p)
+                ring_.emplace(fnv1a(name + "#" + std::to_string(p)), i);
+        }
+    }
+}
+
+int32_t UpstreamBalancer::ParseBalanceType(const std::string &name, balance_type_t &type) {
+    if (name == "round_robin")
+        type = kBalanceRoundRobin;
+    else if (name == "least_conn")
+        type = kBalanceLeastConn;
+    else if (name == "hash")
+        type = kBalanceHash;
+    else
+        return -1;
+    return 0;
+}
+
+bool UpstreamBalancer::Owns(const int32_t &fd) const {
+    for (auto &backend : backends_) {
+        if ((backend.probe != nullptr && backend.probe->Owns(fd)) || backend.pool->Owns(fd))
+            return true;
+    }
+    return false;
+}
+
+int32_t UpstreamBalancer::HandleEvent(const int32_t &fd) {
+    auto now = getnowtime_ms();
+    for (size_t i = 0; i < backends_.size(); ++i) {
+        auto &backend = backends_[i];
+        if (backend.probe != nullptr && backend.probe->Owns(fd)) {
+            auto ret = backend.probe->HandleEvent(fd, now);
+            FinishProbe(i, ret, now);
+            return ret < 0 ? -1 : 0;
+        }
+        if (backend.pool->Owns(fd)) {
+            ///refills of the pool tell about the backend as much as streams do
+            auto ret = backend.pool->HandleConnectEvent(fd);
+            if (ret != kRaceRunning)
+                OnConnectResult(i, ret == kRaceWon, now);
+            return ret < 0 ? ret : 0;
+        }
+    }
+    return -1;
+}
+
+bool UpstreamBalancer::Available(const backend_state_t &backend, const int64_t &now_ms) const {
+    return backend.healthy && now_ms >= backend.ejected_until_ms;
+}
+
+int32_t UpstreamBalancer::Select(const uint32_t &conn_id, const std::vector<bool> &tried, const int64_t &now_ms) {
+    auto usable = [&](size_t i) { return !tried[i] && Available(backends_[i], now_ms); };
+    switch (policy_.type) {
+        case kBalanceRoundRobin: {
+            ///nginx's smooth weighted round robin, heavy backends are spread out instead of picked in a row
+            int32_t best = -1;
+            int32_t total = 0;
+            for (size_t i = 0; i < backends_.size(); ++i) {
+                if (!usable(i))
+                    continue;
+                backends_[i].current_weight += backends_[i].weight;
+                total += backends_[i].weight;
+                if (best < 0 || backends_[i].current_weight > backends_[best].current_weight)
+                    best = static_cast<int32_t>(i);
+            }
+            if (best >= 0)
+                backends_[best].current_weight -= total;
+            return best;
+        }
+        case kBalanceLeastConn: {
+            int32_t best = -1;
+            ///start from a moving index so that ties do not always go to the first backend
+            for (size_t n = 0; n < backends_.size(); ++n) {
+                auto i = (rr_start_ + n) % backends_.size();
+                if (!usable(i))
+                    continue;
+                if (best < 0 || static_cast<int64_t>(backends_[i].active_streams) * backends_[best].weight <
+                    static_cast<int64_t>(backends_[best].active_streams) * backends_[i].weight)
+                    best = static_cast<int32_t>(i);
+            }
+            ++rr_start_;
+            return best;
+        }
+        case kBalanceHash: {
+            if (ring_.empty())
+                return -1;
+            ///walk the ring clockwise to the first usable backend, so only the streams of an
+            ///ejected backend move elsewhere
+            auto it = ring_.lower_bound(mix32(conn_id));
+            for (size_t n = 0; n < ring_.size(); ++n, ++it) {
+                if (it == ring_.end())
+                    it = ring_.begin();
+                if (usable(it->second))
+                    return static_cast<int32_t>(it->second);
+            }
+            return -1;
+        }
+    }
+    return -1;
+}
+
+int32_t UpstreamBalancer::Pick(const uint32_t &conn_id, int32_t &fd, std::vector<socket_address_t> &addrs) {
+    auto now = getnowtime_ms();
+    auto &picking = picking_[conn_id];
+    if (picking.tried.empty()) {
+        picking.index = -1;
+        picking.tried.assign(backends_.size(), false);
+    }
+    for (size_t n = 0; n < backends_.size(); ++n) {
+        auto index = Select(conn_id, picking.tried, now);
+        if (index < 0)
+            break;
+        picking.tried[index] = true;
+        auto &backend = backends_[index];
+        if (backend.pool->Acquire(fd) == 0) {
+            ++backend.active_streams;
+            stream_backend_[fd] = index;
+            picking_.erase(conn_id);
+            return kPickPooled;
+        }
+        if (backend.pool->Enabled())
+            LOG(WARNING) << "upstream pool of " << backend.addr.ip << ":" << backend.addr.port
+                         << " is empty, connect directly";
+        auto ret = resolver_->Lookup(backend.addr.ip, backend.addr.port, addrs);
+        if (ret == kLookupPending) {
+            LOG(WARNING) << "backend " << backend.addr.ip << " is still being looked up, try another one";
+            continue;
+        }
+        if (ret < 0) {
+            OnConnectResult(index, false, now);
+            continue;
+        }
+        ///counted from now on, so least_conn sees the streams still connecting
+        ++backend.active_streams;
+        picking.index = index;
+        return kPickConnect;
+    }
+    LOG(ERROR) << "no backend available for conn_id:" << conn_id;
+    picking_.erase(conn_id);
+    return -1;
+}
+
+void UpstreamBalancer::ConnectDone(const uint32_t &conn_id, const int32_t &fd) {
+    auto it = picking_.find(conn_id);
+    if (it == picking_.end() || it->second.index < 0)
+        return;
+    auto index = static_cast<size_t>(it->second.index);
+    it->second.index = -1;
+    OnConnectResult(index, fd >= 0, getnowtime_ms());
+    if (fd < 0) {
+        --backends_[index].active_streams;
+        return;
+    }
+    stream_backend_[fd] = index;
+    picking_.erase(it);
+}
+
+void UpstreamBalancer::Abandon(const uint32_t &conn_id) {
+    auto it = picking_.find(conn_id);
+    if (it == picking_.end())
+        return;
+    if (it->second.index >= 0)
+        --backends_[it->second.index].active_streams;
+    picking_.erase(it);
+}
+
+void UpstreamBalancer::Release(const int32_t &fd) {
+    auto it = stream_backend_.find(fd);
+    if (it == stream_backend_.end())
+        return;
+    --backends_[it->second].active_streams;
+    stream_backend_.erase(it);
+}
+
+void UpstreamBalancer::ReleaseAll() {
+    for (auto &backend : backends_)
+        backend.active_streams = 0;
+    stream_backend_.clear();
+    picking_.clear();
+}
+
+void UpstreamBalancer::OnConnectResult(const size_t &index, bool ok, const int64_t &now_ms) {
+    auto &backend = backends_[index];
+    if (ok) {
+        backend.fails = 0;
+        return;
+    }
+    ++backend.fails;
+    if (policy_.max_fails > 0 && backend.fails >= policy_.max_fails && now_ms >= backend.ejected_until_ms) {
+        LOG(WARNING) << "backend " << backend.addr.ip << ":" << backend.addr.port << " failed " << backend.fails
+                     << " times, eject it for " << policy_.fail_timeout_ms << "ms";
+        backend.ejected_until_ms = now_ms + policy_.fail_timeout_ms;
+        backend.fails = 0;
+    }
+}
+
+void UpstreamBalancer::StartProbe(const size_t &index, const int64_t &now_ms) {
+    auto &backend = backends_[index];
+    std::vector<socket_address_t> addrs;
+    auto ret = resolver_->Lookup(backend.addr.ip, backend.addr.port, addrs);
+    ///a backend being looked up is probed next round
+    if (ret == kLookupPending)
+        return;
+    if (ret < 0) {
+        FinishProbe(index, ret, now_ms);
+        return;
+    }
+    ///a backend is healthy if any of its addresses is, the same as for its streams
+    connect_policy_t probe_policy = connect_policy_;
+    probe_policy.timeout_ms = policy_.health_check_timeout_ms;
+    ///a probe sends nothing, with fast open it would never leave the host
+    probe_policy.fastopen = false;
+    backend.probe.reset(new HappyEyeballs(epoll_fd_, addrs, probe_policy));
+    FinishProbe(index, backend.probe->Start(now_ms), now_ms);
+}
+
+void UpstreamBalancer::FinishProbe(const size_t &index, const int32_t &ret, const int64_t &now_ms) {
+    if (ret == kRaceRunning)
+        return;
+    auto &backend = backends_[index];
+    bool ok = ret == kRaceWon;
+    if (backend.probe != nullptr)
+        out_of_fds_ |= backend.probe->TakeOutOfFds();
+    if (ok)
+        close(backend.probe->winner());
+    backend.probe.reset();
+    if (ok != backend.healthy)
+        LOG(WARNING) << "backend " << backend.addr.ip << ":" << backend.addr.port << " is "
+                     << (ok ? "healthy" : "unhealthy");
+    backend.healthy = ok;
+    if (ok)
+        backend.ejected_until_ms = 0;
+}
+
+void UpstreamBalancer::Update(const int64_t &now_ms) {
+    for (size_t i = 0; i < backends_.size(); ++i) {
+        auto &backend = backends_[i];
+        if (backend.probe != nullptr)
+            FinishProbe(i, backend.probe->Update(now_ms), now_ms);
+        ///no new connections are kept ready for a backend that can't be picked
+        if (Available(backend, now_ms)) {
+            auto failed = backend.pool->Update(now_ms);
+            for (int32_t n = 0; n < failed; ++n)
+                OnConnectResult(i, false, now_ms);
+        }
+    }
+    if (policy_.health_check_interval_ms > 0 && now_ms >= next_probe_ms_) {
+        for (size_t i = 0; i < backends_.size(); ++i) {
+            if (backends_[i].probe == nullptr)
+                StartProbe(i, now_ms);
+        }
+        next_probe_ms_ = now_ms + policy_.health_check_interval_ms;
+    }
+}
+
+bool UpstreamBalancer::TakeOutOfFds() {
+    auto out_of_fds = out_of_fds_;
+    out_of_fds_ = false;
+    for (auto &backend : backends_) {
+        if (backend.probe != nullptr)
+            out_of_fds |= backend.probe->TakeOutOfFds();
+        out_of_fds |= backend.pool->TakeOutOfFds();
+    }
+    return out_of_fds;
+}
+
+int32_t UpstreamBalancer::NextTimeoutMs(const int64_t &now_ms) const {
+    int64_t timeout = -1;
+    auto take = [&timeout](int64_t t) {
+        if (t < 0)
+            t = 0;
+        if (timeout < 0 || t < timeout)
+            timeout = t;
+    };
+    if (policy_.health_check_interval_ms > 0)
+        take(next_probe_ms_ - now_ms);
+    for (auto &backend : backends_) {
+        if (backend.probe != nullptr)
+            take(backend.probe->NextTimeoutMs(now_ms));
+        if (Available(backend, now_ms)) {
+            auto pool_timeout = backend.pool->NextTimeoutMs(now_ms);
+            if (pool_timeout >= 0)
+                take(pool_timeout);
+        } else if (backend.healthy) {
+            take(backend.ejected_until_ms - now_ms);
+        }
+    }
+    return static_cast<int32_t>(timeout);
+}
+
+}
@@ -0,0 +1,208 @@
+#include "tcptun_cipher.h"
+#include <cstring>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <glog/logging.h>
+#include "tcptun_common.h"
+#include "tcptun_frame.h"
+
+namespace tcptun {
+
+const size_t FrameCipher::kNonceLen;
+const size_t FrameCipher::kProofLen;
+const size_t FrameCipher::kTagLen;
+
+namespace {
+const size_t kKeyLen = 32;
+const size_t kIvLen = 12;
+const char kClientLabel[] = "tcptun client";
+const char kServerLabel[] = "tcptun server";
+const char kClient2ServerLabel[] = "tcptun c2s";
+const char kServer2ClientLabel[] = "tcptun s2c";
+
+int32_t hmac_sha256(const void *key, const size_t &key_len, const std::string &data, unsigned char *out) {
+    unsigned int out_len = 0;
+    if (HMAC(EVP_sha256(), key, static_cast<int>(key_len), reinterpret_cast<const unsigned char *>(data.data()),
+             data.size(), out, &out_len) == nullptr) {
+        LOG(ERROR) << "failed to call HMAC";
+        return -1;
+    }
+    return 0;
+}
+}
+
+FrameCipher::FrameCipher(const cipher_policy_t &policy)
+    : policy_(policy),
+      ready_(false),
+      seal_ctx_(EVP_CIPHER_CTX_new()),
+      open_ctx_(EVP_CIPHER_CTX_new()),
+      seal_counter_(0),
+      open_counter_(0) {
+    if (seal_ctx_ == nullptr || open_ctx_ == nullptr)
+        LOG(ERROR) << "failed to call EVP_CIPHER_CTX_new";
+}
+
+FrameCipher::~FrameCipher() {
+    EVP_CIPHER_CTX_free(seal_ctx_);
+    EVP_CIPHER_CTX_free(open_ctx_);
+}
+
+int32_t FrameCipher::ParseCipherType(const std::string &name, cipher_type_t &type) {
+    if (name == "none")
+        type = kCipherNone;
+    else if (name == "aes-256-gcm")
+        type = kCipherAes256Gcm;
+    else if (name == "chacha20-poly1305")
+        type = kCipherChacha20Poly1305;
+    else
+        return -1;
+    return 0;
+}
+
+int32_t FrameCipher::GenerateNonce(char *nonce) {
+    if (RAND_bytes(reinterpret_cast<unsigned char *>(nonce), kNonceLen) != 1) {
+        LOG(ERROR) << "failed to call RAND_bytes";
+        return -1;
+    }
+    return 0;
+}
+
+int32_t FrameCipher::ComputeProof(bool is_client, const uint32_t &features, const char *client_nonce,
+                                  const char *server_nonce, char *proof) {
+    char features_buf[4];
+    write_u32(features_buf, features);
+    std::string data(is_client ? kClientLabel : kServerLabel);
+    data.append(1, static_cast<char>(policy_.type));
+    data.append(features_buf, sizeof(features_buf));
+    data.append(client_nonce, kNonceLen);
+    if (!is_client)
+        data.append(server_nonce, kNonceLen);
+    return hmac_sha256(policy_.psk.data(), policy_.psk.size(), data, reinterpret_cast<unsigned char *>(proof));
+}
+
+bool FrameCipher::VerifyProof(bool is_client, const uint32_t &features, const char *client_nonce,
+                              const char *server_nonce, const char *proof) {
+    char expected[kProofLen];
+    if (ComputeProof(is_client, features, client_nonce, server_nonce, expected) < 0)
+        return false;
+    return CRYPTO_memcmp(expected, proof, kProofLen) == 0;
+}
+
+int32_t FrameCipher::DeriveKeys(bool is_client, const char *client_nonce, const char *server_nonce) {
+    ///HKDF-SHA256 with the two nonces as salt and psk as input key material
+    std::string salt(client_nonce, kNonceLen);
+    salt.append(server_nonce, kNonceLen);
+    unsigned char prk[32];
+    if (hmac_sha256(salt.data(), salt.size(), policy_.psk, prk) < 0)
+        return -1;
+    unsigned char c2s_key[kKeyLen];
+    unsigned char s2c_key[kKeyLen];
+    if (hmac_sha256(prk, sizeof(prk), std::string(kClient2ServerLabel) + '\x01', c2s_key) < 0)
+        return -1;
+    if (hmac_sha256(prk, sizeof(prk), std::string(kServer2ClientLabel) + '\x01', s2c_key) < 0)
+        return -1;
+    auto ret = InitContext(seal_ctx_, is_client ? c2s_key : s2c_key, true);
+    if (ret == 0)
+        ret = InitContext(open_ctx_, is_client ? s2c_key : c2s_key, false);
+    OPENSSL_cleanse(prk, sizeof(prk));
+    OPENSSL_cleanse(c2s_key, sizeof(c2s_key));
+    OPENSSL_cleanse(s2c_key, sizeof(s2c_key));
+    if (ret < 0)
+        return ret;
+    seal_counter_ = 0;
+    open_counter_ = 0;
+    ready_ = true;
+    return 0;
+}
+
+int32_t FrameCipher::InitContext(EVP_CIPHER_CTX *ctx, const unsigned char *key, bool encrypt) {
+    const EVP_CIPHER *cipher = policy_.type == kCipherAes256Gcm ? EVP_aes_256_gcm() : EVP_chacha20_poly1305();
+    ///the key schedule is computed once here, every frame later only sets its iv
+    if (EVP_CipherInit_ex(ctx, cipher, nullptr, nullptr, nullptr, encrypt ? 1 : 0) != 1 ||
+        EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_IVLEN, kIvLen, nullptr) != 1 ||
+        EVP_CipherInit_ex(ctx, nullptr, nullptr, key, nullptr, encrypt ? 1 : 0) != 1) {
+        LOG(ERROR) << "failed to init cipher context";
+        return -1;
+    }
+    return 0;
+}
+
+void FrameCipher::MakeIv(uint64_t counter, unsigned char *iv) {
+    memset(iv, 0, kIvLen - 8);
+    write_u32(reinterpret_cast<char *>(iv + kIvLen - 8), static_cast<uint32_t>(counter >> 32));
+    write_u32(reinterpret_cast<char *>(iv + kIvLen - 4), static_cast<uint32_t>(counter));
+}
+
+int32_t FrameCipher::SealFrames(char *buf, const size_t &len) {
+    if (!ready_)
+        return -1;
+    unsigned char iv[kIvLen];
+    int32_t frames = 0;
+    size_t offset = 0;
+    frame_header_t header = {0};
+    while (offset + kFrameHeaderLen <= len) {
+        read_frame_header(buf + offset, header);
+        auto aad = reinterpret_cast<unsigned char *>(buf + offset);
+        auto payload = aad + kFrameHeaderLen;
+        if (header.length < kTagLen || offset + kFrameHeaderLen + header.length > len) {
+            LOG(ERROR) << "invalid frame to seal length:" << header.length;
+            return -2;
+        }
+        int plain_len = header.length - kTagLen;
+        int out_len = 0;
+        MakeIv(seal_counter_++, iv);
+        if (EVP_EncryptInit_ex(seal_ctx_, nullptr, nullptr, nullptr, iv) != 1 ||
+            EVP_EncryptUpdate(seal_ctx_, nullptr, &out_len, aad, kFrameHeaderLen) != 1 ||
+            EVP_EncryptUpdate(seal_ctx_, payload, &out_len, payload, plain_len) != 1 ||
+            EVP_EncryptFinal_ex(seal_ctx_, payload + out_len, &out_len) != 1 ||
+            EVP_CIPHER_CTX_ctrl(seal_ctx_, EVP_CTRL_AEAD_GET_TAG, kTagLen, payload + plain_len) != 1) {
+            LOG(ERROR) << "failed to seal frame conn_id:" << header.conn_id;
+            return -3;
+        }
+        offset += kFrameHeaderLen + header.length;
+        ++frames;
+    }
+    return frames;
+}
+
+int32_t FrameCipher::OpenFrames(char *buf, const size_t &len) {
+    if (!ready_)
+        return -1;
+    unsigned char iv[kIvLen];
+    int32_t frames = 0;
+    size_t offset = 0;
+    frame_header_t header = {0};
+    while (offset + kFrameHeaderLen <= len) {
+        read_frame_header(buf + offset, header);
+        auto aad = reinterpret_cast<unsigned char *>(buf + offset);
+        auto payload = aad + kFrameHeaderLen;
+        if (header.length < kTagLen || offset + kFrameHeaderLen + header.length > len) {
+            LOG(ERROR) << "invalid frame to open length:" << header.length;
+            return -2;
+        }
+        int cipher_len = header.length - kTagLen;
+        int out_len = 0;
+        MakeIv(open_counter_++, iv);
+        if (EVP_DecryptInit_ex(open_ctx_, nullptr, nullptr, nullptr, iv) != 1 ||
+            EVP_CIPHER_CTX_ctrl(open_ctx_, EVP_CTRL_AEAD_SET_TAG, kTagLen, payload + cipher_len) != 1 ||
+            EVP_DecryptUpdate(open_ctx_, nullptr, &out_len, aad, kFrameHeaderLen) != 1 ||
+            EVP_DecryptUpdate(open_ctx_, payload, &out_len, payload, cipher_len) != 1 ||
+            EVP_DecryptFinal_ex(open_ctx_, payload + out_len, &out_len) != 1) {
+            LOG(ERROR) << "frame failed authentication conn_id:" << header.conn_id;
+            return -3;
+        }
+        offset += kFrameHeaderLen + header.length;
+        ++frames;
+    }
+    return frames;
+}
+
+void FrameCipher::Reset() {
+    ready_ = false;
+    seal_counter_ = 0;
+    open_counter_ = 0;
+}
+
+}
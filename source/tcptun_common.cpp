@@ -6,7 +6,16 @@
 #include <sys/epoll.h>
 #include <glog/logging.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <sys/stat.h>
+#include <sys/signalfd.h>
+#include <sched.h>
+#include <signal.h>
+#include <cstring>
+#include <cstdlib>
 #include "tcptun_common.h"
 #include <unistd.h>
 #include <fcntl.h>
@@ -25,6 +34,51 @@ int32_t AddEvent2Epoll(const int32_t &epoll_fd, const int32_t &fd, const uint32_
     return 0;
 }
 
+int32_t ModEvent2Epoll(const int32_t &epoll_fd, const int32_t &fd, const uint32_t &events) {
+    struct epoll_event ev = {0};
+    ev.events = events;
+    ev.data.fd = fd;
+    auto ret = epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+    if (ret != 0) {
+        LOG(INFO) << "modify fd:" << fd << " in epoll_fd:" << epoll_fd << " failed, error:" << strerror(errno);
+        return -1;
+    }
+    return 0;
+}
+
+int32_t AddEvent2Epoll(const int32_t &epoll_fd, const int32_t &fd, const uint32_t &events, const uint64_t &data) {
+    struct epoll_event ev = {0};
+    ev.events = events;
+    ev.data.u64 = data;
+    auto ret = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    if (ret != 0) {
+        LOG(INFO) << "add fd:" << fd << " to epoll_fd:" << epoll_fd << " failed, error:" << strerror(errno);
+        return -1;
+    }
+    return 0;
+}
+
+int32_t ModEvent2Epoll(const int32_t &epoll_fd, const int32_t &fd, const uint32_t &events, const uint64_t &data) {
+    struct epoll_event ev = {0};
+    ev.events = events;
+    ev.data.u64 = data;
+    auto ret = epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+    if (ret != 0) {
+        LOG(INFO) << "modify fd:" << fd << " in epoll_fd:" << epoll_fd << " failed, error:" << strerror(errno);
+        return -1;
+    }
+    return 0;
+}
+
+int32_t DelEvent2Epoll(const int32_t &epoll_fd, const int32_t &fd) {
+    auto ret = epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    if (ret != 0) {
+        LOG(INFO) << "delete fd:" << fd << " from epoll_fd:" << epoll_fd << " failed, error:" << strerror(errno);
+        return -1;
+    }
+    return 0;
+}
+
 int set_non_blocking(const int &fd) {
     int opts = -1;
     opts = fcntl(fd, F_GETFL);
@@ -40,17 +94,180 @@ int set_non_blocking(const int &fd) {
                    << " error:" << strerror(errno);
         return -1;
     }
+    return 0;
+}
+
+int set_reset_on_close(const int32_t &fd) {
+    struct linger value;
+    value.l_onoff = 1;
+    value.l_linger = 0;
+    if (setsockopt(fd, SOL_SOCKET, SO_LINGER, &value, sizeof(value)) < 0) {
+        LOG(WARNING) << "failed to call setsockopt SO_LINGER fd:" << fd << " error:" << strerror(errno);
+        return -1;
+    }
+    return 0;
 }
 
-int new_listen_socket(const std::string &ip, const size_t &port, int &fd) {
-    struct sockaddr_in local_listen_addr = {0};
-    local_listen_addr.sin_family = AF_INET;
-    local_listen_addr.sin_port = htons(port);
-    if(inet_pton(local_listen_addr.sin_family, ip.c_str(), &local_listen_addr.sin_addr) <0){
-        LOG(ERROR)<<"failed to call inet_pton error:" <<strerror(errno);
+namespace {
+const char kUnixAddressPrefix[] = "unix:";
+
+///address of an ipv4 or ipv6 literal, hostnames are refused since resolving them would block
+int resolve_ip_port(const std::string &ip, const size_t &port, const int32_t &socktype,
+                    struct sockaddr_storage &addr, socklen_t &addr_len) {
+    std::string host = ip;
+    if (host.size() > 2 && host.front() == '[' && host.back() == ']')
+        host = host.substr(1, host.size() - 2);
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = socktype;
+    hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+    struct addrinfo *result = nullptr;
+    auto ret = getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &result);
+    if (ret != 0 || result == nullptr) {
+        LOG(ERROR) << "failed to call getaddrinfo ip:" << ip << " error:" << gai_strerror(ret);
         return -1;
     }
-    fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    memset(&addr, 0, sizeof(addr));
+    memcpy(&addr, result->ai_addr, result->ai_addrlen);
+    addr_len = result->ai_addrlen;
+    freeaddrinfo(result);
+    return 0;
+}
+
+///an ipv6 listener also takes ipv4 clients as ::ffff:a.b.c.d unless it is v6only
+int set_dual_stack(const int &fd, const struct sockaddr_storage &addr, const bool &dual_stack) {
+    if (addr.ss_family != AF_INET6)
+        return 0;
+    int v6only = dual_stack ? 0 : 1;
+    if (setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only)) == -1) {
+        LOG(ERROR) << "failed to call setsockopt IPV6_V6ONLY error:" << strerror(errno);
+        return -1;
+    }
+    return 0;
+}
+
+///the path of addr follows "unix:"
+int fill_unix_address(const std::string &addr, struct sockaddr_un &unix_addr) {
+    auto path = addr.substr(sizeof(kUnixAddressPrefix) - 1);
+    if (path.empty() || path.size() >= sizeof(unix_addr.sun_path)) {
+        LOG(ERROR) << "invalid unix socket path:" << path;
+        return -1;
+    }
+    memset(&unix_addr, 0, sizeof(unix_addr));
+    unix_addr.sun_family = AF_UNIX;
+    memcpy(unix_addr.sun_path, path.data(), path.size());
+    return 0;
+}
+
+int new_unix_listen_socket(const std::string &addr, int &fd) {
+    struct sockaddr_un unix_addr;
+    if (fill_unix_address(addr, unix_addr) < 0)
+        return -1;
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        LOG(ERROR) << "create new unix socket failed" << strerror(errno);
+        return -1;
+    }
+    ///a socket file left by a dead process makes bind fail, remove it unless someone still listens on it
+    struct stat st;
+    if (stat(unix_addr.sun_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        int probe_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (probe_fd >= 0 && connect(probe_fd, (struct sockaddr *) &unix_addr, sizeof(unix_addr)) == 0) {
+            LOG(ERROR) << "unix socket path:" << unix_addr.sun_path << " is in use";
+            close(probe_fd);
+            close(fd);
+            return -1;
+        }
+        if (probe_fd >= 0)
+            close(probe_fd);
+        unlink(unix_addr.sun_path);
+    }
+    if (bind(fd, (struct sockaddr *) &unix_addr, sizeof(unix_addr)) == -1) {
+        LOG(ERROR) << "unix socket bind error path:" << unix_addr.sun_path << " error:" << strerror(errno);
+        close(fd);
+        return -1;
+    }
+    if (listen(fd, 5) < 0) {
+        LOG(ERROR) << "failed to call listen error:" << strerror(errno);
+        close(fd);
+        return -1;
+    }
+    LOG(INFO) << "local unix socket listen_fd:" << fd;
+    return 0;
+}
+
+int new_stream_socket(const socket_address_t &address, const int32_t &flags, const bool &fastopen, int &fd) {
+    auto family = address.addr.ss_family;
+    fd = socket(family, SOCK_STREAM | flags, family == AF_UNIX ? 0 : IPPROTO_TCP);
+    if (fd < 0) {
+        ///the caller tells EMFILE from other errors
+        auto error = errno;
+        LOG(ERROR) << "create new socket failed" << strerror(error);
+        errno = error;
+        return -1;
+    }
+    if (fastopen && family != AF_UNIX) {
+        int on = 1;
+        static bool warned = false;
+        ///linux 4.11 or later, an older kernel just does a plain connect
+        if (setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &on, sizeof(on)) < 0 && !warned) {
+            LOG(WARNING) << "failed to call setsockopt TCP_FASTOPEN_CONNECT error:" << strerror(errno)
+                         << ", connect without fast open";
+            warned = true;
+        }
+    }
+    return 0;
+}
+}
+
+bool is_unix_address(const std::string &addr) {
+    return addr.compare(0, sizeof(kUnixAddressPrefix) - 1, kUnixAddressPrefix) == 0;
+}
+
+int resolve_literal_address(const std::string &ip, const size_t &port, socket_address_t &address) {
+    if (!is_unix_address(ip))
+        return resolve_ip_port(ip, port, SOCK_STREAM, address.addr, address.len);
+    struct sockaddr_un unix_addr;
+    if (fill_unix_address(ip, unix_addr) < 0)
+        return -1;
+    memset(&address.addr, 0, sizeof(address.addr));
+    memcpy(&address.addr, &unix_addr, sizeof(unix_addr));
+    address.len = sizeof(unix_addr);
+    return 0;
+}
+
+std::string address_to_string(const socket_address_t &address) {
+    char text[INET6_ADDRSTRLEN] = {0};
+    switch (address.addr.ss_family) {
+        case AF_INET: {
+            auto in = reinterpret_cast<const struct sockaddr_in *>(&address.addr);
+            inet_ntop(AF_INET, &in->sin_addr, text, sizeof(text));
+            return std::string(text) + ":" + std::to_string(ntohs(in->sin_port));
+        }
+        case AF_INET6: {
+            auto in6 = reinterpret_cast<const struct sockaddr_in6 *>(&address.addr);
+            inet_ntop(AF_INET6, &in6->sin6_addr, text, sizeof(text));
+            return "[" + std::string(text) + "]:" + std::to_string(ntohs(in6->sin6_port));
+        }
+        case AF_UNIX: {
+            auto un = reinterpret_cast<const struct sockaddr_un *>(&address.addr);
+            return kUnixAddressPrefix + std::string(un->sun_path);
+        }
+        default:
+            return "unknown";
+    }
+}
+
+int new_listen_socket(const std::string &ip, const size_t &port, const bool &dual_stack, int &fd,
+                      const int32_t &incoming_cpu) {
+    if (is_unix_address(ip))
+        return new_unix_listen_socket(ip, fd);
+    struct sockaddr_storage local_listen_addr;
+    socklen_t slen = 0;
+    if (resolve_ip_port(ip, port, SOCK_STREAM, local_listen_addr, slen) < 0)
+        return -1;
+    fd = socket(local_listen_addr.ss_family, SOCK_STREAM, IPPROTO_TCP);
     if (fd == -1) {
         LOG(ERROR) << "create new socket failed" << strerror(errno);
         return -1;
@@ -61,7 +278,17 @@ int new_listen_socket(const std::string &ip, const size_t &port, int &fd) {
         close(fd);
         return -1;
     }
-    socklen_t slen = sizeof(local_listen_addr);
+    if (set_dual_stack(fd, local_listen_addr, dual_stack) < 0) {
+        close(fd);
+        return -1;
+    }
+    if (incoming_cpu >= 0 &&
+        (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) == -1 ||
+         setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &incoming_cpu, sizeof(incoming_cpu)) == -1)) {
+        LOG(ERROR) << "failed to steer the connections of cpu:" << incoming_cpu << " error:" << strerror(errno);
+        close(fd);
+        return -1;
+    }
     if (bind(fd, (struct sockaddr *) &local_listen_addr, slen) == -1) {
         LOG(ERROR) << "socket bind error port:" << port
                    << " error:" << strerror(errno);
@@ -77,30 +304,152 @@ int new_listen_socket(const std::string &ip, const size_t &port, int &fd) {
     return 0;
 }
 
-int new_connected_socket(const std::string &remote_ip,
-                         const size_t &remote_port, int &fd) {
-    struct sockaddr_in remote_addr_in = {0};
-    socklen_t slen = sizeof(remote_addr_in);
-    remote_addr_in.sin_family = AF_INET;
-    remote_addr_in.sin_port = htons(remote_port);
-    if(inet_pton(remote_addr_in.sin_family, remote_ip.c_str(), &remote_addr_in.sin_addr) <0){
-        LOG(ERROR)<<"failed to call inet_pton error:" <<strerror(errno);
+int set_listen_fastopen(const int &fd) {
+    ///length of the queue of fast open requests not accepted yet
+    int queue_len = 256;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &queue_len, sizeof(queue_len)) < 0) {
+        LOG(WARNING) << "failed to call setsockopt TCP_FASTOPEN error:" << strerror(errno);
         return -1;
     }
-    fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (fd < 0) {
-        LOG(ERROR) << "create new socket failed" << strerror(errno);
+    return 0;
+}
+
+int new_connected_socket(const std::string &remote_ip,
+                         const size_t &remote_port, const bool &fastopen, int &fd) {
+    socket_address_t remote_addr;
+    if (resolve_literal_address(remote_ip, remote_port, remote_addr) < 0)
+        return -1;
+    return new_connected_socket(remote_addr, fastopen, fd);
+}
+
+int new_connected_socket(const socket_address_t &address, const bool &fastopen, int &fd) {
+    if (new_stream_socket(address, 0, fastopen, fd) < 0)
         return -1;
-    }
     ///blocking connect, if network is bad, may block for a pretty long time
-    int ret = connect(fd, (struct sockaddr *) &remote_addr_in, slen);
+    int ret = connect(fd, (const struct sockaddr *) &address.addr, address.len);
     if (ret < 0) {
-        LOG(ERROR) << "failed to establish connection to remote, error:"
+        LOG(ERROR) << "failed to establish connection to " << address_to_string(address) << ", error:"
                    << strerror(errno);
         close(fd);
         return -1;
     }
-    LOG(INFO) << "create new remote connection tcp_fd:" << fd;
+    LOG(INFO) << "create new remote connection fd:" << fd;
+    return 0;
+}
+
+int new_connecting_socket(const std::string &remote_ip, const size_t &remote_port, const bool &fastopen, int &fd) {
+    socket_address_t remote_addr;
+    if (resolve_literal_address(remote_ip, remote_port, remote_addr) < 0)
+        return -1;
+    return new_connecting_socket(remote_addr, fastopen, fd);
+}
+
+int new_connecting_socket(const socket_address_t &address, const bool &fastopen, int &fd) {
+    if (new_stream_socket(address, SOCK_NONBLOCK, fastopen, fd) < 0)
+        return -1;
+    ///connect of unix socket never waits, EAGAIN means the backlog of the listener is full
+    int ret = connect(fd, (const struct sockaddr *) &address.addr, address.len);
+    if (ret < 0 && errno != EINPROGRESS) {
+        LOG(ERROR) << "failed to call connect to " << address_to_string(address) << ", error:" << strerror(errno);
+        close(fd);
+        return -1;
+    }
+    return 0;
+}
+
+namespace {
+///a burst of a whole arq window must not overflow the kernel buffers
+const int32_t kUdpSocketBufLen = 4 * 1024 * 1024;
+
+int new_udp_socket(const int32_t &family, int &fd) {
+    fd = socket(family, SOCK_DGRAM, IPPROTO_UDP);
+    if (fd < 0) {
+        LOG(ERROR) << "create new udp socket failed" << strerror(errno);
+        return -1;
+    }
+    int32_t buf_len = kUdpSocketBufLen;
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buf_len, sizeof(buf_len)) < 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &buf_len, sizeof(buf_len)) < 0)
+        LOG(WARNING) << "failed to call setsockopt udp buffer error:" << strerror(errno);
+    return 0;
+}
+}
+
+int new_bound_udp_socket(const std::string &ip, const size_t &port, const bool &dual_stack, int &fd) {
+    struct sockaddr_storage local_addr;
+    socklen_t slen = 0;
+    if (resolve_ip_port(ip, port, SOCK_DGRAM, local_addr, slen) < 0)
+        return -1;
+    if (new_udp_socket(local_addr.ss_family, fd) < 0)
+        return -1;
+    if (set_dual_stack(fd, local_addr, dual_stack) < 0) {
+        close(fd);
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr *) &local_addr, slen) == -1) {
+        LOG(ERROR) << "udp socket bind error port:" << port << " error:" << strerror(errno);
+        close(fd);
+        return -1;
+    }
+    LOG(INFO) << "local udp socket fd:" << fd;
+    return 0;
+}
+
+int new_connected_udp_socket(const std::string &remote_ip, const size_t &remote_port, int &fd) {
+    struct sockaddr_storage remote_addr;
+    socklen_t slen = 0;
+    if (resolve_ip_port(remote_ip, remote_port, SOCK_DGRAM, remote_addr, slen) < 0)
+        return -1;
+    if (new_udp_socket(remote_addr.ss_family, fd) < 0)
+        return -1;
+    ///connect of udp only fixes the peer address, nothing is sent
+    if (connect(fd, (struct sockaddr *) &remote_addr, slen) < 0) {
+        LOG(ERROR) << "failed to call connect for udp error:" << strerror(errno);
+        close(fd);
+        return -1;
+    }
+    LOG(INFO) << "create new remote udp socket fd:" << fd;
+    return 0;
+}
+
+int new_signal_fd(const std::vector<int> &signals, int &fd) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    for (auto &sig : signals)
+        sigaddset(&mask, sig);
+    if (sigprocmask(SIG_BLOCK, &mask, nullptr) < 0) {
+        LOG(ERROR) << "failed to call sigprocmask error:" << strerror(errno);
+        return -1;
+    }
+    fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd < 0) {
+        LOG(ERROR) << "failed to call signalfd error:" << strerror(errno);
+        return -1;
+    }
+    return 0;
+}
+
+int parse_host_port(const std::string &addr, std::string &host, int32_t &port) {
+    auto colon = addr.rfind(':');
+    if (colon == std::string::npos || colon == 0 || colon + 1 == addr.size())
+        return -1;
+    host = addr.substr(0, colon);
+    if (host.front() == '[') {
+        if (host.size() < 3 || host.back() != ']')
+            return -1;
+        host = host.substr(1, host.size() - 2);
+    } else if (host.find(':') != std::string::npos) {
+        ///an ipv6 host without brackets can't be told from its port
+        return -1;
+    }
+    port = 0;
+    for (size_t i = colon + 1; i < addr.size(); ++i) {
+        if (addr[i] < '0' || addr[i] > '9' || port > 65535)
+            return -1;
+        port = port * 10 + (addr[i] - '0');
+    }
+    if (port < 1 || port > 65535)
+        return -1;
     return 0;
 }
 
@@ -120,9 +469,56 @@ uint32_t read_u32(const char *p) {
     return res;
 }
 
+void write_u16(char *p, uint16_t l) {
+    *(unsigned char *) (p + 1) = (unsigned char) ((l >> 0) & 0xff);
+    *(unsigned char *) (p + 0) = (unsigned char) ((l >> 8) & 0xff);
+}
+
+uint16_t read_u16(const char *p) {
+    uint16_t res;
+    res = *(const unsigned char *) (p + 0);
+    res = *(const unsigned char *) (p + 1) + (res << 8);
+    return res;
+}
+
 int64_t getnowtime_ms() {
     struct timeval tv = {0};
     gettimeofday(&tv, nullptr);
     return 1000 * tv.tv_sec + tv.tv_usec / 1000;
 }
+
+int64_t getnowtime_us() {
+    struct timeval tv = {0};
+    gettimeofday(&tv, nullptr);
+    return 1000000 * static_cast<int64_t>(tv.tv_sec) + tv.tv_usec;
+}
+
+int parse_cpu_list(const std::string &list, std::vector<int32_t> &cpus) {
+    cpus.clear();
+    size_t start = 0;
+    while (start <= list.size()) {
+        auto end = list.find(',', start);
+        if (end == std::string::npos)
+            end = list.size();
+        auto range = list.substr(start, end - start);
+        auto dash = range.find('-');
+        char *rest = nullptr;
+        auto first = strtol(range.c_str(), &rest, 10);
+        auto last = first;
+        if (rest == range.c_str() || (dash == std::string::npos ? *rest != '\0' : rest != range.c_str() + dash))
+            return -1;
+        if (dash != std::string::npos) {
+            auto second = range.c_str() + dash + 1;
+            last = strtol(second, &rest, 10);
+            if (rest == second || *rest != '\0')
+                return -1;
+        }
+        if (first < 0 || last < first || last >= CPU_SETSIZE)
+            return -1;
+        for (auto cpu = first; cpu <= last; ++cpu)
+            cpus.push_back(static_cast<int32_t>(cpu));
+        start = end + 1;
+    }
+    return cpus.empty() ? -1 : 0;
+}
 }
@@ -0,0 +1,79 @@
+#include "tcptun_compressor.h"
+#include <algorithm>
+#include <glog/logging.h>
+#include "tcptun_lz4.h"
+
+namespace tcptun {
+
+namespace {
+///payloads smaller than this hardly shrink and are never compressed
+const size_t kMinCompressLen = 64;
+///a frame is counted as compressible only if it shrinks to 7/8 or smaller
+const size_t kGainNumerator = 7;
+const size_t kGainDenominator = 8;
+///stream is bypassed after this number of consecutive misses
+const uint32_t kMaxMisses = 4;
+const uint32_t kMinBypassFrames = 64;
+const uint32_t kMaxBypassFrames = 4096;
+}
+
+FrameCompressor::FrameCompressor(const compress_policy_t &policy)
+    : policy_(policy), lz4_state_(lz4_state_len()) {
+    if (policy_.acceleration < 1)
+        policy_.acceleration = 1;
+}
+
+int32_t FrameCompressor::Compress(const uint32_t &conn_id,
+                                  const char *src,
+                                  const size_t &len,
+                                  char *dst,
+                                  const size_t &dst_len) {
+    if (!policy_.enable || len < kMinCompressLen)
+        return 0;
+    auto &sample = connid2sample_[conn_id];
+    if (sample.bypass_frames > 0) {
+        --sample.bypass_frames;
+        return 0;
+    }
+    auto ret = lz4_compress(lz4_state_.data(), src, static_cast<int32_t>(len), dst, static_cast<int32_t>(dst_len),
+                            policy_.acceleration);
+    if (ret <= 0) {
+        LOG(ERROR) << "failed to call lz4_compress conn_id:" << conn_id << " len:" << len;
+        return -1;
+    }
+    if (static_cast<size_t>(ret) * kGainDenominator > len * kGainNumerator) {
+        if (++sample.misses >= kMaxMisses) {
+            ///stream looks incompressible, stop wasting cpu on it for a while
+            sample.backoff = sample.backoff == 0 ? kMinBypassFrames : std::min(sample.backoff * 2, kMaxBypassFrames);
+            sample.bypass_frames = sample.backoff;
+            sample.misses = 0;
+        }
+        return 0;
+    }
+    sample.misses = 0;
+    sample.backoff = 0;
+    return ret;
+}
+
+int32_t FrameCompressor::Decompress(const char *src, const size_t &len, char *dst, const size_t &dst_len) {
+    auto ret = lz4_decompress(src, static_cast<int32_t>(len), dst, static_cast<int32_t>(dst_len));
+    if (ret < 0) {
+        LOG(ERROR) << "failed to call lz4_decompress len:" << len << " ret:" << ret;
+        return -1;
+    }
+    return ret;
+}
+
+void FrameCompressor::RemoveStream(const uint32_t &conn_id) {
+    connid2sample_.erase(conn_id);
+}
+
+void FrameCompressor::Clear() {
+    connid2sample_.clear();
+}
+
+size_t FrameCompressor::CompressBound(const size_t &len) {
+    return static_cast<size_t>(lz4_compress_bound(static_cast<int32_t>(len)));
+}
+
+}
@@ -3,11 +3,11 @@
 //
 
 #include <cstring>
+#include <algorithm>
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <netinet/in.h>
-#include <netinet/tcp.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
 #include <unistd.h>
@@ -15,34 +15,203 @@
 #include "random_generator.h"
 #include "tcptun_common.h"
 #include "tcptun_connection_manager.h"
+#include "tcptun_arq_transport.h"
 
 namespace tcptun {
 
-ConnectionManager::ConnectionManager(const int32_t &local_listen_fd,
+namespace {
+///features(4) | nonce | proof
+const size_t kHelloAuthLen = 4 + FrameCipher::kNonceLen + FrameCipher::kProofLen;
+const size_t kPeerSendCompactLen = 64 * 1024;
+///idle timeouts are checked every tick, a turn of the wheel is a few minutes
+const int32_t kIdleTickMs = 250;
+const size_t kIdleWheelSlots = 1024;
+///share of the streams reset at once when the process is out of fds
+const size_t kEvictFraction = 64;
+///a listener out of fds is paused this long first, then twice longer every time up to the max
+const int32_t kAcceptBackoffMs = 100;
+const int32_t kMaxAcceptBackoffMs = 3200;
+///connections of the backlog closed at most at once with the reserve fd
+const int32_t kMaxShedConnections = 128;
+///streams are allocated this many at a time
+const size_t kStreamPoolChunk = 256;
+///a new peer link is closed if it has not sent a whole hello in this time
+const int32_t kPendingLinkTimeoutMs = 10000;
+///new peer links waiting for their hello at most, the oldest one is closed for a new one
+const size_t kMaxPendingLinks = 64;
+///client nonces remembered against replayed hellos
+const size_t kMaxSeenNonces = 4096;
+
+int32_t open_reserve_fd() {
+    return open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+}
+
+ConnectionManager::ConnectionManager(const int32_t &epoll_fd,
+                                     const int32_t &local_listen_fd,
                                      const int32_t &peer_connected_fd,
-                                     ip_port_t ip_port)
-    : local_listen_fd_(local_listen_fd),
-      peer_connected_fd_(peer_connected_fd),
+                                     ip_port_t ip_port,
+                                     const transport_policy_t &transport_policy,
+                                     const batch_policy_t &batch_policy,
+                                     const compress_policy_t &compress_policy,
+                                     const cipher_policy_t &cipher_policy,
+                                     const balance_policy_t &balance_policy,
+                                     const upstream_pool_policy_t &upstream_pool_policy,
+                                     const resolver_policy_t &resolver_policy,
+                                     const connect_policy_t &connect_policy,
+                                     const stream_policy_t &stream_policy,
+                                     const rate_policy_t &rate_policy,
+                                     const priority_policy_t &priority_policy,
+                                     const memory_policy_t &memory_policy,
+                                     MemoryBudget *memory_budget)
+    : epoll_fd_(epoll_fd),
+      local_listen_fd_(local_listen_fd),
+      is_client_(peer_connected_fd != 0),
+      transport_type_(transport_policy.type),
+      peer_recv_buf_(kFrameHeaderLen + kMaxFramePayloadLen),
+      peer_recv_len_(0),
+      peer_send_offset_(0),
+      peer_sealed_offset_(0),
+      peer_want_write_(false),
+      batch_policy_(batch_policy),
+      peer_corked_(false),
+      peer_cork_deadline_ms_(0),
+      peer_rtt_us_(0),
+      local_features_((compress_policy.enable ? kFeatureCompress : 0) |
+                      (cipher_policy.type != kCipherNone ? kFeatureEncrypt : 0)),
+      peer_features_(0),
+      hello_sent_(false),
+      compressor_(compress_policy),
+      compress_buf_(kFrameHeaderLen + FrameCompressor::CompressBound(sizeof(recv_buf))),
+      cipher_(cipher_policy),
+      client_nonce_(),
+      resolver_(epoll_fd, resolver_policy),
+      balancer_(epoll_fd, balance_policy, upstream_pool_policy, connect_policy, &resolver_),
+      stream_policy_(stream_policy),
+      stream_pool_(kStreamPoolChunk),
+      connect_policy_(connect_policy),
+      draining_(false),
+      drain_serves_streams_(false),
+      memory_policy_(memory_policy),
+      memory_budget_(memory_budget),
+      session_memory_(0),
+      peer_read_paused_(false),
+      outside_read_paused_(false),
+      memory_stats_(),
+      rate_policy_(rate_policy),
+      session_rate_(rate_policy.session_kbps, rate_policy.burst_ms),
+      next_unthrottle_ms_(-1),
+      priority_policy_(priority_policy),
+      scheduler_(priority_policy),
+      backlogged_streams_(0),
+      idle_wheel_(kIdleTickMs, kIdleWheelSlots),
+      reserve_fd_(open_reserve_fd()),
+      accept_backoff_ms_(kAcceptBackoffMs),
+      connects_out_of_fds_(false),
       remote_server_info_(std::move(ip_port)) {
-    auto ret = set_non_blocking(local_listen_fd_);
-    if (ret < 0)
-        LOG(ERROR) << "failed to call set_non_blocking to local_listen_fd:" << local_listen_fd;
-    if (peer_connected_fd != 0) {
-        ret = set_non_blocking(peer_connected_fd);
+    if (AddListener(local_listen_fd_, stream_policy_.frontend, stream_policy_.target, stream_policy_.rate_kbps,
+                    stream_policy_.priority, stream_policy_.weight, stream_policy_.idle_timeout_ms) < 0)
+        LOG(ERROR) << "failed to add local_listen_fd:" << local_listen_fd;
+    for (auto &rule : stream_policy_.allow_destinations) {
+        if (allowlist_.Add(rule) < 0)
+            LOG(ERROR) << "failed to add destination rule:" << rule << ", it is ignored";
+    }
+    if (transport_type_ == kTransportUdp) {
+        ///one udp socket carries every session of tcptun server, there is nothing to accept
+        auto arq = new ArqTransport(is_client_ ? peer_connected_fd : local_listen_fd, is_client_, transport_policy);
+        ///like a new peer link of tcp, a new session takes over only once its hello is authenticated
+        if (!is_client_)
+            arq->SetSessionCheck([this](const char *data, const size_t &len) { return CheckPeerHello(data, len); });
+        peer_.reset(arq);
+    } else if (peer_connected_fd != 0) {
+        peer_.reset(new TcpTransport(epoll_fd_, peer_connected_fd));
+    }
+    if (peer_ != nullptr)
+        peer_->SetUnsentLimit(priority_policy_.link_queue);
+    if (reserve_fd_ < 0)
+        LOG(WARNING) << "failed to open the reserve fd, error:" << strerror(errno);
+}
+
+ConnectionManager::~ConnectionManager() {
+    memory_budget_->Charge(-session_memory_);
+    for (auto &ele : pending_links_)
+        close(ele.first);
+    if (reserve_fd_ >= 0)
+        close(reserve_fd_);
+}
+
+int32_t ConnectionManager::AddListener(const int32_t &listen_fd, const frontend_type_t &frontend,
+                                       const std::string &target, const int32_t &rate_kbps,
+                                       const int32_t &priority, const int32_t &weight,
+                                       const int32_t &idle_timeout_ms) {
+    ///a blocking accept would stall the loop, and shedding connections out of fds relies on EAGAIN
+    if (set_non_blocking(listen_fd) < 0) {
+        LOG(ERROR) << "failed to call set_non_blocking to listen_fd:" << listen_fd;
+        return -1;
+    }
+    listener_t listener;
+    listener.frontend = frontend;
+    listener.target = target;
+    listener.rate = TokenBucket(rate_kbps, rate_policy_.burst_ms);
+    listener.priority = priority;
+    listener.weight = weight;
+    listener.idle_timeout_ms = idle_timeout_ms;
+    listeners_[listen_fd] = listener;
+    return 0;
+}
+
+void ConnectionManager::RemoveListener(const int32_t &listen_fd) {
+    listeners_.erase(listen_fd);
+    paused_listeners_.erase(listen_fd);
+}
+
+void ConnectionManager::HandleEvents(const epoll_data_t &data, const uint32_t &events) {
+    ///outside connections of streams are the most of the events, they point to their stream
+    auto stream = event_stream(data);
+    if (stream != nullptr) {
+        HandleStreamEvents(stream, events);
+        return;
+    }
+    ///the udp socket of tcptun server is both the listener and the peer link
+    if (data.fd == PeerFd()) {
+        auto ret = HandlePeerEvents(events);
         if (ret < 0)
-            LOG(ERROR) << "failed to call set_non_blocking to peer_connected_fd:" << peer_connected_fd;
+            LOG(ERROR) << "failed to call HandlePeerEvents ret:" << ret;
+    } else if (pending_links_.count(data.fd)) {
+        HandlePendingLinkEvents(data.fd, events);
+    } else if (IsListener(data.fd)) {
+        if (HandleNewConnection(is_client_, data.fd) < 0)
+            LOG(ERROR) << "failed to call HandleNewConnection listen_fd:" << data.fd;
+    } else {
+        HandleOutsideEvents(data.fd, events);
     }
 }
 
-int32_t ConnectionManager::HandleNewConnection(bool is_client) {
+int32_t ConnectionManager::HandleNewConnection(bool is_client, const int32_t &listen_fd) {
     if (is_client) {
-        auto new_conn_fd = accept(local_listen_fd_, nullptr, nullptr);
+        auto it = listeners_.find(listen_fd);
+        if (it == listeners_.end()) {
+            LOG(WARNING) << "listen_fd is not recorded:" << listen_fd;
+            return -3;
+        }
+        auto new_conn_fd = accept(listen_fd, nullptr, nullptr);
         if (new_conn_fd < 0) {
             if (errno == EAGAIN || errno == EWOULDBLOCK)
                 return 0;
+            if (errno == EMFILE || errno == ENFILE) {
+                HandleAcceptExhausted(listen_fd);
+                return 0;
+            }
             LOG(ERROR) << "tcptun client failed to call accept, error:" << strerror(errno);
             return -1;
         }
+        accept_backoff_ms_ = kAcceptBackoffMs;
+        if (outside_read_paused_) {
+            LOG(WARNING) << "memory over budget, refuse new connection";
+            ++memory_stats_.refused_streams;
+            close(new_conn_fd);
+            return 0;
+        }
         uint32_t conn_id = 0;
         while (true) {
             conn_id = 0;
@@ -51,134 +220,1416 @@ int32_t ConnectionManager::HandleNewConnection(bool is_client) {
                 LOG(ERROR) << "failed to call GetRandomNumberNonZero ret" << ret;
                 return -2;
             }
-            if (!connid2outside_connectionfd_.count(conn_id))
+            if (!streams_.count(conn_id))
                 break;
         }
-        connid2outside_connectionfd_[conn_id] = new_conn_fd;
-        outside_connectionfd_2connid_[new_conn_fd] = conn_id;
+        auto &listener = it->second;
+        auto stream = NewStream(conn_id, new_conn_fd);
+        stream->listen_fd = listen_fd;
+        if (rate_policy_.stream_kbps > 0 || listener.rate.Limited()) {
+            stream->rate_limited = true;
+            stream->rate = TokenBucket(rate_policy_.stream_kbps, rate_policy_.burst_ms);
+        }
+        scheduler_.SetStream(conn_id, listener.priority, listener.weight);
+        TrackOutside(stream, listener.idle_timeout_ms);
+        if (listener.frontend != kFrontendNone) {
+            ///the destination is known once the outside client has sent its request
+            stream->state = kStreamHandshake;
+            stream->handshake.reset(new ProxyHandshake(listener.frontend));
+        } else {
+            auto ret = QueueOpenToPeer(conn_id, listener.target);
+            if (ret < 0)
+                LOG(WARNING) << "failed to call QueueOpenToPeer conn_id:" << conn_id << " ret:" << ret;
+        }
         return new_conn_fd;
     } else {
-        auto new_peer_fd = accept(local_listen_fd_, nullptr, nullptr);
+        auto new_peer_fd = accept(listen_fd, nullptr, nullptr);
         if (new_peer_fd < 0) {
             if (errno == EAGAIN || errno == EWOULDBLOCK)
                 return 0;
+            if (errno == EMFILE || errno == ENFILE) {
+                HandleAcceptExhausted(listen_fd);
+                return 0;
+            }
             LOG(ERROR) << "tcptun server failed to call accept, error:" << strerror(errno);
             return -1;
         }
-        if (peer_connected_fd_ != 0)
-            close(peer_connected_fd_);
-        ///we will just use the new fd to replace the old,so for a single
-        ///tcptun server it can just handle one tcptun client at the same time
-        ///if you want to use more tcptun client, you can run the same
-        ///number of tcptun servers as tcptun clients
-        peer_connected_fd_ = new_peer_fd;
-        for(auto& ele : outside_connectionfd_2connid_)
-            close(ele.first);
-        connid2outside_connectionfd_.clear();
-        outside_connectionfd_2connid_.clear();
-        bzero(recv_buf, sizeof(recv_buf));
+        accept_backoff_ms_ = kAcceptBackoffMs;
+        if (set_non_blocking(new_peer_fd) < 0) {
+            LOG(ERROR) << "failed to call set_non_blocking to new_peer_fd:" << new_peer_fd;
+            close(new_peer_fd);
+            return -4;
+        }
+        if (pending_links_.size() >= kMaxPendingLinks) {
+            auto oldest = std::min_element(pending_links_.begin(), pending_links_.end(),
+                                           [](const std::pair<const int32_t, pending_link_t> &a,
+                                              const std::pair<const int32_t, pending_link_t> &b) {
+                                               return a.second.deadline_ms < b.second.deadline_ms;
+                                           });
+            LOG(WARNING) << "too many new peer links without hello, close fd:" << oldest->first;
+            ClosePendingLink(oldest->first);
+        }
+        if (AddEvent2Epoll(epoll_fd_, new_peer_fd, EPOLLIN) < 0) {
+            LOG(ERROR) << "failed to call AddEvent2Epoll epoll_fd:" << epoll_fd_ << " new_peer_fd:" << new_peer_fd;
+            close(new_peer_fd);
+            return -5;
+        }
+        ///anyone can connect, the link replaces the current one only once its hello is authenticated
+        auto &link = pending_links_[new_peer_fd];
+        link.hello.clear();
+        link.deadline_ms = getnowtime_ms() + kPendingLinkTimeoutMs;
         return new_peer_fd;
     }
 }
 
-int32_t ConnectionManager::RecvDataFromPeer() {
+void ConnectionManager::HandlePendingLinkEvents(const int32_t &fd, const uint32_t &events) {
+    auto &link = pending_links_[fd];
+    frame_header_t header = {0};
+    while (true) {
+        auto want = kFrameHeaderLen;
+        if (link.hello.size() >= kFrameHeaderLen) {
+            read_frame_header(link.hello.data(), header);
+            want += header.length;
+        }
+        ///read no further than the hello, the frames the client sends behind it are left in the socket
+        char buf[kFrameHeaderLen + kHelloAuthLen];
+        auto ret = recv(fd, buf, want - link.hello.size(), 0);
+        if (ret < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            if (errno == EINTR)
+                continue;
+            LOG(WARNING) << "failed to call recv for new peer link fd:" << fd << " error:" << strerror(errno);
+            ClosePendingLink(fd);
+            return;
+        } else if (ret == 0) {
+            LOG(INFO) << "new peer link fd:" << fd << " closed before its hello";
+            ClosePendingLink(fd);
+            return;
+        }
+        link.hello.append(buf, ret);
+        auto check = CheckPeerHello(link.hello.data(), link.hello.size());
+        if (check < 0) {
+            LOG(WARNING) << "new peer link fd:" << fd << " did not start with an authenticated hello, close it";
+            ClosePendingLink(fd);
+            return;
+        }
+        if (check > 0)
+            break;
+    }
+    auto hello = std::move(link.hello);
+    pending_links_.erase(fd);
+    PromotePendingLink(fd, hello);
+}
+
+int32_t ConnectionManager::CheckPeerHello(const char *data, const size_t &len) {
+    if (len < kFrameHeaderLen)
+        return 0;
+    frame_header_t header = {0};
+    read_frame_header(data, header);
+    if (header.type != kFrameHello || header.length < 4 || header.length > kHelloAuthLen ||
+        (cipher_.Enabled() && header.length != kHelloAuthLen))
+        return -1;
+    if (len < kFrameHeaderLen + header.length)
+        return 0;
+    return AuthenticateHello(data + kFrameHeaderLen) ? 1 : -1;
+}
+
+bool ConnectionManager::AuthenticateHello(const char *payload) {
+    ///without a cipher there is no psk to prove, a well formed hello is all a client can show
+    if (!cipher_.Enabled())
+        return true;
+    auto features = read_u32(payload);
+    const char *nonce = payload + 4;
+    const char *proof = nonce + FrameCipher::kNonceLen;
+    if (!(features & kFeatureEncrypt) || !cipher_.VerifyProof(true, features, nonce, nullptr, proof))
+        return false;
+    std::string key(nonce, FrameCipher::kNonceLen);
+    if (!seen_client_nonces_.insert(key).second) {
+        LOG(WARNING) << "replayed client hello";
+        return false;
+    }
+    seen_client_nonce_order_.push_back(std::move(key));
+    if (seen_client_nonce_order_.size() > kMaxSeenNonces) {
+        seen_client_nonces_.erase(seen_client_nonce_order_.front());
+        seen_client_nonce_order_.pop_front();
+    }
+    return true;
+}
+
+void ConnectionManager::PromotePendingLink(const int32_t &fd, const std::string &hello) {
+    LOG(INFO) << "new peer link fd:" << fd << " sent its hello, it replaces the current one";
+    ///we will just use the new fd to replace the old,so for a single
+    ///tcptun server it can just handle one tcptun client at the same time
+    ///if you want to use more tcptun client, you can run the same
+    ///number of tcptun servers as tcptun clients
+    peer_.reset(new TcpTransport(epoll_fd_, fd));
+    peer_->SetUnsentLimit(priority_policy_.link_queue);
+    CloseOutsideConnections();
     bzero(recv_buf, sizeof(recv_buf));
-    recv_len = recv(peer_connected_fd_, recv_buf, sizeof(recv_buf), 0);
-    auto ret = recv_len;
+    ResetPeerState();
+    frame_header_t header = {0};
+    read_frame_header(hello.data(), header);
+    auto ret = HandleHelloFromPeer(header, hello.data() + kFrameHeaderLen);
+    if (ret < 0)
+        LOG(ERROR) << "failed to call HandleHelloFromPeer for new peer link fd:" << fd << " ret:" << ret;
+}
+
+void ConnectionManager::ClosePendingLink(const int32_t &fd) {
+    ///a closing fd will be moved by epoll, so we don't need to worry about it
+    close(fd);
+    pending_links_.erase(fd);
+}
+
+void ConnectionManager::UpdatePendingLinks(const int64_t &now) {
+    for (auto it = pending_links_.begin(); it != pending_links_.end();) {
+        if (now < it->second.deadline_ms) {
+            ++it;
+            continue;
+        }
+        LOG(WARNING) << "new peer link fd:" << it->first << " sent no hello in time, close it";
+        close(it->first);
+        it = pending_links_.erase(it);
+    }
+}
+
+int32_t ConnectionManager::SendHelloToPeer() {
+    char frame[kFrameHeaderLen + kHelloAuthLen];
+    frame_header_t header = {0};
+    header.type = kFrameHello;
+    header.length = 4;
+    write_u32(frame + kFrameHeaderLen, local_features_);
+    if (cipher_.Enabled()) {
+        ///hello: features(4) | client nonce | client proof
+        char *nonce = frame + kFrameHeaderLen + 4;
+        if (cipher_.GenerateNonce(nonce) < 0 ||
+            cipher_.ComputeProof(true, local_features_, nonce, nullptr, nonce + FrameCipher::kNonceLen) < 0) {
+            LOG(ERROR) << "failed to build authenticated hello";
+            return -1;
+        }
+        memcpy(client_nonce_, nonce, sizeof(client_nonce_));
+        header.length = kHelloAuthLen;
+    }
+    write_frame_header(frame, header);
+    hello_sent_ = true;
+    return QueueFrameToPeer(frame, kFrameHeaderLen + header.length);
+}
+
+int32_t ConnectionManager::HandlePeerEvents(const uint32_t &events) {
+    if (peer_ == nullptr)
+        return 0;
+    auto ret = peer_->HandleEvents(events);
+    if (ret < 0) {
+        LOG(ERROR) << "failed to handle events of peer link ret:" << ret;
+        return -1;
+    }
+    if (ret & kTransportReset) {
+        ///same as accepting a new tcptun client, streams of the old session are dropped
+        LOG(INFO) << "new session of peer link";
+        CloseOutsideConnections();
+        bzero(recv_buf, sizeof(recv_buf));
+        ResetPeerState();
+    }
+    ///EPOLLOUT needs nothing here, queued frames are sent by FlushToPeer at the end of the round
+    if (ret & kTransportReadable)
+        return RecvDataFromPeer();
+    return 0;
+}
+
+int32_t ConnectionManager::PeerFd() const {
+    if (peer_ == nullptr || peer_->fd() == 0)
+        return -1;
+    return peer_->fd();
+}
+
+int32_t ConnectionManager::RecvDataFromPeer() {
+    ///read until the transport is drained, udp transport buffers the stream itself
+    ///so level triggered epoll would not report the rest again
+    while (PeerConnected() && !peer_read_paused_) {
+        auto ret = RecvFramesFromPeer();
+        if (ret <= 0)
+            return ret;
+        ///the frames handled may have filled up the buffers of outside connections
+        UpdateMemory();
+    }
+    return 0;
+}
+
+int32_t ConnectionManager::RecvFramesFromPeer() {
+    auto ret = peer_->Recv(peer_recv_buf_.data() + peer_recv_len_, peer_recv_buf_.size() - peer_recv_len_);
     if (ret < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        if (errno == EINTR)
+            return 1;
         LOG(ERROR) << "failed to call recv error" << strerror(errno);
         return -1;
     } else if (ret == 0) {
         LOG(INFO) << "peer closed";
-        ///a closing fd will be moved by epoll, so we don't need to worry about it
-        close(peer_connected_fd_);
-        peer_connected_fd_ = 0;
-        return 0;
-    }
-    auto conn_id = read_u32(recv_buf);
-    if (!connid2outside_connectionfd_.count(conn_id)) {
-        ///only tcptun_server can run to here, means we need to establish a new connection to server
-        int32_t connected_fd = -1;
-        auto ncs_ret = new_connected_socket(remote_server_info_.ip, remote_server_info_.port, connected_fd);
-        if (ncs_ret < 0) {
-            LOG(ERROR) << "failed to call new_connected_socket ret:" << ncs_ret;
-            return -3;
+        ClosePeerConnection();
+        return 0;
+    }
+    peer_recv_len_ += ret;
+    ///a single recv may carry several frames as well as a partial one,
+    ///keep the partial frame in peer_recv_buf_ until the rest arrives
+    size_t end = 0;
+    frame_header_t header = {0};
+    while (peer_recv_len_ - end >= kFrameHeaderLen) {
+        read_frame_header(peer_recv_buf_.data() + end, header);
+        if (peer_recv_len_ - end < kFrameHeaderLen + header.length)
+            break;
+        end += kFrameHeaderLen + header.length;
+    }
+    size_t offset = 0;
+    size_t opened_end = 0;
+    while (offset < end) {
+        if (cipher_.Ready() && offset >= opened_end) {
+            ///open all the whole frames received in one batch
+            if (cipher_.OpenFrames(peer_recv_buf_.data() + offset, end - offset) < 0) {
+                LOG(ERROR) << "frames from peer failed authentication, close peer link";
+                ClosePeerConnection();
+                return -2;
+            }
+            opened_end = end;
         }
-        ret = set_non_blocking(ncs_ret);
-        if (ret < 0)
-            LOG(WARNING) << "failed to call set_non_blocking on new_connected_fd:" << ncs_ret;
-        outside_connectionfd_2connid_[connected_fd] = conn_id;
-        connid2outside_connectionfd_[conn_id] = connected_fd;
+        read_frame_header(peer_recv_buf_.data() + offset, header);
+        auto frame_len = kFrameHeaderLen + header.length;
+        if (cipher_.Enabled() && header.type != kFrameHello) {
+            if (offset >= opened_end) {
+                LOG(ERROR) << "unauthenticated frame from peer, close peer link";
+                ClosePeerConnection();
+                return -3;
+            }
+            header.length -= FrameCipher::kTagLen;
+        }
+        auto hf_ret = HandleFrameFromPeer(header, peer_recv_buf_.data() + offset + kFrameHeaderLen);
+        if (hf_ret < 0)
+            LOG(WARNING) << "failed to handle frame from peer conn_id:" << header.conn_id << " ret:" << hf_ret;
+        if (!PeerConnected())
+            return hf_ret;
+        offset += frame_len;
+    }
+    if (offset != 0) {
+        memmove(peer_recv_buf_.data(), peer_recv_buf_.data() + offset, peer_recv_len_ - offset);
+        peer_recv_len_ -= offset;
+    }
+    return 1;
+}
+
+int32_t ConnectionManager::HandleHelloFromPeer(const frame_header_t &header, const char *payload) {
+    if (header.length < 4 || (cipher_.Enabled() && header.length < kHelloAuthLen)) {
+        LOG(ERROR) << "invalid hello frame length:" << header.length << ", close peer link";
+        ClosePeerConnection();
+        return -1;
+    }
+    auto features = read_u32(payload);
+    const char *nonce = payload + 4;
+    const char *proof = nonce + FrameCipher::kNonceLen;
+    if (cipher_.Ready() || (cipher_.Enabled() && !(features & kFeatureEncrypt))) {
+        LOG(ERROR) << "unexpected hello from peer features:" << features << ", close peer link";
+        ClosePeerConnection();
+        return -2;
+    }
+    if (hello_sent_) {
+        ///we are tcptun client, this is the answer of tcptun server
+        if (cipher_.Enabled()) {
+            if (!cipher_.VerifyProof(false, features, client_nonce_, nonce, proof) ||
+                cipher_.DeriveKeys(true, client_nonce_, nonce) < 0) {
+                LOG(ERROR) << "failed to authenticate tcptun server, close peer link";
+                ClosePeerConnection();
+                return -3;
+            }
+        }
+        peer_features_ = local_features_ & features;
+        LOG(INFO) << "peer link features:" << peer_features_;
+        return 0;
+    }
+    ///we are tcptun server, answer with the features we agree to
+    if (cipher_.Enabled() && !cipher_.VerifyProof(true, features, nonce, nullptr, proof)) {
+        LOG(ERROR) << "failed to authenticate tcptun client, close peer link";
+        ClosePeerConnection();
+        return -4;
+    }
+    peer_features_ = local_features_ & features;
+    LOG(INFO) << "peer link features:" << peer_features_;
+    char frame[kFrameHeaderLen + kHelloAuthLen];
+    frame_header_t answer = {0};
+    answer.type = kFrameHello;
+    answer.length = 4;
+    write_u32(frame + kFrameHeaderLen, peer_features_);
+    if (cipher_.Enabled()) {
+        char *server_nonce = frame + kFrameHeaderLen + 4;
+        if (cipher_.GenerateNonce(server_nonce) < 0 ||
+            cipher_.ComputeProof(false, peer_features_, nonce, server_nonce,
+                                 server_nonce + FrameCipher::kNonceLen) < 0 ||
+            cipher_.DeriveKeys(false, nonce, server_nonce) < 0) {
+            LOG(ERROR) << "failed to answer authenticated hello, close peer link";
+            ClosePeerConnection();
+            return -5;
+        }
+        answer.length = kHelloAuthLen;
+    }
+    write_frame_header(frame, answer);
+    hello_sent_ = true;
+    return QueueFrameToPeer(frame, kFrameHeaderLen + answer.length);
+}
+
+int32_t ConnectionManager::HandleFrameFromPeer(const frame_header_t &header, const char *payload) {
+    if (header.type == kFrameHello)
+        return HandleHelloFromPeer(header, payload);
+    if (cipher_.Enabled() && !hello_sent_) {
+        ///tcptun server never opens connections for a peer that has not authenticated
+        LOG(ERROR) << "frame from peer before hello, close peer link";
+        ClosePeerConnection();
+        return -1;
+    }
+    if (header.type == kFrameOpen)
+        return HandleOpenFromPeer(header, payload);
+    if (header.type == kFrameClose) {
+        ///attempts still running are closed with the race
+        if (connecting_streams_.erase(header.conn_id)) {
+            balancer_.Abandon(header.conn_id);
+            scheduler_.RemoveStream(header.conn_id);
+        }
+        auto it = streams_.find(header.conn_id);
+        if (it != streams_.end()) {
+            LOG(INFO) << "stream conn_id:" << header.conn_id << " closed by peer";
+            auto stream = it->second;
+            if (header.flags & kFrameFlagReset) {
+                set_reset_on_close(stream->fd);
+                CloseOutsideConnection(stream);
+            } else if (!stream->send_buf.empty()) {
+                ///bytes peer sent before closing are delivered first
+                stream->state = kStreamHalfClosed;
+                WatchOutside(stream);
+            } else
+                CloseOutsideConnection(stream);
+        }
+        return 0;
+    }
+    if (header.type != kFrameData) {
+        LOG(WARNING) << "unknown frame type:" << static_cast<int32_t>(header.type) << " conn_id:" << header.conn_id;
+        return -1;
+    }
+    size_t payload_len = header.length;
+    if (header.flags & kFrameFlagCompressed) {
+        ///decompress into recv_buf, it is not used again until this frame is handled
+        auto ret = compressor_.Decompress(payload, header.length, recv_buf, sizeof(recv_buf));
+        if (ret < 0) {
+            LOG(ERROR) << "failed to decompress frame conn_id:" << header.conn_id;
+            return -2;
+        }
+        payload = recv_buf;
+        payload_len = ret;
+    }
+    auto conn_id = header.conn_id;
+    auto connecting = connecting_streams_.find(conn_id);
+    if (connecting != connecting_streams_.end()) {
+        ///the client does not wait for the stream to be connected, its data waits here instead
+        connecting->second.pending.append(payload, payload_len);
+        return 0;
+    }
+    auto it = streams_.find(conn_id);
+    if (it == streams_.end()) {
+        ///the stream was refused or closed already, the data sent before peer learned it is dropped
+        VLOG(1) << "drop data of unknown conn_id:" << conn_id;
+        return -3;
     }
     ///now we need to send the data that we received from peer to outside corresponding connection
-    ret = send(connid2outside_connectionfd_[conn_id], recv_buf + 4, recv_len - 4, 0);
+    return SendToOutside(it->second, payload, payload_len);
+}
+
+int32_t ConnectionManager::SendToOutside(stream_t *stream, const char *data, const size_t &len) {
+    TouchOutside(stream);
+    if (!stream->send_buf.empty()) {
+        ///bytes behind the kept ones must wait for them
+        stream->send_buf.append(data, len);
+        return 0;
+    }
+    auto ret = send(stream->fd, data, len, MSG_NOSIGNAL);
     if (ret < 0) {
-        LOG(ERROR) << "failed to call send for fd:" << connid2outside_connectionfd_[conn_id] << " error:"
-                   << strerror(errno);
-        return -4;
-    } else {
-        if (ret != (recv_len - 4)) {
-            ///todo
-            LOG(WARNING) << "failed to send all the data for fd:" << connid2outside_connectionfd_[conn_id];
-            ///we need to handle the issue when tcp buffer don't have enough space for us to send data
+        ///EINPROGRESS, a fast open connect without a cookie sent a bare SYN and took no data
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINPROGRESS) {
+            LOG(ERROR) << "failed to call send for fd:" << stream->fd << " error:" << strerror(errno);
+            return -4;
+        }
+        ret = 0;
+    }
+    stream->bytes_out += ret;
+    if (ret == static_cast<ssize_t>(len))
+        return 0;
+    stream->send_buf.assign(data + ret, len - ret);
+    sending_streams_.insert(stream);
+    WatchOutside(stream);
+    return 0;
+}
+
+int32_t ConnectionManager::FlushToOutside(stream_t *stream) {
+    if (!stream->send_buf.empty()) {
+        auto ret = send(stream->fd, stream->send_buf.data(), stream->send_buf.size(), MSG_NOSIGNAL);
+        if (ret < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINPROGRESS)
+                return 0;
+            LOG(ERROR) << "failed to call send for fd:" << stream->fd << " error:" << strerror(errno);
+            CloseOutsideStream(stream);
+            return -5;
         }
+        stream->bytes_out += ret;
+        stream->send_buf.erase(0, ret);
+        if (!stream->send_buf.empty())
+            return 0;
+        ///the memory of a large burst is not kept for the life of the stream
+        std::string().swap(stream->send_buf);
+        sending_streams_.erase(stream);
+    }
+    if (stream->state == kStreamHalfClosed) {
+        CloseOutsideConnection(stream);
+        return 0;
     }
-    return connid2outside_connectionfd_[conn_id];
+    WatchOutside(stream);
+    return 0;
 }
 
-int32_t ConnectionManager::RecvDataFromOutside(const int32_t &readable_fd) {
-    if (!outside_connectionfd_2connid_.count(readable_fd)) {
-        LOG(WARNING) << "readable_fd is not recorded:" << readable_fd;
+int32_t ConnectionManager::HandleOpenFromPeer(const frame_header_t &header, const char *payload) {
+    ///only tcptun_server can run to here, means we need to establish a new connection to server
+    auto conn_id = header.conn_id;
+    if (streams_.count(conn_id) || connecting_streams_.count(conn_id)) {
+        LOG(WARNING) << "stream conn_id:" << conn_id << " is opened twice";
         return -1;
     }
-    bzero(recv_buf, sizeof(recv_buf));
-    ///we need to leave space before datafor conn_id
-    recv_len = recv(readable_fd, recv_buf + 4, sizeof(recv_buf) - 4, 0);
+    if (draining_ && !drain_serves_streams_) {
+        LOG(INFO) << "draining, refuse stream conn_id:" << conn_id;
+        QueueCloseToPeer(conn_id);
+        return 0;
+    }
+    if (outside_read_paused_) {
+        LOG(WARNING) << "memory over budget, refuse stream conn_id:" << conn_id;
+        ++memory_stats_.refused_streams;
+        QueueCloseToPeer(conn_id);
+        return 0;
+    }
+    connecting_stream_t stream;
+    stream.backend = header.length == 0;
+    stream.destination.assign(payload, header.length);
+    stream.port = 0;
+    int32_t priority = -1;
+    int32_t weight = 1;
+    read_priority_flags(header.flags, priority, weight);
+    if (stream.backend) {
+        scheduler_.SetStream(conn_id, priority, weight);
+        connecting_streams_[conn_id] = std::move(stream);
+        return ConnectStream(conn_id);
+    }
+    auto service = stream_policy_.services.find(stream.destination);
+    if (service != stream_policy_.services.end()) {
+        ///a service is configured by the admin of tcptun server, it needs no allowlist, and it is
+        ///the only way for a stream to reach a unix socket on the host of tcptun server
+        if (is_unix_address(service->second)) {
+            stream.host = service->second;
+        } else if (parse_host_port(service->second, stream.host, stream.port) < 0) {
+            LOG(ERROR) << "invalid address:" << service->second << " of service:" << stream.destination;
+            QueueCloseToPeer(conn_id);
+            return -5;
+        }
+    } else if (parse_host_port(stream.destination, stream.host, stream.port) < 0 ||
+               !allowlist_.Allowed(stream.host, stream.port)) {
+        LOG(WARNING) << "destination:" << stream.destination << " of conn_id:" << conn_id << " is not allowed";
+        QueueCloseToPeer(conn_id);
+        return -3;
+    }
+    scheduler_.SetStream(conn_id, priority, weight);
+    connecting_streams_[conn_id] = std::move(stream);
+    return ConnectStream(conn_id);
+}
+
+int32_t ConnectionManager::ConnectStream(const uint32_t &conn_id) {
+    auto it = connecting_streams_.find(conn_id);
+    if (it == connecting_streams_.end())
+        return 0;
+    auto &stream = it->second;
+    std::vector<socket_address_t> addrs;
+    if (stream.backend) {
+        int32_t pooled_fd = -1;
+        auto ret = balancer_.Pick(conn_id, pooled_fd, addrs);
+        if (ret < 0) {
+            LOG(ERROR) << "failed to connect to any backend ret:" << ret;
+            connecting_streams_.erase(it);
+            QueueCloseToPeer(conn_id);
+            scheduler_.RemoveStream(conn_id);
+            return -2;
+        }
+        if (ret == kPickPooled) {
+            std::string pending;
+            pending.swap(stream.pending);
+            connecting_streams_.erase(it);
+            auto outside = AttachOutsideConnection(conn_id, pooled_fd);
+            if (pending.empty())
+                return 0;
+            return SendToOutside(outside, pending.data(), pending.size());
+        }
+    } else {
+        auto ret = resolver_.Lookup(stream.host, stream.port, addrs);
+        if (ret == kLookupPending)
+            return 0;
+        if (ret < 0) {
+            LOG(ERROR) << "failed to look up destination:" << stream.destination << " of conn_id:" << conn_id;
+            connecting_streams_.erase(it);
+            QueueCloseToPeer(conn_id);
+            scheduler_.RemoveStream(conn_id);
+            return -4;
+        }
+    }
+    stream.race.reset(new HappyEyeballs(epoll_fd_, addrs, connect_policy_));
+    return HandleRaceResult(conn_id, stream.race->Start(getnowtime_ms()));
+}
+
+int32_t ConnectionManager::HandleRaceResult(const uint32_t &conn_id, const int32_t &ret) {
+    if (ret == kRaceRunning)
+        return 0;
+    auto it = connecting_streams_.find(conn_id);
+    if (it == connecting_streams_.end())
+        return 0;
+    auto &stream = it->second;
+    connects_out_of_fds_ |= stream.race->TakeOutOfFds();
+    if (ret < 0) {
+        stream.race.reset();
+        if (stream.backend) {
+            ///blame the backend and try another one
+            balancer_.ConnectDone(conn_id, -1);
+            return ConnectStream(conn_id);
+        }
+        LOG(ERROR) << "failed to connect to destination:" << stream.destination << " of conn_id:" << conn_id;
+        connecting_streams_.erase(it);
+        QueueCloseToPeer(conn_id);
+        scheduler_.RemoveStream(conn_id);
+        return -4;
+    }
+    auto connected_fd = stream.race->winner();
+    if (stream.backend)
+        balancer_.ConnectDone(conn_id, connected_fd);
+    std::string pending;
+    pending.swap(stream.pending);
+    connecting_streams_.erase(it);
+    auto outside = AttachOutsideConnection(conn_id, connected_fd);
+    if (pending.empty())
+        return 0;
+    return SendToOutside(outside, pending.data(), pending.size());
+}
+
+void ConnectionManager::UpdateRaces(const int64_t &now) {
+    std::vector<std::pair<uint32_t, int32_t>> results;
+    for (auto &ele : connecting_streams_) {
+        if (ele.second.race == nullptr)
+            continue;
+        auto ret = ele.second.race->Update(now);
+        connects_out_of_fds_ |= ele.second.race->TakeOutOfFds();
+        if (ret != kRaceRunning)
+            results.emplace_back(ele.first, ret);
+    }
+    ///handling a result changes connecting_streams_
+    for (auto &result : results)
+        HandleRaceResult(result.first, result.second);
+}
+
+void ConnectionManager::UpdateConnectsOutOfFds() {
+    if (balancer_.TakeOutOfFds())
+        connects_out_of_fds_ = true;
+    if (!connects_out_of_fds_)
+        return;
+    connects_out_of_fds_ = false;
+    ///the same as an accept out of fds, the races retry their address in a moment
+    EvictStreams();
+}
+
+int32_t ConnectionManager::HandleResolverEvent() {
+    std::vector<std::string> hosts;
+    auto ret = resolver_.HandleEvent(hosts);
+    if (ret < 0)
+        return ret;
+    std::vector<uint32_t> ready;
+    for (auto &ele : connecting_streams_) {
+        if (ele.second.backend || ele.second.race != nullptr)
+            continue;
+        if (std::find(hosts.begin(), hosts.end(), ele.second.host) != hosts.end())
+            ready.push_back(ele.first);
+    }
+    for (auto &conn_id : ready)
+        ConnectStream(conn_id);
+    return 0;
+}
+
+stream_t *ConnectionManager::NewStream(const uint32_t &conn_id, const int32_t &fd) {
+    auto stream = stream_pool_.Acquire(fd, conn_id);
+    streams_[conn_id] = stream;
+    fd_streams_[fd] = stream;
+    ///epoll reports the stream itself, events need no lookup of the fd
+    if (AddEvent2Epoll(epoll_fd_, fd, OutsideEvents(stream), stream_event_data(stream)) < 0)
+        LOG(ERROR) << "failed to call AddEvent2Epoll epoll_fd:" << epoll_fd_ << " fd:" << fd;
+    return stream;
+}
+
+stream_t *ConnectionManager::AttachOutsideConnection(const uint32_t &conn_id, const int32_t &fd) {
+    auto ret = set_non_blocking(fd);
+    if (ret < 0)
+        LOG(WARNING) << "failed to call set_non_blocking on new_connected_fd:" << fd;
+    auto stream = NewStream(conn_id, fd);
+    if (rate_policy_.stream_kbps > 0) {
+        stream->rate_limited = true;
+        stream->rate = TokenBucket(rate_policy_.stream_kbps, rate_policy_.burst_ms);
+    }
+    TrackOutside(stream, stream_policy_.idle_timeout_ms);
+    return stream;
+}
+
+int32_t ConnectionManager::HandleStreamEvents(stream_t *stream, const uint32_t &events) {
+    ///the stream was closed earlier in this round
+    if (stream->fd < 0)
+        return 0;
+    if ((events & EPOLLOUT) || (stream->state == kStreamHalfClosed && (events & (EPOLLERR | EPOLLHUP)))) {
+        auto ret = FlushToOutside(stream);
+        if (ret < 0 || stream->fd < 0)
+            return ret;
+    }
+    ///peer knows nothing of the stream any more
+    if (stream->state == kStreamHalfClosed)
+        return 0;
+    if (events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+        return RecvDataFromOutside(stream, (events & (EPOLLERR | EPOLLHUP)) != 0);
+    return 0;
+}
+
+int32_t ConnectionManager::HandleOutsideEvents(const int32_t &fd, const uint32_t &events) {
+    if (balancer_.Owns(fd))
+        return balancer_.HandleEvent(fd);
+    if (resolver_.Owns(fd))
+        return HandleResolverEvent();
+    for (auto &ele : connecting_streams_) {
+        if (ele.second.race == nullptr || !ele.second.race->Owns(fd))
+            continue;
+        ///the stream may be erased while its result is handled, so conn_id is copied
+        auto conn_id = ele.first;
+        return HandleRaceResult(conn_id, ele.second.race->HandleEvent(fd, getnowtime_ms()));
+    }
+    VLOG(1) << "events:" << events << " of unknown fd:" << fd;
+    return 0;
+}
+
+int32_t ConnectionManager::RecvDataFromOutside(stream_t *stream, bool broken) {
+    size_t len = sizeof(recv_buf) - kFrameHeaderLen;
+    bool rate_limited = session_rate_.Limited() || stream->rate_limited;
+    if (rate_limited && !broken) {
+        auto now = getnowtime_ms();
+        auto allowance = ReadAllowance(stream, now);
+        if (allowance == 0) {
+            ///the bytes wait in the kernel, whose receive window holds the sender back
+            ThrottleOutside(stream, now);
+            return 0;
+        }
+        len = std::min(len, allowance);
+    }
+    ///we need to leave space before data for frame header
+    recv_len = recv(stream->fd, recv_buf + kFrameHeaderLen, len, 0);
     auto ret = recv_len;
     if (ret < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
         LOG(ERROR) << "failed to call recv error" << strerror(errno);
+        ///a reset connection keeps reporting EPOLLERR until it is closed
+        CloseOutsideStream(stream);
         return -2;
     } else if (ret == 0) {
         LOG(INFO) << "outside connection closed";
-        ///a closing fd will be moved by epoll, so we don't need to worry about it
-        close(readable_fd);
-        uint32_t conn_id = outside_connectionfd_2connid_[readable_fd];
-        outside_connectionfd_2connid_.erase(readable_fd);
-        connid2outside_connectionfd_.erase(conn_id);
+        CloseOutsideStream(stream);
         return -3;
     }
-    write_u32(recv_buf, outside_connectionfd_2connid_[readable_fd]);
-    ret = send(peer_connected_fd_, recv_buf, recv_len + 4, 0);
+    if (rate_limited)
+        ConsumeReadAllowance(stream, recv_len);
+    TouchOutside(stream);
+    stream->bytes_in += recv_len;
+    if (stream->state == kStreamHandshake)
+        return HandleProxyHandshake(stream);
+    auto conn_id = stream->conn_id;
+    ret = QueueDataToPeer(conn_id, recv_len);
+    if (priority_policy_.stream_queue > 0 &&
+        scheduler_.Queued(conn_id) >= static_cast<size_t>(priority_policy_.stream_queue))
+        BacklogOutside(stream);
+    return ret;
+}
+
+int32_t ConnectionManager::HandleProxyHandshake(stream_t *stream) {
+    auto fd = stream->fd;
+    auto conn_id = stream->conn_id;
+    auto &handshake = *stream->handshake;
+    std::string reply;
+    auto ret = handshake.Feed(recv_buf + kFrameHeaderLen, recv_len, reply);
+    if (!reply.empty() && send(fd, reply.data(), reply.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(reply.size()))
+        LOG(WARNING) << "failed to send proxy reply to fd:" << fd;
     if (ret < 0) {
-        LOG(ERROR) << "failed to call send for peer_connected_fd:" << peer_connected_fd_ << " error:"
-                   << strerror(errno);
+        LOG(WARNING) << "bad proxy request from fd:" << fd << " ret:" << ret;
+        CloseOutsideConnection(stream);
         return -4;
-    } else {
-        if (ret != (recv_len + 4)) {
-            ///todo
-            LOG(WARNING) << "failed to send all the data for peer_connected_fd:" << peer_connected_fd_;
-            ///we need to handle the issue when tcp buffer don't have enough space for us to send data
+    }
+    if (ret == kHandshakeMore)
+        return 0;
+    LOG(INFO) << "stream conn_id:" << conn_id << " asks for destination:" << handshake.destination();
+    ret = QueueOpenToPeer(conn_id, handshake.destination());
+    if (ret < 0)
+        return ret;
+    ///bytes sent right behind the request belong to the stream
+    auto remaining = handshake.remaining();
+    stream->state = kStreamOpen;
+    stream->handshake.reset();
+    for (size_t offset = 0; offset < remaining.size(); offset += recv_len) {
+        recv_len = std::min(remaining.size() - offset, sizeof(recv_buf) - kFrameHeaderLen);
+        memcpy(recv_buf + kFrameHeaderLen, remaining.data() + offset, recv_len);
+        ret = QueueDataToPeer(conn_id, recv_len);
+        if (ret < 0)
+            return ret;
+    }
+    return 0;
+}
+
+int32_t ConnectionManager::QueueDataToPeer(const uint32_t &conn_id, const size_t &len) {
+    frame_header_t header = {0};
+    header.conn_id = conn_id;
+    header.type = kFrameData;
+    if (peer_features_ & kFeatureCompress) {
+        auto compressed_len = compressor_.Compress(header.conn_id, recv_buf + kFrameHeaderLen, len,
+                                                   compress_buf_.data() + kFrameHeaderLen,
+                                                   compress_buf_.size() - kFrameHeaderLen);
+        if (compressed_len > 0) {
+            header.flags = kFrameFlagCompressed;
+            header.length = static_cast<uint16_t>(compressed_len);
+            write_frame_header(compress_buf_.data(), header);
+            return QueueFrameToPeer(compress_buf_.data(), compressed_len + kFrameHeaderLen);
         }
     }
+    header.length = static_cast<uint16_t>(len);
+    write_frame_header(recv_buf, header);
+    return QueueFrameToPeer(recv_buf, len + kFrameHeaderLen);
+}
+
+int32_t ConnectionManager::QueueOpenToPeer(const uint32_t &conn_id, const std::string &destination) {
+    std::vector<char> frame(kFrameHeaderLen + destination.size());
+    frame_header_t header = {0};
+    header.conn_id = conn_id;
+    header.type = kFrameOpen;
+    header.length = static_cast<uint16_t>(destination.size());
+    int32_t priority = 0;
+    int32_t weight = 0;
+    if (scheduler_.Stream(conn_id, priority, weight))
+        header.flags = write_priority_flags(priority, weight);
+    write_frame_header(frame.data(), header);
+    memcpy(frame.data() + kFrameHeaderLen, destination.data(), destination.size());
+    return QueueFrameToPeer(frame.data(), frame.size());
+}
+
+int32_t ConnectionManager::QueueCloseToPeer(const uint32_t &conn_id, bool reset) {
+    char frame[kFrameHeaderLen];
+    frame_header_t header = {0};
+    header.conn_id = conn_id;
+    header.type = kFrameClose;
+    header.flags = reset ? kFrameFlagReset : 0;
+    write_frame_header(frame, header);
+    return QueueFrameToPeer(frame, sizeof(frame));
+}
+
+int32_t ConnectionManager::QueueFrameToPeer(const char *frame, const size_t &len) {
+    if (!PeerConnected()) {
+        LOG(WARNING) << "peer is not connected, drop frame len:" << len;
+        return -5;
+    }
+    frame_header_t header = {0};
+    read_frame_header(frame, header);
+    ///the link buffer is sent in order, frames of every stream wait in the scheduler once it is full
+    ///so that the next one is picked when there is room again, hello is always the first frame
+    if (header.type != kFrameHello && priority_policy_.link_queue > 0 &&
+        (!scheduler_.empty() ||
+         peer_send_buf_.size() - peer_send_offset_ >= static_cast<size_t>(priority_policy_.link_queue))) {
+        scheduler_.Push(header.conn_id, frame, len);
+        return 0;
+    }
+    AppendFrameToPeer(frame, len);
     return 0;
 }
 
+void ConnectionManager::AppendFrameToPeer(const char *frame, const size_t &len) {
+    auto start = peer_send_buf_.size();
+    peer_send_buf_.insert(peer_send_buf_.end(), frame, frame + len);
+    frame_header_t header = {0};
+    read_frame_header(frame, header);
+    if (cipher_.Enabled() && header.type != kFrameHello) {
+        ///reserve room for the tag, the frame is sealed by FlushToPeer
+        header.length += FrameCipher::kTagLen;
+        write_frame_header(peer_send_buf_.data() + start, header);
+        peer_send_buf_.resize(peer_send_buf_.size() + FrameCipher::kTagLen);
+    } else if (peer_sealed_offset_ == start) {
+        peer_sealed_offset_ = peer_send_buf_.size();
+    }
 }
 
+void ConnectionManager::ScheduleFramesToPeer() {
+    uint32_t conn_id = 0;
+    const char *frame = nullptr;
+    while (peer_send_buf_.size() - peer_send_offset_ < static_cast<size_t>(priority_policy_.link_queue)) {
+        auto len = scheduler_.Pop(conn_id, frame);
+        if (len == 0)
+            break;
+        AppendFrameToPeer(frame, len);
+        if (backlogged_streams_ > 0)
+            UpdateBacklogged(conn_id);
+    }
+}
 
+int32_t ConnectionManager::FlushToPeer() {
+    auto now = getnowtime_ms();
+    ///health checks of backends and refills of their pools
+    balancer_.Update(now);
+    UpdateRaces(now);
+    UpdateConnectsOutOfFds();
+    UpdateThrottled(now);
+    UpdateIdle(now);
+    UpdatePausedListeners(now);
+    UpdatePendingLinks(now);
+    if (peer_ == nullptr) {
+        UpdateMemory();
+        return 0;
+    }
+    if (PeerConnected()) {
+        auto ret = SendFramesToPeer(now);
+        if (ret < 0)
+            return ret;
+    }
+    ///transports with their own timers send what was handed to them in this round here
+    auto events = peer_->Update(now);
+    ///frames sent and outside connections flushed in this round may let reading go on, udp transport
+    ///keeps what it has received without reporting it again, so peer is read at once
+    auto resumed = UpdateMemory();
+    if (resumed || (events > 0 && (events & kTransportReadable)))
+        return RecvDataFromPeer();
+    return 0;
+}
 
+int32_t ConnectionManager::SendFramesToPeer(const int64_t &now) {
+    do {
+        ScheduleFramesToPeer();
+        if (cipher_.Ready() && peer_sealed_offset_ < peer_send_buf_.size()) {
+            ///seal every frame queued in this round with one call
+            auto ret = cipher_.SealFrames(peer_send_buf_.data() + peer_sealed_offset_,
+                                          peer_send_buf_.size() - peer_sealed_offset_);
+            if (ret < 0) {
+                LOG(ERROR) << "failed to seal frames to peer ret:" << ret;
+                return -6;
+            }
+            peer_sealed_offset_ = peer_send_buf_.size();
+        }
+        if (peer_send_offset_ < peer_sealed_offset_) {
+            if (!batch_policy_.enable || !PeerLinkBusy()) {
+                ///link is idle, nothing to wait for
+                if (peer_corked_)
+                    SetPeerCork(false);
+            } else if (!peer_corked_) {
+                ///like nagle we only hold data while the link has data in flight, but the
+                ///hold time is bounded by a fraction of rtt instead of waiting for the ack
+                auto hold_ms = static_cast<int64_t>(peer_rtt_us_ * batch_policy_.rtt_fraction / 1000);
+                if (hold_ms > batch_policy_.max_hold_ms)
+                    hold_ms = batch_policy_.max_hold_ms;
+                if (hold_ms > 0 && SetPeerCork(true) == 0)
+                    peer_cork_deadline_ms_ = now + hold_ms;
+            }
+            ///while corked kernel still sends full segments, only the tail is held
+            auto ret = SendPendingToPeer();
+            if (ret < 0)
+                return ret;
+        }
+        ///the transport took the frames, the next ones are picked now that there is room
+    } while (!scheduler_.empty() &&
+             peer_send_buf_.size() - peer_send_offset_ < static_cast<size_t>(priority_policy_.link_queue));
+    if (peer_corked_ && now >= peer_cork_deadline_ms_)
+        SetPeerCork(false);
+    return 0;
+}
 
+int32_t ConnectionManager::NextTimeoutMs() {
+    auto now = getnowtime_ms();
+    int32_t timeout = -1;
+    if (peer_corked_) {
+        auto remain = peer_cork_deadline_ms_ - now;
+        timeout = remain > 0 ? static_cast<int32_t>(remain) : 0;
+    }
+    if (peer_ != nullptr) {
+        auto transport_timeout = peer_->NextTimeoutMs(now);
+        if (transport_timeout >= 0 && (timeout < 0 || transport_timeout < timeout))
+            timeout = transport_timeout;
+    }
+    auto balancer_timeout = balancer_.NextTimeoutMs(now);
+    if (balancer_timeout >= 0 && (timeout < 0 || balancer_timeout < timeout))
+        timeout = balancer_timeout;
+    for (auto &ele : connecting_streams_) {
+        if (ele.second.race == nullptr)
+            continue;
+        auto race_timeout = ele.second.race->NextTimeoutMs(now);
+        if (race_timeout >= 0 && (timeout < 0 || race_timeout < timeout))
+            timeout = race_timeout;
+    }
+    auto idle_timeout = idle_wheel_.NextTimeoutMs(now);
+    if (idle_timeout >= 0 && (timeout < 0 || idle_timeout < timeout))
+        timeout = idle_timeout;
+    for (auto &ele : paused_listeners_) {
+        auto pause_timeout = static_cast<int32_t>(std::max<int64_t>(0, ele.second - now));
+        if (timeout < 0 || pause_timeout < timeout)
+            timeout = pause_timeout;
+    }
+    for (auto &ele : pending_links_) {
+        auto pending_timeout = static_cast<int32_t>(std::max<int64_t>(0, ele.second.deadline_ms - now));
+        if (timeout < 0 || pending_timeout < timeout)
+            timeout = pending_timeout;
+    }
+    if (next_unthrottle_ms_ >= 0) {
+        auto throttle_timeout = static_cast<int32_t>(std::max<int64_t>(0, next_unthrottle_ms_ - now));
+        if (timeout < 0 || throttle_timeout < timeout)
+            timeout = throttle_timeout;
+    }
+    return timeout;
+}
 
+void ConnectionManager::StartDrain(const bool &handover) {
+    draining_ = true;
+    ///tcptun client keeps the link, refusing its streams would fail them until the link moves
+    drain_serves_streams_ = handover && transport_type_ == kTransportTcp && !cipher_.Enabled();
+    ///a client still sending its hello reconnects to the process taking over the listener
+    for (auto &ele : pending_links_)
+        close(ele.first);
+    pending_links_.clear();
+}
 
+bool ConnectionManager::Drained() const {
+    return streams_.empty() && connecting_streams_.empty();
+}
 
+void ConnectionManager::AbortStreams() {
+    drain_serves_streams_ = false;
+    for (auto &ele : streams_)
+        QueueCloseToPeer(ele.first);
+    for (auto &ele : connecting_streams_)
+        QueueCloseToPeer(ele.first);
+    CloseOutsideConnections();
+}
 
+int32_t ConnectionManager::ReleasePeer(int32_t &fd, uint32_t &features) {
+    if (transport_type_ != kTransportTcp || !PeerConnected() || cipher_.Enabled())
+        return -1;
+    ///the other process knows nothing about our streams, nor about a frame we have half read
+    if (!Drained() || peer_recv_len_ != 0 || peer_send_offset_ != peer_send_buf_.size() || !scheduler_.empty())
+        return 1;
+    if (peer_corked_)
+        SetPeerCork(false);
+    fd = static_cast<TcpTransport *>(peer_.get())->Detach();
+    features = peer_features_;
+    peer_.reset();
+    CloseOutsideConnections();
+    ResetPeerState();
+    return 0;
+}
+
+int32_t ConnectionManager::AdoptPeer(const int32_t &fd, const uint32_t &features) {
+    if (transport_type_ != kTransportTcp || cipher_.Enabled())
+        return -1;
+    if (PeerConnected()) {
+        ///a tcptun client connected to us meanwhile, it is newer than the one handed over
+        LOG(WARNING) << "peer link is connected already, refuse the one handed over";
+        return -2;
+    }
+    peer_.reset(new TcpTransport(epoll_fd_, fd));
+    peer_->SetUnsentLimit(priority_policy_.link_queue);
+    CloseOutsideConnections();
+    ResetPeerState();
+    ///the hello was answered by the process we took over from
+    peer_features_ = features;
+    hello_sent_ = true;
+    return fd;
+}
+
+memory_stats_t ConnectionManager::MemoryStats() const {
+    auto stats = memory_stats_;
+    stats.session_bytes = session_memory_;
+    stats.global_bytes = memory_budget_->used();
+    stats.global_peak = memory_budget_->peak();
+    stats.streams = streams_.size() + connecting_streams_.size();
+    return stats;
+}
+
+uint32_t ConnectionManager::OutsideEvents(const stream_t *stream) const {
+    ///peer knows nothing of a closing stream, there is nothing to read it for
+    uint32_t events = (outside_read_paused_ || stream->state == kStreamHalfClosed || stream->unthrottle_ms >= 0 ||
+                       stream->backlogged) ? 0 : EPOLLIN;
+    if (!stream->send_buf.empty())
+        events |= EPOLLOUT;
+    return events;
+}
+
+void ConnectionManager::WatchOutside(stream_t *stream) {
+    if (ModEvent2Epoll(epoll_fd_, stream->fd, OutsideEvents(stream), stream_event_data(stream)) < 0)
+        LOG(ERROR) << "failed to call ModEvent2Epoll epoll_fd:" << epoll_fd_ << " fd:" << stream->fd;
+}
+
+bool ConnectionManager::UpdateMemory() {
+    int64_t outside_memory = 0;
+    bool stream_over = false;
+    for (auto &stream : sending_streams_) {
+        outside_memory += stream->send_buf.size();
+        if (over_limit(stream->send_buf.size(), memory_policy_.stream_limit, peer_read_paused_))
+            stream_over = true;
+    }
+    for (auto &ele : connecting_streams_) {
+        outside_memory += ele.second.pending.size();
+        if (over_limit(ele.second.pending.size(), memory_policy_.stream_limit, peer_read_paused_))
+            stream_over = true;
+    }
+    auto session_memory = outside_memory + static_cast<int64_t>(peer_send_buf_.size() - peer_send_offset_) +
+                          static_cast<int64_t>(scheduler_.bytes());
+    memory_budget_->Charge(session_memory - session_memory_);
+    session_memory_ = session_memory;
+    memory_stats_.session_peak = std::max(memory_stats_.session_peak, session_memory_);
+    SetOutsideReadPaused(over_limit(session_memory_, memory_policy_.session_limit, outside_read_paused_) ||
+                         memory_budget_->Exceeded(outside_read_paused_));
+    ///bytes held for outside connections drain whatever peer does, while frames to peer drain only if
+    ///peer reads them, so they never pause reading peer, or both sides could wait for each other
+    bool peer_over = over_limit(session_memory_, memory_policy_.session_limit, peer_read_paused_) ||
+                     memory_budget_->Exceeded(peer_read_paused_);
+    return SetPeerReadPaused(stream_over || (outside_memory > 0 && peer_over));
+}
+
+bool ConnectionManager::SetPeerReadPaused(bool paused) {
+    if (paused == peer_read_paused_)
+        return false;
+    peer_read_paused_ = paused;
+    if (paused) {
+        LOG(WARNING) << "memory over budget, pause reading peer session_bytes:" << session_memory_
+                     << " global_bytes:" << memory_budget_->used();
+        ++memory_stats_.peer_read_pauses;
+    } else {
+        LOG(INFO) << "resume reading peer session_bytes:" << session_memory_;
+    }
+    if (PeerConnected())
+        peer_->SetWantRead(!paused);
+    return !paused;
+}
+
+void ConnectionManager::SetOutsideReadPaused(bool paused) {
+    if (paused == outside_read_paused_)
+        return;
+    outside_read_paused_ = paused;
+    if (paused) {
+        LOG(WARNING) << "memory over budget, pause reading outside connections and refuse new streams session_bytes:"
+                     << session_memory_ << " global_bytes:" << memory_budget_->used();
+        ++memory_stats_.outside_read_pauses;
+    } else {
+        LOG(INFO) << "resume reading outside connections session_bytes:" << session_memory_;
+    }
+    for (auto &ele : streams_)
+        WatchOutside(ele.second);
+}
+
+size_t ConnectionManager::ReadAllowance(stream_t *stream, const int64_t &now) {
+    auto allowance = session_rate_.Available(now);
+    if (!stream->rate_limited)
+        return allowance;
+    allowance = std::min(allowance, stream->rate.Available(now));
+    auto listener = listeners_.find(stream->listen_fd);
+    if (listener != listeners_.end())
+        allowance = std::min(allowance, listener->second.rate.Available(now));
+    return allowance;
+}
+
+void ConnectionManager::ConsumeReadAllowance(stream_t *stream, const size_t &bytes) {
+    session_rate_.Consume(bytes);
+    if (!stream->rate_limited)
+        return;
+    stream->rate.Consume(bytes);
+    auto listener = listeners_.find(stream->listen_fd);
+    if (listener != listeners_.end())
+        listener->second.rate.Consume(bytes);
+}
+
+void ConnectionManager::ThrottleOutside(stream_t *stream, const int64_t &now) {
+    ///wait for a full read, one byte at a time would wake us up for every few bytes
+    auto wanted = sizeof(recv_buf) - kFrameHeaderLen;
+    auto wait_ms = session_rate_.WaitMs(wanted);
+    if (stream->rate_limited) {
+        wait_ms = std::max(wait_ms, stream->rate.WaitMs(wanted));
+        auto listener = listeners_.find(stream->listen_fd);
+        if (listener != listeners_.end())
+            wait_ms = std::max(wait_ms, listener->second.rate.WaitMs(wanted));
+    }
+    auto wake_ms = now + std::max<int64_t>(1, wait_ms);
+    stream->unthrottle_ms = wake_ms;
+    throttled_streams_.insert(stream);
+    if (next_unthrottle_ms_ < 0 || wake_ms < next_unthrottle_ms_)
+        next_unthrottle_ms_ = wake_ms;
+    WatchOutside(stream);
+}
+
+void ConnectionManager::BacklogOutside(stream_t *stream) {
+    ///the bytes wait in the kernel until the stream has its turn on the peer link
+    if (stream->backlogged)
+        return;
+    stream->backlogged = true;
+    ++backlogged_streams_;
+    WatchOutside(stream);
+}
+
+void ConnectionManager::UpdateBacklogged(const uint32_t &conn_id) {
+    if (scheduler_.Queued(conn_id) > static_cast<size_t>(priority_policy_.stream_queue / 2))
+        return;
+    auto it = streams_.find(conn_id);
+    if (it == streams_.end() || !it->second->backlogged)
+        return;
+    it->second->backlogged = false;
+    --backlogged_streams_;
+    WatchOutside(it->second);
+}
+
+void ConnectionManager::TrackOutside(stream_t *stream, const int32_t &idle_timeout_ms) {
+    stream->active_ms = getnowtime_ms();
+    stream->idle_timeout_ms = idle_timeout_ms;
+    stream->timer_ms = -1;
+    if (idle_timeout_ms > 0) {
+        stream->timer_ms = stream->active_ms + idle_timeout_ms;
+        idle_wheel_.Add(stream->fd, stream->timer_ms);
+    }
+}
+
+void ConnectionManager::TouchOutside(stream_t *stream) {
+    ///the timer is not moved, it finds out that the stream was active when it expires
+    stream->active_ms = getnowtime_ms();
+}
 
+void ConnectionManager::UpdateIdle(const int64_t &now) {
+    if (idle_wheel_.size() == 0)
+        return;
+    std::vector<std::pair<int32_t, int64_t>> expired;
+    idle_wheel_.Advance(now, expired);
+    for (auto &timer : expired) {
+        auto it = fd_streams_.find(timer.first);
+        ///the stream of the timer is gone, its fd may be used by another one already
+        if (it == fd_streams_.end() || it->second->timer_ms != timer.second)
+            continue;
+        auto stream = it->second;
+        auto expire_ms = stream->active_ms + stream->idle_timeout_ms;
+        if (expire_ms > now) {
+            stream->timer_ms = expire_ms;
+            idle_wheel_.Add(timer.first, expire_ms);
+            continue;
+        }
+        LOG(INFO) << "stream conn_id:" << stream->conn_id << " idle for " << now - stream->active_ms
+                  << "ms, close it";
+        CloseOutsideStream(stream);
+    }
+}
+
+size_t ConnectionManager::EvictStreams() {
+    if (streams_.empty())
+        return 0;
+    std::vector<std::pair<int64_t, stream_t *>> streams;
+    streams.reserve(streams_.size());
+    for (auto &ele : streams_)
+        streams.emplace_back(ele.second->active_ms, ele.second);
+    auto count = std::max<size_t>(1, streams.size() / kEvictFraction);
+    if (streams.size() > count)
+        std::nth_element(streams.begin(), streams.begin() + count, streams.end());
+    count = std::min(count, streams.size());
+    LOG(WARNING) << "out of fds, reset " << count << " least recently active streams of " << streams.size();
+    for (size_t i = 0; i < count; ++i)
+        CloseOutsideStream(streams[i].second, true);
+    return count;
+}
+
+void ConnectionManager::HandleAcceptExhausted(const int32_t &listen_fd) {
+    ///the fds of the streams reset are free, the connection is accepted when epoll reports it again
+    if (EvictStreams() > 0)
+        return;
+    ///nothing to free, outside clients are closed at once instead of waiting in the backlog
+    if (reserve_fd_ < 0)
+        reserve_fd_ = open_reserve_fd();
+    ///the shed loop stops at EAGAIN, accept on a blocking listener would wait for the next client
+    auto flags = fcntl(listen_fd, F_GETFL);
+    if (flags < 0 || !(flags & O_NONBLOCK))
+        LOG(ERROR) << "listen_fd:" << listen_fd << " is blocking, its connections are not shed";
+    else if (reserve_fd_ >= 0) {
+        close(reserve_fd_);
+        for (int32_t i = 0; i < kMaxShedConnections; ++i) {
+            auto fd = accept(listen_fd, nullptr, nullptr);
+            if (fd < 0)
+                break;
+            ++memory_stats_.refused_streams;
+            close(fd);
+        }
+        reserve_fd_ = open_reserve_fd();
+    }
+    if (DelEvent2Epoll(epoll_fd_, listen_fd) < 0) {
+        LOG(ERROR) << "failed to call DelEvent2Epoll epoll_fd:" << epoll_fd_ << " listen_fd:" << listen_fd;
+        return;
+    }
+    LOG(WARNING) << "out of fds, stop accepting on listen_fd:" << listen_fd << " for " << accept_backoff_ms_ << "ms";
+    paused_listeners_[listen_fd] = getnowtime_ms() + accept_backoff_ms_;
+    accept_backoff_ms_ = std::min(accept_backoff_ms_ * 2, kMaxAcceptBackoffMs);
+}
+
+void ConnectionManager::UpdatePausedListeners(const int64_t &now) {
+    for (auto it = paused_listeners_.begin(); it != paused_listeners_.end();) {
+        ///a draining process has closed its listeners
+        if (!draining_ && it->second > now) {
+            ++it;
+            continue;
+        }
+        if (!draining_ && AddEvent2Epoll(epoll_fd_, it->first, EPOLLIN) < 0)
+            LOG(ERROR) << "failed to call AddEvent2Epoll epoll_fd:" << epoll_fd_ << " listen_fd:" << it->first;
+        it = paused_listeners_.erase(it);
+    }
+}
+
+void ConnectionManager::UpdateThrottled(const int64_t &now) {
+    if (next_unthrottle_ms_ < 0 || now < next_unthrottle_ms_)
+        return;
+    next_unthrottle_ms_ = -1;
+    for (auto it = throttled_streams_.begin(); it != throttled_streams_.end();) {
+        auto stream = *it;
+        if (stream->unthrottle_ms > now) {
+            if (next_unthrottle_ms_ < 0 || stream->unthrottle_ms < next_unthrottle_ms_)
+                next_unthrottle_ms_ = stream->unthrottle_ms;
+            ++it;
+            continue;
+        }
+        it = throttled_streams_.erase(it);
+        stream->unthrottle_ms = -1;
+        WatchOutside(stream);
+    }
+}
 
+int32_t ConnectionManager::SendPendingToPeer() {
+    ///frames behind peer_sealed_offset_ wait for the handshake
+    while (peer_send_offset_ < peer_sealed_offset_) {
+        auto ret = peer_->Send(peer_send_buf_.data() + peer_send_offset_, peer_sealed_offset_ - peer_send_offset_);
+        if (ret < 0) {
+            ///EINPROGRESS, the peer link was connected by fast open and its handshake is not done yet
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINPROGRESS)
+                break;
+            if (errno == EINTR)
+                continue;
+            LOG(ERROR) << "failed to call send for peer fd:" << peer_->fd() << " error:" << strerror(errno);
+            return -4;
+        }
+        peer_send_offset_ += ret;
+    }
+    if (peer_send_offset_ == peer_send_buf_.size()) {
+        peer_send_buf_.clear();
+        peer_send_offset_ = 0;
+        peer_sealed_offset_ = 0;
+    } else if (peer_send_offset_ >= kPeerSendCompactLen) {
+        ///drop the sent part so that a link which never drains does not grow forever
+        peer_send_buf_.erase(peer_send_buf_.begin(), peer_send_buf_.begin() + peer_send_offset_);
+        peer_sealed_offset_ -= peer_send_offset_;
+        peer_send_offset_ = 0;
+    }
+    bool want_write = peer_send_offset_ < peer_sealed_offset_;
+    if (want_write != peer_want_write_) {
+        ///only ask for EPOLLOUT when kernel send buffer is full
+        if (peer_->SetWantWrite(want_write) < 0)
+            return -5;
+        peer_want_write_ = want_write;
+    }
+    return 0;
+}
 
+bool ConnectionManager::PeerLinkBusy() {
+    return peer_->Busy(peer_rtt_us_);
+}
 
+int32_t ConnectionManager::SetPeerCork(bool cork) {
+    if (peer_->SetCork(cork) < 0) {
+        peer_corked_ = false;
+        return -1;
+    }
+    peer_corked_ = cork;
+    return 0;
+}
 
+void ConnectionManager::ResetPeerState() {
+    peer_recv_len_ = 0;
+    peer_send_buf_.clear();
+    peer_send_offset_ = 0;
+    peer_sealed_offset_ = 0;
+    peer_want_write_ = false;
+    scheduler_.Clear();
+    ///nothing is queued for the streams any more
+    for (auto &ele : streams_) {
+        if (backlogged_streams_ == 0)
+            break;
+        if (!ele.second->backlogged)
+            continue;
+        ele.second->backlogged = false;
+        --backlogged_streams_;
+        WatchOutside(ele.second);
+    }
+    ///a new transport reports bytes of peer from the start
+    peer_read_paused_ = false;
+    peer_corked_ = false;
+    peer_cork_deadline_ms_ = 0;
+    peer_rtt_us_ = 0;
+    peer_features_ = 0;
+    hello_sent_ = false;
+    compressor_.Clear();
+    cipher_.Reset();
+}
 
+void ConnectionManager::CloseOutsideConnection(stream_t *stream) {
+    ///a closing fd will be moved by epoll, so we don't need to worry about it
+    auto fd = stream->fd;
+    auto conn_id = stream->conn_id;
+    close(fd);
+    streams_.erase(conn_id);
+    fd_streams_.erase(fd);
+    compressor_.RemoveStream(conn_id);
+    scheduler_.RemoveStream(conn_id);
+    balancer_.Release(fd);
+    sending_streams_.erase(stream);
+    throttled_streams_.erase(stream);
+    if (stream->backlogged)
+        --backlogged_streams_;
+    stream_pool_.Release(stream);
+}
 
+void ConnectionManager::CloseOutsideStream(stream_t *stream, bool reset) {
+    ///a stream still in the handshake of its frontend was never opened to peer
+    if (stream->state == kStreamOpen && PeerConnected())
+        QueueCloseToPeer(stream->conn_id, reset);
+    if (reset)
+        set_reset_on_close(stream->fd);
+    CloseOutsideConnection(stream);
+}
 
+void ConnectionManager::CloseOutsideConnections() {
+    for (auto &ele : streams_) {
+        close(ele.second->fd);
+        stream_pool_.Release(ele.second);
+    }
+    streams_.clear();
+    fd_streams_.clear();
+    balancer_.ReleaseAll();
+    connecting_streams_.clear();
+    sending_streams_.clear();
+    throttled_streams_.clear();
+    scheduler_.RemoveStreams();
+    backlogged_streams_ = 0;
+    idle_wheel_.Clear();
+}
 
+void ConnectionManager::ClosePeerConnection() {
+    if (!PeerConnected())
+        return;
+    peer_->Close();
+    ResetPeerState();
+}
 
+}
@@ -0,0 +1,336 @@
+#include "tcptun_event_loop.h"
+#include "tcptun_common.h"
+#include <cstring>
+#include <algorithm>
+#include <sstream>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <linux/mempolicy.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <glog/logging.h>
+
+namespace tcptun {
+
+const size_t EventLoop::kMinEvents;
+const size_t EventLoop::kMaxEvents;
+const int32_t EventLoop::kShrinkWakeups;
+
+std::string loop_stats_to_string(const loop_stats_t &stats) {
+    std::ostringstream os;
+    os << "wakeups:" << stats.wakeups << " events:" << stats.events << " events_per_wakeup:"
+       << (stats.wakeups > 0 ? stats.events / stats.wakeups : 0) << " peak_events:" << stats.peak_events
+       << " full_wakeups:" << stats.full_wakeups << " busy_poll_wakeups:" << stats.busy_poll_wakeups
+       << " event_array_size:" << stats.event_array_size;
+    return os.str();
+}
+
+CallbackHandler::CallbackHandler(event_callback_t callback) : callback_(std::move(callback)) {}
+
+void CallbackHandler::HandleEvents(const epoll_data_t &data, const uint32_t &events) {
+    callback_(events);
+}
+
+EventLoop::EventLoop()
+    : epoll_fd_(-1),
+      wakeup_fd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+      events_(kMinEvents),
+      sparse_wakeups_(0),
+      busy_poll_us_(0),
+      stats_(),
+      default_handler_(nullptr),
+      next_timer_id_(1),
+      thread_id_(std::this_thread::get_id()),
+      quit_(false),
+      tasks_(wakeup_fd_) {
+    epoll_fd_ = epoll_create1(0);
+    if (epoll_fd_ < 0) {
+        LOG(ERROR) << "failed to call epoll_create1 error:" << strerror(errno);
+        return;
+    }
+    if (wakeup_fd_ < 0) {
+        LOG(ERROR) << "failed to call eventfd error:" << strerror(errno);
+        return;
+    }
+    if (AddEvent2Epoll(epoll_fd_, wakeup_fd_, EPOLLIN) < 0)
+        LOG(ERROR) << "failed to call AddEvent2Epoll epoll_fd:" << epoll_fd_ << " wakeup_fd:" << wakeup_fd_;
+}
+
+EventLoop::~EventLoop() {
+    std::vector<void *> tasks;
+    tasks_.Drain(tasks, tasks_.size());
+    for (auto task : tasks)
+        delete static_cast<task_t *>(task);
+    if (wakeup_fd_ >= 0)
+        close(wakeup_fd_);
+    if (epoll_fd_ >= 0)
+        close(epoll_fd_);
+}
+
+int32_t EventLoop::AddHandler(const int32_t &fd, const uint32_t &events, EventHandler *handler) {
+    if (fd < 0 || handler == nullptr)
+        return -1;
+    if (AddEvent2Epoll(epoll_fd_, fd, events) < 0) {
+        LOG(ERROR) << "failed to call AddEvent2Epoll epoll_fd:" << epoll_fd_ << " fd:" << fd;
+        return -2;
+    }
+    if (static_cast<size_t>(fd) >= handlers_.size())
+        handlers_.resize(fd + 1, nullptr);
+    handlers_[fd] = handler;
+    return 0;
+}
+
+int32_t EventLoop::ModHandler(const int32_t &fd, const uint32_t &events) {
+    if (ModEvent2Epoll(epoll_fd_, fd, events) < 0) {
+        LOG(ERROR) << "failed to call ModEvent2Epoll epoll_fd:" << epoll_fd_ << " fd:" << fd;
+        return -1;
+    }
+    return 0;
+}
+
+int32_t EventLoop::DelHandler(const int32_t &fd) {
+    if (fd < 0 || static_cast<size_t>(fd) >= handlers_.size() || handlers_[fd] == nullptr)
+        return -1;
+    handlers_[fd] = nullptr;
+    if (DelEvent2Epoll(epoll_fd_, fd) < 0) {
+        LOG(ERROR) << "failed to call DelEvent2Epoll epoll_fd:" << epoll_fd_ << " fd:" << fd;
+        return -2;
+    }
+    return 0;
+}
+
+void EventLoop::SetDefaultHandler(EventHandler *handler) {
+    default_handler_ = handler;
+}
+
+void EventLoop::SetTimeoutHook(const std::function<int32_t()> &hook) {
+    timeout_hook_ = hook;
+}
+
+void EventLoop::SetRoundHook(const task_t &hook) {
+    round_hook_ = hook;
+}
+
+int32_t EventLoop::PinThread(const std::vector<int32_t> &cpus) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (auto cpu : cpus) {
+        if (cpu < 0 || cpu >= CPU_SETSIZE) {
+            LOG(ERROR) << "invalid cpu:" << cpu;
+            return -1;
+        }
+        CPU_SET(cpu, &set);
+    }
+    auto ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (ret != 0) {
+        LOG(ERROR) << "failed to call pthread_setaffinity_np error:" << strerror(ret);
+        return -2;
+    }
+    ///pages are placed when they are first touched, by default on the node of the cpu touching them
+    ///unless the process was started with another policy, such as interleaving by numactl, libnuma
+    ///is not needed for the system call
+    if (syscall(SYS_set_mempolicy, MPOL_LOCAL, nullptr, 0) < 0)
+        LOG(WARNING) << "failed to call set_mempolicy error:" << strerror(errno) << ", buffers may be remote";
+    return 0;
+}
+
+void EventLoop::SetBusyPoll(const int32_t &busy_poll_us) {
+    busy_poll_us_ = std::max(0, busy_poll_us);
+}
+
+uint64_t EventLoop::RunAt(const int64_t &when_ms, const task_t &task) {
+    timer_t timer;
+    timer.id = next_timer_id_++;
+    timer.interval_ms = 0;
+    timer.task = task;
+    timers_.emplace(when_ms, std::move(timer));
+    return next_timer_id_ - 1;
+}
+
+uint64_t EventLoop::RunAfter(const int32_t &delay_ms, const task_t &task) {
+    return RunAt(getnowtime_ms() + std::max(0, delay_ms), task);
+}
+
+uint64_t EventLoop::RunEvery(const int32_t &interval_ms, const task_t &task) {
+    timer_t timer;
+    timer.id = next_timer_id_++;
+    ///a timer of zero interval would fire in every round
+    timer.interval_ms = std::max(1, interval_ms);
+    timer.task = task;
+    timers_.emplace(getnowtime_ms() + timer.interval_ms, std::move(timer));
+    return next_timer_id_ - 1;
+}
+
+void EventLoop::CancelTimer(const uint64_t &id) {
+    for (auto it = timers_.begin(); it != timers_.end(); ++it) {
+        if (it->second.id == id) {
+            timers_.erase(it);
+            return;
+        }
+    }
+    std::replace(firing_timers_.begin(), firing_timers_.end(), id, static_cast<uint64_t>(0));
+}
+
+void EventLoop::RunInLoop(const task_t &task) {
+    if (InLoopThread())
+        task();
+    else
+        QueueInLoop(task);
+}
+
+void EventLoop::QueueInLoop(const task_t &task) {
+    ///the loop is woken up only by the first of the tasks queued before it takes them
+    tasks_.Push(new task_t(task));
+}
+
+void EventLoop::Wakeup() {
+    notify_event_fd(wakeup_fd_);
+}
+
+int32_t EventLoop::Loop() {
+    thread_id_ = std::this_thread::get_id();
+    quit_ = false;
+    while (!quit_) {
+        auto nfds = Wait(NextTimeoutMs(getnowtime_ms()));
+        if (nfds < 0) {
+            if (errno != EINTR) {
+                LOG(ERROR) << "epoll_wait return error:" << strerror(errno);
+                return -1;
+            }
+            nfds = 0;
+        }
+        for (int i = 0; i < nfds; ++i) {
+            ///epoll_event is packed, its data can't be referred to
+            epoll_data_t data = events_[i].data;
+            ///fds registered by AddHandler keep their number in the whole of data, stream pointers and
+            ///the like are far beyond any fd
+            if (data.u64 < handlers_.size() && handlers_[data.u64] != nullptr)
+                handlers_[data.u64]->HandleEvents(data, events_[i].events);
+            else if (data.u64 == static_cast<uint64_t>(wakeup_fd_))
+                HandleWakeup();
+            else if (default_handler_ != nullptr)
+                default_handler_->HandleEvents(data, events_[i].events);
+        }
+        ResizeEvents(nfds);
+        RunTimers(getnowtime_ms());
+        RunTasks();
+        if (round_hook_)
+            round_hook_();
+    }
+    return 0;
+}
+
+void EventLoop::Quit() {
+    quit_ = true;
+    if (!InLoopThread())
+        Wakeup();
+}
+
+int32_t EventLoop::NextTimeoutMs(const int64_t &now) {
+    int32_t timeout_ms = timeout_hook_ ? timeout_hook_() : -1;
+    if (!timers_.empty()) {
+        auto timer_ms = static_cast<int32_t>(std::max<int64_t>(0, timers_.begin()->first - now));
+        if (timeout_ms < 0 || timer_ms < timeout_ms)
+            timeout_ms = timer_ms;
+    }
+    if (tasks_.size() > 0)
+        timeout_ms = 0;
+    return timeout_ms;
+}
+
+int32_t EventLoop::Wait(int32_t timeout_ms) {
+    auto max_events = static_cast<int>(events_.size());
+    if (busy_poll_us_ > 0 && timeout_ms != 0) {
+        auto start_us = getnowtime_us();
+        ///the spin never outlasts the wait it replaces
+        auto spin_us = timeout_ms < 0 ? busy_poll_us_ : std::min<int64_t>(busy_poll_us_, 1000LL * timeout_ms);
+        auto now_us = start_us;
+        do {
+            auto nfds = epoll_wait(epoll_fd_, events_.data(), max_events, 0);
+            if (nfds > 0)
+                ++stats_.busy_poll_wakeups;
+            if (nfds != 0)
+                return nfds;
+            now_us = getnowtime_us();
+        } while (now_us - start_us < spin_us);
+        if (timeout_ms > 0)
+            timeout_ms = std::max<int32_t>(0, timeout_ms - static_cast<int32_t>((now_us - start_us) / 1000));
+    }
+    return epoll_wait(epoll_fd_, events_.data(), max_events, timeout_ms);
+}
+
+void EventLoop::ResizeEvents(const int32_t &nfds) {
+    ///a wait which timed out counts as a sparse one too
+    if (nfds > 0) {
+        ++stats_.wakeups;
+        stats_.events += nfds;
+        stats_.peak_events = std::max(stats_.peak_events, nfds);
+    }
+    auto used = static_cast<size_t>(nfds);
+    if (used == events_.size()) {
+        ///more events may be ready, take them in fewer calls from now on
+        ++stats_.full_wakeups;
+        sparse_wakeups_ = 0;
+        if (events_.size() < kMaxEvents)
+            events_.resize(std::min(kMaxEvents, events_.size() * 2));
+        return;
+    }
+    if (used > events_.size() / 4 || events_.size() <= kMinEvents) {
+        sparse_wakeups_ = 0;
+        return;
+    }
+    if (++sparse_wakeups_ < kShrinkWakeups)
+        return;
+    sparse_wakeups_ = 0;
+    events_.resize(std::max(kMinEvents, events_.size() / 2));
+    events_.shrink_to_fit();
+}
+
+loop_stats_t EventLoop::Stats() const {
+    auto stats = stats_;
+    stats.event_array_size = events_.size();
+    return stats;
+}
+
+void EventLoop::HandleWakeup() {
+    uint64_t count = 0;
+    while (read(wakeup_fd_, &count, sizeof(count)) == sizeof(count)) {}
+}
+
+void EventLoop::RunTimers(const int64_t &now) {
+    std::vector<std::pair<int64_t, timer_t>> due;
+    while (!timers_.empty() && timers_.begin()->first <= now) {
+        due.emplace_back(timers_.begin()->first, std::move(timers_.begin()->second));
+        timers_.erase(timers_.begin());
+    }
+    if (due.empty())
+        return;
+    firing_timers_.clear();
+    for (auto &ele : due)
+        firing_timers_.push_back(ele.second.id);
+    for (size_t i = 0; i < due.size(); ++i) {
+        if (firing_timers_[i] == 0)
+            continue;
+        due[i].second.task();
+        if (firing_timers_[i] == 0 || due[i].second.interval_ms == 0)
+            continue;
+        ///a late round does not make the timer fire more often to catch up
+        auto &timer = due[i].second;
+        timers_.emplace(std::max(due[i].first + timer.interval_ms, now), std::move(timer));
+    }
+    firing_timers_.clear();
+}
+
+void EventLoop::RunTasks() {
+    ///tasks queued by these ones run in the next round
+    std::vector<void *> tasks;
+    tasks_.Drain(tasks, tasks_.size());
+    for (auto task : tasks) {
+        std::unique_ptr<task_t> owned(static_cast<task_t *>(task));
+        (*owned)();
+    }
+}
+
+}
@@ -0,0 +1,365 @@
+#include "tcptun_fec.h"
+#include <cstring>
+#include <algorithm>
+#include <glog/logging.h>
+#include "tcptun_common.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TCPTUN_FEC_X86 1
+#endif
+
+namespace tcptun {
+
+namespace {
+///decoder forgets groups this far behind the newest one
+const uint32_t kMaxFecGroups = 256;
+
+struct gf256_tables_t {
+  uint8_t exp[512];
+  uint8_t log[256];
+  uint8_t mul[256][256];
+  ///c * x = lo[c][x & 0x0f] ^ hi[c][x >> 4], used by the shuffle based multiply
+  uint8_t lo[256][16];
+  uint8_t hi[256][16];
+  gf256_tables_t() {
+      ///primitive polynomial x^8 + x^4 + x^3 + x^2 + 1
+      uint32_t x = 1;
+      for (int32_t i = 0; i < 255; ++i) {
+          exp[i] = static_cast<uint8_t>(x);
+          log[x] = static_cast<uint8_t>(i);
+          x <<= 1;
+          if (x & 0x100)
+              x ^= 0x11d;
+      }
+      for (int32_t i = 255; i < 512; ++i)
+          exp[i] = exp[i - 255];
+      log[0] = 0;
+      for (int32_t a = 0; a < 256; ++a) {
+          for (int32_t b = 0; b < 256; ++b)
+              mul[a][b] = (a == 0 || b == 0) ? 0 : exp[log[a] + log[b]];
+          for (int32_t n = 0; n < 16; ++n) {
+              lo[a][n] = mul[a][n];
+              hi[a][n] = mul[a][n << 4];
+          }
+      }
+  }
+};
+
+const gf256_tables_t &gf256() {
+    static gf256_tables_t tables;
+    return tables;
+}
+
+uint8_t gf256_inv(const uint8_t &a) {
+    return gf256().exp[255 - gf256().log[a]];
+}
+
+typedef size_t (*mul_add_func_t)(const uint8_t &c, const uint8_t *src, uint8_t *dst, const size_t &len);
+
+size_t mul_add_scalar(const uint8_t &c, const uint8_t *src, uint8_t *dst, const size_t &len) {
+    const uint8_t *row = gf256().mul[c];
+    for (size_t i = 0; i < len; ++i)
+        dst[i] ^= row[src[i]];
+    return len;
+}
+
+#ifdef TCPTUN_FEC_X86
+__attribute__((target("ssse3")))
+size_t mul_add_ssse3(const uint8_t &c, const uint8_t *src, uint8_t *dst, const size_t &len) {
+    const __m128i table_lo = _mm_loadu_si128(reinterpret_cast<const __m128i *>(gf256().lo[c]));
+    const __m128i table_hi = _mm_loadu_si128(reinterpret_cast<const __m128i *>(gf256().hi[c]));
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+        __m128i l = _mm_and_si128(s, mask);
+        __m128i h = _mm_and_si128(_mm_srli_epi64(s, 4), mask);
+        __m128i p = _mm_xor_si128(_mm_shuffle_epi8(table_lo, l), _mm_shuffle_epi8(table_hi, h));
+        __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i *>(dst + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm_xor_si128(d, p));
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+size_t mul_add_avx2(const uint8_t &c, const uint8_t *src, uint8_t *dst, const size_t &len) {
+    const __m256i table_lo = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(gf256().lo[c])));
+    const __m256i table_hi = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(gf256().hi[c])));
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+        __m256i l = _mm256_and_si256(s, mask);
+        __m256i h = _mm256_and_si256(_mm256_srli_epi64(s, 4), mask);
+        __m256i p = _mm256_xor_si256(_mm256_shuffle_epi8(table_lo, l), _mm256_shuffle_epi8(table_hi, h));
+        __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(dst + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), _mm256_xor_si256(d, p));
+    }
+    return i;
+}
+#endif
+
+mul_add_func_t select_mul_add() {
+#ifdef TCPTUN_FEC_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return mul_add_avx2;
+    if (__builtin_cpu_supports("ssse3"))
+        return mul_add_ssse3;
+#endif
+    return mul_add_scalar;
+}
+
+///invert a n x n matrix in place by gauss-jordan elimination
+int32_t invert_matrix(std::vector<uint8_t> &m, const int32_t &n) {
+    std::vector<uint8_t> inv(n * n, 0);
+    for (int32_t i = 0; i < n; ++i)
+        inv[i * n + i] = 1;
+    for (int32_t col = 0; col < n; ++col) {
+        int32_t pivot = col;
+        while (pivot < n && m[pivot * n + col] == 0)
+            ++pivot;
+        if (pivot == n)
+            return -1;
+        if (pivot != col) {
+            for (int32_t k = 0; k < n; ++k) {
+                std::swap(m[pivot * n + k], m[col * n + k]);
+                std::swap(inv[pivot * n + k], inv[col * n + k]);
+            }
+        }
+        uint8_t scale = gf256_inv(m[col * n + col]);
+        for (int32_t k = 0; k < n; ++k) {
+            m[col * n + k] = gf256().mul[scale][m[col * n + k]];
+            inv[col * n + k] = gf256().mul[scale][inv[col * n + k]];
+        }
+        for (int32_t row = 0; row < n; ++row) {
+            uint8_t factor = m[row * n + col];
+            if (row == col || factor == 0)
+                continue;
+            for (int32_t k = 0; k < n; ++k) {
+                m[row * n + k] ^= gf256().mul[factor][m[col * n + k]];
+                inv[row * n + k] ^= gf256().mul[factor][inv[col * n + k]];
+            }
+        }
+    }
+    m.swap(inv);
+    return 0;
+}
+}
+
+void gf256_mul_add_region(const uint8_t &c, const uint8_t *src, uint8_t *dst, const size_t &len) {
+    static const mul_add_func_t mul_add = select_mul_add();
+    if (c == 0)
+        return;
+    size_t done = 0;
+    if (c == 1) {
+        for (; done < len; ++done)
+            dst[done] ^= src[done];
+        return;
+    }
+    done = mul_add(c, src, dst, len);
+    if (done < len)
+        mul_add_scalar(c, src + done, dst + done, len - done);
+}
+
+ReedSolomon::ReedSolomon(const int32_t &data_shards, const int32_t &parity_shards)
+    : data_shards_(0), parity_shards_(0) {
+    ///the rows of the parity shards are numbered in GF(256), the codec is left without shards otherwise
+    if (data_shards <= 0 || parity_shards < 0 || data_shards + parity_shards > 256) {
+        LOG(ERROR) << "invalid shards data_shards:" << data_shards << " parity_shards:" << parity_shards;
+        return;
+    }
+    data_shards_ = data_shards;
+    parity_shards_ = parity_shards;
+    matrix_.assign((data_shards_ + parity_shards_) * data_shards_, 0);
+    for (int32_t i = 0; i < data_shards_; ++i)
+        matrix_[i * data_shards_ + i] = 1;
+    ///cauchy matrix 1 / (x_i ^ y_j) with x_i = data_shards + i and y_j = j
+    for (int32_t i = 0; i < parity_shards_; ++i) {
+        for (int32_t j = 0; j < data_shards_; ++j) {
+            auto x = static_cast<uint8_t>(data_shards_ + i);
+            matrix_[(data_shards_ + i) * data_shards_ + j] = gf256_inv(static_cast<uint8_t>(x ^ j));
+        }
+    }
+}
+
+int32_t ReedSolomon::Encode(const std::vector<const uint8_t *> &data,
+                            const std::vector<uint8_t *> &parity,
+                            const size_t &shard_len) {
+    if (!Valid())
+        return -1;
+    if (static_cast<int32_t>(data.size()) != data_shards_ || static_cast<int32_t>(parity.size()) != parity_shards_)
+        return -1;
+    for (int32_t i = 0; i < parity_shards_; ++i) {
+        memset(parity[i], 0, shard_len);
+        const uint8_t *row = matrix_.data() + (data_shards_ + i) * data_shards_;
+        for (int32_t j = 0; j < data_shards_; ++j)
+            gf256_mul_add_region(row[j], data[j], parity[i], shard_len);
+    }
+    return 0;
+}
+
+int32_t ReedSolomon::Reconstruct(const std::vector<uint8_t *> &shards,
+                                 const std::vector<bool> &present,
+                                 const size_t &shard_len) {
+    if (!Valid())
+        return -1;
+    auto total = data_shards_ + parity_shards_;
+    if (static_cast<int32_t>(shards.size()) != total || static_cast<int32_t>(present.size()) != total)
+        return -1;
+    ///prefer data shards, the rows of them in the matrix are trivial
+    std::vector<int32_t> rows;
+    for (int32_t i = 0; i < total && static_cast<int32_t>(rows.size()) < data_shards_; ++i) {
+        if (present[i])
+            rows.push_back(i);
+    }
+    if (static_cast<int32_t>(rows.size()) < data_shards_)
+        return -2;
+    std::vector<uint8_t> sub(data_shards_ * data_shards_);
+    for (int32_t r = 0; r < data_shards_; ++r)
+        memcpy(sub.data() + r * data_shards_, matrix_.data() + rows[r] * data_shards_, data_shards_);
+    if (invert_matrix(sub, data_shards_) < 0)
+        return -3;
+    for (int32_t d = 0; d < data_shards_; ++d) {
+        if (present[d])
+            continue;
+        memset(shards[d], 0, shard_len);
+        for (int32_t r = 0; r < data_shards_; ++r)
+            gf256_mul_add_region(sub[d * data_shards_ + r], shards[rows[r]], shards[d], shard_len);
+    }
+    return 0;
+}
+
+FecEncoder::FecEncoder(const int32_t &data_shards, const int32_t &parity_shards)
+    : rs_(data_shards, parity_shards), group_id_(0) {}
+
+int32_t FecEncoder::Encode(const char *data, const size_t &len, std::vector<std::vector<char>> &packets) {
+    if (!rs_.Valid() || len > 0xffff)
+        return -1;
+    std::vector<char> packet(kFecHeaderLen + 2 + len);
+    write_u32(packet.data(), group_id_);
+    packet[4] = static_cast<char>(shards_.size());
+    packet[5] = static_cast<char>(rs_.data_shards());
+    packet[6] = static_cast<char>(rs_.parity_shards());
+    packet[7] = 0;
+    write_u16(packet.data() + kFecHeaderLen, static_cast<uint16_t>(len));
+    memcpy(packet.data() + kFecHeaderLen + 2, data, len);
+    shards_.emplace_back(packet.begin() + kFecHeaderLen, packet.end());
+    packets.push_back(std::move(packet));
+    if (static_cast<int32_t>(shards_.size()) < rs_.data_shards())
+        return 0;
+    ///group is complete, shorter shards are padded with zero to the longest one
+    size_t shard_len = 0;
+    for (auto &shard : shards_)
+        shard_len = std::max(shard_len, shard.size());
+    std::vector<const uint8_t *> data_ptrs;
+    for (auto &shard : shards_) {
+        shard.resize(shard_len, 0);
+        data_ptrs.push_back(shard.data());
+    }
+    std::vector<std::vector<char>> parity(rs_.parity_shards(), std::vector<char>(kFecHeaderLen + shard_len));
+    std::vector<uint8_t *> parity_ptrs;
+    for (int32_t i = 0; i < rs_.parity_shards(); ++i) {
+        write_u32(parity[i].data(), group_id_);
+        parity[i][4] = static_cast<char>(rs_.data_shards() + i);
+        parity[i][5] = static_cast<char>(rs_.data_shards());
+        parity[i][6] = static_cast<char>(rs_.parity_shards());
+        parity[i][7] = 0;
+        parity_ptrs.push_back(reinterpret_cast<uint8_t *>(parity[i].data() + kFecHeaderLen));
+    }
+    auto ret = rs_.Encode(data_ptrs, parity_ptrs, shard_len);
+    shards_.clear();
+    ++group_id_;
+    if (ret < 0) {
+        LOG(ERROR) << "failed to call ReedSolomon Encode ret:" << ret;
+        return -2;
+    }
+    for (auto &p : parity)
+        packets.push_back(std::move(p));
+    return 0;
+}
+
+FecDecoder::FecDecoder(const int32_t &data_shards, const int32_t &parity_shards)
+    : rs_(data_shards, parity_shards), recovered_(0) {}
+
+int32_t FecDecoder::Decode(const char *packet, const size_t &len, std::vector<std::vector<char>> &datas) {
+    if (!rs_.Valid() || len < kFecHeaderLen + 2)
+        return -1;
+    auto group_id = read_u32(packet);
+    auto index = static_cast<uint8_t>(packet[4]);
+    auto total = rs_.data_shards() + rs_.parity_shards();
+    if (static_cast<uint8_t>(packet[5]) != rs_.data_shards() || static_cast<uint8_t>(packet[6]) != rs_.parity_shards()
+        || index >= total) {
+        LOG(WARNING) << "fec datagram does not match local shards index:" << static_cast<int32_t>(index);
+        return -2;
+    }
+    const char *shard = packet + kFecHeaderLen;
+    size_t shard_len = len - kFecHeaderLen;
+    if (index < rs_.data_shards()) {
+        size_t data_len = read_u16(shard);
+        if (data_len + 2 > shard_len)
+            return -3;
+    }
+    auto it = groups_.find(group_id);
+    if (it == groups_.end()) {
+        ///forget the groups which are too old to be completed
+        for (auto old = groups_.begin(); old != groups_.end();) {
+            if (static_cast<int32_t>(group_id - old->first) > static_cast<int32_t>(kMaxFecGroups))
+                old = groups_.erase(old);
+            else
+                ++old;
+        }
+        group_t group;
+        group.shards.resize(total);
+        group.present.assign(total, false);
+        group.received = 0;
+        group.done = false;
+        it = groups_.insert(std::make_pair(group_id, std::move(group))).first;
+    }
+    auto &group = it->second;
+    if (group.done || group.present[index])
+        return 0;
+    if (index < rs_.data_shards())
+        datas.emplace_back(shard + 2, shard + 2 + read_u16(shard));
+    group.shards[index].assign(shard, shard + shard_len);
+    group.present[index] = true;
+    if (++group.received < rs_.data_shards())
+        return 0;
+    group.done = true;
+    size_t parity_len = 0;
+    for (int32_t i = rs_.data_shards(); i < total; ++i) {
+        if (group.present[i])
+            parity_len = group.shards[i].size();
+    }
+    if (parity_len != 0) {
+        ///some data shards are lost, rebuild them from the parity
+        std::vector<uint8_t *> ptrs;
+        for (int32_t i = 0; i < total; ++i) {
+            if (group.present[i] && group.shards[i].size() > parity_len)
+                return -4;
+            group.shards[i].resize(parity_len, 0);
+            ptrs.push_back(group.shards[i].data());
+        }
+        auto ret = rs_.Reconstruct(ptrs, group.present, parity_len);
+        if (ret < 0) {
+            LOG(ERROR) << "failed to call ReedSolomon Reconstruct ret:" << ret;
+            return -5;
+        }
+        for (int32_t i = 0; i < rs_.data_shards(); ++i) {
+            if (group.present[i])
+                continue;
+            size_t data_len = read_u16(reinterpret_cast<const char *>(group.shards[i].data()));
+            if (data_len + 2 > parity_len)
+                continue;
+            datas.emplace_back(group.shards[i].begin() + 2, group.shards[i].begin() + 2 + data_len);
+            ++recovered_;
+        }
+    }
+    group.shards.clear();
+    group.shards.shrink_to_fit();
+    return 0;
+}
+
+}
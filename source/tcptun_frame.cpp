@@ -0,0 +1,32 @@
+#include "tcptun_frame.h"
+#include "tcptun_common.h"
+
+namespace tcptun {
+
+void write_frame_header(char *p, const frame_header_t &header) {
+    write_u32(p, header.conn_id);
+    *(unsigned char *) (p + 4) = header.type;
+    *(unsigned char *) (p + 5) = header.flags;
+    write_u16(p + 6, header.length);
+}
+
+void read_frame_header(const char *p, frame_header_t &header) {
+    header.conn_id = read_u32(p);
+    header.type = *(const unsigned char *) (p + 4);
+    header.flags = *(const unsigned char *) (p + 5);
+    header.length = read_u16(p + 6);
+}
+
+uint8_t write_priority_flags(const int32_t &priority, const int32_t &weight) {
+    return kFrameFlagPriority | static_cast<uint8_t>(((weight - 1) & 0x1f) << 2) | static_cast<uint8_t>(priority & 0x03);
+}
+
+bool read_priority_flags(const uint8_t &flags, int32_t &priority, int32_t &weight) {
+    if (!(flags & kFrameFlagPriority))
+        return false;
+    priority = flags & 0x03;
+    weight = ((flags >> 2) & 0x1f) + 1;
+    return true;
+}
+
+}
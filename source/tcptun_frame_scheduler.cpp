@@ -0,0 +1,151 @@
+#include "tcptun_frame_scheduler.h"
+#include <algorithm>
+#include "tcptun_frame.h"
+
+namespace tcptun {
+
+namespace {
+///bytes a stream of weight one sends in its turn, two frames of a full read of an outside connection
+const int64_t kSchedulerQuantum = 4096;
+///sent frames are dropped from the queue of a stream once they take this many bytes
+const size_t kSchedulerCompactLen = 64 * 1024;
+}
+
+FrameScheduler::FrameScheduler(const priority_policy_t &policy) : policy_(policy), credits_(), bytes_(0) {}
+
+void FrameScheduler::SetStream(const uint32_t &conn_id, const int32_t &priority, const int32_t &weight) {
+    stream_t stream;
+    stream.priority = (priority >= 0 && priority < kPriorityClasses) ? priority : policy_.default_class;
+    stream.weight = std::min(std::max(weight, 1), kMaxPriorityWeight);
+    streams_[conn_id] = stream;
+}
+
+void FrameScheduler::RemoveStream(const uint32_t &conn_id) {
+    streams_.erase(conn_id);
+}
+
+void FrameScheduler::RemoveStreams() {
+    streams_.clear();
+}
+
+bool FrameScheduler::Stream(const uint32_t &conn_id, int32_t &priority, int32_t &weight) const {
+    auto it = streams_.find(conn_id);
+    if (it == streams_.end())
+        return false;
+    priority = it->second.priority;
+    weight = it->second.weight;
+    return true;
+}
+
+void FrameScheduler::Push(const uint32_t &conn_id, const char *frame, const size_t &len) {
+    auto it = queues_.find(conn_id);
+    if (it == queues_.end()) {
+        queue_t queue;
+        auto stream = streams_.find(conn_id);
+        ///frames of a stream peer never heard of, such as the close of a refused one, go with the default class
+        queue.priority = stream != streams_.end() ? stream->second.priority : policy_.default_class;
+        queue.weight = stream != streams_.end() ? stream->second.weight : 1;
+        queue.offset = 0;
+        ///a new stream starts with a full turn
+        queue.deficit = kSchedulerQuantum * queue.weight;
+        it = queues_.emplace(conn_id, std::move(queue)).first;
+        active_[it->second.priority].push_back(conn_id);
+    }
+    auto &queue = it->second;
+    if (queue.offset >= kSchedulerCompactLen) {
+        queue.frames.erase(0, queue.offset);
+        queue.offset = 0;
+    }
+    queue.frames.append(frame, len);
+    bytes_ += len;
+}
+
+size_t FrameScheduler::Pop(uint32_t &conn_id, const char *&frame) {
+    auto priority = ClassToServe();
+    if (priority < 0)
+        return 0;
+    auto &ring = active_[priority];
+    while (true) {
+        conn_id = ring.front();
+        auto &queue = queues_[conn_id];
+        frame_header_t header = {0};
+        read_frame_header(queue.frames.data() + queue.offset, header);
+        auto len = kFrameHeaderLen + header.length;
+        if (queue.deficit < static_cast<int64_t>(len)) {
+            ///the turn of the stream is over, what it did not use is kept for the next one
+            queue.deficit += kSchedulerQuantum * queue.weight;
+            ring.pop_front();
+            ring.push_back(conn_id);
+            continue;
+        }
+        queue.deficit -= len;
+        auto offset = queue.offset;
+        queue.offset += len;
+        bytes_ -= len;
+        if (queue.offset < queue.frames.size()) {
+            frame = queue.frames.data() + offset;
+        } else {
+            ///the last frame of the stream stays valid in popped_ after its queue is gone
+            popped_.swap(queue.frames);
+            frame = popped_.data() + offset;
+            queues_.erase(conn_id);
+            ring.pop_front();
+        }
+        UpdateCredits(priority, len);
+        return len;
+    }
+}
+
+size_t FrameScheduler::Queued(const uint32_t &conn_id) const {
+    auto it = queues_.find(conn_id);
+    return it == queues_.end() ? 0 : it->second.frames.size() - it->second.offset;
+}
+
+void FrameScheduler::Clear() {
+    queues_.clear();
+    for (auto &ring : active_)
+        ring.clear();
+    std::fill(credits_, credits_ + kPriorityClasses, 0);
+    bytes_ = 0;
+}
+
+void FrameScheduler::UpdateCredits(const int32_t &served, const size_t &len) {
+    bool ahead = false;
+    for (int32_t priority = 0; priority < kPriorityClasses; ++priority) {
+        if (priority == served) {
+            ///a class served ahead of higher ones pays with its credits
+            if (active_[priority].empty())
+                credits_[priority] = 0;
+            else if (ahead)
+                credits_[priority] -= static_cast<int64_t>(len) * 100;
+            continue;
+        }
+        if (active_[priority].empty()) {
+            ///credits are for waiting, a class can't save them up while it is idle
+            credits_[priority] = 0;
+            continue;
+        }
+        if (priority < served) {
+            ahead = true;
+            continue;
+        }
+        credits_[priority] = std::min(credits_[priority] + static_cast<int64_t>(len) * policy_.share_percent,
+                                      kSchedulerQuantum * 100);
+    }
+}
+
+int32_t FrameScheduler::ClassToServe() const {
+    int32_t first = 0;
+    while (first < kPriorityClasses && active_[first].empty())
+        ++first;
+    if (first == kPriorityClasses)
+        return -1;
+    ///a waiting class which has earned its share goes ahead
+    for (auto priority = first + 1; priority < kPriorityClasses; ++priority) {
+        if (!active_[priority].empty() && credits_[priority] > 0)
+            return priority;
+    }
+    return first;
+}
+
+}
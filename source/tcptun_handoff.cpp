@@ -0,0 +1,127 @@
+#include "tcptun_handoff.h"
+#include <cstring>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <glog/logging.h>
+#include "tcptun_common.h"
+
+namespace tcptun {
+
+namespace {
+///type(4) | features(4) | fd count(4)
+const size_t kHandoffMsgLen = 12;
+///the running process answers within one round of its event loop
+const int32_t kHandoffRecvTimeoutMs = 5000;
+}
+
+int32_t send_handoff_msg(const int32_t &fd, const handoff_msg_t &msg) {
+    if (msg.fds.empty() || msg.fds.size() > kMaxHandoffFds) {
+        LOG(ERROR) << "invalid fd count:" << msg.fds.size() << " of handoff message";
+        return -1;
+    }
+    char data[kHandoffMsgLen];
+    write_u32(data, msg.type);
+    write_u32(data + 4, msg.features);
+    write_u32(data + 8, static_cast<uint32_t>(msg.fds.size()));
+    struct iovec iov;
+    iov.iov_base = data;
+    iov.iov_len = sizeof(data);
+    char control[CMSG_SPACE(sizeof(int32_t) * kMaxHandoffFds)];
+    memset(control, 0, sizeof(control));
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control;
+    hdr.msg_controllen = CMSG_SPACE(sizeof(int32_t) * msg.fds.size());
+    auto cmsg = CMSG_FIRSTHDR(&hdr);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int32_t) * msg.fds.size());
+    memcpy(CMSG_DATA(cmsg), msg.fds.data(), sizeof(int32_t) * msg.fds.size());
+    ssize_t ret;
+    do {
+        ret = sendmsg(fd, &hdr, MSG_NOSIGNAL);
+    } while (ret < 0 && errno == EINTR);
+    if (ret != static_cast<ssize_t>(sizeof(data))) {
+        LOG(ERROR) << "failed to call sendmsg for handoff fd:" << fd << " error:" << strerror(errno);
+        return -2;
+    }
+    return 0;
+}
+
+int32_t recv_handoff_msg(const int32_t &fd, handoff_msg_t &msg) {
+    msg.fds.clear();
+    char data[kHandoffMsgLen];
+    struct iovec iov;
+    iov.iov_base = data;
+    iov.iov_len = sizeof(data);
+    char control[CMSG_SPACE(sizeof(int32_t) * kMaxHandoffFds)];
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control;
+    hdr.msg_controllen = sizeof(control);
+    ssize_t ret;
+    do {
+        ret = recvmsg(fd, &hdr, MSG_CMSG_CLOEXEC);
+    } while (ret < 0 && errno == EINTR);
+    if (ret == 0)
+        return 1;
+    if (ret < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            LOG(ERROR) << "failed to call recvmsg for handoff fd:" << fd << " error:" << strerror(errno);
+        return -1;
+    }
+    for (auto cmsg = CMSG_FIRSTHDR(&hdr); cmsg != nullptr; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        auto count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int32_t);
+        msg.fds.resize(count);
+        memcpy(msg.fds.data(), CMSG_DATA(cmsg), sizeof(int32_t) * count);
+    }
+    ///a stream socket never splits a message this small, anything else is not from tcptun server
+    if (ret != static_cast<ssize_t>(sizeof(data)) || (hdr.msg_flags & MSG_CTRUNC) ||
+        msg.fds.size() != read_u32(data + 8)) {
+        LOG(ERROR) << "invalid handoff message len:" << ret << " fds:" << msg.fds.size();
+        for (auto &received : msg.fds)
+            close(received);
+        msg.fds.clear();
+        return -2;
+    }
+    msg.type = read_u32(data);
+    msg.features = read_u32(data + 4);
+    return 0;
+}
+
+int32_t connect_handoff(const std::string &path, int32_t &fd) {
+    struct sockaddr_un addr;
+    if (path.empty() || path.size() >= sizeof(addr.sun_path))
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.data(), path.size());
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        LOG(ERROR) << "create new unix socket failed" << strerror(errno);
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        ///nobody to take over from, which is the case of a cold start
+        close(fd);
+        fd = -1;
+        return -2;
+    }
+    struct timeval timeout;
+    timeout.tv_sec = kHandoffRecvTimeoutMs / 1000;
+    timeout.tv_usec = kHandoffRecvTimeoutMs % 1000 * 1000;
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0)
+        LOG(WARNING) << "failed to call setsockopt SO_RCVTIMEO error:" << strerror(errno);
+    return 0;
+}
+
+}
@@ -0,0 +1,149 @@
+#include "tcptun_happy_eyeballs.h"
+#include <cstring>
+#include <algorithm>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <glog/logging.h>
+
+namespace tcptun {
+
+namespace {
+///an attempt which found no fd free is retried after this, the owner frees fds meanwhile
+const int32_t kOutOfFdsRetryMs = 50;
+}
+
+HappyEyeballs::HappyEyeballs(const int32_t &epoll_fd, const std::vector<socket_address_t> &addrs,
+                             const connect_policy_t &policy)
+    : epoll_fd_(epoll_fd),
+      policy_(policy),
+      next_(0),
+      next_attempt_ms_(0),
+      deadline_ms_(0),
+      winner_(-1),
+      out_of_fds_(false) {
+    ///the preferred family goes first, then the families take turns so a broken one costs one delay
+    std::vector<socket_address_t> first, second;
+    for (auto &address : addrs) {
+        if (address.addr.ss_family == addrs.front().addr.ss_family)
+            first.push_back(address);
+        else
+            second.push_back(address);
+    }
+    for (size_t i = 0; i < std::max(first.size(), second.size()); ++i) {
+        if (i < first.size())
+            addrs_.push_back(first[i]);
+        if (i < second.size())
+            addrs_.push_back(second[i]);
+    }
+}
+
+HappyEyeballs::~HappyEyeballs() {
+    CloseAttempts();
+}
+
+bool HappyEyeballs::Owns(const int32_t &fd) const {
+    for (auto &attempt : attempts_) {
+        if (attempt.first == fd)
+            return true;
+    }
+    return false;
+}
+
+int32_t HappyEyeballs::Start(const int64_t &now_ms) {
+    deadline_ms_ = now_ms + policy_.timeout_ms;
+    next_attempt_ms_ = now_ms;
+    return Update(now_ms);
+}
+
+void HappyEyeballs::StartAttempt(const int64_t &now_ms) {
+    auto index = next_;
+    int32_t fd = -1;
+    if (new_connecting_socket(addrs_[index], policy_.fastopen, fd) < 0) {
+        if (errno == EMFILE || errno == ENFILE) {
+            ///keep the address for a retry once the owner has freed some fds
+            out_of_fds_ = true;
+            next_attempt_ms_ = now_ms + kOutOfFdsRetryMs;
+            return;
+        }
+        ///nothing to wait for, go on with the next address at once
+        ++next_;
+        next_attempt_ms_ = now_ms;
+        return;
+    }
+    ++next_;
+    if (AddEvent2Epoll(epoll_fd_, fd, EPOLLOUT) < 0) {
+        LOG(ERROR) << "failed to call AddEvent2Epoll epoll_fd:" << epoll_fd_ << " fd:" << fd;
+        close(fd);
+        next_attempt_ms_ = now_ms;
+        return;
+    }
+    attempts_.emplace_back(fd, index);
+    next_attempt_ms_ = now_ms + policy_.attempt_delay_ms;
+}
+
+int32_t HappyEyeballs::HandleEvent(const int32_t &fd, const int64_t &now_ms) {
+    auto it = std::find_if(attempts_.begin(), attempts_.end(),
+                           [&fd](const std::pair<int32_t, size_t> &attempt) { return attempt.first == fd; });
+    if (it == attempts_.end())
+        return winner_ >= 0 ? kRaceWon : kRaceRunning;
+    int32_t error = 0;
+    socklen_t len = sizeof(error);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0)
+        error = errno;
+    if (error == 0) {
+        ///a connected fd is watched by its owner for EPOLLIN from now on
+        DelEvent2Epoll(epoll_fd_, fd);
+        winner_ = fd;
+        attempts_.erase(it);
+        CloseAttempts();
+        return kRaceWon;
+    }
+    LOG(WARNING) << "failed to connect to " << address_to_string(addrs_[it->second]) << " error:" << strerror(error);
+    ///a closing fd will be moved by epoll, so we don't need to worry about it
+    close(fd);
+    attempts_.erase(it);
+    ///a failed attempt hands its turn to the next address at once
+    next_attempt_ms_ = now_ms;
+    return Update(now_ms);
+}
+
+int32_t HappyEyeballs::Update(const int64_t &now_ms) {
+    if (winner_ >= 0)
+        return kRaceWon;
+    if (now_ms >= deadline_ms_) {
+        LOG(WARNING) << "no address of " << addrs_.size() << " connected in " << policy_.timeout_ms << "ms";
+        CloseAttempts();
+        return -1;
+    }
+    while (next_ < addrs_.size() && now_ms >= next_attempt_ms_)
+        StartAttempt(now_ms);
+    if (attempts_.empty() && next_ >= addrs_.size())
+        return -2;
+    return kRaceRunning;
+}
+
+int32_t HappyEyeballs::NextTimeoutMs(const int64_t &now_ms) const {
+    if (winner_ >= 0)
+        return -1;
+    auto timeout = deadline_ms_ - now_ms;
+    if (next_ < addrs_.size())
+        timeout = std::min(timeout, next_attempt_ms_ - now_ms);
+    return static_cast<int32_t>(std::max<int64_t>(0, timeout));
+}
+
+bool HappyEyeballs::TakeOutOfFds() {
+    auto out_of_fds = out_of_fds_;
+    out_of_fds_ = false;
+    return out_of_fds;
+}
+
+void HappyEyeballs::CloseAttempts() {
+    for (auto &attempt : attempts_)
+        close(attempt.first);
+    attempts_.clear();
+    next_ = addrs_.size();
+}
+
+}
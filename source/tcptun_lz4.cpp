@@ -0,0 +1,252 @@
+#include "tcptun_lz4.h"
+#include <cstring>
+
+namespace tcptun {
+
+namespace {
+const uint32_t kHashLog = 12;
+const size_t kMinMatch = 4;
+///the last bytes of a block are literals
+const size_t kLastLiterals = 5;
+///the last match starts at least this far before the end of a block
+const size_t kMfLimit = 12;
+const int32_t kMinCompressLen = kMfLimit + 1;
+const size_t kMaxDistance = 65535;
+const uint32_t kMlBits = 4;
+const size_t kMlMask = (1U << kMlBits) - 1;
+const size_t kRunMask = (1U << (8 - kMlBits)) - 1;
+///misses in a row before the search step grows
+const uint32_t kSkipTrigger = 6;
+
+typedef struct {
+  ///position of the last sequence of each hash, from the start of the block
+  uint32_t table[1 << kHashLog];
+} lz4_state_t;
+
+uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+uint32_t hash_sequence(const uint32_t &sequence) {
+    return (sequence * 2654435761U) >> (32 - kHashLog);
+}
+
+///@return bytes matching from ip and match, ip stops before limit
+size_t count_match(const uint8_t *ip, const uint8_t *match, const uint8_t *limit) {
+    const uint8_t *start = ip;
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (ip + sizeof(uint64_t) <= limit) {
+        uint64_t a, b;
+        memcpy(&a, ip, sizeof(a));
+        memcpy(&b, match, sizeof(b));
+        if (a != b)
+            return static_cast<size_t>(ip - start) + (__builtin_ctzll(a ^ b) >> 3);
+        ip += sizeof(uint64_t);
+        match += sizeof(uint64_t);
+    }
+#endif
+    while (ip < limit && *ip == *match) {
+        ++ip;
+        ++match;
+    }
+    return static_cast<size_t>(ip - start);
+}
+
+///write the length of a token field which overflowed its 4 bits
+uint8_t *write_length(uint8_t *op, size_t len) {
+    for (; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = static_cast<uint8_t>(len);
+    return op;
+}
+
+///read the length of a token field which overflowed its 4 bits, @return nullptr if the block ends in it
+const uint8_t *read_length(const uint8_t *ip, const uint8_t *iend, size_t &len) {
+    uint8_t s;
+    do {
+        if (ip >= iend)
+            return nullptr;
+        s = *ip++;
+        len += s;
+    } while (s == 255);
+    return ip;
+}
+
+bool is_match(const uint8_t *match, const uint8_t *ip) {
+    return match < ip && match + kMaxDistance >= ip && read32(match) == read32(ip);
+}
+}
+
+int32_t lz4_compress_bound(const int32_t &len) {
+    if (len < 0 || len > kLz4MaxInputLen)
+        return 0;
+    return len + len / 255 + 16;
+}
+
+size_t lz4_state_len() {
+    return sizeof(lz4_state_t);
+}
+
+int32_t lz4_compress(void *state, const char *src, const int32_t &src_len, char *dst, const int32_t &dst_len,
+                     int32_t acceleration) {
+    if (src_len < 0 || src_len > kLz4MaxInputLen || dst_len <= 0)
+        return 0;
+    if (acceleration < 1)
+        acceleration = 1;
+    auto table = static_cast<lz4_state_t *>(state)->table;
+    memset(table, 0, sizeof(lz4_state_t::table));
+    auto base = reinterpret_cast<const uint8_t *>(src);
+    auto ip = base;
+    auto anchor = base;
+    auto iend = base + src_len;
+    auto mflimit = iend - kMfLimit;
+    auto matchlimit = iend - kLastLiterals;
+    auto op = reinterpret_cast<uint8_t *>(dst);
+    auto oend = op + dst_len;
+    size_t last_run = 0;
+
+    ///blocks this short are literals only
+    if (src_len >= kMinCompressLen) {
+        while (true) {
+            const uint8_t *match = nullptr;
+            auto forward = ip;
+            uint32_t step = 1;
+            uint32_t search_match_nb = static_cast<uint32_t>(acceleration) << kSkipTrigger;
+            bool found = false;
+            ///find a match, the step grows with the misses in a row
+            while (true) {
+                ip = forward;
+                forward += step;
+                step = search_match_nb++ >> kSkipTrigger;
+                if (ip > mflimit)
+                    break;
+                auto h = hash_sequence(read32(ip));
+                match = base + table[h];
+                table[h] = static_cast<uint32_t>(ip - base);
+                if (is_match(match, ip)) {
+                    found = true;
+                    break;
+                }
+            }
+            if (!found)
+                break;
+            ///take the pending literals which match too
+            while (ip > anchor && match > base && ip[-1] == match[-1]) {
+                --ip;
+                --match;
+            }
+
+            auto lit_len = static_cast<size_t>(ip - anchor);
+            auto token = op++;
+            if (op + lit_len + lit_len / 255 + 2 + 1 + kLastLiterals > oend)
+                return 0;
+            if (lit_len >= kRunMask) {
+                *token = static_cast<uint8_t>(kRunMask << kMlBits);
+                op = write_length(op, lit_len - kRunMask);
+            } else {
+                *token = static_cast<uint8_t>(lit_len << kMlBits);
+            }
+            memcpy(op, anchor, lit_len);
+            op += lit_len;
+
+            bool tail = false;
+            while (true) {
+                op[0] = static_cast<uint8_t>(ip - match);
+                op[1] = static_cast<uint8_t>((ip - match) >> 8);
+                op += 2;
+                auto match_len = count_match(ip + kMinMatch, match + kMinMatch, matchlimit);
+                ip += kMinMatch + match_len;
+                if (op + match_len / 255 + 1 + kLastLiterals > oend)
+                    return 0;
+                if (match_len >= kMlMask) {
+                    *token = static_cast<uint8_t>(*token + kMlMask);
+                    op = write_length(op, match_len - kMlMask);
+                } else {
+                    *token = static_cast<uint8_t>(*token + match_len);
+                }
+                anchor = ip;
+                if (ip > mflimit) {
+                    tail = true;
+                    break;
+                }
+                table[hash_sequence(read32(ip - 2))] = static_cast<uint32_t>(ip - 2 - base);
+                ///a match right away needs no literals
+                auto h = hash_sequence(read32(ip));
+                match = base + table[h];
+                table[h] = static_cast<uint32_t>(ip - base);
+                if (!is_match(match, ip))
+                    break;
+                token = op++;
+                *token = 0;
+            }
+            if (tail)
+                break;
+            ++ip;
+        }
+    }
+
+    last_run = static_cast<size_t>(iend - anchor);
+    if (op + 1 + last_run + (last_run + 255 - kRunMask) / 255 > oend)
+        return 0;
+    if (last_run >= kRunMask) {
+        *op++ = static_cast<uint8_t>(kRunMask << kMlBits);
+        op = write_length(op, last_run - kRunMask);
+    } else {
+        *op++ = static_cast<uint8_t>(last_run << kMlBits);
+    }
+    memcpy(op, anchor, last_run);
+    op += last_run;
+    return static_cast<int32_t>(op - reinterpret_cast<uint8_t *>(dst));
+}
+
+int32_t lz4_decompress(const char *src, const int32_t &src_len, char *dst, const int32_t &dst_len) {
+    if (src == nullptr || src_len <= 0 || dst_len < 0)
+        return -1;
+    auto ip = reinterpret_cast<const uint8_t *>(src);
+    auto iend = ip + src_len;
+    auto ostart = reinterpret_cast<uint8_t *>(dst);
+    auto op = ostart;
+    auto oend = op + dst_len;
+    while (true) {
+        if (ip >= iend)
+            return -1;
+        auto token = *ip++;
+        size_t len = token >> kMlBits;
+        if (len == kRunMask && (ip = read_length(ip, iend, len)) == nullptr)
+            return -1;
+        if (len > static_cast<size_t>(iend - ip) || len > static_cast<size_t>(oend - op))
+            return -1;
+        memcpy(op, ip, len);
+        ip += len;
+        op += len;
+        ///the last sequence has literals only
+        if (ip == iend)
+            break;
+        if (iend - ip < 2)
+            return -1;
+        size_t offset = static_cast<size_t>(ip[0]) | (static_cast<size_t>(ip[1]) << 8);
+        ip += 2;
+        if (offset == 0 || offset > static_cast<size_t>(op - ostart))
+            return -1;
+        len = token & kMlMask;
+        if (len == kMlMask && (ip = read_length(ip, iend, len)) == nullptr)
+            return -1;
+        len += kMinMatch;
+        if (len > static_cast<size_t>(oend - op))
+            return -1;
+        auto match = op - offset;
+        if (offset >= len) {
+            memcpy(op, match, len);
+            op += len;
+        } else {
+            ///the match overlaps the bytes it produces
+            while (len-- > 0)
+                *op++ = *match++;
+        }
+    }
+    return static_cast<int32_t>(op - ostart);
+}
+
+}
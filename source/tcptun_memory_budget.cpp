@@ -0,0 +1,33 @@
+#include "tcptun_memory_budget.h"
+#include <algorithm>
+#include <sstream>
+
+namespace tcptun {
+
+bool over_limit(const int64_t &used, const int64_t &limit, bool paused) {
+    if (limit <= 0)
+        return false;
+    return used >= (paused ? limit / 2 : limit);
+}
+
+std::string memory_stats_to_string(const memory_stats_t &stats) {
+    std::ostringstream os;
+    os << "streams:" << stats.streams << " session_bytes:" << stats.session_bytes << " session_peak:"
+       << stats.session_peak << " global_bytes:" << stats.global_bytes << " global_peak:" << stats.global_peak
+       << " peer_read_pauses:" << stats.peer_read_pauses << " outside_read_pauses:" << stats.outside_read_pauses
+       << " refused_streams:" << stats.refused_streams;
+    return os.str();
+}
+
+MemoryBudget::MemoryBudget(const int64_t &limit) : limit_(limit), used_(0), peak_(0) {}
+
+void MemoryBudget::Charge(const int64_t &bytes) {
+    used_ += bytes;
+    peak_ = std::max(peak_, used_);
+}
+
+bool MemoryBudget::Exceeded(bool paused) const {
+    return over_limit(used_, limit_, paused);
+}
+
+}
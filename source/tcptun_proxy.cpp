@@ -0,0 +1,161 @@
+#include "tcptun_proxy.h"
+#include <cstring>
+#include <algorithm>
+#include <arpa/inet.h>
+#include <glog/logging.h>
+#include "tcptun_common.h"
+
+namespace tcptun {
+
+const size_t ProxyHandshake::kMaxRequestLen;
+
+namespace {
+const uint8_t kSocksVersion = 0x05;
+const uint8_t kSocksMethodNoAuth = 0x00;
+const uint8_t kSocksMethodNone = 0xff;
+const uint8_t kSocksCmdConnect = 0x01;
+const uint8_t kSocksAtypIpv4 = 0x01;
+const uint8_t kSocksAtypDomain = 0x03;
+const uint8_t kSocksAtypIpv6 = 0x04;
+const uint8_t kSocksReplySucceeded = 0x00;
+const uint8_t kSocksReplyCmdNotSupported = 0x07;
+const uint8_t kSocksReplyAtypNotSupported = 0x08;
+
+std::string socks5_reply(const uint8_t &rep) {
+    ///| ver | rep | rsv | atyp | bnd.addr(4) | bnd.port(2) |, the bound address is not known
+    std::string reply(10, '\0');
+    reply[0] = static_cast<char>(kSocksVersion);
+    reply[1] = static_cast<char>(rep);
+    reply[3] = static_cast<char>(kSocksAtypIpv4);
+    return reply;
+}
+}
+
+ProxyHandshake::ProxyHandshake(const frontend_type_t &type) : type_(type), greeted_(false) {}
+
+int32_t ProxyHandshake::ParseFrontendType(const std::string &name, frontend_type_t &type) {
+    if (name == "none")
+        type = kFrontendNone;
+    else if (name == "socks5")
+        type = kFrontendSocks5;
+    else if (name == "http_connect")
+        type = kFrontendHttpConnect;
+    else
+        return -1;
+    return 0;
+}
+
+int32_t ProxyHandshake::Feed(const char *data, const size_t &len, std::string &reply) {
+    reply.clear();
+    buf_.insert(buf_.end(), data, data + len);
+    auto ret = type_ == kFrontendSocks5 ? FeedSocks5(reply) : FeedHttpConnect(reply);
+    if (ret == kHandshakeMore && buf_.size() > kMaxRequestLen) {
+        LOG(WARNING) << "proxy request is longer than " << kMaxRequestLen << " bytes";
+        return -1;
+    }
+    return ret;
+}
+
+void ProxyHandshake::Consume(const size_t &len) {
+    buf_.erase(buf_.begin(), buf_.begin() + len);
+}
+
+int32_t ProxyHandshake::FeedSocks5(std::string &reply) {
+    auto p = reinterpret_cast<const uint8_t *>(buf_.data());
+    if (!greeted_) {
+        ///| ver | nmethods | methods |
+        if (buf_.size() < 2)
+            return kHandshakeMore;
+        if (p[0] != kSocksVersion) {
+            LOG(WARNING) << "unsupported socks version:" << static_cast<int32_t>(p[0]);
+            return -1;
+        }
+        size_t greeting_len = 2 + p[1];
+        if (buf_.size() < greeting_len)
+            return kHandshakeMore;
+        bool no_auth = std::find(p + 2, p + greeting_len, kSocksMethodNoAuth) != p + greeting_len;
+        reply.push_back(static_cast<char>(kSocksVersion));
+        reply.push_back(static_cast<char>(no_auth ? kSocksMethodNoAuth : kSocksMethodNone));
+        if (!no_auth) {
+            LOG(WARNING) << "socks client does not offer no authentication";
+            return -2;
+        }
+        Consume(greeting_len);
+        greeted_ = true;
+        p = reinterpret_cast<const uint8_t *>(buf_.data());
+    }
+    ///| ver | cmd | rsv | atyp | dst.addr | dst.port(2) |
+    if (buf_.size() < 5)
+        return kHandshakeMore;
+    if (p[0] != kSocksVersion) {
+        LOG(WARNING) << "unsupported socks version:" << static_cast<int32_t>(p[0]);
+        return -1;
+    }
+    if (p[1] != kSocksCmdConnect) {
+        reply += socks5_reply(kSocksReplyCmdNotSupported);
+        return -3;
+    }
+    size_t addr_len = 0;
+    size_t addr_offset = 4;
+    switch (p[3]) {
+        case kSocksAtypIpv4:
+            addr_len = 4;
+            break;
+        case kSocksAtypIpv6:
+            addr_len = 16;
+            break;
+        case kSocksAtypDomain:
+            addr_len = p[4];
+            addr_offset = 5;
+            break;
+        default:
+            reply += socks5_reply(kSocksReplyAtypNotSupported);
+            return -4;
+    }
+    size_t request_len = addr_offset + addr_len + 2;
+    if (buf_.size() < request_len)
+        return kHandshakeMore;
+    std::string host;
+    if (p[3] == kSocksAtypDomain) {
+        host.assign(buf_.data() + addr_offset, addr_len);
+    } else {
+        char text[INET6_ADDRSTRLEN] = {0};
+        inet_ntop(p[3] == kSocksAtypIpv4 ? AF_INET : AF_INET6, p + addr_offset, text, sizeof(text));
+        host = p[3] == kSocksAtypIpv4 ? std::string(text) : "[" + std::string(text) + "]";
+    }
+    destination_ = host + ":" + std::to_string(read_u16(buf_.data() + addr_offset + addr_len));
+    Consume(request_len);
+    reply += socks5_reply(kSocksReplySucceeded);
+    return kHandshakeDone;
+}
+
+int32_t ProxyHandshake::FeedHttpConnect(std::string &reply) {
+    static const char kHeaderEnd[] = "\r\n\r\n";
+    auto end = std::search(buf_.begin(), buf_.end(), kHeaderEnd, kHeaderEnd + 4);
+    if (end == buf_.end())
+        return kHandshakeMore;
+    ///CONNECT host:port HTTP/1.1, the headers are not needed
+    std::string request_line(buf_.begin(), std::find(buf_.begin(), end, '\r'));
+    auto first_space = request_line.find(' ');
+    auto second_space = request_line.find(' ', first_space + 1);
+    if (first_space == std::string::npos || second_space == std::string::npos) {
+        reply = "HTTP/1.1 400 Bad Request\r\n\r\n";
+        return -1;
+    }
+    if (request_line.compare(0, first_space, "CONNECT") != 0) {
+        reply = "HTTP/1.1 405 Method Not Allowed\r\nAllow: CONNECT\r\n\r\n";
+        return -2;
+    }
+    destination_ = request_line.substr(first_space + 1, second_space - first_space - 1);
+    std::string host;
+    int32_t port = 0;
+    if (parse_host_port(destination_, host, port) < 0) {
+        reply = "HTTP/1.1 400 Bad Request\r\n\r\n";
+        return -3;
+    }
+    Consume(end - buf_.begin() + 4);
+    reply = "HTTP/1.1 200 Connection Established\r\n\r\n";
+    return kHandshakeDone;
+}
+
+}
@@ -0,0 +1,190 @@
+#include "tcptun_resolver.h"
+#include <cstring>
+#include <algorithm>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <glog/logging.h>
+
+namespace tcptun {
+
+const size_t Resolver::kMaxCacheEntries;
+
+namespace {
+bool is_ip_literal(const std::string &host) {
+    char addr[16];
+    auto ip = host.size() > 2 && host.front() == '[' && host.back() == ']' ? host.substr(1, host.size() - 2) : host;
+    return inet_pton(AF_INET, ip.c_str(), addr) == 1 || inet_pton(AF_INET6, ip.c_str(), addr) == 1;
+}
+
+void set_port(socket_address_t &address, const int32_t &port) {
+    if (address.addr.ss_family == AF_INET)
+        reinterpret_cast<struct sockaddr_in *>(&address.addr)->sin_port = htons(port);
+    else if (address.addr.ss_family == AF_INET6)
+        reinterpret_cast<struct sockaddr_in6 *>(&address.addr)->sin6_port = htons(port);
+}
+}
+
+Resolver::Resolver(const int32_t &epoll_fd, const resolver_policy_t &policy)
+    : epoll_fd_(epoll_fd),
+      event_fd_(-1),
+      policy_(policy),
+      stopping_(false) {
+    policy_.threads = std::max(1, policy_.threads);
+    event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd_ < 0) {
+        LOG(ERROR) << "failed to call eventfd error:" << strerror(errno);
+        return;
+    }
+    if (AddEvent2Epoll(epoll_fd_, event_fd_, EPOLLIN) < 0)
+        LOG(ERROR) << "failed to call AddEvent2Epoll epoll_fd:" << epoll_fd_ << " event_fd:" << event_fd_;
+}
+
+Resolver::~Resolver() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    cond_.notify_all();
+    ///a worker inside getaddrinfo is waited for, it gives up by the timeout of resolv.conf
+    for (auto &worker : workers_)
+        worker.join();
+    if (event_fd_ >= 0)
+        close(event_fd_);
+}
+
+int32_t Resolver::Lookup(const std::string &host, const int32_t &port, std::vector<socket_address_t> &addrs) {
+    addrs.clear();
+    if (is_unix_address(host) || is_ip_literal(host)) {
+        socket_address_t address;
+        if (resolve_literal_address(host, port, address) < 0)
+            return -1;
+        addrs.push_back(address);
+        return kLookupDone;
+    }
+    if (event_fd_ < 0) {
+        LOG(ERROR) << "resolver is not ready, can't look up host:" << host;
+        return -2;
+    }
+    auto now = getnowtime_ms();
+    auto it = cache_.find(host);
+    if (it == cache_.end()) {
+        if (cache_.size() >= kMaxCacheEntries)
+            Evict(now);
+        entry_t entry;
+        entry.expire_ms = 0;
+        entry.resolving = false;
+        it = cache_.emplace(host, entry).first;
+    }
+    auto &entry = it->second;
+    if (now >= entry.expire_ms && !entry.resolving)
+        Start(host, entry);
+    if (entry.addrs.empty())
+        return entry.resolving ? kLookupPending : -3;
+    for (auto address : entry.addrs) {
+        set_port(address, port);
+        addrs.push_back(address);
+    }
+    return kLookupDone;
+}
+
+void Resolver::Start(const std::string &host, entry_t &entry) {
+    entry.resolving = true;
+    std::lock_guard<std::mutex> lock(mutex_);
+    ///most processes never look up a hostname, so the workers wait until one does
+    while (static_cast<int32_t>(workers_.size()) < policy_.threads)
+        workers_.emplace_back(&Resolver::Work, this);
+    queries_.push_back(host);
+    cond_.notify_one();
+}
+
+void Resolver::Evict(const int64_t &now_ms) {
+    for (auto it = cache_.begin(); it != cache_.end();) {
+        if (!it->second.resolving && now_ms >= it->second.expire_ms)
+            it = cache_.erase(it);
+        else
+            ++it;
+    }
+}
+
+int32_t Resolver::HandleEvent(std::vector<std::string> &hosts) {
+    hosts.clear();
+    uint64_t count = 0;
+    if (read(event_fd_, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        LOG(ERROR) << "failed to call read event_fd:" << event_fd_ << " error:" << strerror(errno);
+        return -1;
+    }
+    std::vector<answer_t> answers;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        answers.swap(answers_);
+    }
+    auto now = getnowtime_ms();
+    for (auto &answer : answers) {
+        auto &entry = cache_[answer.host];
+        entry.resolving = false;
+        if (answer.error == 0) {
+            entry.addrs.swap(answer.addrs);
+            entry.expire_ms = now + policy_.cache_ttl_ms;
+        } else if (!entry.addrs.empty()) {
+            ///keep using the last answer rather than failing every stream while dns is down
+            LOG(WARNING) << "failed to look up host:" << answer.host << " again error:" << gai_strerror(answer.error)
+                         << ", keep the last answer";
+            entry.expire_ms = now + policy_.negative_ttl_ms;
+        } else {
+            LOG(WARNING) << "failed to look up host:" << answer.host << " error:" << gai_strerror(answer.error);
+            entry.expire_ms = now + policy_.negative_ttl_ms;
+        }
+        hosts.push_back(answer.host);
+    }
+    return 0;
+}
+
+void Resolver::Work() {
+    while (true) {
+        std::string host;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cond_.wait(lock, [this] { return stopping_ || !queries_.empty(); });
+            if (stopping_)
+                return;
+            host = queries_.front();
+            queries_.pop_front();
+        }
+        answer_t answer;
+        answer.host = host;
+        struct addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_ADDRCONFIG;
+        struct addrinfo *result = nullptr;
+        answer.error = getaddrinfo(host.c_str(), nullptr, &hints, &result);
+        for (auto ai = result; answer.error == 0 && ai != nullptr; ai = ai->ai_next) {
+            if (ai->ai_family != AF_INET && ai->ai_family != AF_INET6)
+                continue;
+            socket_address_t address;
+            memset(&address.addr, 0, sizeof(address.addr));
+            memcpy(&address.addr, ai->ai_addr, ai->ai_addrlen);
+            address.len = ai->ai_addrlen;
+            answer.addrs.push_back(address);
+        }
+        if (result != nullptr)
+            freeaddrinfo(result);
+        if (answer.error == 0 && answer.addrs.empty())
+            answer.error = EAI_NONAME;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            answers_.push_back(std::move(answer));
+        }
+        uint64_t one = 1;
+        if (write(event_fd_, &one, sizeof(one)) < 0)
+            LOG(ERROR) << "failed to call write event_fd:" << event_fd_ << " error:" << strerror(errno);
+    }
+}
+
+}
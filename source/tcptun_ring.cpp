@@ -0,0 +1,124 @@
+#include "tcptun_ring.h"
+#include <cstring>
+#include <algorithm>
+#include <errno.h>
+#include <unistd.h>
+#include <glog/logging.h>
+
+namespace tcptun {
+
+void notify_event_fd(const int32_t &notify_fd) {
+    uint64_t one = 1;
+    ///EAGAIN means the counter is full, the consumer has been woken up already
+    if (write(notify_fd, &one, sizeof(one)) != sizeof(one) && errno != EAGAIN)
+        LOG(ERROR) << "failed to write notify_fd:" << notify_fd << " error:" << strerror(errno);
+}
+
+namespace {
+size_t round_up_power_of_two(const size_t &n) {
+    size_t size = 1;
+    while (size < n)
+        size <<= 1;
+    return size;
+}
+}
+
+SpscRing::SpscRing(const size_t &capacity, const int32_t &notify_fd)
+    : tail_(0),
+      head_cache_(0),
+      head_(0),
+      tail_cache_(0),
+      mask_(round_up_power_of_two(std::max<size_t>(1, capacity)) - 1),
+      notify_fd_(notify_fd),
+      slots_(new void *[mask_ + 1]) {}
+
+bool SpscRing::Push(void *msg) {
+    auto tail = tail_.load(std::memory_order_relaxed);
+    if (tail - head_cache_ > mask_) {
+        head_cache_ = head_.load(std::memory_order_acquire);
+        if (tail - head_cache_ > mask_)
+            return false;
+    }
+    slots_[tail & mask_] = msg;
+    ///the store of tail_ and the load of head_ are ordered against those of Drain, so either the
+    ///consumer sees the message or we see it has taken everything and may be asleep
+    tail_.store(tail + 1, std::memory_order_seq_cst);
+    if (head_.load(std::memory_order_seq_cst) == tail)
+        notify_event_fd(notify_fd_);
+    return true;
+}
+
+size_t SpscRing::Drain(std::vector<void *> &msgs, const size_t &max) {
+    auto head = head_.load(std::memory_order_relaxed);
+    size_t count = 0;
+    while (count < max) {
+        if (head == tail_cache_) {
+            tail_cache_ = tail_.load(std::memory_order_acquire);
+            if (head == tail_cache_)
+                break;
+        }
+        msgs.push_back(slots_[head & mask_]);
+        ++head;
+        ++count;
+    }
+    head_.store(head, std::memory_order_seq_cst);
+    ///messages over max, or pushed after we looked while the producer saw the ring not empty
+    if (tail_.load(std::memory_order_seq_cst) != head)
+        notify_event_fd(notify_fd_);
+    return count;
+}
+
+MpscQueue::MpscQueue(const int32_t &notify_fd)
+    : head_(nullptr),
+      pending_(0),
+      tail_(new node_t),
+      notify_fd_(notify_fd) {
+    tail_->next.store(nullptr);
+    tail_->msg = nullptr;
+    head_.store(tail_);
+}
+
+MpscQueue::~MpscQueue() {
+    while (tail_ != nullptr) {
+        auto next = tail_->next.load();
+        delete tail_;
+        tail_ = next;
+    }
+}
+
+void MpscQueue::Push(void *msg) {
+    auto node = new node_t;
+    node->next.store(nullptr, std::memory_order_relaxed);
+    node->msg = msg;
+    auto prev = head_.exchange(node, std::memory_order_acq_rel);
+    ///till this store the consumer can't reach node nor the nodes pushed after it
+    prev->next.store(node, std::memory_order_release);
+    if (pending_.fetch_add(1, std::memory_order_seq_cst) == 0)
+        notify_event_fd(notify_fd_);
+}
+
+size_t MpscQueue::Drain(std::vector<void *> &msgs, const size_t &max) {
+    size_t count = 0;
+    while (count < max) {
+        auto next = tail_->next.load(std::memory_order_acquire);
+        if (next == nullptr)
+            break;
+        msgs.push_back(next->msg);
+        delete tail_;
+        tail_ = next;
+        ++count;
+    }
+    auto taken = static_cast<int64_t>(count);
+    ///a message may be taken before its producer counts it, then pending_ is below zero for a while
+    auto left = pending_.fetch_sub(taken, std::memory_order_seq_cst) - taken;
+    ///messages over max, or a producer in the middle of Push, which counts it only after linking it
+    if (left > 0)
+        notify_event_fd(notify_fd_);
+    return count;
+}
+
+size_t MpscQueue::size() const {
+    return static_cast<size_t>(std::max<int64_t>(0, pending_.load()));
+}
+
+}
@@ -0,0 +1,53 @@
+#include "tcptun_stream.h"
+#include <algorithm>
+
+namespace tcptun {
+
+uint64_t stream_event_data(stream_t *stream) {
+    return reinterpret_cast<uintptr_t>(stream) | kStreamEventTag;
+}
+
+stream_t *event_stream(const epoll_data_t &data) {
+    if (!(data.u64 & kStreamEventTag))
+        return nullptr;
+    return reinterpret_cast<stream_t *>(static_cast<uintptr_t>(data.u64 & ~kStreamEventTag));
+}
+
+StreamPool::StreamPool(const size_t &chunk_size) : chunk_size_(std::max<size_t>(1, chunk_size)), size_(0) {}
+
+stream_t *StreamPool::Acquire(const int32_t &fd, const uint32_t &conn_id) {
+    if (free_.empty()) {
+        chunks_.emplace_back(new stream_t[chunk_size_]);
+        auto chunk = chunks_.back().get();
+        ///handed out from the start of the chunk
+        for (size_t i = chunk_size_; i > 0; --i)
+            free_.push_back(chunk + i - 1);
+    }
+    auto stream = free_.back();
+    free_.pop_back();
+    ++size_;
+    stream->fd = fd;
+    stream->conn_id = conn_id;
+    stream->state = kStreamOpen;
+    stream->rate_limited = false;
+    stream->rate = TokenBucket();
+    stream->listen_fd = -1;
+    stream->unthrottle_ms = -1;
+    stream->backlogged = false;
+    stream->active_ms = 0;
+    stream->idle_timeout_ms = 0;
+    stream->timer_ms = -1;
+    stream->bytes_in = 0;
+    stream->bytes_out = 0;
+    return stream;
+}
+
+void StreamPool::Release(stream_t *stream) {
+    stream->fd = -1;
+    stream->handshake.reset();
+    std::string().swap(stream->send_buf);
+    free_.push_back(stream);
+    --size_;
+}
+
+}
@@ -0,0 +1,66 @@
+#include "tcptun_timer_wheel.h"
+#include <algorithm>
+
+namespace tcptun {
+
+TimerWheel::TimerWheel(const int32_t &tick_ms, const size_t &slots)
+    : tick_ms_(std::max(1, tick_ms)), slots_(std::max<size_t>(1, slots)), tick_(-1), size_(0) {}
+
+void TimerWheel::Add(const int32_t &id, const int64_t &expire_ms) {
+    auto tick = expire_ms / tick_ms_;
+    ///a timer due already goes to the slot looked at next
+    if (tick < tick_)
+        tick = tick_;
+    timer_t timer;
+    timer.id = id;
+    timer.expire_ms = expire_ms;
+    slots_[tick % slots_.size()].push_back(timer);
+    ++size_;
+}
+
+void TimerWheel::Advance(const int64_t &now, std::vector<std::pair<int32_t, int64_t>> &expired) {
+    auto now_tick = now / tick_ms_;
+    auto slots = static_cast<int64_t>(slots_.size());
+    ///one turn looks at every slot, the first one too as the timers added before it may be anywhere
+    if (tick_ < 0 || now_tick - tick_ >= slots)
+        tick_ = now_tick - slots + 1;
+    while (true) {
+        auto &slot = slots_[tick_ % slots];
+        for (size_t i = 0; i < slot.size();) {
+            ///the rest are for a later turn
+            if (slot[i].expire_ms > now) {
+                ++i;
+                continue;
+            }
+            expired.emplace_back(slot[i].id, slot[i].expire_ms);
+            slot[i] = slot.back();
+            slot.pop_back();
+            --size_;
+        }
+        ///the slot of now is looked at again, timers later in its tick are still in it
+        if (tick_ == now_tick)
+            break;
+        ++tick_;
+    }
+}
+
+int32_t TimerWheel::NextTimeoutMs(const int64_t &now) const {
+    if (size_ == 0)
+        return -1;
+    auto now_tick = now / tick_ms_;
+    auto slots = static_cast<int64_t>(slots_.size());
+    for (int64_t tick = now_tick; tick < now_tick + slots; ++tick) {
+        if (!slots_[tick % slots].empty())
+            return static_cast<int32_t>((tick + 1) * tick_ms_ - now);
+    }
+    return -1;
+}
+
+void TimerWheel::Clear() {
+    for (auto &slot : slots_)
+        slot.clear();
+    tick_ = -1;
+    size_ = 0;
+}
+
+}
@@ -0,0 +1,42 @@
+#include "tcptun_token_bucket.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace tcptun {
+
+namespace {
+///a bucket smaller than this would cut reads into tiny pieces
+const double kMinBucketBytes = 4096;
+}
+
+TokenBucket::TokenBucket(const int32_t &rate_kbps, const int32_t &burst_ms)
+    : rate_(rate_kbps / 8.0),
+      capacity_(std::max(kMinBucketBytes, rate_kbps / 8.0 * burst_ms)),
+      tokens_(capacity_),
+      last_ms_(0) {}
+
+size_t TokenBucket::Available(const int64_t &now_ms) {
+    if (!Limited())
+        return std::numeric_limits<size_t>::max();
+    if (last_ms_ != 0 && now_ms > last_ms_)
+        tokens_ = std::min(capacity_, tokens_ + (now_ms - last_ms_) * rate_);
+    last_ms_ = now_ms;
+    return tokens_ > 0 ? static_cast<size_t>(tokens_) : 0;
+}
+
+void TokenBucket::Consume(const size_t &bytes) {
+    if (Limited())
+        tokens_ -= bytes;
+}
+
+int64_t TokenBucket::WaitMs(const size_t &bytes) const {
+    if (!Limited())
+        return 0;
+    auto wanted = std::min(capacity_, static_cast<double>(bytes));
+    if (tokens_ >= wanted)
+        return 0;
+    return static_cast<int64_t>(std::ceil((wanted - tokens_) / rate_));
+}
+
+}
@@ -0,0 +1,114 @@
+#include "tcptun_transport.h"
+#include <cstring>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <glog/logging.h>
+#include "tcptun_common.h"
+
+namespace tcptun {
+
+TcpTransport::TcpTransport(const int32_t &epoll_fd, const int32_t &fd)
+    : epoll_fd_(epoll_fd), fd_(fd), want_read_(true), want_write_(false), is_tcp_(true) {
+    auto ret = set_non_blocking(fd_);
+    if (ret < 0)
+        LOG(ERROR) << "failed to call set_non_blocking to peer_connected_fd:" << fd_;
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    if (getsockname(fd_, (struct sockaddr *) &addr, &len) == 0)
+        is_tcp_ = addr.ss_family != AF_UNIX;
+}
+
+TcpTransport::~TcpTransport() {
+    Close();
+}
+
+int32_t TcpTransport::HandleEvents(const uint32_t &events) {
+    ///EPOLLOUT needs nothing here, queued frames are sent at the end of the round
+    return (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) ? kTransportReadable : 0;
+}
+
+ssize_t TcpTransport::Recv(char *buf, const size_t &len) {
+    return recv(fd_, buf, len, 0);
+}
+
+ssize_t TcpTransport::Send(const char *buf, const size_t &len) {
+    return send(fd_, buf, len, MSG_NOSIGNAL);
+}
+
+int32_t TcpTransport::SetWantWrite(bool want) {
+    ///only ask for EPOLLOUT when kernel send buffer is full
+    want_write_ = want;
+    return UpdateEvents();
+}
+
+int32_t TcpTransport::SetWantRead(bool want) {
+    ///the kernel receive buffer fills up and tcp flow control holds peer back
+    want_read_ = want;
+    return UpdateEvents();
+}
+
+int32_t TcpTransport::SetUnsentLimit(const int32_t &bytes) {
+    if (!is_tcp_ || bytes <= 0)
+        return 0;
+    if (setsockopt(fd_, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &bytes, sizeof(bytes)) < 0) {
+        LOG(WARNING) << "failed to call setsockopt TCP_NOTSENT_LOWAT:" << bytes << " error:" << strerror(errno);
+        return -1;
+    }
+    return 0;
+}
+
+int32_t TcpTransport::UpdateEvents() {
+    auto ret = ModEvent2Epoll(epoll_fd_, fd_, (want_read_ ? EPOLLIN : 0) | (want_write_ ? EPOLLOUT : 0));
+    if (ret < 0) {
+        LOG(ERROR) << "failed to call ModEvent2Epoll epoll_fd:" << epoll_fd_ << " peer_connected_fd:" << fd_;
+        return -1;
+    }
+    return 0;
+}
+
+bool TcpTransport::Busy(uint32_t &rtt_us) {
+    ///a unix socket has neither rtt nor unacked bytes, frames are never held for it
+    if (!is_tcp_)
+        return false;
+    struct tcp_info info = {0};
+    socklen_t len = sizeof(info);
+    if (getsockopt(fd_, IPPROTO_TCP, TCP_INFO, &info, &len) < 0) {
+        LOG(WARNING) << "failed to call getsockopt TCP_INFO error:" << strerror(errno);
+        return false;
+    }
+    rtt_us = info.tcpi_rtt;
+    return info.tcpi_unacked > 0;
+}
+
+int32_t TcpTransport::SetCork(bool cork) {
+    if (!is_tcp_)
+        return -1;
+    int32_t value = cork ? 1 : 0;
+    if (setsockopt(fd_, IPPROTO_TCP, TCP_CORK, &value, sizeof(value)) < 0) {
+        LOG(WARNING) << "failed to call setsockopt TCP_CORK:" << value << " error:" << strerror(errno);
+        return -1;
+    }
+    return 0;
+}
+
+void TcpTransport::Close() {
+    if (fd_ == 0)
+        return;
+    ///a closing fd will be moved by epoll, so we don't need to worry about it
+    close(fd_);
+    fd_ = 0;
+}
+
+int32_t TcpTransport::Detach() {
+    auto fd = fd_;
+    if (fd_ != 0 && DelEvent2Epoll(epoll_fd_, fd_) < 0)
+        LOG(WARNING) << "failed to call DelEvent2Epoll epoll_fd:" << epoll_fd_ << " peer_connected_fd:" << fd_;
+    fd_ = 0;
+    return fd;
+}
+
+}
@@ -0,0 +1,157 @@
+#include "tcptun_upstream_pool.h"
+#include <cstring>
+#include <algorithm>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <glog/logging.h>
+
+namespace tcptun {
+
+namespace {
+const int32_t kMinRetryBackoffMs = 100;
+const int32_t kMaxRetryBackoffMs = 5000;
+}
+
+UpstreamPool::UpstreamPool(const int32_t &epoll_fd, ip_port_t remote, const upstream_pool_policy_t &policy,
+                           const connect_policy_t &connect_policy, Resolver *resolver)
+    : epoll_fd_(epoll_fd),
+      remote_(std::move(remote)),
+      policy_(policy),
+      connect_policy_(connect_policy),
+      resolver_(resolver),
+      retry_backoff_ms_(kMinRetryBackoffMs),
+      retry_ms_(0),
+      out_of_fds_(false) {
+    ///a fast open connect is not made before the first send, an idle connection must be a real one
+    connect_policy_.fastopen = false;
+    if (Enabled())
+        Refill(getnowtime_ms());
+}
+
+UpstreamPool::~UpstreamPool() {
+    ///connects in progress are closed with their races
+    for (auto &ele : idle_)
+        close(ele.first);
+}
+
+bool UpstreamPool::Owns(const int32_t &fd) const {
+    for (auto &race : connecting_) {
+        if (race->Owns(fd))
+            return true;
+    }
+    return false;
+}
+
+int32_t UpstreamPool::HandleConnectEvent(const int32_t &fd) {
+    auto now = getnowtime_ms();
+    for (size_t i = 0; i < connecting_.size(); ++i) {
+        if (connecting_[i]->Owns(fd))
+            return FinishConnect(i, connecting_[i]->HandleEvent(fd, now), now);
+    }
+    return -1;
+}
+
+int32_t UpstreamPool::FinishConnect(const size_t &index, const int32_t &ret, const int64_t &now_ms) {
+    if (ret == kRaceRunning)
+        return ret;
+    out_of_fds_ |= connecting_[index]->TakeOutOfFds();
+    if (ret == kRaceWon) {
+        ///the winner is removed from epoll already, it is not watched until a stream takes it
+        idle_.emplace_back(connecting_[index]->winner(), now_ms);
+        retry_backoff_ms_ = kMinRetryBackoffMs;
+    } else {
+        LOG(WARNING) << "failed to connect to outside server for pool ret:" << ret;
+        retry_ms_ = now_ms + retry_backoff_ms_;
+        retry_backoff_ms_ = std::min(retry_backoff_ms_ * 2, kMaxRetryBackoffMs);
+    }
+    connecting_.erase(connecting_.begin() + index);
+    return ret;
+}
+
+int32_t UpstreamPool::Acquire(int32_t &fd) {
+    while (!idle_.empty()) {
+        fd = idle_.front().first;
+        idle_.pop_front();
+        char c = 0;
+        auto ret = recv(fd, &c, sizeof(c), MSG_PEEK | MSG_DONTWAIT);
+        ///nothing to read means the connection is alive, data means the server speaks first
+        if ((ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) || ret > 0)
+            return 0;
+        LOG(INFO) << "pooled connection fd:" << fd << " was closed by outside server";
+        close(fd);
+    }
+    return -1;
+}
+
+int32_t UpstreamPool::Update(const int64_t &now_ms) {
+    if (!Enabled())
+        return 0;
+    int32_t failed = 0;
+    for (size_t i = connecting_.size(); i-- > 0;) {
+        if (FinishConnect(i, connecting_[i]->Update(now_ms), now_ms) < 0)
+            ++failed;
+    }
+    while (policy_.max_idle_ms > 0 && !idle_.empty() && now_ms - idle_.front().second >= policy_.max_idle_ms) {
+        ///outside servers tend to close idle connections, replace them before that happens
+        close(idle_.front().first);
+        idle_.pop_front();
+    }
+    Refill(now_ms);
+    return failed;
+}
+
+void UpstreamPool::Refill(const int64_t &now_ms) {
+    if (now_ms < retry_ms_)
+        return;
+    if (static_cast<int32_t>(connecting_.size() + idle_.size()) >= policy_.size)
+        return;
+    std::vector<socket_address_t> addrs;
+    auto ret = resolver_->Lookup(remote_.ip, remote_.port, addrs);
+    if (ret == kLookupPending) {
+        ///the answer is there by the next try, which is not a failure of the outside server
+        retry_ms_ = now_ms + kMinRetryBackoffMs;
+        return;
+    }
+    if (ret < 0) {
+        retry_ms_ = now_ms + retry_backoff_ms_;
+        retry_backoff_ms_ = std::min(retry_backoff_ms_ * 2, kMaxRetryBackoffMs);
+        return;
+    }
+    while (static_cast<int32_t>(connecting_.size() + idle_.size()) < policy_.size) {
+        connecting_.emplace_back(new HappyEyeballs(epoll_fd_, addrs, connect_policy_));
+        ///a race over at once leaves the pool short, which waits for the backoff
+        if (FinishConnect(connecting_.size() - 1, connecting_.back()->Start(now_ms), now_ms) < 0)
+            return;
+    }
+}
+
+bool UpstreamPool::TakeOutOfFds() {
+    auto out_of_fds = out_of_fds_;
+    out_of_fds_ = false;
+    for (auto &race : connecting_)
+        out_of_fds |= race->TakeOutOfFds();
+    return out_of_fds;
+}
+
+int32_t UpstreamPool::NextTimeoutMs(const int64_t &now_ms) const {
+    if (!Enabled())
+        return -1;
+    int64_t timeout = -1;
+    if (static_cast<int32_t>(connecting_.size() + idle_.size()) < policy_.size)
+        timeout = std::max<int64_t>(0, retry_ms_ - now_ms);
+    for (auto &race : connecting_) {
+        auto race_timeout = race->NextTimeoutMs(now_ms);
+        if (race_timeout >= 0 && (timeout < 0 || race_timeout < timeout))
+            timeout = race_timeout;
+    }
+    if (policy_.max_idle_ms > 0 && !idle_.empty()) {
+        auto expire = std::max<int64_t>(0, idle_.front().second + policy_.max_idle_ms - now_ms);
+        if (timeout < 0 || expire < timeout)
+            timeout = expire;
+    }
+    return static_cast<int32_t>(timeout);
+}
+
+}
@@ -0,0 +1,336 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <fstream>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "tcptun_common.h"
+
+namespace {
+///the flood goes on this long, the cpu time of tcptun client is measured meanwhile
+const int64_t kFloodMs = 2000;
+///connections of the flood held open at most
+const size_t kMaxFloodConnections = 512;
+///the flood comes in bursts smaller than kMaxShedConnections of connection manager, so a shed loop that
+///does not stop at EAGAIN blocks in accept once a burst is shed
+const int32_t kBurstConnections = 16;
+const int64_t kBurstIntervalMs = 100;
+///tcptun client paused on accept uses less cpu than this
+const double kMaxCpuShare = 0.25;
+///longer than kMaxAcceptBackoffMs of connection manager
+const int64_t kRearmTimeoutMs = 5000;
+
+int32_t listen_loopback(uint16_t &port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    socklen_t len = sizeof(addr);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 16) < 0 ||
+        getsockname(fd, (struct sockaddr *) &addr, &len) < 0) {
+        close(fd);
+        return -1;
+    }
+    port = ntohs(addr.sin_port);
+    return fd;
+}
+
+///a free port of the loopback for tcptun client to listen on
+uint16_t free_port() {
+    uint16_t port = 0;
+    auto fd = listen_loopback(port);
+    if (fd < 0)
+        return 0;
+    close(fd);
+    return port;
+}
+
+///non-blocking connect to the port of the loopback, @return the fd or -1
+int32_t connect_loopback(const uint16_t &port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0)
+        return -1;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+uint16_t local_port(const int32_t &fd) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    if (getsockname(fd, (struct sockaddr *) &addr, &len) < 0)
+        return 0;
+    return ntohs(addr.sin_port);
+}
+
+///fds open in process pid
+std::set<int32_t> open_fds(const pid_t &pid) {
+    std::set<int32_t> fds;
+    auto path = "/proc/" + std::to_string(pid) + "/fd";
+    DIR *dir = opendir(path.c_str());
+    if (dir == nullptr)
+        return fds;
+    while (auto entry = readdir(dir)) {
+        if (entry->d_name[0] != '.')
+            fds.insert(atoi(entry->d_name));
+    }
+    closedir(dir);
+    return fds;
+}
+
+///user and system cpu time of process pid in clock ticks
+int64_t cpu_ticks(const pid_t &pid) {
+    std::ifstream stat("/proc/" + std::to_string(pid) + "/stat");
+    std::string line;
+    std::getline(stat, line);
+    ///the name in parentheses may hold spaces, the fields are counted after it
+    auto pos = line.rfind(')');
+    if (pos == std::string::npos)
+        return -1;
+    std::istringstream fields(line.substr(pos + 2));
+    std::string field;
+    int64_t utime = 0, stime = 0;
+    for (int32_t i = 3; i <= 15 && fields >> field; ++i) {
+        if (i == 14)
+            utime = atoll(field.c_str());
+        else if (i == 15)
+            stime = atoll(field.c_str());
+    }
+    return utime + stime;
+}
+
+///whether process pid holds the accepted end of the connection from client_port to server_port
+bool holds_connection(const pid_t &pid, const uint16_t &server_port, const uint16_t &client_port) {
+    std::ifstream tcp("/proc/net/tcp");
+    std::string line;
+    std::getline(tcp, line);
+    char local[16], remote[16];
+    std::string inode;
+    while (std::getline(tcp, line)) {
+        std::istringstream fields(line);
+        std::string sl, local_addr, remote_addr, state, queues, timer, retrnsmt, uid, timeout;
+        fields >> sl >> local_addr >> remote_addr >> state >> queues >> timer >> retrnsmt >> uid >> timeout >> inode;
+        snprintf(local, sizeof(local), ":%04X", server_port);
+        snprintf(remote, sizeof(remote), ":%04X", client_port);
+        if (local_addr.size() > 5 && local_addr.compare(local_addr.size() - 5, 5, local) == 0 &&
+            remote_addr.size() > 5 && remote_addr.compare(remote_addr.size() - 5, 5, remote) == 0 && inode != "0")
+            break;
+        inode.clear();
+    }
+    if (inode.empty())
+        return false;
+    auto target = "socket:[" + inode + "]";
+    for (auto fd : open_fds(pid)) {
+        char link[64] = {0};
+        auto path = "/proc/" + std::to_string(pid) + "/fd/" + std::to_string(fd);
+        if (readlink(path.c_str(), link, sizeof(link) - 1) > 0 && target == link)
+            return true;
+    }
+    return false;
+}
+
+///the connection was closed by the other end, a shed connection reads EOF or a reset
+bool closed_by_peer(const int32_t &fd) {
+    struct pollfd pfd = {fd, POLLIN, 0};
+    if (poll(&pfd, 1, 0) <= 0)
+        return false;
+    char c = 0;
+    auto ret = recv(fd, &c, sizeof(c), MSG_DONTWAIT);
+    return ret == 0 || (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK);
+}
+
+int32_t fail(const pid_t &pid, const char *what) {
+    fprintf(stderr, "FAIL: %s\n", what);
+    if (pid > 0) {
+        kill(pid, SIGKILL);
+        waitpid(pid, nullptr, 0);
+    }
+    return 1;
+}
+}
+
+///tcptun client out of fds on loopback: its RLIMIT_NOFILE is lowered to the fds it has open, so every
+///accept fails with EMFILE and no stream can be evicted. while connects flood its second listener it must
+///shed them with the reserve fd and pause the listener instead of spinning on level triggered epoll,
+///blocking in accept or logging accept errors, and it must accept again once fds are free
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s path/to/tcptun_client\n", argv[0]);
+        return 2;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+
+    ///tcptun server side of the peer link, whatever tcptun client sends is drained
+    uint16_t server_port = 0;
+    auto server_fd = listen_loopback(server_port);
+    ///the first listener is the one set up like listen_port, the flood goes to the second one
+    auto first_port = free_port();
+    auto client_port = free_port();
+    if (server_fd < 0 || first_port == 0 || client_port == 0 || first_port == client_port)
+        return fail(0, "no loopback port");
+    std::atomic<bool> peer_linked(false);
+    std::thread peer([&]() {
+        auto fd = accept(server_fd, nullptr, nullptr);
+        if (fd < 0)
+            return;
+        peer_linked = true;
+        char buf[4096];
+        while (recv(fd, buf, sizeof(buf), 0) > 0) {
+        }
+        close(fd);
+    });
+    peer.detach();
+
+    char config_path[] = "/tmp/tcptun_stress_fds_XXXXXX";
+    char log_path[] = "/tmp/tcptun_stress_fds_log_XXXXXX";
+    auto config_fd = mkstemp(config_path);
+    auto log_fd = mkstemp(log_path);
+    if (config_fd < 0 || log_fd < 0)
+        return fail(0, "no temporary files");
+    auto config = "{ \"BUF_SIZE\" : 2048, \"listen_ip\" : \"127.0.0.1\", \"listen_port\" : " +
+                  std::to_string(first_port) + ", \"remote_ip\" : \"127.0.0.1\", \"remote_port\" : " +
+                  std::to_string(server_port) + ", \"listeners\" : [ { \"listen_ip\" : \"127.0.0.1\", " +
+                  "\"listen_port\" : " + std::to_string(first_port) + " }, { \"listen_ip\" : \"127.0.0.1\", " +
+                  "\"listen_port\" : " + std::to_string(client_port) + " } ] }";
+    if (write(config_fd, config.data(), config.size()) != static_cast<ssize_t>(config.size()))
+        return fail(0, "failed to write the config");
+    close(config_fd);
+
+    auto pid = fork();
+    if (pid < 0)
+        return fail(0, "failed to fork");
+    if (pid == 0) {
+        dup2(log_fd, STDERR_FILENO);
+        close(log_fd);
+        close(server_fd);
+        execl(argv[1], argv[1], config_path, static_cast<char *>(nullptr));
+        _exit(127);
+    }
+    close(log_fd);
+    for (int32_t i = 0; i < 100 && !peer_linked; ++i)
+        usleep(50 * 1000);
+    if (!peer_linked)
+        return fail(pid, "tcptun client did not connect to the peer");
+    usleep(200 * 1000);
+
+    ///no fd left for accept, the reserve fd is the last one tcptun client opened
+    auto fds = open_fds(pid);
+    if (fds.empty() || *fds.rbegin() + 1 != static_cast<int32_t>(fds.size()))
+        return fail(pid, "fds of tcptun client are not contiguous");
+    struct rlimit old_limit;
+    struct rlimit low_limit = {fds.size(), fds.size()};
+    if (prlimit(pid, RLIMIT_NOFILE, nullptr, &old_limit) < 0)
+        return fail(pid, "failed to read RLIMIT_NOFILE of tcptun client");
+    low_limit.rlim_max = old_limit.rlim_max;
+    if (prlimit(pid, RLIMIT_NOFILE, &low_limit, nullptr) < 0)
+        return fail(pid, "failed to lower RLIMIT_NOFILE of tcptun client");
+
+    std::vector<int32_t> flood;
+    size_t connects = 0;
+    size_t shed = 0;
+    auto start_ticks = cpu_ticks(pid);
+    auto start = tcptun::getnowtime_ms();
+    int64_t last_burst = 0;
+    while (tcptun::getnowtime_ms() - start < kFloodMs) {
+        if (tcptun::getnowtime_ms() - last_burst >= kBurstIntervalMs) {
+            last_burst = tcptun::getnowtime_ms();
+            for (int32_t i = 0; i < kBurstConnections; ++i) {
+                if (flood.size() >= kMaxFloodConnections) {
+                    close(flood.front());
+                    flood.erase(flood.begin());
+                }
+                auto fd = connect_loopback(client_port);
+                if (fd >= 0) {
+                    flood.push_back(fd);
+                    ++connects;
+                }
+            }
+        }
+        for (size_t i = 0; i < flood.size();) {
+            if (closed_by_peer(flood[i])) {
+                close(flood[i]);
+                flood.erase(flood.begin() + i);
+                ++shed;
+            } else {
+                ++i;
+            }
+        }
+        usleep(1000);
+    }
+    auto elapsed_ms = tcptun::getnowtime_ms() - start;
+    auto cpu_share = static_cast<double>(cpu_ticks(pid) - start_ticks) / sysconf(_SC_CLK_TCK) * 1000 / elapsed_ms;
+    for (auto fd : flood)
+        close(fd);
+    printf("flood connects:%zu shed:%zu cpu of tcptun client:%.1f%%\n", connects, shed, cpu_share * 100);
+
+    ///fds are free again, the paused listener must be watched again and accept
+    if (prlimit(pid, RLIMIT_NOFILE, &old_limit, nullptr) < 0)
+        return fail(pid, "failed to restore RLIMIT_NOFILE of tcptun client");
+    auto probe = connect_loopback(client_port);
+    auto probe_port = probe >= 0 ? local_port(probe) : 0;
+    bool rearmed = false;
+    start = tcptun::getnowtime_ms();
+    while (!rearmed && tcptun::getnowtime_ms() - start < kRearmTimeoutMs) {
+        usleep(20 * 1000);
+        rearmed = probe_port != 0 && holds_connection(pid, client_port, probe_port);
+    }
+    printf("accepted again after %lldms\n", static_cast<long long>(tcptun::getnowtime_ms() - start));
+    close(probe);
+    kill(pid, SIGTERM);
+    waitpid(pid, nullptr, 0);
+
+    std::ifstream log(log_path);
+    std::string line;
+    bool paused = false;
+    size_t accept_errors = 0;
+    while (std::getline(log, line)) {
+        if (line.find("stop accepting on listen_fd") != std::string::npos)
+            paused = true;
+        if (line.find("failed to call accept") != std::string::npos)
+            ++accept_errors;
+    }
+    unlink(config_path);
+    unlink(log_path);
+    if (shed == 0)
+        return fail(0, "no connection of the flood was shed with the reserve fd");
+    if (!paused)
+        return fail(0, "the listener was not paused");
+    if (cpu_share > kMaxCpuShare)
+        return fail(0, "tcptun client spins while out of fds");
+    if (accept_errors > 0)
+        return fail(0, "tcptun client logged accept errors");
+    if (!rearmed)
+        return fail(0, "tcptun client did not accept again once fds were free");
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,282 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "tcptun_common.h"
+
+namespace {
+///both ends drop and delay the datagrams they send by these
+const double kLossRate = 0.05;
+const int32_t kDelayMs = 20;
+const int32_t kFecDataShards = 10;
+const int32_t kFecParityShards = 3;
+///streams sent through the tunnel at once, each one echoed back by the outside server
+const int32_t kStreams = 4;
+const size_t kStreamBytes = 1 << 20;
+///a stream not echoed back in this time fails
+const int64_t kTransferTimeoutMs = 30000;
+const int64_t kLinkTimeoutMs = 10000;
+
+int32_t listen_loopback(const int32_t &type, uint16_t &port) {
+    int fd = socket(AF_INET, type, 0);
+    if (fd < 0)
+        return -1;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    socklen_t len = sizeof(addr);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        (type == SOCK_STREAM && listen(fd, 16) < 0) || getsockname(fd, (struct sockaddr *) &addr, &len) < 0) {
+        close(fd);
+        return -1;
+    }
+    port = ntohs(addr.sin_port);
+    return fd;
+}
+
+///a free tcp or udp port of the loopback for tcptun client or tcptun server to listen on
+uint16_t free_port(const int32_t &type) {
+    uint16_t port = 0;
+    auto fd = listen_loopback(type, port);
+    if (fd < 0)
+        return 0;
+    close(fd);
+    return port;
+}
+
+///blocking connect to the port of the loopback, reads time out after timeout_ms, @return the fd or -1
+int32_t connect_loopback(const uint16_t &port, const int64_t &timeout_ms) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    struct timeval tv = {static_cast<time_t>(timeout_ms / 1000), static_cast<suseconds_t>(timeout_ms % 1000 * 1000)};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+///the outside server, every connection gets back what it sends
+void echo_server(const int32_t &listen_fd) {
+    while (true) {
+        auto fd = accept(listen_fd, nullptr, nullptr);
+        if (fd < 0)
+            return;
+        std::thread([fd]() {
+            char buf[16384];
+            ssize_t len;
+            while ((len = recv(fd, buf, sizeof(buf), 0)) > 0) {
+                if (send(fd, buf, len, MSG_NOSIGNAL) != len)
+                    break;
+            }
+            close(fd);
+        }).detach();
+    }
+}
+
+pid_t spawn(const char *path, const std::string &config_path, const std::string &log_path) {
+    auto pid = fork();
+    if (pid != 0)
+        return pid;
+    auto log_fd = open(log_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (log_fd >= 0)
+        dup2(log_fd, STDERR_FILENO);
+    execl(path, path, config_path.c_str(), static_cast<char *>(nullptr));
+    _exit(127);
+}
+
+std::string write_temp(const std::string &content) {
+    char path[] = "/tmp/tcptun_stress_udp_XXXXXX";
+    auto fd = mkstemp(path);
+    if (fd < 0)
+        return "";
+    auto ret = write(fd, content.data(), content.size());
+    close(fd);
+    if (ret != static_cast<ssize_t>(content.size()))
+        return "";
+    return path;
+}
+
+/**
+ * send kStreamBytes of the stream's own random bytes through tcptun client and read them back
+ * @return what went wrong, empty if every byte came back in order
+ */
+std::string run_stream(const uint16_t &client_port, const int32_t &index) {
+    auto fd = connect_loopback(client_port, kTransferTimeoutMs);
+    if (fd < 0)
+        return "failed to connect to tcptun client";
+    std::thread writer([fd, index]() {
+        std::mt19937 rng(index);
+        std::vector<char> buf(16384);
+        for (size_t sent = 0; sent < kStreamBytes; sent += buf.size()) {
+            for (auto &c : buf)
+                c = static_cast<char>(rng());
+            if (send(fd, buf.data(), buf.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(buf.size()))
+                return;
+        }
+    });
+    std::mt19937 rng(index);
+    std::string error;
+    char buf[16384];
+    size_t received = 0;
+    auto start = tcptun::getnowtime_ms();
+    while (received < kStreamBytes && error.empty()) {
+        auto len = recv(fd, buf, sizeof(buf), 0);
+        if (len <= 0 || tcptun::getnowtime_ms() - start > kTransferTimeoutMs) {
+            error = (len == 0 ? "closed" : "timed out") + std::string(" after ") + std::to_string(received) + " bytes";
+            break;
+        }
+        for (ssize_t i = 0; i < len; ++i) {
+            if (buf[i] != static_cast<char>(rng())) {
+                error = "wrong byte at " + std::to_string(received + i);
+                break;
+            }
+        }
+        received += len;
+    }
+    shutdown(fd, SHUT_RDWR);
+    writer.join();
+    close(fd);
+    return error;
+}
+
+/**
+ * wait until a few bytes make it through the tunnel and back
+ * @return milliseconds of the round trip, below zero if the peer link does not come up
+ */
+int64_t probe_link(const uint16_t &client_port) {
+    auto start = tcptun::getnowtime_ms();
+    while (tcptun::getnowtime_ms() - start < kLinkTimeoutMs) {
+        auto fd = connect_loopback(client_port, 1000);
+        if (fd < 0) {
+            usleep(50 * 1000);
+            continue;
+        }
+        auto sent = tcptun::getnowtime_ms();
+        char buf[4] = {'p', 'i', 'n', 'g'};
+        size_t received = 0;
+        if (send(fd, buf, sizeof(buf), MSG_NOSIGNAL) == sizeof(buf)) {
+            ssize_t len;
+            while (received < sizeof(buf) && (len = recv(fd, buf + received, sizeof(buf) - received, 0)) > 0)
+                received += len;
+        }
+        close(fd);
+        if (received == sizeof(buf))
+            return tcptun::getnowtime_ms() - sent;
+        usleep(50 * 1000);
+    }
+    return -1;
+}
+
+int32_t fail(const std::vector<pid_t> &pids, const std::string &what) {
+    fprintf(stderr, "FAIL: %s\n", what.c_str());
+    for (auto pid : pids) {
+        kill(pid, SIGKILL);
+        waitpid(pid, nullptr, 0);
+    }
+    return 1;
+}
+}
+
+///tcptun client and tcptun server over the udp transport on loopback, both ends losing kLossRate of the
+///datagrams they send and delaying the rest by kDelayMs, with fec if asked. every stream sent through
+///the tunnel and echoed back by the outside server must come back whole and in order
+int main(int argc, char *argv[]) {
+    if (argc < 3 || (argc > 3 && strcmp(argv[3], "fec") != 0)) {
+        fprintf(stderr, "usage: %s path/to/tcptun_client path/to/tcptun_server [fec]\n", argv[0]);
+        return 2;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    bool fec = argc > 3;
+
+    uint16_t echo_port = 0;
+    auto echo_fd = listen_loopback(SOCK_STREAM, echo_port);
+    auto server_port = free_port(SOCK_DGRAM);
+    auto client_port = free_port(SOCK_STREAM);
+    if (echo_fd < 0 || server_port == 0 || client_port == 0)
+        return fail({}, "no loopback port");
+    std::thread(echo_server, echo_fd).detach();
+
+    auto link = std::string(", \"transport\" : \"udp\", \"udp_loss_rate\" : ") + std::to_string(kLossRate) +
+                ", \"udp_delay_ms\" : " + std::to_string(kDelayMs);
+    if (fec)
+        link += ", \"fec_data_shards\" : " + std::to_string(kFecDataShards) + ", \"fec_parity_shards\" : " +
+                std::to_string(kFecParityShards);
+    auto server_config = write_temp("{ \"BUF_SIZE\" : 2048, \"listen_ip\" : \"127.0.0.1\", \"listen_port\" : " +
+                                    std::to_string(server_port) + ", \"remote_ip\" : \"127.0.0.1\", " +
+                                    "\"remote_port\" : " + std::to_string(echo_port) + link + " }");
+    auto client_config = write_temp("{ \"BUF_SIZE\" : 2048, \"listen_ip\" : \"127.0.0.1\", \"listen_port\" : " +
+                                    std::to_string(client_port) + ", \"remote_ip\" : \"127.0.0.1\", " +
+                                    "\"remote_port\" : " + std::to_string(server_port) + link + " }");
+    if (server_config.empty() || client_config.empty())
+        return fail({}, "failed to write the configs");
+    auto server_log = server_config + ".log";
+    auto client_log = client_config + ".log";
+    auto server_pid = spawn(argv[2], server_config, server_log);
+    usleep(200 * 1000);
+    auto client_pid = spawn(argv[1], client_config, client_log);
+    std::vector<pid_t> pids = {client_pid, server_pid};
+    if (server_pid < 0 || client_pid < 0)
+        return fail(pids, "failed to fork");
+
+    auto rtt_ms = probe_link(client_port);
+    if (rtt_ms < 0)
+        return fail(pids, "no data through the tunnel in " + std::to_string(kLinkTimeoutMs) + "ms");
+    ///each way is delayed once by the end sending it
+    if (rtt_ms < 2 * kDelayMs)
+        return fail(pids, "round trip of " + std::to_string(rtt_ms) + "ms, udp_delay_ms is not in effect");
+
+    std::vector<std::string> errors(kStreams);
+    std::vector<std::thread> streams;
+    auto start = tcptun::getnowtime_ms();
+    for (int32_t i = 0; i < kStreams; ++i)
+        streams.emplace_back([&errors, client_port, i]() { errors[i] = run_stream(client_port, i); });
+    for (auto &stream : streams)
+        stream.join();
+    auto elapsed_ms = tcptun::getnowtime_ms() - start;
+    ///a udp link tells tcptun server nothing when tcptun client exits, it would drain for drain_timeout_ms
+    for (auto pid : pids) {
+        kill(pid, SIGKILL);
+        waitpid(pid, nullptr, 0);
+    }
+    printf("%s loss:%.0f%% delay:%dms round trip:%lldms %d streams of %zu bytes echoed in %lldms\n",
+           fec ? "fec" : "arq", kLossRate * 100, kDelayMs, static_cast<long long>(rtt_ms), kStreams, kStreamBytes,
+           static_cast<long long>(elapsed_ms));
+    int32_t ret = 0;
+    for (int32_t i = 0; i < kStreams; ++i) {
+        if (!errors[i].empty()) {
+            fprintf(stderr, "FAIL: stream %d %s, logs in %s and %s\n", i, errors[i].c_str(), client_log.c_str(),
+                    server_log.c_str());
+            ret = 1;
+        }
+    }
+    unlink(server_config.c_str());
+    unlink(client_config.c_str());
+    if (ret != 0)
+        return ret;
+    unlink(server_log.c_str());
+    unlink(client_log.c_str());
+    printf("ok\n");
+    return 0;
+}
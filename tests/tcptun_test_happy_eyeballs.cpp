@@ -0,0 +1,211 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <set>
+#include <string>
+#include <vector>
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <glog/logging.h>
+#include "tcptun_common.h"
+#include "tcptun_happy_eyeballs.h"
+
+namespace {
+const int32_t kAttemptDelayMs = 200;
+const int32_t kConnectTimeoutMs = 10000;
+///the winner comes this late after attempt_delay_ms at most, far less than kConnectTimeoutMs
+const int64_t kSlackMs = 300;
+///connections filling the accept queue of the blackhole, listen(fd, 0) holds one
+const int32_t kBacklogFill = 4;
+
+int32_t listen_loopback(const int32_t &backlog, uint16_t &port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, backlog) < 0 ||
+        getsockname(fd, (struct sockaddr *) &addr, &len) < 0) {
+        close(fd);
+        return -1;
+    }
+    port = ntohs(addr.sin_port);
+    return fd;
+}
+
+uint16_t peer_port(const int32_t &fd) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    if (getpeername(fd, (struct sockaddr *) &addr, &len) < 0)
+        return 0;
+    return ntohs(addr.sin_port);
+}
+
+std::set<int32_t> open_fds() {
+    std::set<int32_t> fds;
+    DIR *dir = opendir("/proc/self/fd");
+    if (dir == nullptr)
+        return fds;
+    auto dir_fd = dirfd(dir);
+    while (auto entry = readdir(dir)) {
+        if (entry->d_name[0] != '.' && atoi(entry->d_name) != dir_fd)
+            fds.insert(atoi(entry->d_name));
+    }
+    closedir(dir);
+    return fds;
+}
+
+///@return sockets of this host sending their SYN to port of the loopback, from /proc/net/tcp
+size_t syn_sent_to(const uint16_t &port) {
+    std::ifstream tcp("/proc/net/tcp");
+    std::string line;
+    char remote[16];
+    snprintf(remote, sizeof(remote), "0100007F:%04X", port);
+    size_t count = 0;
+    std::getline(tcp, line);
+    while (std::getline(tcp, line)) {
+        char local_addr[64], remote_addr[64], state[8];
+        if (sscanf(line.c_str(), "%*s %63s %63s %7s", local_addr, remote_addr, state) == 3 &&
+            remote == std::string(remote_addr) && std::string(state) == "02")
+            ++count;
+    }
+    return count;
+}
+
+/**
+ * a listener nobody accepts on and whose accept queue is full, the kernel drops every SYN to it
+ * so a connect stays pending like one to a blackholed address
+ * @param fills the connections filling the queue, closed by the caller
+ */
+int32_t blackhole_listener(uint16_t &port, std::vector<int32_t> &fills) {
+    auto fd = listen_loopback(0, port);
+    if (fd < 0)
+        return -1;
+    for (int32_t i = 0; i < kBacklogFill; ++i) {
+        int fill = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(port);
+        connect(fill, (struct sockaddr *) &addr, sizeof(addr));
+        fills.push_back(fill);
+    }
+    ///the handshakes past the queue are left pending
+    usleep(100 * 1000);
+    return fd;
+}
+
+///run a race started with the result ret until it is over, @return what the race returned last
+int32_t finish_race(tcptun::HappyEyeballs &eyeballs, const int32_t &epoll_fd, int32_t ret) {
+    while (ret == tcptun::kRaceRunning) {
+        struct epoll_event events[8];
+        auto n = epoll_wait(epoll_fd, events, 8, eyeballs.NextTimeoutMs(tcptun::getnowtime_ms()));
+        for (int32_t i = 0; i < n && ret == tcptun::kRaceRunning; ++i)
+            ret = eyeballs.HandleEvent(events[i].data.fd, tcptun::getnowtime_ms());
+        if (ret == tcptun::kRaceRunning)
+            ret = eyeballs.Update(tcptun::getnowtime_ms());
+    }
+    return ret;
+}
+
+tcptun::socket_address_t loopback(const uint16_t &port) {
+    tcptun::socket_address_t address;
+    tcptun::resolve_literal_address("127.0.0.1", port, address);
+    return address;
+}
+
+int32_t fail(const char *what) {
+    fprintf(stderr, "FAIL: %s\n", what);
+    return 1;
+}
+}
+
+///RFC 8305 races on loopback: a blackholed address before a live one must lose to it once
+///attempt_delay_ms has passed instead of holding the stream for connect_timeout_ms, and its pending
+///connect must be closed. a refused address before a live one hands its turn over at once
+int main(int argc, char *argv[]) {
+    google::InitGoogleLogging("INFO");
+    FLAGS_logtostderr = true;
+    uint16_t live_port = 0, blackhole_port = 0, refused_port = 0;
+    std::vector<int32_t> fills;
+    auto live_fd = listen_loopback(16, live_port);
+    auto blackhole_fd = blackhole_listener(blackhole_port, fills);
+    ///nothing listens on a port freed again, a connect to it is refused
+    auto refused_fd = listen_loopback(16, refused_port);
+    close(refused_fd);
+    auto epoll_fd = epoll_create1(0);
+    if (live_fd < 0 || blackhole_fd < 0 || refused_fd < 0 || epoll_fd < 0)
+        return fail("no loopback port");
+    tcptun::connect_policy_t policy = {kAttemptDelayMs, kConnectTimeoutMs, false};
+
+    auto fds_before = open_fds();
+    ///the connections past the full queue are stuck in SYN_SENT too
+    auto stuck_fills = syn_sent_to(blackhole_port);
+    int64_t elapsed_ms = 0;
+    int32_t loser = -1;
+    {
+        tcptun::HappyEyeballs eyeballs(epoll_fd, {loopback(blackhole_port), loopback(live_port)}, policy);
+        auto start = tcptun::getnowtime_ms();
+        auto ret = eyeballs.Start(start);
+        if (ret != tcptun::kRaceRunning)
+            return fail("the connect to the blackhole did not stay pending");
+        for (auto fd : open_fds()) {
+            if (!fds_before.count(fd))
+                loser = fd;
+        }
+        if (loser < 0 || !eyeballs.Owns(loser) || syn_sent_to(blackhole_port) != stuck_fills + 1)
+            return fail("no pending attempt to the blackhole");
+        ret = finish_race(eyeballs, epoll_fd, ret);
+        elapsed_ms = tcptun::getnowtime_ms() - start;
+        printf("blackhole then live: won in %lldms, attempt_delay_ms:%d connect_timeout_ms:%d\n",
+               static_cast<long long>(elapsed_ms), kAttemptDelayMs, kConnectTimeoutMs);
+        if (ret != tcptun::kRaceWon)
+            return fail("the race was lost");
+        if (peer_port(eyeballs.winner()) != live_port)
+            return fail("the winner is not connected to the live listener");
+        if (elapsed_ms < kAttemptDelayMs - 10 || elapsed_ms > kAttemptDelayMs + kSlackMs)
+            return fail("the live address did not win in about attempt_delay_ms");
+        ///the losing attempt is gone as soon as the race is won, not when the race is destroyed
+        if (fcntl(loser, F_GETFD) >= 0 || errno != EBADF || eyeballs.Owns(loser))
+            return fail("the fd of the losing attempt is open");
+        if (syn_sent_to(blackhole_port) != stuck_fills)
+            return fail("the connect to the blackhole is still pending");
+        auto fds_after = open_fds();
+        fds_after.erase(eyeballs.winner());
+        if (fds_after != fds_before)
+            return fail("the race left fds open besides the winner");
+        close(eyeballs.winner());
+    }
+
+    {
+        tcptun::HappyEyeballs eyeballs(epoll_fd, {loopback(refused_port), loopback(live_port)}, policy);
+        auto start = tcptun::getnowtime_ms();
+        auto ret = finish_race(eyeballs, epoll_fd, eyeballs.Start(start));
+        elapsed_ms = tcptun::getnowtime_ms() - start;
+        printf("refused then live: won in %lldms\n", static_cast<long long>(elapsed_ms));
+        if (ret != tcptun::kRaceWon || peer_port(eyeballs.winner()) != live_port)
+            return fail("the live address did not win after a refused one");
+        if (elapsed_ms >= kAttemptDelayMs)
+            return fail("a refused address held the race for attempt_delay_ms");
+        close(eyeballs.winner());
+    }
+
+    for (auto fd : fills)
+        close(fd);
+    close(blackhole_fd);
+    close(live_fd);
+    close(epoll_fd);
+    printf("ok\n");
+    return 0;
+}
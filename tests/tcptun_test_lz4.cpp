@@ -0,0 +1,230 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+#include <dlfcn.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "tcptun_lz4.h"
+
+namespace {
+///ctest counts this exit code as skipped, see SKIP_RETURN_CODE in CMakeLists.txt
+const int32_t kSkipped = 77;
+///blocks of the corruption tests are this long before compression
+const size_t kCorruptedLen = 4096;
+const int32_t kGarbageBlocks = 20000;
+
+typedef int (*lz4_compress_fn)(const char *, char *, int, int, int);
+typedef int (*lz4_decompress_fn)(const char *, char *, int, int);
+typedef int (*lz4_bound_fn)(int);
+
+///the entry points of liblz4, which is opened at run time so that no lz4 headers are needed
+struct liblz4_t {
+  lz4_compress_fn compress_fast;
+  lz4_decompress_fn decompress_safe;
+  lz4_bound_fn compress_bound;
+};
+
+///len bytes ending right before a page nobody can access, so a read or write past the end crashes the test
+class GuardedBuffer {
+ public:
+  explicit GuardedBuffer(const size_t &len) : len_(len) {
+      auto page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+      map_len_ = (len + page - 1) / page * page + page;
+      map_ = static_cast<char *>(mmap(nullptr, map_len_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+      if (map_ == MAP_FAILED) {
+          perror("mmap");
+          abort();
+      }
+      mprotect(map_ + map_len_ - page, page, PROT_NONE);
+      data_ = map_ + map_len_ - page - len;
+  }
+  ~GuardedBuffer() { munmap(map_, map_len_); }
+  GuardedBuffer(const GuardedBuffer &) = delete;
+  GuardedBuffer &operator=(const GuardedBuffer &) = delete;
+  char *data() { return data_; }
+  int32_t len() const { return static_cast<int32_t>(len_); }
+ private:
+  size_t len_;
+  size_t map_len_;
+  char *map_;
+  char *data_;
+};
+
+int32_t open_liblz4(liblz4_t &lib) {
+    auto handle = dlopen("liblz4.so.1", RTLD_NOW);
+    if (handle == nullptr)
+        handle = dlopen("liblz4.so", RTLD_NOW);
+    if (handle == nullptr)
+        return -1;
+    lib.compress_fast = reinterpret_cast<lz4_compress_fn>(dlsym(handle, "LZ4_compress_fast"));
+    lib.decompress_safe = reinterpret_cast<lz4_decompress_fn>(dlsym(handle, "LZ4_decompress_safe"));
+    lib.compress_bound = reinterpret_cast<lz4_bound_fn>(dlsym(handle, "LZ4_compressBound"));
+    if (lib.compress_fast == nullptr || lib.decompress_safe == nullptr || lib.compress_bound == nullptr)
+        return -1;
+    return 0;
+}
+
+///the payloads tcptun sees: json and logs, incompressible bytes, long runs and short periods
+std::vector<std::string> make_inputs(std::mt19937 &rng) {
+    std::vector<size_t> lens;
+    for (size_t len = 0; len <= 64; ++len)
+        lens.push_back(len);
+    for (auto len : {100, 255, 256, 1000, 4096, 65535, 65536, 70000, 300000})
+        lens.push_back(len);
+    std::vector<std::string> inputs;
+    for (auto len : lens) {
+        std::string random, text, run, period;
+        for (size_t i = 0; i < len; ++i)
+            random.push_back(static_cast<char>(rng()));
+        while (text.size() < len)
+            text += "{\"conn_id\":" + std::to_string(rng() % 100000) + ",\"event\":\"close\",\"bytes\":" +
+                    std::to_string(rng() % 1000000) + "}\n";
+        text.resize(len);
+        run.assign(len, 'a');
+        for (size_t i = 0; i < len; ++i)
+            period.push_back(static_cast<char>('a' + i % (1 + len % 7)));
+        inputs.push_back(random);
+        inputs.push_back(text);
+        inputs.push_back(run);
+        inputs.push_back(period);
+        ///matches further apart than the 64KB window of the format
+        if (len >= 70000) {
+            std::string far = random.substr(0, len / 2);
+            inputs.push_back(far + far);
+        }
+    }
+    return inputs;
+}
+
+int32_t fail(const char *what, const size_t &len) {
+    fprintf(stderr, "FAIL: %s, input of %zu bytes\n", what, len);
+    return 1;
+}
+
+///blocks of tcptun_lz4 are decompressed by liblz4 and the other way round, to the same bytes
+int32_t test_round_trip(const liblz4_t &lib, std::mt19937 &rng) {
+    std::vector<char> state(tcptun::lz4_state_len());
+    size_t blocks = 0;
+    for (auto &input : make_inputs(rng)) {
+        auto len = static_cast<int32_t>(input.size());
+        auto bound = tcptun::lz4_compress_bound(len);
+        if (bound != lib.compress_bound(len))
+            return fail("lz4_compress_bound differs from LZ4_compressBound", input.size());
+        for (auto acceleration : {1, 8}) {
+            GuardedBuffer ours(bound);
+            auto ours_len = tcptun::lz4_compress(state.data(), input.data(), len, ours.data(), ours.len(), acceleration);
+            if (ours_len <= 0 || ours_len > bound)
+                return fail("lz4_compress failed", input.size());
+            GuardedBuffer out(input.size());
+            if (lib.decompress_safe(ours.data(), out.data(), ours_len, out.len()) != len ||
+                memcmp(out.data(), input.data(), input.size()) != 0)
+                return fail("liblz4 does not decompress the block of lz4_compress", input.size());
+            if (tcptun::lz4_decompress(ours.data(), ours_len, out.data(), out.len()) != len ||
+                memcmp(out.data(), input.data(), input.size()) != 0)
+                return fail("lz4_decompress does not decompress the block of lz4_compress", input.size());
+            ///one byte short of the block on either side is an error, not an overflow
+            if (ours_len > 1) {
+                GuardedBuffer short_dst(ours_len - 1);
+                if (tcptun::lz4_compress(state.data(), input.data(), len, short_dst.data(), short_dst.len(),
+                                         acceleration) != 0)
+                    return fail("lz4_compress wrote a block longer than dst", input.size());
+            }
+            if (len > 0) {
+                GuardedBuffer short_out(input.size() - 1);
+                if (tcptun::lz4_decompress(ours.data(), ours_len, short_out.data(), short_out.len()) >= 0)
+                    return fail("lz4_decompress wrote a block longer than dst", input.size());
+            }
+
+            GuardedBuffer theirs(bound);
+            auto theirs_len = lib.compress_fast(input.data(), theirs.data(), len, theirs.len(), acceleration);
+            if (theirs_len <= 0)
+                return fail("liblz4 failed to compress", input.size());
+            if (tcptun::lz4_decompress(theirs.data(), theirs_len, out.data(), out.len()) != len ||
+                memcmp(out.data(), input.data(), input.size()) != 0)
+                return fail("lz4_decompress does not decompress the block of liblz4", input.size());
+            blocks += 2;
+        }
+    }
+    printf("round trip with liblz4: %zu blocks\n", blocks);
+    return 0;
+}
+
+/**
+ * decompress a malformed block into a buffer of dst_len, src and dst end at guard pages
+ * @return what lz4_decompress returns, the test crashes if it reads or writes out of bounds
+ */
+int32_t decompress_guarded(const std::string &block, const size_t &dst_len) {
+    GuardedBuffer src(block.size());
+    memcpy(src.data(), block.data(), block.size());
+    GuardedBuffer dst(dst_len);
+    auto ret = tcptun::lz4_decompress(src.data(), src.len(), dst.data(), dst.len());
+    if (ret > dst.len())
+        abort();
+    return ret;
+}
+
+///truncated, bit flipped and random blocks are rejected or decoded without leaving their buffers
+int32_t test_corrupted(std::mt19937 &rng) {
+    std::vector<char> state(tcptun::lz4_state_len());
+    std::vector<std::string> blocks;
+    for (auto &input : make_inputs(rng)) {
+        if (input.size() != kCorruptedLen)
+            continue;
+        std::string block(tcptun::lz4_compress_bound(kCorruptedLen), '\0');
+        auto len = tcptun::lz4_compress(state.data(), input.data(), kCorruptedLen, &block[0],
+                                        static_cast<int32_t>(block.size()), 1);
+        block.resize(len);
+        blocks.push_back(block);
+    }
+    size_t truncated = 0, flipped = 0, accepted = 0;
+    for (auto &block : blocks) {
+        ///a block cut right after the literals of a sequence is well formed, but shorter
+        for (size_t len = 1; len < block.size(); ++len, ++truncated) {
+            if (decompress_guarded(block.substr(0, len), kCorruptedLen) == static_cast<int32_t>(kCorruptedLen))
+                return fail("lz4_decompress decoded a truncated block to the whole input", kCorruptedLen);
+        }
+        if (tcptun::lz4_decompress(block.data(), 0, nullptr, 0) >= 0)
+            return fail("lz4_decompress accepted an empty block", kCorruptedLen);
+        for (size_t i = 0; i < block.size(); ++i) {
+            for (auto mask : {0x01, 0x10, 0x80, 0xff}) {
+                auto corrupted = block;
+                corrupted[i] = static_cast<char>(corrupted[i] ^ mask);
+                ///a flipped literal still decodes, to bytes of the same length
+                auto ret = decompress_guarded(corrupted, kCorruptedLen);
+                if (ret >= 0)
+                    ++accepted;
+                ++flipped;
+            }
+        }
+    }
+    for (int32_t i = 0; i < kGarbageBlocks; ++i) {
+        std::string garbage(1 + rng() % 64, '\0');
+        for (auto &c : garbage)
+            c = static_cast<char>(rng());
+        decompress_guarded(garbage, rng() % 256);
+    }
+    printf("corrupted blocks: %zu truncated %zu flipped (%zu still decode) %d random\n", truncated, flipped, accepted,
+           kGarbageBlocks);
+    return 0;
+}
+}
+
+///tcptun_lz4 against liblz4 of the host in both directions, and malformed blocks fed to lz4_decompress,
+///it is skipped if liblz4 is not installed
+int main(int argc, char *argv[]) {
+    std::mt19937 rng(20200209);
+    if (test_corrupted(rng) != 0)
+        return 1;
+    liblz4_t lib;
+    if (open_liblz4(lib) < 0) {
+        printf("no liblz4 to test against, skipped\n");
+        return kSkipped;
+    }
+    if (test_round_trip(lib, rng) != 0)
+        return 1;
+    printf("ok\n");
+    return 0;
+}